@@ -270,6 +270,9 @@ static int iscsi_tgt_params_set(struct iscsi_session *session,
 		SET_PARAM(params, info, iparams, nop_in_interval);
 		SET_PARAM(params, info, iparams, nop_in_timeout);
 
+		scst_sess_set_cmd_cache_size(session->scst_sess,
+			params->queued_cmnds);
+
 		PRINT_INFO("Target parameters set for session %llx: "
 			"QueuedCommands %d, Response timeout %d, Nop-In "
 			"interval %d, Nop-In timeout %d", session->sid,
@@ -41,6 +41,7 @@
 #include <linux/wait.h>
 #include <linux/cpumask.h>
 #include <linux/dlm.h>
+#include <linux/hash.h>
 #ifdef CONFIG_SCST_MEASURE_LATENCY
 #include <linux/log2.h>
 #endif
@@ -1649,6 +1650,19 @@ struct scst_dev_type {
 	 */
 	ssize_t (*del_device)(const char *device_name);
 
+	/*
+	 * This function adds several virtual devices at once. It is called
+	 * instead of add_device, when a single write to the mgmt entry
+	 * contains only "add_device" commands, one per line. Allows the dev
+	 * handler to probe and register the new devices in parallel. Returns
+	 * 0 on success or the first error otherwise. The devices, which were
+	 * successfully added, must stay added.
+	 *
+	 * OPTIONAL.
+	 */
+	ssize_t (*add_devices)(int cnt, const char **device_names,
+		char **params);
+
 	/*
 	 * This function called if not "add_device" or "del_device" command is
 	 * sent to the mgmt entry (see comment for add_device above). In this
@@ -1940,6 +1954,16 @@ struct scst_session {
 
 	spinlock_t sess_list_lock; /* protects sess_cmd_list, etc */
 
+	/*
+	 * Hash of not internal cmds from sess_cmd_list by their tags, used
+	 * to find the cmd to abort without walking sess_cmd_list. Protected
+	 * by sess_list_lock.
+	 */
+#define	SESS_CMD_HASH_SHIFT 7
+#define	SESS_CMD_HASH_SIZE (1 << SESS_CMD_HASH_SHIFT)
+#define	SESS_CMD_HASH_FN(tag) hash_64((tag), SESS_CMD_HASH_SHIFT)
+	struct list_head sess_cmd_hash[SESS_CMD_HASH_SIZE];
+
 	atomic_t refcnt;		/* get/put counter */
 
 	/*
@@ -1951,6 +1975,20 @@ struct scst_session {
 	/* Some statistics. Protected by sess_list_lock. */
 	struct scst_io_stat_entry io_stats[SCST_DATA_DIR_MAX];
 
+	/*
+	 * Cache of free commands, which scst_rx_cmd() reuses instead of
+	 * allocating them from the slab. Its size is set by the target
+	 * driver by scst_sess_set_cmd_cache_size(), usually to the session's
+	 * queue depth, and 0 (disabled) by default. All fields are protected
+	 * by sess_cmd_cache_lock.
+	 */
+	spinlock_t sess_cmd_cache_lock;
+	struct list_head sess_cmd_cache_list;
+	int sess_cmd_cache_cnt;
+	int sess_cmd_cache_size;
+	unsigned long sess_cmd_cache_hits;
+	unsigned long sess_cmd_cache_misses;
+
 	/* Access control for this session and list entry there */
 	struct scst_acg *acg;
 
@@ -2391,6 +2429,9 @@ struct scst_cmd {
 	/* List entry for sess's sess_cmd_list */
 	struct list_head sess_cmd_list_entry;
 
+	/* List entry for sess's sess_cmd_hash, not used for internal cmds */
+	struct list_head sess_cmd_hash_entry;
+
 	/*
 	 * Used to found the cmd by scst_find_cmd_by_tag(). Set by the
 	 * target driver on the cmd's initialization time
@@ -2692,12 +2733,21 @@ struct scst_mgmt_cmd {
 
 	uint32_t cmd_sn; /* affected command's highest SN */
 
+	/* Time, when this mgmt cmd was allocated, for latency statistics */
+	ktime_t start_time;
+
 	/* corresponding cmd (to be aborted, found by tag) */
 	struct scst_cmd *cmd_to_abort;
 
 	/* corresponding device for this mgmt cmd (found by lun or by tag) */
 	struct scst_tgt_dev *mcmd_tgt_dev;
 
+	/*
+	 * For TARGET RESET referenced ACG, which devices were blocked. The
+	 * session can be reassigned to another ACG meanwhile.
+	 */
+	struct scst_acg *mcmd_reset_acg;
+
 	/* completion status, one of the SCST_MGMT_STATUS_* constants */
 	int status;
 
@@ -2788,6 +2838,10 @@ struct scst_ext_blocker {
 	uint8_t ext_blocker_data[];
 };
 
+/* Default and max sizes of each internal EXTENDED COPY READ or WRITE */
+#define SCST_EXT_COPY_DEF_IO_SIZE	(512*1024)
+#define SCST_EXT_COPY_MAX_IO_SIZE	(4*1024*1024)
+
 /*
  * SCST device
  */
@@ -3078,6 +3132,23 @@ struct scst_device {
 	/* MAXIMUM WRITE SAME LENGTH in bytes */
 	uint64_t max_write_same_len;
 
+	/*
+	 * Max size in bytes of each internal READ or WRITE generated by
+	 * the copy manager for this device. Dev handlers may lower or raise
+	 * it in attach() up to SCST_EXT_COPY_MAX_IO_SIZE to match the
+	 * backing storage.
+	 */
+	int ext_copy_max_io_size;
+
+	/*
+	 * Max number of internal READs and, separately, WRITEs the copy
+	 * manager keeps in flight for each EXTENDED COPY on this device.
+	 */
+	int ext_copy_max_in_flight;
+
+	/* Whether or not ext_copy_max_io_size has been modified via sysfs */
+	unsigned int ext_copy_max_io_size_set:1;
+
 	/* A list entry used during TM */
 	struct list_head tm_dev_list_entry;
 
@@ -3650,6 +3721,7 @@ struct scst_cmd *scst_rx_cmd(struct scst_session *sess,
 int scst_rx_cmd_prealloced(struct scst_cmd *cmd, struct scst_session *sess,
 	const uint8_t *lun, int lun_len, const uint8_t *cdb,
 	unsigned int cdb_len, bool atomic);
+int scst_sess_set_cmd_cache_size(struct scst_session *sess, int size);
 void scst_cmd_init_done(struct scst_cmd *cmd,
 	enum scst_exec_context pref_context);
 
@@ -5723,6 +5795,8 @@ ssize_t scst_readv(struct file *file, const struct iovec *vec,
 		   unsigned long vlen, loff_t *pos);
 ssize_t scst_writev(struct file *file, const struct iovec *vec,
 		    unsigned long vlen, loff_t *pos);
+ssize_t scst_writev_dsync(struct file *file, const struct iovec *vec,
+			  unsigned long vlen, loff_t *pos);
 void scst_write_same(struct scst_cmd *cmd, struct scst_data_descriptor *where);
 int scst_scsi_execute(struct scsi_device *sdev, const unsigned char *cmd,
 		      int data_direction, void *buffer, unsigned int bufflen,
@@ -60,7 +60,6 @@ struct scst_event_entry {
 	scst_event_done_notify_fn event_notify_fn;
 	void *notify_fn_priv;
 	unsigned long event_timeout; /* in jiffies */
-	int *pqueued_events_cnt;
 	union {
 		struct work_struct scst_event_queue_work;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
@@ -85,11 +84,57 @@ struct scst_event_notify_done {
 	int status;
 };
 
+/*
+ * Entry of the events buffer filled by SCST_EVENT_GET_NEXT_EVENTS. Entries
+ * follow each other, each one is entry_len bytes long and starts 8 bytes
+ * aligned.
+ */
+struct scst_event_batch_entry {
+	uint32_t entry_len;
+
+	/*
+	 * Number of identical events, i.e. with the same code, issuer and
+	 * payload, which came while this one was waiting to be dequeued and
+	 * were merged into it. Events with notification are never merged.
+	 * Events are merged only for subscribers, which have called
+	 * SCST_EVENT_GET_NEXT_EVENTS at least once, so the users of
+	 * SCST_EVENT_GET_NEXT_EVENT alone still get every event.
+	 */
+	uint32_t coalesced_cnt;
+
+	struct scst_event event;
+};
+
+struct scst_event_user_batch {
+	aligned_u64 events_buf; /* in: user buffer for the events */
+	int32_t events_buf_len; /* in: its size */
+
+	/* out: number of the returned events */
+	int32_t events_cnt;
+
+	/* out: if ENOSPC returned, size of the buffer for the next event */
+	int32_t needed_len;
+
+	/*
+	 * out: number of events lost since the previous
+	 * SCST_EVENT_GET_NEXT_EVENTS, because the queue was full
+	 */
+	uint32_t dropped_cnt;
+};
+
+#define SCST_EVENT_BATCH_NEXT(e)					\
+	((struct scst_event_batch_entry *)((uint8_t *)(e) + (e)->entry_len))
+
 /* IOCTLs */
 #define SCST_EVENT_ALLOW_EVENT		_IOW('u', 1, struct scst_event)
 #define SCST_EVENT_DISALLOW_EVENT	_IOW('u', 2, struct scst_event)
 #define SCST_EVENT_GET_NEXT_EVENT	_IOWR('u', 3, struct scst_event_user)
 #define SCST_EVENT_NOTIFY_DONE		_IOW('u', 4, struct scst_event_notify_done)
+/*
+ * Returns as many queued events as fit in the buffer, at least one. Blocks
+ * the same way as SCST_EVENT_GET_NEXT_EVENT.
+ */
+#define SCST_EVENT_GET_NEXT_EVENTS	_IOWR('u', 5, struct scst_event_user_batch)
 
 #ifdef __KERNEL__
 void scst_event_queue(uint32_t event_code, const char *issuer_name,
@@ -55,6 +55,10 @@
 #define SCST_USER_MAX_PARTIAL_TRANSFERS_OPT		\
 		SCST_USER_PARTIAL_TRANSFERS_SUPPORTED
 
+#define SCST_USER_QUEUE_STEER_CPU	0
+#define SCST_USER_QUEUE_STEER_LBA	1
+#define SCST_USER_MAX_QUEUE_STEER_OPT	SCST_USER_QUEUE_STEER_LBA
+
 #ifndef __KERNEL__
 #define aligned_u64 uint64_t __attribute__((aligned(8)))
 #endif
@@ -112,6 +116,8 @@ struct scst_user_dev_desc {
 	struct scst_user_opt opt;
 	uint32_t block_size;
 	uint8_t enable_pr_cmds_notifications;
+	uint8_t queues_num;
+	uint8_t queue_steering;
 	char name[SCST_MAX_NAME];
 	char sgv_name[SCST_MAX_NAME];
 };
@@ -353,10 +359,41 @@ struct scst_user_get_multi {
 	int16_t replies_cnt; /* in */
 	int16_t replies_done; /* out */
 	int16_t cmds_cnt; /* in/out */
-	int16_t pad;
+	int16_t queue; /* in */
 	struct scst_user_get_cmd cmds[0]; /* out */
 };
 
+/*
+ * Header of a shared memory ring. Entries are produced at tail and
+ * consumed at head, both are free running and taken modulo entries.
+ */
+struct scst_user_ring_hdr {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t entries;
+
+/* Values for scst_user_ring_hdr.flags */
+#define SCST_USER_RING_NEED_WAKEUP	1
+	uint32_t flags;
+};
+
+struct scst_user_ring_setup {
+	uint32_t cmd_entries; /* in/out */
+	uint32_t reply_entries; /* in/out */
+	int32_t eventfd; /* in */
+	uint32_t poll_usecs; /* in */
+	aligned_u64 cmd_hdr_offs; /* out */
+	aligned_u64 cmds_offs; /* out */
+	aligned_u64 reply_hdr_offs; /* out */
+	aligned_u64 replies_offs; /* out */
+	aligned_u64 mmap_size; /* out */
+};
+
+struct scst_user_arena_desc {
+	aligned_u64 pbuf;
+	aligned_u64 len;
+};
+
 #define SCST_USER_REGISTER_DEVICE	_IOW('u', 1, struct scst_user_dev_desc)
 #define SCST_USER_UNREGISTER_DEVICE	_IO('u', 2)
 #define SCST_USER_SET_OPTIONS		_IOW('u', 3, struct scst_user_opt)
@@ -368,6 +405,9 @@ struct scst_user_get_multi {
 #define SCST_USER_GET_EXTENDED_CDB	_IOWR('u', 9, struct scst_user_get_ext_cdb)
 #define SCST_USER_PREALLOC_BUFFER	_IOWR('u', 10, union scst_user_prealloc_buffer)
 #define SCST_USER_REPLY_AND_GET_MULTI	_IOWR('u', 11, struct scst_user_get_multi)
+#define SCST_USER_RING_SETUP		_IOWR('u', 12, struct scst_user_ring_setup)
+#define SCST_USER_RING_WAKEUP		_IO('u', 13)
+#define SCST_USER_REGISTER_ARENA	_IOW('u', 14, struct scst_user_arena_desc)
 
 /* Values for scst_user_get_cmd.subcode */
 #define SCST_USER_ATTACH_SESS		\
@@ -22,6 +22,10 @@
 #include <linux/poll.h>
 #include <linux/stddef.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/eventfd.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
 
 #define LOG_PREFIX		DEV_USER_NAME
 
@@ -37,6 +41,10 @@
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/sched/signal.h>
+#include <linux/sched/mm.h>
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+#include <linux/mmu_context.h>
 #endif
 
 #ifndef INSIDE_KERNEL_TREE
@@ -51,6 +59,85 @@ for details.
 #define DEV_USER_CMD_HASH_ORDER		6
 #define DEV_USER_ATTACH_TIMEOUT		(5*HZ)
 
+#define DEV_USER_MAX_ARENAS		4
+
+#define DEV_USER_MAX_QUEUES		32
+/* LBA steering keeps each 1 MB range of the device on the same queue */
+#define DEV_USER_STEER_RANGE_SHIFT	20
+
+#define DEV_USER_RING_DEF_ENTRIES	256
+#define DEV_USER_RING_MAX_ENTRIES	32768
+/* Max busy polling time of the rings thread, it keeps a CPU busy meanwhile */
+#define DEV_USER_RING_MAX_POLL_USECS	10000
+
+/*
+ * Pair of rings shared with the user space via mmap(): commands ring,
+ * produced by the kernel, and replies ring, produced by the user space.
+ * Both are served by a per device kernel thread, so the user space can
+ * get commands and reply on them without any syscall.
+ */
+struct scst_user_ring {
+	void *mem;
+	size_t size;
+
+	struct scst_user_ring_hdr *cmd_hdr;
+	struct scst_user_get_cmd *cmds;
+	struct scst_user_ring_hdr *reply_hdr;
+	struct scst_user_reply_cmd *replies;
+
+	/*
+	 * Private copies of the kernel owned indexes and masks, which the
+	 * user space can't corrupt.
+	 */
+	uint32_t cmd_mask;
+	uint32_t cmd_tail;
+	uint32_t reply_mask;
+	uint32_t reply_head;
+
+	/* How long the thread busy polls the rings before going to sleep */
+	unsigned int poll_usecs;
+
+	struct mm_struct *mm;
+	struct eventfd_ctx *eventfd;
+	wait_queue_head_t user_waitQ;
+	struct task_struct *thread;
+};
+
+/*
+ * User space buffer, registered by SCST_USER_REGISTER_ARENA and pinned for
+ * the device lifetime. Command buffers inside it are mapped without
+ * get_user_pages(), and buffers of commands, for which the user space would
+ * be asked to allocate memory, are carved from it by the kernel.
+ */
+struct scst_user_arena {
+	unsigned long ubuff;
+	int num_pages;
+	struct page **pages;
+	/* Pages carved for commands, protected by arena_lock */
+	unsigned long *bitmap;
+};
+
+/*
+ * Queue of commands, ready to be sent to the user space. Commands are
+ * steered to a queue by the submitting CPU or by their LBA range, and user
+ * threads, bound to a queue, get commands only from it and from the first
+ * queue, which also carries all management commands.
+ *
+ * All fields are protected by udev_cmd_threads.cmd_list_lock.
+ */
+struct scst_user_queue {
+	struct list_head ready_cmd_list;
+
+	/* Threads, bound to this queue, wait here */
+	wait_queue_head_t waitQ;
+
+	unsigned int depth;
+	unsigned int max_depth;
+	unsigned long cmds;
+	/* Total time commands waited in the queue for a user thread */
+	uint64_t wait_ns;
+};
+
 struct scst_user_dev {
 	/*
 	 * Must be kept here, because it's needed on the cleanup time,
@@ -58,8 +145,13 @@ struct scst_user_dev {
 	 */
 	struct scst_cmd_threads udev_cmd_threads;
 
+	/* Set on the registration, never changed afterwards */
+	int queues_num;
+	uint8_t queue_steering;
+
 	/* Protected by udev_cmd_threads.cmd_list_lock */
-	struct list_head ready_cmd_list;
+	int next_queue;
+	struct scst_user_queue queues[DEV_USER_MAX_QUEUES];
 
 	/*
 	 * Don't need any protection or assignment in SCST_USER_SET_OPTIONS
@@ -105,6 +197,17 @@ struct scst_user_dev {
 
 	struct list_head cleanup_list_entry;
 	struct completion cleanup_cmpl;
+
+	/* Set once by SCST_USER_RING_SETUP, protected by dev_list_lock */
+	struct scst_user_ring *ring;
+
+	/*
+	 * Arenas are only added, arenas_num is incremented after the arena
+	 * set up, both under arena_lock.
+	 */
+	spinlock_t arena_lock;
+	int arenas_num;
+	struct scst_user_arena arenas[DEV_USER_MAX_ARENAS];
 };
 
 /* Most fields are unprotected, since only one thread at time can access them */
@@ -122,6 +225,7 @@ struct scst_user_cmd {
 	unsigned int buf_dirty:1;
 	unsigned int background_exec:1;
 	unsigned int aborted:1;
+	unsigned int arena_alloced:1;
 
 	struct scst_user_cmd *buf_ucmd;
 
@@ -134,6 +238,10 @@ struct scst_user_cmd {
 	struct page **data_pages;
 	struct sgv_pool_obj *sgv;
 
+	/* Where the buffer was carved from, if arena_alloced */
+	struct scst_user_arena *arena;
+	int arena_first_page;
+
 	/*
 	 * Special flags, which can be accessed asynchronously (hence "long").
 	 * Protected by udev_cmd_threads.cmd_list_lock.
@@ -145,7 +253,10 @@ struct scst_user_cmd {
 
 	unsigned int state;
 
+	/* All protected by udev_cmd_threads.cmd_list_lock */
 	struct list_head ready_cmd_list_entry;
+	int queue;
+	ktime_t ready_time;
 
 	unsigned int h;
 	struct list_head hash_list_entry;
@@ -183,12 +294,21 @@ static int dev_user_unregister_dev(struct file *file);
 static int dev_user_flush_cache(struct file *file);
 static int dev_user_capacity_changed(struct file *file);
 static int dev_user_prealloc_buffer(struct file *file, void __user *arg);
+static int dev_user_register_arena(struct file *file, void __user *arg);
+static void dev_user_free_arenas(struct scst_user_dev *dev);
+static void dev_user_arena_free(struct scst_user_cmd *ucmd);
+static int dev_user_arena_alloc(struct scst_user_cmd *ucmd, int len,
+	gfp_t gfp_mask);
+static int dev_user_ring_setup(struct file *file, void __user *arg);
+static int dev_user_ring_wakeup(struct file *file);
+static void dev_user_ring_free(struct scst_user_dev *dev);
 static int __dev_user_set_opt(struct scst_user_dev *dev,
 	const struct scst_user_opt *opt);
 static int dev_user_set_opt(struct file *file, const struct scst_user_opt *opt);
 static int dev_user_get_opt(struct file *file, void __user *arg);
 
 static unsigned int dev_user_poll(struct file *filp, poll_table *wait);
+static int dev_user_mmap(struct file *file, struct vm_area_struct *vma);
 static long dev_user_ioctl(struct file *file, unsigned int cmd,
 	unsigned long arg);
 static int dev_user_release(struct inode *inode, struct file *file);
@@ -226,6 +346,7 @@ static struct kmem_cache *user_cmd_cachep;
 
 static const struct file_operations dev_user_fops = {
 	.poll		= dev_user_poll,
+	.mmap		= dev_user_mmap,
 	.unlocked_ioctl	= dev_user_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl	= dev_user_ioctl,
@@ -474,6 +595,9 @@ static void dev_user_unmap_buf(struct scst_user_cmd *ucmd)
 	kfree(ucmd->data_pages);
 	ucmd->data_pages = NULL;
 
+	if (ucmd->arena_alloced)
+		dev_user_arena_free(ucmd);
+
 	TRACE_EXIT();
 	return;
 }
@@ -574,7 +698,8 @@ static int dev_user_alloc_sg(struct scst_user_cmd *ucmd, int cached_buff)
 	} else {
 		TRACE_MEM("%s", "Not cached buff");
 		flags |= SGV_POOL_ALLOC_NO_CACHED;
-		if (ucmd->ubuff == 0) {
+		if ((ucmd->ubuff == 0) &&
+		    (dev_user_arena_alloc(ucmd, orig_bufflen, gfp_mask) != 0)) {
 			res = 1;
 			goto out;
 		}
@@ -727,6 +852,7 @@ static struct scst_user_cmd *dev_user_alloc_ucmd(struct scst_user_dev *dev,
 		goto out;
 	}
 	ucmd->dev = dev;
+	ucmd->queue = -1;
 	atomic_set(&ucmd->ucmd_ref, 1);
 
 	cmd_insert_hash(ucmd);
@@ -1145,14 +1271,14 @@ static inline bool dev_user_mgmt_ucmd(struct scst_user_cmd *ucmd)
 }
 
 /* Supposed to be called under cmd_list_lock */
-static inline void dev_user_add_to_ready_head(struct scst_user_cmd *ucmd)
+static inline void dev_user_add_to_ready_head(struct scst_user_cmd *ucmd,
+	struct scst_user_queue *q)
 {
-	struct scst_user_dev *dev = ucmd->dev;
 	struct list_head *entry;
 
 	TRACE_ENTRY();
 
-	__list_for_each(entry, &dev->ready_cmd_list) {
+	__list_for_each(entry, &q->ready_cmd_list) {
 		struct scst_user_cmd *u = list_entry(entry,
 			struct scst_user_cmd, ready_cmd_list_entry);
 		/*
@@ -1172,16 +1298,53 @@ static inline void dev_user_add_to_ready_head(struct scst_user_cmd *ucmd)
 	TRACE_DBG("Adding ucmd %p (state %d) to tail "
 		"of mgmt ready cmd list", ucmd, ucmd->state);
 	list_add_tail(&ucmd->ready_cmd_list_entry,
-		&dev->ready_cmd_list);
+		&q->ready_cmd_list);
 
 out:
 	TRACE_EXIT();
 	return;
 }
 
+/*
+ * Returns the queue of ucmd. The queue is chosen on the first queuing and
+ * then kept, so all states of a command are served by the same threads.
+ *
+ * Called under udev_cmd_threads.cmd_list_lock and IRQ off.
+ */
+static struct scst_user_queue *dev_user_ucmd_queue(struct scst_user_cmd *ucmd)
+{
+	struct scst_user_dev *dev = ucmd->dev;
+	struct scst_cmd *cmd = ucmd->cmd;
+
+	if (likely(ucmd->queue >= 0))
+		goto out;
+
+	if ((dev->queues_num == 1) || (cmd == NULL))
+		ucmd->queue = 0;
+	else if (dev->queue_steering == SCST_USER_QUEUE_STEER_LBA)
+		ucmd->queue = (uint32_t)hash_64(((uint64_t)cmd->lba <<
+					cmd->dev->block_shift) >>
+				DEV_USER_STEER_RANGE_SHIFT, 32) % dev->queues_num;
+	else
+		ucmd->queue = smp_processor_id() % dev->queues_num;
+
+	TRACE_DBG("ucmd %p steered to queue %d", ucmd, ucmd->queue);
+
+out:
+	return &dev->queues[ucmd->queue];
+}
+
+/* Called under udev_cmd_threads.cmd_list_lock and IRQ off */
+static inline void dev_user_del_from_ready(struct scst_user_cmd *ucmd)
+{
+	list_del(&ucmd->ready_cmd_list_entry);
+	ucmd->dev->queues[ucmd->queue].depth--;
+}
+
 static void dev_user_add_to_ready(struct scst_user_cmd *ucmd)
 {
 	struct scst_user_dev *dev = ucmd->dev;
+	struct scst_user_queue *q;
 	unsigned long flags;
 	/*
 	 * Note, a separate softIRQ check is required for real-time kernels
@@ -1199,6 +1362,12 @@ static void dev_user_add_to_ready(struct scst_user_cmd *ucmd)
 
 	ucmd->this_state_unjammed = 0;
 
+	q = dev_user_ucmd_queue(ucmd);
+	ucmd->ready_time = ktime_get();
+	q->depth++;
+	if (q->depth > q->max_depth)
+		q->max_depth = q->depth;
+
 	if ((ucmd->state == UCMD_STATE_PARSING) ||
 	    (ucmd->state == UCMD_STATE_BUF_ALLOCING)) {
 		/*
@@ -1210,26 +1379,49 @@ static void dev_user_add_to_ready(struct scst_user_cmd *ucmd)
 		 * of our commands completed in NOP timeout to allow the head
 		 * commands to go, then we are really overloaded and/or stuck.
 		 */
-		dev_user_add_to_ready_head(ucmd);
+		dev_user_add_to_ready_head(ucmd, q);
 	} else if (unlikely(dev_user_mgmt_ucmd(ucmd))) {
-		dev_user_add_to_ready_head(ucmd);
+		dev_user_add_to_ready_head(ucmd, q);
 		do_wake = 1;
 	} else {
 		if ((ucmd->cmd != NULL) &&
 		    unlikely((ucmd->cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))) {
 			TRACE_DBG("Adding HQ ucmd %p to head of ready cmd list",
 				ucmd);
-			dev_user_add_to_ready_head(ucmd);
+			dev_user_add_to_ready_head(ucmd, q);
 		} else {
 			TRACE_DBG("Adding ucmd %p to ready cmd list", ucmd);
 			list_add_tail(&ucmd->ready_cmd_list_entry,
-				      &dev->ready_cmd_list);
+				      &q->ready_cmd_list);
 		}
 		do_wake |= ((ucmd->state == UCMD_STATE_ON_CACHE_FREEING) ||
 			    (ucmd->state == UCMD_STATE_ON_FREEING) ||
 			    (ucmd->state == UCMD_STATE_EXT_COPY_REMAPPING));
 	}
 
+	if (dev->queues_num > 1) {
+		/*
+		 * The current thread might be bound to another queue, so
+		 * always wake up somebody. Threads, bound to the queue, are
+		 * preferred, otherwise any thread, including not bound ones,
+		 * waiting on the device waitQ. Threads bound to other queues
+		 * wait there exclusively as well, so an exclusive wake up
+		 * could pick one of them and lose the wake up. Hence wake up
+		 * all of them for not queue 0 commands.
+		 */
+		if ((q != &dev->queues[0]) && waitqueue_active(&q->waitQ)) {
+			TRACE_DBG("Waking up queue %d of dev %p", ucmd->queue,
+				dev);
+			wake_up(&q->waitQ);
+			do_wake = 0;
+		} else if (q != &dev->queues[0]) {
+			TRACE_DBG("Waking up all threads of dev %p", dev);
+			wake_up_all(&dev->udev_cmd_threads.cmd_list_waitQ);
+			do_wake = 0;
+		} else
+			do_wake = 1;
+	}
+
 	if (do_wake) {
 		TRACE_DBG("Waking up dev %p", dev);
 		wake_up(&dev->udev_cmd_threads.cmd_list_waitQ);
@@ -1241,8 +1433,132 @@ static void dev_user_add_to_ready(struct scst_user_cmd *ucmd)
 	return;
 }
 
+/*
+ * Gets references of the pages of the user buffer, if it is entirely inside
+ * a registered arena. Returns true on success.
+ */
+static bool dev_user_arena_get_pages(struct scst_user_dev *dev,
+	unsigned long ubuff, int num_pg, struct page **pages)
+{
+	struct scst_user_arena *arena;
+	int i, n, first;
+
+	/* Pairs with smp_store_release() in dev_user_register_arena() */
+	n = smp_load_acquire(&dev->arenas_num);
+	for (i = 0; i < n; i++) {
+		arena = &dev->arenas[i];
+		if ((ubuff >= arena->ubuff) &&
+		    (((ubuff - arena->ubuff) >> PAGE_SHIFT) + num_pg <=
+							arena->num_pages))
+			goto found;
+	}
+	return false;
+
+found:
+	first = (ubuff - arena->ubuff) >> PAGE_SHIFT;
+	for (i = 0; i < num_pg; i++) {
+		pages[i] = arena->pages[first + i];
+		get_page(pages[i]);
+	}
+	return true;
+}
+
+/*
+ * Carves the buffer of len bytes for ucmd from the registered arenas, so the
+ * user space doesn't need to allocate it. Returns 0 on success.
+ */
+static int dev_user_arena_alloc(struct scst_user_cmd *ucmd, int len,
+	gfp_t gfp_mask)
+{
+	struct scst_user_dev *dev = ucmd->dev;
+	struct scst_user_arena *arena;
+	int res = -ENOMEM, i, n, num_pg = PAGE_ALIGN(len) >> PAGE_SHIFT;
+	unsigned long first = 0, flags;
+
+	TRACE_ENTRY();
+
+	n = smp_load_acquire(&dev->arenas_num);
+	if (n == 0)
+		goto out;
+
+	EXTRACHECKS_BUG_ON(ucmd->data_pages != NULL);
+
+	ucmd->data_pages = kmalloc_array(num_pg, sizeof(*ucmd->data_pages),
+					 gfp_mask);
+	if (ucmd->data_pages == NULL) {
+		TRACE(TRACE_OUT_OF_MEM, "Unable to allocate data_pages array "
+			"(num_pg=%d)", num_pg);
+		goto out;
+	}
+
+	spin_lock_irqsave(&dev->arena_lock, flags);
+	for (i = 0; i < n; i++) {
+		arena = &dev->arenas[i];
+		first = bitmap_find_next_zero_area(arena->bitmap,
+				arena->num_pages, 0, num_pg, 0);
+		if (first < arena->num_pages) {
+			bitmap_set(arena->bitmap, first, num_pg);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&dev->arena_lock, flags);
+
+	if (i == n) {
+		TRACE_MEM("No %d free pages in arenas (ucmd %p)", num_pg,
+			ucmd);
+		kfree(ucmd->data_pages);
+		ucmd->data_pages = NULL;
+		goto out;
+	}
+
+	for (i = 0; i < num_pg; i++) {
+		ucmd->data_pages[i] = arena->pages[first + i];
+		get_page(ucmd->data_pages[i]);
+	}
+
+	ucmd->num_data_pages = num_pg;
+	ucmd->ubuff = arena->ubuff + (first << PAGE_SHIFT);
+	ucmd->first_page_offset = 0;
+	ucmd->arena = arena;
+	ucmd->arena_first_page = first;
+	ucmd->arena_alloced = 1;
+	res = 0;
+
+	TRACE_MEM("Carved %d pages from arena %lx (ucmd %p, ubuff %lx)",
+		num_pg, arena->ubuff, ucmd, ucmd->ubuff);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Returns the buffer carved by dev_user_arena_alloc() to its arena */
+static void dev_user_arena_free(struct scst_user_cmd *ucmd)
+{
+	struct scst_user_dev *dev = ucmd->dev;
+	unsigned long flags;
+
+	TRACE_MEM("Returning %d pages to arena %lx (ucmd %p, ubuff %lx)",
+		ucmd->num_data_pages, ucmd->arena->ubuff, ucmd, ucmd->ubuff);
+
+	spin_lock_irqsave(&dev->arena_lock, flags);
+	bitmap_clear(ucmd->arena->bitmap, ucmd->arena_first_page,
+		ucmd->num_data_pages);
+	spin_unlock_irqrestore(&dev->arena_lock, flags);
+
+	ucmd->arena_alloced = 0;
+	ucmd->arena = NULL;
+	return;
+}
+
+/*
+ * Pins the user space buffer ubuff as the data buffer of ucmd. If writable
+ * is false, the kernel only reads from the buffer, so it is pinned without
+ * FOLL_WRITE. Then pages of a shared file mapping are neither dirtied, nor,
+ * for a read-only mapping, refused or copied.
+ */
 static int dev_user_map_buf(struct scst_user_cmd *ucmd, unsigned long ubuff,
-	int num_pg)
+	int num_pg, bool writable)
 {
 	int res = 0, rc;
 	int i;
@@ -1272,15 +1588,19 @@ static int dev_user_map_buf(struct scst_user_cmd *ucmd, unsigned long ubuff,
 		ucmd->num_data_pages, (int)(ubuff & ~PAGE_MASK),
 		(ucmd->cmd != NULL) ? ucmd->cmd->bufflen : -1);
 
+	if (dev_user_arena_get_pages(ucmd->dev, ubuff, ucmd->num_data_pages,
+			ucmd->data_pages))
+		goto mapped;
+
 	down_read(&tsk->mm->mmap_sem);
 #if (!defined(CONFIG_SUSE_KERNEL) &&			 \
 	LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)) || \
 	LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
-	rc = get_user_pages(ubuff, ucmd->num_data_pages, 1/*writable*/,
+	rc = get_user_pages(ubuff, ucmd->num_data_pages, writable,
 			    0/*don't force*/, ucmd->data_pages, NULL);
 #else
-	rc = get_user_pages(ubuff, ucmd->num_data_pages, FOLL_WRITE,
-			    ucmd->data_pages, NULL);
+	rc = get_user_pages(ubuff, ucmd->num_data_pages,
+			    writable ? FOLL_WRITE : 0, ucmd->data_pages, NULL);
 #endif
 	up_read(&tsk->mm->mmap_sem);
 
@@ -1289,6 +1609,7 @@ static int dev_user_map_buf(struct scst_user_cmd *ucmd, unsigned long ubuff,
 	if (rc < ucmd->num_data_pages)
 		goto out_unmap;
 
+mapped:
 	ucmd->ubuff = ubuff;
 	ucmd->first_page_offset = (ubuff & ~PAGE_MASK);
 
@@ -1345,7 +1666,8 @@ static int dev_user_process_reply_alloc(struct scst_user_cmd *ucmd,
 		} else
 			pages = calc_num_pg(reply->alloc_reply.pbuf,
 					    cmd->bufflen);
-		res = dev_user_map_buf(ucmd, reply->alloc_reply.pbuf, pages);
+		res = dev_user_map_buf(ucmd, reply->alloc_reply.pbuf, pages,
+				       true);
 	} else {
 		scst_set_busy(ucmd->cmd);
 		scst_set_cmd_abnormal_done_state(ucmd->cmd);
@@ -1812,7 +2134,17 @@ static int dev_user_process_reply_exec(struct scst_user_cmd *ucmd,
 				pages = cmd->sg_cnt;
 			} else
 				pages = calc_num_pg(ereply->pbuf, cmd->bufflen);
-			rc = dev_user_map_buf(ucmd, ereply->pbuf, pages);
+			/*
+			 * Data of medium READs are only sent to the initiator.
+			 * Cached buffers can later be reused for WRITEs and
+			 * responses of other commands can be modified by the
+			 * SCST core, e.g. the WP bit of MODE SENSE, so those
+			 * need writable pages.
+			 */
+			rc = dev_user_map_buf(ucmd, ereply->pbuf, pages,
+				ucmd->buff_cached ||
+				(cmd->data_direction != SCST_DATA_READ) ||
+				(cmd->op_flags & SCST_LBA_NOT_VALID));
 			if ((rc != 0) || (ucmd->ubuff == 0))
 				goto out_compl;
 
@@ -2171,7 +2503,7 @@ static int dev_user_process_scst_commands(struct scst_user_dev *dev)
 }
 
 /* Called under udev_cmd_threads.cmd_list_lock and IRQ off */
-static struct scst_user_cmd *__dev_user_get_next_cmd(struct list_head *cmd_list)
+static struct scst_user_cmd *__dev_user_get_next_cmd(struct scst_user_queue *q)
 	__releases(&dev->udev_cmd_threads.cmd_list_lock)
 	__acquires(&dev->udev_cmd_threads.cmd_list_lock)
 {
@@ -2179,12 +2511,12 @@ static struct scst_user_cmd *__dev_user_get_next_cmd(struct list_head *cmd_list)
 
 again:
 	u = NULL;
-	if (!list_empty(cmd_list)) {
-		u = list_first_entry(cmd_list, typeof(*u),
+	if (!list_empty(&q->ready_cmd_list)) {
+		u = list_first_entry(&q->ready_cmd_list, typeof(*u),
 			       ready_cmd_list_entry);
 
 		TRACE_DBG("Found ready ucmd %p", u);
-		list_del(&u->ready_cmd_list_entry);
+		dev_user_del_from_ready(u);
 
 		EXTRACHECKS_BUG_ON(u->this_state_unjammed);
 
@@ -2227,35 +2559,135 @@ again:
 		}
 		u->sent_to_user = 1;
 		u->seen_by_user = 1;
+		q->cmds++;
+		q->wait_ns += ktime_to_ns(ktime_sub(ktime_get(),
+						    u->ready_time));
 	}
 	return u;
 }
 
-static inline int test_cmd_threads(struct scst_user_dev *dev, bool can_block)
+/*
+ * Gets the next ready ucmd for a thread, bound to the queue with index
+ * queue, or, if queue is negative, for a not bound thread, which serves all
+ * queues in round robin order.
+ *
+ * Called under udev_cmd_threads.cmd_list_lock and IRQ off.
+ */
+static struct scst_user_cmd *dev_user_get_next_queued(struct scst_user_dev *dev,
+	int queue)
+	__releases(&dev->udev_cmd_threads.cmd_list_lock)
+	__acquires(&dev->udev_cmd_threads.cmd_list_lock)
+{
+	struct scst_user_cmd *u;
+	int i, q;
+
+	if (queue >= 0) {
+		u = __dev_user_get_next_cmd(&dev->queues[queue]);
+		if ((u == NULL) && (queue != 0))
+			u = __dev_user_get_next_cmd(&dev->queues[0]);
+		goto out;
+	}
+
+	for (i = 0; i < dev->queues_num; i++) {
+		q = dev->next_queue;
+		if (++dev->next_queue >= dev->queues_num)
+			dev->next_queue = 0;
+		u = __dev_user_get_next_cmd(&dev->queues[q]);
+		if (u != NULL)
+			goto out;
+	}
+	u = NULL;
+
+out:
+	return u;
+}
+
+/* Called under udev_cmd_threads.cmd_list_lock */
+static bool dev_user_has_ready(struct scst_user_dev *dev, int queue)
+{
+	int i;
+
+	if (queue >= 0)
+		return !list_empty(&dev->queues[queue].ready_cmd_list) ||
+		       !list_empty(&dev->queues[0].ready_cmd_list);
+
+	for (i = 0; i < dev->queues_num; i++) {
+		if (!list_empty(&dev->queues[i].ready_cmd_list))
+			return true;
+	}
+	return false;
+}
+
+static inline int test_cmd_threads(struct scst_user_dev *dev, int queue,
+	bool can_block)
 {
 	int res = !list_empty(&dev->udev_cmd_threads.active_cmd_list) ||
-		  !list_empty(&dev->ready_cmd_list) ||
+		  dev_user_has_ready(dev, queue) ||
 		  !can_block || !dev->blocking || dev->cleanup_done ||
 		  signal_pending(current);
 	return res;
 }
 
-/* Called under udev_cmd_threads.cmd_list_lock and IRQ off */
+/*
+ * Waits for work for a thread, bound to a queue other than the first one.
+ * Such thread waits on both the device waitQ, which is woken up for SCST
+ * and management commands, and on the queue waitQ, which is woken up for
+ * commands, steered to the queue.
+ *
+ * Called under udev_cmd_threads.cmd_list_lock and IRQ off.
+ */
+static void dev_user_wait_queue(struct scst_user_dev *dev, int queue,
+	bool can_block)
+	__releases(&dev->udev_cmd_threads.cmd_list_lock)
+	__acquires(&dev->udev_cmd_threads.cmd_list_lock)
+{
+	struct scst_user_queue *q = &dev->queues[queue];
+	DEFINE_WAIT(wait);
+	DEFINE_WAIT(qwait);
+
+	if (test_cmd_threads(dev, queue, can_block))
+		return;
+
+	do {
+		prepare_to_wait_exclusive_head(
+			&dev->udev_cmd_threads.cmd_list_waitQ, &wait,
+			TASK_INTERRUPTIBLE);
+		prepare_to_wait_exclusive_head(&q->waitQ, &qwait,
+			TASK_INTERRUPTIBLE);
+		if (test_cmd_threads(dev, queue, can_block))
+			break;
+		spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+		schedule();
+		spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	} while (!test_cmd_threads(dev, queue, can_block));
+
+	finish_wait(&q->waitQ, &qwait);
+	finish_wait(&dev->udev_cmd_threads.cmd_list_waitQ, &wait);
+	return;
+}
+
+/*
+ * Called under udev_cmd_threads.cmd_list_lock and IRQ off. See
+ * dev_user_get_next_queued() for the queue argument.
+ */
 static int dev_user_get_next_cmd(struct scst_user_dev *dev,
-	struct scst_user_cmd **ucmd, bool can_block)
+	struct scst_user_cmd **ucmd, bool can_block, int queue)
 {
 	int res = 0;
 
 	TRACE_ENTRY();
 
 	while (1) {
-		wait_event_locked(dev->udev_cmd_threads.cmd_list_waitQ,
-				  test_cmd_threads(dev, can_block), lock_irq,
-				  dev->udev_cmd_threads.cmd_list_lock);
+		if (queue > 0)
+			dev_user_wait_queue(dev, queue, can_block);
+		else
+			wait_event_locked(dev->udev_cmd_threads.cmd_list_waitQ,
+				test_cmd_threads(dev, queue, can_block),
+				lock_irq, dev->udev_cmd_threads.cmd_list_lock);
 
 		dev_user_process_scst_commands(dev);
 
-		*ucmd = __dev_user_get_next_cmd(&dev->ready_cmd_list);
+		*ucmd = dev_user_get_next_queued(dev, queue);
 		if (*ucmd != NULL)
 			break;
 
@@ -2278,7 +2710,7 @@ static int dev_user_get_next_cmd(struct scst_user_dev *dev,
 
 /* No locks */
 static int dev_user_get_cmd_to_user(struct scst_user_dev *dev,
-	void __user *where, bool can_block)
+	void __user *where, bool can_block, int queue)
 {
 	int res;
 	struct scst_user_cmd *ucmd;
@@ -2287,7 +2719,7 @@ static int dev_user_get_cmd_to_user(struct scst_user_dev *dev,
 
 	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 again:
-	res = dev_user_get_next_cmd(dev, &ucmd, can_block);
+	res = dev_user_get_next_cmd(dev, &ucmd, can_block, queue);
 	if (res == 0) {
 		int len, rc;
 		/*
@@ -2316,7 +2748,8 @@ again:
 			/* Requeue ucmd back */
 			spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 			list_add(&ucmd->ready_cmd_list_entry,
-				&dev->ready_cmd_list);
+				&dev->queues[ucmd->queue].ready_cmd_list);
+			dev->queues[ucmd->queue].depth++;
 			spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 		}
 #ifdef CONFIG_SCST_EXTRACHECKS
@@ -2375,7 +2808,7 @@ static int dev_user_reply_get_cmd(struct file *file, void __user *arg)
 			goto out;
 	}
 
-	res = dev_user_get_cmd_to_user(dev, arg, true);
+	res = dev_user_get_cmd_to_user(dev, arg, true, -1);
 
 out:
 	TRACE_EXIT_RES(res);
@@ -2387,7 +2820,7 @@ static int dev_user_reply_get_multi(struct file *file, void __user *arg)
 	int res = 0, rc;
 	struct scst_user_dev *dev;
 	struct scst_user_reply_cmd __user *replies;
-	int16_t i, replies_cnt, replies_done = 0, cmds_cnt = 0;
+	int16_t i, replies_cnt, replies_done = 0, cmds_cnt = 0, queue = 0;
 
 	TRACE_ENTRY();
 
@@ -2410,8 +2843,25 @@ static int dev_user_reply_get_multi(struct file *file, void __user *arg)
 		goto out;
 	}
 
-	TRACE_DBG("replies %d, space %d (dev %s)",
-		replies_cnt, cmds_cnt, dev->name);
+	if (dev->queues_num > 1) {
+		res = get_user(queue, (int16_t __user *)
+			&((struct scst_user_get_multi __user *)arg)->queue);
+		if (unlikely(res < 0)) {
+			PRINT_ERROR("%s", "Unable to get queue");
+			goto out;
+		}
+		if (unlikely((queue < 0) || (queue > dev->queues_num))) {
+			PRINT_ERROR("Wrong queue %d (dev %s has %d queues)",
+				queue, dev->name, dev->queues_num);
+			res = -EINVAL;
+			goto out;
+		}
+	}
+	/* 0 means any queue, otherwise 1-based queue number */
+	queue--;
+
+	TRACE_DBG("replies %d, space %d, queue %d (dev %s)",
+		replies_cnt, cmds_cnt, queue, dev->name);
 
 	if (replies_cnt == 0)
 		goto get_cmds;
@@ -2453,7 +2903,8 @@ static int dev_user_reply_get_multi(struct file *file, void __user *arg)
 get_cmds:
 	for (i = 0; i < cmds_cnt; i++) {
 		res = dev_user_get_cmd_to_user(dev,
-			&((struct scst_user_get_multi __user *)arg)->cmds[i], i == 0);
+			&((struct scst_user_get_multi __user *)arg)->cmds[i], i == 0,
+			queue);
 		if (res != 0) {
 			if ((res == -EAGAIN) && (i > 0))
 				res = 0;
@@ -2482,6 +2933,459 @@ out_part_replies_done:
 	goto out;
 }
 
+static inline bool dev_user_ring_has_cmds(struct scst_user_ring *ring)
+{
+	return ring->cmd_tail != READ_ONCE(ring->cmd_hdr->head);
+}
+
+static inline bool dev_user_ring_cmd_space(struct scst_user_ring *ring)
+{
+	/* A garbage head written by the user space is treated as full ring */
+	return ring->cmd_tail - smp_load_acquire(&ring->cmd_hdr->head) <=
+		ring->cmd_mask;
+}
+
+static inline bool dev_user_ring_has_replies(struct scst_user_ring *ring)
+{
+	return READ_ONCE(ring->reply_hdr->tail) != ring->reply_head;
+}
+
+static inline bool dev_user_ring_mmget(struct mm_struct *mm)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	return mmget_not_zero(mm);
+#else
+	return atomic_inc_not_zero(&mm->mm_users);
+#endif
+}
+
+static inline void dev_user_ring_use_mm(struct mm_struct *mm)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	kthread_use_mm(mm);
+#else
+	use_mm(mm);
+#endif
+}
+
+static inline void dev_user_ring_unuse_mm(struct mm_struct *mm)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	kthread_unuse_mm(mm);
+#else
+	unuse_mm(mm);
+#endif
+}
+
+static void dev_user_ring_notify(struct scst_user_ring *ring)
+{
+	/* Pairs with the user space setting NEED_WAKEUP and rechecking tail */
+	smp_mb();
+	if (!(READ_ONCE(ring->cmd_hdr->flags) & SCST_USER_RING_NEED_WAKEUP))
+		return;
+
+	if (ring->eventfd != NULL)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(ring->eventfd);
+#else
+		eventfd_signal(ring->eventfd, 1);
+#endif
+	wake_up_all(&ring->user_waitQ);
+	return;
+}
+
+/*
+ * Processes the replies from the replies ring and the active SCST commands,
+ * then moves the ready commands to the commands ring. Since replies and
+ * commands refer to the user space buffers, the user space process mm is
+ * used for the time of processing.
+ *
+ * Returns number of processed entries, or negative error code, if the rings
+ * can't be served anymore.
+ */
+static int dev_user_ring_process(struct scst_user_dev *dev,
+	struct scst_user_ring *ring)
+{
+	int res = 0, rc, cmds = 0;
+	uint32_t tail;
+	struct scst_user_cmd *ucmd;
+
+	TRACE_ENTRY();
+
+	if (unlikely(!dev_user_ring_mmget(ring->mm))) {
+		TRACE_MGMT_DBG("User space process of dev %s has gone",
+			dev->name);
+		res = -ESRCH;
+		goto out;
+	}
+
+	dev_user_ring_use_mm(ring->mm);
+
+	tail = smp_load_acquire(&ring->reply_hdr->tail);
+	if (unlikely(tail - ring->reply_head > ring->reply_mask + 1)) {
+		PRINT_ERROR("Invalid replies ring tail %u (head %u, dev %s), "
+			"stopping the rings", tail, ring->reply_head, dev->name);
+		res = -EINVAL;
+		goto out_unuse;
+	}
+
+	while (ring->reply_head != tail) {
+		struct scst_user_reply_cmd reply;
+
+		/* Copy it, because the user space can change it any time */
+		memcpy(&reply, &ring->replies[ring->reply_head & ring->reply_mask],
+			sizeof(reply));
+		ring->reply_head++;
+		res++;
+
+		TRACE_BUFFER("Reply", &reply, sizeof(reply));
+
+		rc = dev_user_process_reply(dev, &reply);
+		if (unlikely(rc < 0))
+			TRACE_MGMT_DBG("Reply for cmd_h %d failed: %d",
+				reply.cmd_h, rc);
+	}
+	smp_store_release(&ring->reply_hdr->head, ring->reply_head);
+
+	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+	res += dev_user_process_scst_commands(dev);
+
+	while (dev_user_ring_cmd_space(ring)) {
+		ucmd = dev_user_get_next_queued(dev, -1);
+		if (ucmd == NULL)
+			break;
+		/* See comment in dev_user_get_cmd_to_user() */
+		if (unlikely(ucmd_get_check(ucmd)))
+			continue;
+		spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+		EXTRACHECKS_BUG_ON(ucmd->user_cmd_payload_len == 0);
+
+		TRACE_BUFFER("UCMD", &ucmd->user_cmd,
+			ucmd->user_cmd_payload_len);
+		memcpy(&ring->cmds[ring->cmd_tail & ring->cmd_mask],
+			&ucmd->user_cmd, ucmd->user_cmd_payload_len);
+		ring->cmd_tail++;
+		cmds++;
+#ifdef CONFIG_SCST_EXTRACHECKS
+		ucmd->user_cmd_payload_len = 0;
+#endif
+		ucmd_put(ucmd);
+
+		spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+	}
+
+	spin_unlock_irq(&dev->udev_cmd_threads.cmd_list_lock);
+
+	if (cmds > 0) {
+		smp_store_release(&ring->cmd_hdr->tail, ring->cmd_tail);
+		dev_user_ring_notify(ring);
+		res += cmds;
+	}
+
+out_unuse:
+	dev_user_ring_unuse_mm(ring->mm);
+	mmput(ring->mm);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static inline bool dev_user_ring_test(struct scst_user_dev *dev,
+	struct scst_user_ring *ring)
+{
+	return kthread_should_stop() || dev_user_ring_has_replies(ring) ||
+	       !list_empty(&dev->udev_cmd_threads.active_cmd_list) ||
+	       (dev_user_has_ready(dev, -1) && dev_user_ring_cmd_space(ring));
+}
+
+static int dev_user_ring_thread(void *arg)
+{
+	struct scst_user_dev *dev = arg;
+	struct scst_user_ring *ring = dev->ring;
+	ktime_t idle_start = ktime_get();
+	int rc;
+
+	TRACE_ENTRY();
+
+	PRINT_INFO("Rings thread for dev %s started", dev->name);
+
+	while (!kthread_should_stop()) {
+		rc = dev_user_ring_process(dev, ring);
+		if (unlikely(rc < 0)) {
+			/* Wait for the device release */
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (!kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+
+		if (rc > 0) {
+			idle_start = ktime_get();
+			cond_resched();
+			continue;
+		}
+
+		if (ktime_us_delta(ktime_get(), idle_start) < ring->poll_usecs) {
+			cpu_relax();
+			cond_resched();
+			continue;
+		}
+
+		/*
+		 * Ask the user space to wake us up after it posts replies or
+		 * consumes commands. The barrier pairs with the user space
+		 * posting them and then checking the flag.
+		 */
+		WRITE_ONCE(ring->reply_hdr->flags, SCST_USER_RING_NEED_WAKEUP);
+		smp_mb();
+		wait_event_interruptible(dev->udev_cmd_threads.cmd_list_waitQ,
+			dev_user_ring_test(dev, ring));
+		WRITE_ONCE(ring->reply_hdr->flags, 0);
+
+		idle_start = ktime_get();
+	}
+
+	PRINT_INFO("Rings thread for dev %s finished", dev->name);
+
+	TRACE_EXIT();
+	return 0;
+}
+
+static int dev_user_ring_setup(struct file *file, void __user *arg)
+{
+	int res, rc;
+	struct scst_user_dev *dev;
+	struct scst_user_ring_setup setup;
+	struct scst_user_ring *ring;
+
+	TRACE_ENTRY();
+
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0))
+		goto out;
+
+	rc = copy_from_user(&setup, arg, sizeof(setup));
+	if (unlikely(rc != 0)) {
+		PRINT_ERROR("Failed to copy %d user's bytes", rc);
+		res = -EFAULT;
+		goto out;
+	}
+
+	if (setup.cmd_entries == 0)
+		setup.cmd_entries = DEV_USER_RING_DEF_ENTRIES;
+	if (setup.reply_entries == 0)
+		setup.reply_entries = DEV_USER_RING_DEF_ENTRIES;
+
+	if (!is_power_of_2(setup.cmd_entries) ||
+	    (setup.cmd_entries > DEV_USER_RING_MAX_ENTRIES) ||
+	    !is_power_of_2(setup.reply_entries) ||
+	    (setup.reply_entries > DEV_USER_RING_MAX_ENTRIES)) {
+		PRINT_ERROR("Invalid rings entries %u/%u (dev %s), must be "
+			"power of 2 up to %d", setup.cmd_entries,
+			setup.reply_entries, dev->name,
+			DEV_USER_RING_MAX_ENTRIES);
+		res = -EINVAL;
+		goto out;
+	}
+
+	if (setup.poll_usecs > DEV_USER_RING_MAX_POLL_USECS) {
+		PRINT_ERROR("Invalid rings poll_usecs %u (dev %s), max %d",
+			setup.poll_usecs, dev->name,
+			DEV_USER_RING_MAX_POLL_USECS);
+		res = -EINVAL;
+		goto out;
+	}
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (ring == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	/* Headers in own cache lines, since written by different sides */
+	setup.cmd_hdr_offs = 0;
+	setup.reply_hdr_offs = L1_CACHE_ALIGN(sizeof(*ring->cmd_hdr));
+	setup.cmds_offs = L1_CACHE_ALIGN(setup.reply_hdr_offs +
+		sizeof(*ring->reply_hdr));
+	setup.replies_offs = L1_CACHE_ALIGN(setup.cmds_offs +
+		setup.cmd_entries * sizeof(*ring->cmds));
+	setup.mmap_size = PAGE_ALIGN(setup.replies_offs +
+		setup.reply_entries * sizeof(*ring->replies));
+
+	ring->size = setup.mmap_size;
+	ring->mem = vmalloc_user(ring->size);
+	if (ring->mem == NULL) {
+		PRINT_ERROR("Unable to allocate %zu bytes of rings (dev %s)",
+			ring->size, dev->name);
+		res = -ENOMEM;
+		goto out_free;
+	}
+
+	ring->cmd_hdr = ring->mem + setup.cmd_hdr_offs;
+	ring->cmds = ring->mem + setup.cmds_offs;
+	ring->reply_hdr = ring->mem + setup.reply_hdr_offs;
+	ring->replies = ring->mem + setup.replies_offs;
+	ring->cmd_hdr->entries = setup.cmd_entries;
+	ring->reply_hdr->entries = setup.reply_entries;
+	ring->cmd_mask = setup.cmd_entries - 1;
+	ring->reply_mask = setup.reply_entries - 1;
+	ring->poll_usecs = setup.poll_usecs;
+	init_waitqueue_head(&ring->user_waitQ);
+
+	if (setup.eventfd >= 0) {
+		ring->eventfd = eventfd_ctx_fdget(setup.eventfd);
+		if (IS_ERR(ring->eventfd)) {
+			res = PTR_ERR(ring->eventfd);
+			PRINT_ERROR("Invalid eventfd %d (dev %s): %d",
+				setup.eventfd, dev->name, res);
+			ring->eventfd = NULL;
+			goto out_vfree;
+		}
+	}
+
+	/*
+	 * Only mm_count reference, because the rings mapping holds the file,
+	 * so mm_users reference would never let the process mm go.
+	 */
+	ring->mm = current->mm;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	mmgrab(ring->mm);
+#else
+	atomic_inc(&ring->mm->mm_count);
+#endif
+
+	ring->thread = kthread_create(dev_user_ring_thread, dev,
+		"scst_usr_ring%d", dev->virt_id);
+	if (IS_ERR(ring->thread)) {
+		res = PTR_ERR(ring->thread);
+		PRINT_ERROR("kthread_create() for dev %s failed: %d",
+			dev->name, res);
+		goto out_mmdrop;
+	}
+
+	rc = copy_to_user(arg, &setup, sizeof(setup));
+	if (unlikely(rc != 0)) {
+		PRINT_ERROR("Failed to copy to user %d bytes", rc);
+		res = -EFAULT;
+		goto out_stop;
+	}
+
+	spin_lock(&dev_list_lock);
+	if (dev->ring != NULL) {
+		spin_unlock(&dev_list_lock);
+		PRINT_ERROR("Rings for dev %s already set up", dev->name);
+		res = -EBUSY;
+		goto out_stop;
+	}
+	dev->ring = ring;
+	spin_unlock(&dev_list_lock);
+
+	wake_up_process(ring->thread);
+
+	PRINT_INFO("Set up rings for dev %s: %u commands, %u replies, "
+		"poll %u us", dev->name, setup.cmd_entries,
+		setup.reply_entries, setup.poll_usecs);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_stop:
+	kthread_stop(ring->thread);
+
+out_mmdrop:
+	mmdrop(ring->mm);
+	if (ring->eventfd != NULL)
+		eventfd_ctx_put(ring->eventfd);
+
+out_vfree:
+	vfree(ring->mem);
+
+out_free:
+	kfree(ring);
+	goto out;
+}
+
+static int dev_user_ring_wakeup(struct file *file)
+{
+	int res;
+	struct scst_user_dev *dev;
+
+	TRACE_ENTRY();
+
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0))
+		goto out;
+
+	if (unlikely(dev->ring == NULL)) {
+		res = -EINVAL;
+		goto out;
+	}
+
+	wake_up_process(dev->ring->thread);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Called on the device release, hence the rings aren't mapped anymore */
+static void dev_user_ring_free(struct scst_user_dev *dev)
+{
+	struct scst_user_ring *ring = dev->ring;
+
+	TRACE_ENTRY();
+
+	if (ring == NULL)
+		goto out;
+
+	kthread_stop(ring->thread);
+
+	if (ring->eventfd != NULL)
+		eventfd_ctx_put(ring->eventfd);
+	mmdrop(ring->mm);
+	vfree(ring->mem);
+	kfree(ring);
+	dev->ring = NULL;
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+static int dev_user_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int res;
+	struct scst_user_dev *dev;
+	struct scst_user_ring *ring;
+
+	TRACE_ENTRY();
+
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0))
+		goto out;
+
+	ring = dev->ring;
+	if ((ring == NULL) || (vma->vm_pgoff != 0) ||
+	    (vma->vm_end - vma->vm_start > ring->size)) {
+		res = -EINVAL;
+		goto out;
+	}
+
+	res = remap_vmalloc_range(vma, ring->mem, 0);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static long dev_user_ioctl(struct file *file, unsigned int cmd,
 	unsigned long arg)
 {
@@ -2577,6 +3481,21 @@ static long dev_user_ioctl(struct file *file, unsigned int cmd,
 		res = dev_user_prealloc_buffer(file, (void __user *)arg);
 		break;
 
+	case SCST_USER_REGISTER_ARENA:
+		TRACE_DBG("%s", "REGISTER_ARENA");
+		res = dev_user_register_arena(file, (void __user *)arg);
+		break;
+
+	case SCST_USER_RING_SETUP:
+		TRACE_DBG("%s", "RING_SETUP");
+		res = dev_user_ring_setup(file, (void __user *)arg);
+		break;
+
+	case SCST_USER_RING_WAKEUP:
+		TRACE_DBG("%s", "RING_WAKEUP");
+		res = dev_user_ring_wakeup(file);
+		break;
+
 	default:
 		PRINT_ERROR("Invalid ioctl cmd %x", cmd);
 		res = -EINVAL;
@@ -2600,9 +3519,14 @@ static unsigned int dev_user_poll(struct file *file, poll_table *wait)
 	if (unlikely(res != 0))
 		goto out;
 
+	if ((dev->ring != NULL) && dev_user_ring_has_cmds(dev->ring)) {
+		res |= POLLIN | POLLRDNORM;
+		goto out;
+	}
+
 	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 
-	if (!list_empty(&dev->ready_cmd_list) ||
+	if (dev_user_has_ready(dev, -1) ||
 	    !list_empty(&dev->udev_cmd_threads.active_cmd_list)) {
 		res |= POLLIN | POLLRDNORM;
 		goto out_unlock;
@@ -2612,11 +3536,18 @@ static unsigned int dev_user_poll(struct file *file, poll_table *wait)
 
 	TRACE_DBG("Before poll_wait() (dev %s)", dev->name);
 	poll_wait(file, &dev->udev_cmd_threads.cmd_list_waitQ, wait);
+	if (dev->ring != NULL) {
+		poll_wait(file, &dev->ring->user_waitQ, wait);
+		if (dev_user_ring_has_cmds(dev->ring)) {
+			res |= POLLIN | POLLRDNORM;
+			goto out;
+		}
+	}
 	TRACE_DBG("After poll_wait() (dev %s)", dev->name);
 
 	spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 
-	if (!list_empty(&dev->ready_cmd_list) ||
+	if (dev_user_has_ready(dev, -1) ||
 	    !list_empty(&dev->udev_cmd_threads.active_cmd_list)) {
 		res |= POLLIN | POLLRDNORM;
 		goto out_unlock;
@@ -2856,20 +3787,24 @@ static void dev_user_abort_ready_commands(struct scst_user_dev *dev)
 {
 	struct scst_user_cmd *ucmd;
 	unsigned long flags;
+	int i;
 
 	TRACE_ENTRY();
 
 	spin_lock_irqsave(&dev->udev_cmd_threads.cmd_list_lock, flags);
 again:
-	list_for_each_entry(ucmd, &dev->ready_cmd_list, ready_cmd_list_entry) {
-		if ((ucmd->cmd != NULL) && !ucmd->seen_by_user &&
-		    test_bit(SCST_CMD_ABORTED, &ucmd->cmd->cmd_flags)) {
+	for (i = 0; i < dev->queues_num; i++) {
+		list_for_each_entry(ucmd, &dev->queues[i].ready_cmd_list,
+				    ready_cmd_list_entry) {
+			if ((ucmd->cmd == NULL) || ucmd->seen_by_user ||
+			    !test_bit(SCST_CMD_ABORTED, &ucmd->cmd->cmd_flags))
+				continue;
 			switch (ucmd->state) {
 			case UCMD_STATE_PARSING:
 			case UCMD_STATE_BUF_ALLOCING:
 			case UCMD_STATE_EXECING:
 				TRACE_MGMT_DBG("Aborting ready ucmd %p", ucmd);
-				list_del(&ucmd->ready_cmd_list_entry);
+				dev_user_del_from_ready(ucmd);
 				dev_user_unjam_cmd(ucmd, 0, &flags);
 				goto again;
 			}
@@ -3387,6 +4322,15 @@ static int dev_user_register_dev(struct file *file,
 		break;
 	}
 
+	if ((dev_desc->queues_num > DEV_USER_MAX_QUEUES) ||
+	    (dev_desc->queue_steering > SCST_USER_MAX_QUEUE_STEER_OPT)) {
+		PRINT_ERROR("Wrong queues_num %d or queue_steering %d (max "
+			"queues %d)", dev_desc->queues_num,
+			dev_desc->queue_steering, DEV_USER_MAX_QUEUES);
+		res = -EINVAL;
+		goto out;
+	}
+
 	if (!try_module_get(THIS_MODULE)) {
 		PRINT_ERROR("%s", "Fail to get module");
 		res = -ETXTBSY;
@@ -3399,7 +4343,12 @@ static int dev_user_register_dev(struct file *file,
 		goto out_put;
 	}
 
-	INIT_LIST_HEAD(&dev->ready_cmd_list);
+	dev->queues_num = max_t(int, dev_desc->queues_num, 1);
+	dev->queue_steering = dev_desc->queue_steering;
+	for (i = 0; i < dev->queues_num; i++) {
+		INIT_LIST_HEAD(&dev->queues[i].ready_cmd_list);
+		init_waitqueue_head(&dev->queues[i].waitQ);
+	}
 	if (file->f_flags & O_NONBLOCK) {
 		TRACE_DBG("%s", "Non-blocking operations");
 		dev->blocking = 0;
@@ -3473,6 +4422,7 @@ static int dev_user_register_dev(struct file *file,
 		dev->devtype.pr_cmds_notifications = 1;
 
 	init_completion(&dev->cleanup_cmpl);
+	spin_lock_init(&dev->arena_lock);
 	dev->def_block_size = block_size;
 
 	res = __dev_user_set_opt(dev, &dev_desc->opt);
@@ -3668,7 +4618,7 @@ static int dev_user_prealloc_buffer(struct file *file, void __user *arg)
 	}
 
 	pages = calc_num_pg(pbuf, bufflen);
-	res = dev_user_map_buf(ucmd, pbuf, pages);
+	res = dev_user_map_buf(ucmd, pbuf, pages, true);
 	if (res != 0)
 		goto out_put;
 
@@ -3712,6 +4662,133 @@ out:
 	return res;
 }
 
+static int dev_user_register_arena(struct file *file, void __user *arg)
+{
+	int res = 0, rc, i, num_pg, done = 0;
+	struct scst_user_dev *dev;
+	struct scst_user_arena_desc desc;
+	struct scst_user_arena *arena;
+	struct page **pages;
+	unsigned long *bitmap, ubuff;
+	struct task_struct *tsk = current;
+
+	TRACE_ENTRY();
+
+	dev = file->private_data;
+	res = dev_user_check_reg(dev);
+	if (unlikely(res != 0))
+		goto out;
+
+	rc = copy_from_user(&desc, arg, sizeof(desc));
+	if (unlikely(rc != 0)) {
+		PRINT_ERROR("Failed to copy %d user's bytes", rc);
+		res = -EFAULT;
+		goto out;
+	}
+
+	if (((desc.pbuf & ~PAGE_MASK) != 0) || (desc.len == 0) ||
+	    ((desc.len & ~PAGE_MASK) != 0) ||
+	    ((desc.len >> PAGE_SHIFT) > INT_MAX)) {
+		PRINT_ERROR("Arena %llx with size %lld isn't page aligned "
+			"(dev %s)", (unsigned long long)desc.pbuf,
+			(unsigned long long)desc.len, dev->name);
+		res = -EINVAL;
+		goto out;
+	}
+
+	ubuff = desc.pbuf;
+	num_pg = desc.len >> PAGE_SHIFT;
+
+	pages = vzalloc(num_pg * sizeof(*pages));
+	bitmap = vzalloc(BITS_TO_LONGS(num_pg) * sizeof(*bitmap));
+	if ((pages == NULL) || (bitmap == NULL)) {
+		res = -ENOMEM;
+		goto out_free;
+	}
+
+	while (done < num_pg) {
+		down_read(&tsk->mm->mmap_sem);
+#if (!defined(CONFIG_SUSE_KERNEL) &&			 \
+	LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)) || \
+	LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+		rc = get_user_pages(ubuff + ((unsigned long)done << PAGE_SHIFT),
+				    num_pg - done, 1/*writable*/,
+				    0/*don't force*/, pages + done, NULL);
+#else
+		rc = get_user_pages(ubuff + ((unsigned long)done << PAGE_SHIFT),
+				    num_pg - done, FOLL_WRITE, pages + done,
+				    NULL);
+#endif
+		up_read(&tsk->mm->mmap_sem);
+		if (rc <= 0) {
+			PRINT_ERROR("Failed to pin arena %lx pages (dev %s, "
+				"pinned %d from %d): %d", ubuff, dev->name,
+				done, num_pg, rc);
+			res = (rc < 0) ? rc : -EFAULT;
+			goto out_put;
+		}
+		done += rc;
+	}
+
+	spin_lock_irq(&dev->arena_lock);
+	if (dev->arenas_num == DEV_USER_MAX_ARENAS) {
+		spin_unlock_irq(&dev->arena_lock);
+		PRINT_ERROR("Too many arenas for dev %s (max %d)", dev->name,
+			DEV_USER_MAX_ARENAS);
+		res = -ENOSPC;
+		goto out_put;
+	}
+	arena = &dev->arenas[dev->arenas_num];
+	arena->ubuff = ubuff;
+	arena->num_pages = num_pg;
+	arena->pages = pages;
+	arena->bitmap = bitmap;
+	/* Pairs with smp_load_acquire() in the arenas users */
+	smp_store_release(&dev->arenas_num, dev->arenas_num + 1);
+	spin_unlock_irq(&dev->arena_lock);
+
+	PRINT_INFO("Registered arena %lx with size %lldKB for dev %s", ubuff,
+		(unsigned long long)desc.len >> 10, dev->name);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_put:
+	for (i = 0; i < done; i++)
+		put_page(pages[i]);
+
+out_free:
+	vfree(bitmap);
+	vfree(pages);
+	goto out;
+}
+
+/* Called on the device release, when no commands use the arenas anymore */
+static void dev_user_free_arenas(struct scst_user_dev *dev)
+{
+	struct scst_user_arena *arena;
+	int i, j;
+
+	TRACE_ENTRY();
+
+	for (i = 0; i < dev->arenas_num; i++) {
+		arena = &dev->arenas[i];
+		TRACE_MEM("Releasing arena %lx (dev %s)", arena->ubuff,
+			dev->name);
+		for (j = 0; j < arena->num_pages; j++) {
+			SetPageDirty(arena->pages[j]);
+			put_page(arena->pages[j]);
+		}
+		vfree(arena->bitmap);
+		vfree(arena->pages);
+	}
+	dev->arenas_num = 0;
+
+	TRACE_EXIT();
+	return;
+}
+
 static int __dev_user_set_opt(struct scst_user_dev *dev,
 	const struct scst_user_opt *opt)
 {
@@ -3886,6 +4963,8 @@ static int dev_user_exit_dev(struct scst_user_dev *dev)
 	list_del(&dev->dev_list_entry);
 	spin_unlock(&dev_list_lock);
 
+	dev_user_ring_free(dev);
+
 	dev->blocking = 0;
 	wake_up_all(&dev->udev_cmd_threads.cmd_list_waitQ);
 
@@ -3913,6 +4992,9 @@ static int dev_user_exit_dev(struct scst_user_dev *dev)
 	sgv_pool_del(dev->pool_clust);
 	sgv_pool_del(dev->pool);
 
+	/* After the pools, because their cached buffers can be in arenas */
+	dev_user_free_arenas(dev);
+
 	scst_deinit_threads(&dev->udev_cmd_threads);
 
 	TRACE_MGMT_DBG("Releasing completed (dev %p)", dev);
@@ -3980,7 +5062,7 @@ static int dev_user_process_cleanup(struct scst_user_dev *dev)
 
 		spin_lock_irq(&dev->udev_cmd_threads.cmd_list_lock);
 
-		rc = dev_user_get_next_cmd(dev, &ucmd, false);
+		rc = dev_user_get_next_cmd(dev, &ucmd, false, -1);
 		if (rc == 0)
 			dev_user_unjam_cmd(ucmd, 1, NULL);
 
@@ -4036,6 +5118,15 @@ static ssize_t dev_user_sysfs_commands_show(struct kobject *kobj,
 	udev = dev->dh_priv;
 
 	spin_lock_irqsave(&udev->udev_cmd_threads.cmd_list_lock, flags);
+	for (i = 0; i < udev->queues_num; i++) {
+		struct scst_user_queue *q = &udev->queues[i];
+
+		pos += scnprintf(&buf[pos], SCST_SYSFS_BLOCK_SIZE - pos,
+			"queue %d: depth %u, max_depth %u, cmds %lu, "
+			"avg_wait_us %llu\n", i, q->depth, q->max_depth,
+			q->cmds, q->cmds ? (unsigned long long)
+				div64_u64(q->wait_ns, q->cmds * 1000) : 0ULL);
+	}
 	for (i = 0; i < (int)ARRAY_SIZE(udev->ucmd_hash); i++) {
 		struct list_head *head = &udev->ucmd_hash[i];
 		struct scst_user_cmd *ucmd;
@@ -54,6 +54,7 @@
 #include <linux/swap.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 38)
 #include <linux/falloc.h>
+#include <linux/fadvise.h>
 #endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/sched/signal.h>
@@ -148,6 +149,17 @@ static struct scst_trace_log vdisk_local_trace_tbl[] = {
 #define VDISK_PROC_HELP		"help"
 #endif
 
+/* GET LBA STATUS provisioning extent */
+struct vdisk_lba_extent {
+	uint64_t lba;
+	uint32_t blocks;
+#define VDISK_LBA_MAPPED	0
+#define VDISK_LBA_DEALLOCATED	1
+	uint8_t status;
+};
+
+#define VDISK_LBA_STATUS_CACHE_SIZE	64
+
 struct scst_vdisk_dev {
 	uint64_t nblocks;
 
@@ -197,10 +209,13 @@ struct scst_vdisk_dev {
 	unsigned int expl_alua:1;
 	unsigned int reexam_pending:1;
 	unsigned int size_key:1;
+	unsigned int io_poll:1;
 
 	struct file *fd;
 	struct file *dif_fd;
 	struct block_device *bdev;
+	/* Set when bdev is open and has poll queues, io_poll needs it */
+	bool bdev_can_poll;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
 	struct bio_set *vdisk_bioset;
 #endif
@@ -242,6 +257,48 @@ struct scst_vdisk_dev {
 	/* Unmap INQUIRY parameters */
 	uint32_t unmap_opt_gran, unmap_align, unmap_max_lba_cnt;
 
+	/*
+	 * GET LBA STATUS extents cache. lba_status_gen is incremented after
+	 * each command, which can change provisioning of any block, so the
+	 * cache is valid only while lba_status_cache_gen matches it. The
+	 * cache is protected by lba_status_lock.
+	 */
+	atomic_t lba_status_gen;
+	spinlock_t lba_status_lock;
+	int lba_status_cache_gen;
+	int lba_status_cache_cnt;
+	struct vdisk_lba_extent lba_status_cache[VDISK_LBA_STATUS_CACHE_SIZE];
+
+	/*
+	 * EXTENDED COPY statistics: bytes copied by the filesystem (reflink
+	 * or copy_file_range()) and bytes left to the copy manager.
+	 */
+	atomic64_t ext_copy_offloaded_bytes;
+	atomic64_t ext_copy_copied_bytes;
+
+	/*
+	 * BLOCKIO commands completed by interrupt and by polling and their
+	 * total latency from the bios submission.
+	 */
+	atomic64_t io_irq_cmds;
+	atomic64_t io_irq_ns;
+	atomic64_t io_poll_cmds;
+	atomic64_t io_poll_ns;
+
+	/*
+	 * FILEIO whole device flushes coalescing. flush_started is the number
+	 * of the last started flush, flush_done and flush_res are the number
+	 * and the result of the last completed one. Flushes are serialized
+	 * by flush_mutex, which also protects flush_done and flush_res.
+	 */
+	struct mutex flush_mutex;
+	atomic64_t flush_started;
+	u64 flush_done;
+	int flush_res;
+	/* Flushes requested by commands and actually issued */
+	atomic64_t flush_requested;
+	atomic64_t flush_issued;
+
 	struct scst_device *dev;
 	struct list_head vdev_list_entry;
 
@@ -259,6 +316,16 @@ struct scst_vdisk_dev {
 	enum scst_dif_mode dif_mode;
 	int dif_type;
 	__be64 dif_static_app_tag_combined;
+
+	/*
+	 * Results of vdisk_probe() to pass them to attach() callback. Valid
+	 * only until vdisk_unprobe().
+	 */
+	struct file *probe_fd;
+	uint8_t *probed_mode_pages;
+	int probed_mode_pages_size;
+	unsigned int file_size_probed:1;
+	unsigned int mode_pages_probed:1;
 };
 
 struct vdisk_cmd_params {
@@ -325,6 +392,7 @@ static void blockio_on_alua_state_change_start(struct scst_device *dev,
 	enum scst_tg_state old_state, enum scst_tg_state new_state);
 static void blockio_on_alua_state_change_finish(struct scst_device *dev,
 	enum scst_tg_state old_state, enum scst_tg_state new_state);
+static int fileio_dev_done(struct scst_cmd *cmd);
 static void fileio_on_free_cmd(struct scst_cmd *cmd);
 static enum compl_status_e nullio_exec_read(struct vdisk_cmd_params *p);
 static enum compl_status_e blockio_exec_read(struct vdisk_cmd_params *p);
@@ -374,6 +442,12 @@ static int vcdrom_write_proc(char *buffer, char **start, off_t offset,
 static ssize_t vdisk_add_fileio_device(const char *device_name, char *params);
 static ssize_t vdisk_add_blockio_device(const char *device_name, char *params);
 static ssize_t vdisk_add_nullio_device(const char *device_name, char *params);
+static ssize_t vdisk_add_fileio_devices(int cnt, const char **device_names,
+	char **params);
+static ssize_t vdisk_add_blockio_devices(int cnt, const char **device_names,
+	char **params);
+static ssize_t vdisk_add_nullio_devices(int cnt, const char **device_names,
+	char **params);
 static ssize_t vdisk_del_device(const char *device_name);
 static ssize_t vcdrom_add_device(const char *device_name, char *params);
 static ssize_t vcdrom_del_device(const char *device_name);
@@ -384,6 +458,9 @@ static uint64_t vdisk_gen_dev_id_num(const char *virt_dev_name);
 #ifdef CONFIG_DEBUG_EXT_COPY_REMAP
 static void vdev_ext_copy_remap(struct scst_cmd *cmd,
 	struct scst_ext_copy_seg_descr *descr);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+static void fileio_ext_copy_remap(struct scst_cmd *cmd,
+	struct scst_ext_copy_seg_descr *descr);
 #endif
 static int vdisk_unmap_range(struct scst_cmd *cmd,
 	struct scst_vdisk_dev *virt_dev, uint64_t start_lba, uint32_t blocks);
@@ -490,6 +567,16 @@ static ssize_t vdev_sysfs_inq_vend_specific_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf);
 static ssize_t vdev_zero_copy_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf);
+static ssize_t vdev_ext_copy_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_io_poll_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_sysfs_io_poll_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdisk_io_poll_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_flush_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
 static ssize_t vdev_dif_filename_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf);
 
@@ -584,6 +671,15 @@ static struct kobj_attribute vdev_inq_vend_specific_attr =
 	       vdev_sysfs_inq_vend_specific_store);
 static struct kobj_attribute vdev_zero_copy_attr =
 	__ATTR(zero_copy, S_IRUGO, vdev_zero_copy_show, NULL);
+static struct kobj_attribute vdev_ext_copy_stats_attr =
+	__ATTR(ext_copy_stats, S_IRUGO, vdev_ext_copy_stats_show, NULL);
+static struct kobj_attribute vdisk_io_poll_attr =
+	__ATTR(io_poll, S_IWUSR|S_IRUGO, vdisk_sysfs_io_poll_show,
+	       vdisk_sysfs_io_poll_store);
+static struct kobj_attribute vdisk_io_poll_stats_attr =
+	__ATTR(io_poll_stats, S_IRUGO, vdisk_io_poll_stats_show, NULL);
+static struct kobj_attribute vdisk_flush_stats_attr =
+	__ATTR(flush_stats, S_IRUGO, vdisk_flush_stats_show, NULL);
 static struct kobj_attribute vdev_dif_filename_attr =
 	__ATTR(dif_filename, S_IRUGO, vdev_dif_filename_show, NULL);
 
@@ -619,6 +715,8 @@ static const struct attribute *vdisk_fileio_attrs[] = {
 	&vdev_usn_attr.attr,
 	&vdev_inq_vend_specific_attr.attr,
 	&vdev_zero_copy_attr.attr,
+	&vdev_ext_copy_stats_attr.attr,
+	&vdisk_flush_stats_attr.attr,
 	NULL,
 };
 
@@ -650,6 +748,8 @@ static const struct attribute *vdisk_blockio_attrs[] = {
 	&vdev_usn_attr.attr,
 	&vdev_inq_vend_specific_attr.attr,
 	&vdisk_tp_attr.attr,
+	&vdisk_io_poll_attr.attr,
+	&vdisk_io_poll_stats_attr.attr,
 	NULL,
 };
 
@@ -739,10 +839,13 @@ static struct scst_dev_type vdisk_file_devtype = {
 	.parse =		vdisk_parse,
 	.dev_alloc_data_buf =	fileio_alloc_data_buf,
 	.exec =			fileio_exec,
+	.dev_done =		fileio_dev_done,
 	.on_free_cmd =		fileio_on_free_cmd,
 	.task_mgmt_fn_done =	vdisk_task_mgmt_fn_done,
 #ifdef CONFIG_DEBUG_EXT_COPY_REMAP
 	.ext_copy_remap =	vdev_ext_copy_remap,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	.ext_copy_remap =	fileio_ext_copy_remap,
 #endif
 	.get_supported_opcodes = vdisk_get_supported_opcodes,
 	.devt_priv =		(void *)fileio_ops,
@@ -751,6 +854,7 @@ static struct scst_dev_type vdisk_file_devtype = {
 	.write_proc =		vdisk_write_proc,
 #else
 	.add_device =		vdisk_add_fileio_device,
+	.add_devices =		vdisk_add_fileio_devices,
 	.del_device =		vdisk_del_device,
 	.dev_attrs =		vdisk_fileio_attrs,
 	.add_device_parameters =
@@ -807,6 +911,7 @@ static struct scst_dev_type vdisk_blk_devtype = {
 	.devt_priv =		(void *)blockio_ops,
 #ifndef CONFIG_SCST_PROC
 	.add_device =		vdisk_add_blockio_device,
+	.add_devices =		vdisk_add_blockio_devices,
 	.del_device =		vdisk_del_device,
 	.dev_attrs =		vdisk_blockio_attrs,
 	.add_device_parameters =
@@ -859,6 +964,7 @@ static struct scst_dev_type vdisk_null_devtype = {
 	.get_supported_opcodes = vdisk_get_supported_opcodes,
 #ifndef CONFIG_SCST_PROC
 	.add_device =		vdisk_add_nullio_device,
+	.add_devices =		vdisk_add_nullio_devices,
 	.del_device =		vdisk_del_device,
 	.dev_attrs =		vdisk_nullio_attrs,
 	.add_device_parameters =
@@ -951,9 +1057,17 @@ static const char *vdev_get_filename(const struct scst_vdisk_dev *virt_dev)
 		return "none";
 }
 
-/* Returns fd, use IS_ERR(fd) to get error status */
+/*
+ * Opens file name of virt_dev. The DIF tags file (tags set) is always opened
+ * without O_DIRECT and O_DSYNC, because the tags I/O is done in 8 byte per
+ * block granularity, so its page cache works as a write-back cache of tag
+ * pages shared by commands touching neighbouring blocks. Instead, tags of
+ * write-through devices are fdatasync'ed by vdev_sync_dif_tags().
+ *
+ * Returns fd, use IS_ERR(fd) to get error status.
+ */
 static struct file *vdev_open_fd(const struct scst_vdisk_dev *virt_dev,
-	const char *name, bool read_only)
+	const char *name, bool read_only, bool tags)
 {
 	int open_flags = 0;
 	struct file *fd;
@@ -973,9 +1087,9 @@ static struct file *vdev_open_fd(const struct scst_vdisk_dev *virt_dev,
 		open_flags |= O_RDONLY;
 	else
 		open_flags |= O_RDWR;
-	if (virt_dev->o_direct_flag)
+	if (virt_dev->o_direct_flag && !tags)
 		open_flags |= O_DIRECT;
-	if (virt_dev->wt_flag && !virt_dev->nv_cache)
+	if (virt_dev->wt_flag && !virt_dev->nv_cache && !tags)
 		open_flags |= O_DSYNC;
 
 	TRACE_DBG("Opening file %s, flags 0x%x", name, open_flags);
@@ -1036,6 +1150,59 @@ out:
 	return;
 }
 
+/*
+ * Lets the copy manager generate internal READs and WRITEs of the size the
+ * backing block device can take without splitting.
+ */
+static void vdisk_blockio_check_ext_copy_io_size(struct scst_vdisk_dev *virt_dev)
+{
+	struct scst_device *dev = virt_dev->dev;
+	struct inode *inode;
+	struct file *fd;
+	int io_size;
+
+	TRACE_ENTRY();
+
+	if (!virt_dev->blockio || !virt_dev->dev_active ||
+	    dev->ext_copy_max_io_size_set)
+		goto out;
+
+	fd = filp_open(virt_dev->filename, O_LARGEFILE, 0600);
+	if (IS_ERR(fd)) {
+		TRACE(TRACE_MINOR, "filp_open(%s) failed: %ld",
+			virt_dev->filename, PTR_ERR(fd));
+		goto out;
+	}
+
+	inode = file_inode(fd);
+	if (!S_ISBLK(inode->i_mode))
+		goto out_close;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 31)
+	io_size = min_t(long, (long)queue_max_hw_sectors(bdev_get_queue(inode->i_bdev)) << 9,
+			SCST_EXT_COPY_MAX_IO_SIZE);
+#else
+	io_size = min_t(long, (long)bdev_get_queue(inode->i_bdev)->max_hw_sectors << 9,
+			SCST_EXT_COPY_MAX_IO_SIZE);
+#endif
+	io_size &= PAGE_MASK;
+	if (io_size == 0)
+		goto out_close;
+
+	if (io_size != dev->ext_copy_max_io_size) {
+		TRACE(TRACE_MINOR, "Device %s: EXTENDED COPY I/O size %d",
+			virt_dev->name, io_size);
+		dev->ext_copy_max_io_size = io_size;
+	}
+
+out_close:
+	filp_close(fd, NULL);
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
 static void vdisk_check_tp_support(struct scst_vdisk_dev *virt_dev)
 {
 	struct file *fd = NULL;
@@ -1419,13 +1586,16 @@ out_too_many:
 	goto out;
 }
 
-static int vdev_load_mode_pages(struct scst_vdisk_dev *virt_dev)
+/*
+ * Reads the saved mode pages of virt_dev in a buffer, which then must be
+ * freed by vfree(). Returns the size of the data in *pbuf, or error code.
+ */
+static int vdev_read_mode_pages(struct scst_vdisk_dev *virt_dev, uint8_t **pbuf)
 {
 	int res;
-	struct scst_device *dev = virt_dev->dev;
 	uint8_t *buf;
 	int size;
-	char *name, *name1, *params;
+	char *name, *name1;
 
 	TRACE_ENTRY();
 
@@ -1454,21 +1624,15 @@ static int vdev_load_mode_pages(struct scst_vdisk_dev *virt_dev)
 		goto out_free_name;
 	}
 
-	size = scst_read_file_transactional(name, name1,
+	res = scst_read_file_transactional(name, name1,
 			virt_dev->name, strlen(virt_dev->name), buf, size-1);
-	if (size <= 0) {
-		res = size;
+	if (res <= 0)
 		goto out_free_name1;
-	}
-
-	buf[size-1] = '\0';
 
-	res = scst_restore_global_mode_pages(dev, &buf[strlen(virt_dev->name)+1],
-				&params);
-	if ((res != 0) || (params == NULL))
-		goto out_free_name1;
+	buf[res-1] = '\0';
 
-	res = __vdev_load_mode_pages(virt_dev, params);
+	*pbuf = buf;
+	buf = NULL;
 
 out_free_name1:
 	kfree(name1);
@@ -1484,6 +1648,41 @@ out:
 	return res;
 }
 
+static int vdev_load_mode_pages(struct scst_vdisk_dev *virt_dev)
+{
+	int res;
+	struct scst_device *dev = virt_dev->dev;
+	uint8_t *buf = NULL;
+	char *params;
+
+	TRACE_ENTRY();
+
+	if (virt_dev->mode_pages_probed) {
+		/* Read by vdisk_probe() */
+		res = virt_dev->probed_mode_pages_size;
+		buf = virt_dev->probed_mode_pages;
+		virt_dev->probed_mode_pages = NULL;
+		virt_dev->mode_pages_probed = 0;
+	} else
+		res = vdev_read_mode_pages(virt_dev, &buf);
+	if (res <= 0)
+		goto out;
+
+	res = scst_restore_global_mode_pages(dev, &buf[strlen(virt_dev->name)+1],
+				&params);
+	if ((res != 0) || (params == NULL))
+		goto out_vfree;
+
+	res = __vdev_load_mode_pages(virt_dev, params);
+
+out_vfree:
+	vfree(buf);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 #if defined(CONFIG_BLK_DEV_INTEGRITY)
 static int vdisk_init_block_integrity(struct scst_vdisk_dev *virt_dev)
 {
@@ -1496,7 +1695,8 @@ static int vdisk_init_block_integrity(struct scst_vdisk_dev *virt_dev)
 
 	TRACE_ENTRY();
 
-	fd = vdev_open_fd(virt_dev, virt_dev->filename, virt_dev->rd_only);
+	fd = vdev_open_fd(virt_dev, virt_dev->filename, virt_dev->rd_only,
+		false);
 	if (IS_ERR(fd)) {
 		res = -EINVAL;
 		goto out;
@@ -1608,17 +1808,25 @@ static int vdisk_reexamine(struct scst_vdisk_dev *virt_dev)
 	if (!virt_dev->nullio && !virt_dev->cdrom_empty) {
 		loff_t file_size;
 
-		res = vdisk_get_file_size(virt_dev, &file_size);
-		if (res < 0) {
-			if ((res == -EMEDIUMTYPE) && virt_dev->blockio) {
-				TRACE_DBG("Reexam pending (dev %s)", virt_dev->name);
-				virt_dev->reexam_pending = 1;
-				res = 0;
+		if (virt_dev->file_size_probed) {
+			/* Got by vdisk_probe() */
+			file_size = virt_dev->file_size;
+			virt_dev->file_size_probed = 0;
+		} else {
+			res = vdisk_get_file_size(virt_dev, &file_size);
+			if (res < 0) {
+				if ((res == -EMEDIUMTYPE) && virt_dev->blockio) {
+					TRACE_DBG("Reexam pending (dev %s)",
+						virt_dev->name);
+					virt_dev->reexam_pending = 1;
+					res = 0;
+				}
+				goto out;
 			}
-			goto out;
 		}
 		virt_dev->file_size = file_size;
 		vdisk_blockio_check_flush_support(virt_dev);
+		vdisk_blockio_check_ext_copy_io_size(virt_dev);
 		vdisk_check_tp_support(virt_dev);
 	} else if (virt_dev->cdrom_empty) {
 		virt_dev->file_size = 0;
@@ -1701,7 +1909,7 @@ next:
 	if (virt_dev->dif_filename != NULL) {
 		/* Check if it can be used */
 		struct file *dfd = vdev_open_fd(virt_dev, virt_dev->dif_filename,
-					virt_dev->rd_only);
+					virt_dev->rd_only, true);
 		if (IS_ERR(dfd)) {
 			res = PTR_ERR(dfd);
 			goto out;
@@ -1832,6 +2040,17 @@ static void vdisk_detach(struct scst_device *dev)
 	return;
 }
 
+static bool vdisk_bdev_can_poll(struct block_device *bdev)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+	return bdev_get_queue(bdev)->limits.features & BLK_FEAT_POLL;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	return test_bit(QUEUE_FLAG_POLL, &bdev_get_queue(bdev)->queue_flags);
+#else
+	return false;
+#endif
+}
+
 static int vdisk_open_fd(struct scst_vdisk_dev *virt_dev, bool read_only)
 {
 	int res;
@@ -1839,18 +2058,24 @@ static int vdisk_open_fd(struct scst_vdisk_dev *virt_dev, bool read_only)
 	sBUG_ON(!virt_dev->filename);
 	sBUG_ON(virt_dev->fd);
 
-	virt_dev->fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only);
+	virt_dev->fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only,
+				   false);
 	if (IS_ERR(virt_dev->fd)) {
 		res = PTR_ERR(virt_dev->fd);
 		virt_dev->fd = NULL;
 		goto out;
 	}
 	virt_dev->bdev = virt_dev->blockio ? file_inode(virt_dev->fd)->i_bdev : NULL;
+	virt_dev->bdev_can_poll = (virt_dev->bdev != NULL) &&
+				  vdisk_bdev_can_poll(virt_dev->bdev);
+	if (virt_dev->io_poll && !virt_dev->bdev_can_poll)
+		PRINT_WARNING("Device %s does not support polled I/O (no poll "
+			"queues?), io_poll ignored", virt_dev->name);
 	res = 0;
 
 	if (virt_dev->dif_filename != NULL) {
 		virt_dev->dif_fd = vdev_open_fd(virt_dev,
-			virt_dev->dif_filename, read_only);
+			virt_dev->dif_filename, read_only, true);
 		if (IS_ERR(virt_dev->dif_fd)) {
 			res = PTR_ERR(virt_dev->dif_fd);
 			virt_dev->dif_fd = NULL;
@@ -1879,6 +2104,7 @@ static void vdisk_close_fd(struct scst_vdisk_dev *virt_dev)
 		filp_close(virt_dev->fd, NULL);
 		virt_dev->fd = NULL;
 		virt_dev->bdev = NULL;
+		virt_dev->bdev_can_poll = false;
 	}
 	if (virt_dev->dif_fd) {
 		filp_close(virt_dev->dif_fd, NULL);
@@ -2372,7 +2598,6 @@ static const struct scst_opcode_descriptor scst_op_descr_format_unit = {
 	.od_cdb_usage_bits = { FORMAT_UNIT, 0xF0, 0, 0, 0, SCST_OD_DEFAULT_CONTROL_BYTE },
 };
 
-#if 0
 static const struct scst_opcode_descriptor scst_op_descr_get_lba_status = {
 	.od_opcode = SERVICE_ACTION_IN_16,
 	.od_serv_action = SAI_GET_LBA_STATUS,
@@ -2386,7 +2611,6 @@ static const struct scst_opcode_descriptor scst_op_descr_get_lba_status = {
 			       0xFF, 0xFF, 0xFF, 0xFF, 0,
 			       SCST_OD_DEFAULT_CONTROL_BYTE },
 };
-#endif
 
 static const struct scst_opcode_descriptor scst_op_descr_allow_medium_removal = {
 	.od_opcode = ALLOW_MEDIUM_REMOVAL,
@@ -2870,7 +3094,7 @@ static vdisk_op_fn nullio_ops[256] = {
 };
 
 #define VDISK_OPCODE_DESCRIPTORS					\
-	/* &scst_op_descr_get_lba_status, */				\
+	&scst_op_descr_get_lba_status,					\
 	&scst_op_descr_read_capacity16,					\
 	&scst_op_descr_write_same10,					\
 	&scst_op_descr_write_same16,					\
@@ -3610,18 +3834,34 @@ static void vdisk_on_free_cmd_params(const struct vdisk_cmd_params *p)
 		kfree(p->iv);
 }
 
+static inline void vdisk_lba_status_invalidate(struct scst_vdisk_dev *virt_dev)
+{
+	atomic_inc(&virt_dev->lba_status_gen);
+}
+
+static int fileio_dev_done(struct scst_cmd *cmd)
+{
+	/* Before the response, so the initiator can't see stale LBA status */
+	if (cmd->op_flags & SCST_WRITE_MEDIUM)
+		vdisk_lba_status_invalidate(cmd->dev->dh_priv);
+
+	return SCST_CMD_STATE_DEFAULT;
+}
+
 static void fileio_on_free_cmd(struct scst_cmd *cmd)
 {
 	struct vdisk_cmd_params *p = cmd->dh_priv;
-	struct scst_vdisk_dev *virt_dev;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
 
 	TRACE_ENTRY();
 
+	/* For commands, which didn't reach dev_done() */
+	if (cmd->op_flags & SCST_WRITE_MEDIUM)
+		vdisk_lba_status_invalidate(virt_dev);
+
 	if (!p)
 		goto out;
 
-	virt_dev = cmd->dev->dh_priv;
-
 	if (p->use_zero_copy) {
 		if ((cmd->data_direction & SCST_DATA_READ) &&
 		    virt_dev->zero_copy)
@@ -4009,6 +4249,163 @@ static void scst_copy_and_fill(char *dst, const char *src, int len)
 	scst_copy_and_fill_b(dst, src, len, ' ');
 }
 
+/* Returns true if the WRITE SAME data block consists only of zeros */
+static bool vdisk_ws_pattern_is_zero(struct scst_cmd *cmd)
+{
+	const uint8_t *buf;
+	bool res = true;
+	int i;
+
+	buf = kmap(sg_page(cmd->sg));
+	for (i = 0; i < cmd->bufflen; i++) {
+		if (buf[cmd->sg->offset + i] != 0) {
+			res = false;
+			break;
+		}
+	}
+	kunmap(sg_page(cmd->sg));
+
+	return res;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+/* Issues WRITE SAME bios with the command's data block as the pattern */
+static int blockio_write_same_pattern(struct scst_cmd *cmd,
+	struct block_device *bdev, sector_t sector, sector_t nr_sects)
+{
+	struct page *pg;
+	void *src, *dst;
+	int res;
+
+	pg = alloc_page(cmd->cmd_gfp_mask);
+	if (pg == NULL)
+		return -ENOMEM;
+
+	src = kmap(sg_page(cmd->sg));
+	dst = kmap(pg);
+	memcpy(dst, src + cmd->sg->offset, cmd->bufflen);
+	kunmap(pg);
+	kunmap(sg_page(cmd->sg));
+
+	res = blkdev_issue_write_same(bdev, sector, nr_sects,
+		cmd->cmd_gfp_mask, pg);
+
+	__free_page(pg);
+	return res;
+}
+#endif
+
+/*
+ * Tries to execute non-UNMAP WRITE SAME by the backend storage itself:
+ * zeroing via REQ_OP_WRITE_ZEROES (or WRITE SAME bio for other patterns)
+ * for BLOCKIO and via fallocate(FALLOC_FL_ZERO_RANGE) for FILEIO, so the
+ * data don't have to go through SCST memory block by block.
+ *
+ * Returns true, if the command was executed, including with an error
+ * status, or false, if it should be processed by scst_write_same().
+ */
+static bool vdisk_write_same_offload(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev = cmd->dev;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	uint8_t ctrl_offs = (cmd->cdb_len < 32) ? 1 : 10;
+	uint64_t blocks = cmd->data_len >> dev->block_shift;
+	bool res = false, zero;
+	int rc = -EOPNOTSUPP;
+
+	TRACE_ENTRY();
+
+	/* The same validation as scst_write_same() does */
+	if (unlikely((cmd->data_len <= 0) || (blocks == 0))) {
+		scst_set_invalid_field_in_cdb(cmd, cmd->len_off, 0);
+		res = true;
+		goto out;
+	}
+
+	/*
+	 * Requests with an invalid data-out buffer or CDB are not offloaded,
+	 * scst_write_same() fails them with the proper sense. The data-out
+	 * buffer must be exactly one block, otherwise a short or empty
+	 * buffer would be taken for a zero pattern.
+	 */
+	if ((cmd->sg_cnt != 1) || (cmd->bufflen != dev->block_size) ||
+	    ((cmd->cdb[ctrl_offs] & 0x6) != 0) ||
+	    ((uint64_t)cmd->data_len > dev->max_write_same_len) ||
+	    (cmd->lba > virt_dev->nblocks) ||
+	    ((cmd->lba + blocks) > virt_dev->nblocks))
+		goto out;
+
+	/* Protection information must be generated for each block */
+	if ((dev->dev_dif_mode != SCST_DIF_MODE_NONE) ||
+	    (virt_dev->dif_fd != NULL))
+		goto out;
+
+	if (virt_dev->nullio) {
+		res = true;
+		goto out;
+	}
+
+	zero = vdisk_ws_pattern_is_zero(cmd);
+
+	if (virt_dev->blockio) {
+		sector_t sector = cmd->lba << (dev->block_shift - 9);
+		sector_t nr_sects = blocks << (dev->block_shift - 9);
+
+		if (zero) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+			rc = blkdev_issue_zeroout(virt_dev->bdev, sector,
+				nr_sects, cmd->cmd_gfp_mask,
+				BLKDEV_ZERO_NOUNMAP);
+#endif
+		} else {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+			/* The block device repeats its logical block */
+			if (bdev_write_same(virt_dev->bdev) &&
+			    (bdev_logical_block_size(virt_dev->bdev) == dev->block_size))
+				rc = blockio_write_same_pattern(cmd,
+					virt_dev->bdev, sector, nr_sects);
+#endif
+		}
+		if ((rc == 0) && virt_dev->wt_flag && !virt_dev->nv_cache)
+			rc = vdisk_blockio_flush(virt_dev->bdev,
+				cmd->cmd_gfp_mask, false, NULL, false);
+	} else if (zero) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+		loff_t off = cmd->lba << dev->block_shift;
+		loff_t len = blocks << dev->block_shift;
+		struct file *fd = virt_dev->fd;
+
+		if (fd->f_op->fallocate != NULL)
+			rc = fd->f_op->fallocate(fd, FALLOC_FL_ZERO_RANGE |
+				FALLOC_FL_KEEP_SIZE, off, len);
+		if ((rc == 0) && virt_dev->wt_flag && !virt_dev->nv_cache)
+			rc = vfs_fsync_range(fd, off, off + len - 1, 1);
+#endif
+	}
+
+	TRACE_DBG("WRITE SAME offload (cmd %p, lba %lld, blocks %lld, zero %d): "
+		"%d", cmd, (long long)cmd->lba, (long long)blocks, zero, rc);
+
+	if (rc == 0) {
+		res = true;
+	} else if ((rc != -EOPNOTSUPP) && (rc != -EINVAL) &&
+		   (rc != -ENOMEM)) {
+		/* A real I/O error, emulation would fail the same way */
+		PRINT_ERROR("WRITE SAME offload for dev %s, lba %lld, blocks "
+			"%lld failed: %d", dev->virt_name, (long long)cmd->lba,
+			(long long)blocks, rc);
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_write_error));
+		res = true;
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p)
 {
 	struct scst_cmd *cmd = p->cmd;
@@ -4033,7 +4430,7 @@ static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p)
 
 	if (cmd->cdb[ctrl_offs] & 0x8)
 		vdisk_exec_write_same_unmap(p);
-	else {
+	else if (!vdisk_write_same_offload(p)) {
 		scst_write_same(cmd, NULL);
 		res = RUNNING_ASYNC;
 	}
@@ -4992,14 +5389,15 @@ static int vdisk_set_wt(struct scst_vdisk_dev *virt_dev, int wt, bool read_only)
 	 * to reopen fd.
 	 */
 
-	fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only);
+	fd = vdev_open_fd(virt_dev, virt_dev->filename, read_only, false);
 	if (IS_ERR(fd)) {
 		res = PTR_ERR(fd);
 		goto out_err;
 	}
 
 	if (virt_dev->dif_filename != NULL) {
-		dif_fd = vdev_open_fd(virt_dev, virt_dev->dif_filename, read_only);
+		dif_fd = vdev_open_fd(virt_dev, virt_dev->dif_filename, read_only,
+				      true);
 		if (IS_ERR(dif_fd)) {
 			res = PTR_ERR(dif_fd);
 			goto out_err_close_fd;
@@ -5497,56 +5895,251 @@ out:
 	return CMD_SUCCEEDED;
 }
 
-static enum compl_status_e vdisk_exec_get_lba_status(struct vdisk_cmd_params *p)
+/*
+ * Fills ext with up to max_cnt provisioning extents of the backing file
+ * starting from lba, as reported by SEEK_DATA and SEEK_HOLE. Filesystems
+ * without their support report the whole file as data. Returns number of
+ * filled extents or negative error code.
+ */
+static int fileio_get_lba_extents(struct scst_vdisk_dev *virt_dev,
+	uint64_t lba, struct vdisk_lba_extent *ext, int max_cnt)
 {
-	/* Changing it don't forget to add it to vdisk_opcode_descriptors! */
-	scst_set_invalid_field_in_cdb(p->cmd, 1,
-			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
-	return CMD_SUCCEEDED;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+	struct file *fd = virt_dev->fd;
+	int shift = virt_dev->dev->block_shift;
+	int cnt = 0;
+	loff_t pos;
+
+	while ((lba < virt_dev->nblocks) && (cnt < max_cnt)) {
+		loff_t off = lba << shift;
+		uint64_t end;
+		uint8_t status;
+
+		pos = vfs_llseek(fd, off, SEEK_DATA);
+		if (pos == -ENXIO) {
+			/* No data till the end of the file */
+			end = virt_dev->nblocks;
+			status = VDISK_LBA_DEALLOCATED;
+		} else if (pos < 0) {
+			goto out_err;
+		} else if ((pos >> shift) > lba) {
+			end = pos >> shift;
+			status = VDISK_LBA_DEALLOCATED;
+		} else {
+			/* Partially written blocks are mapped */
+			pos = vfs_llseek(fd, off, SEEK_HOLE);
+			if (pos < 0)
+				goto out_err;
+			end = max_t(uint64_t, (pos + (1 << shift) - 1) >> shift,
+				    lba + 1);
+			status = VDISK_LBA_MAPPED;
+		}
+
+		end = min_t(uint64_t, end, virt_dev->nblocks);
+		/* NUMBER OF LOGICAL BLOCKS field is 32-bit */
+		end = min_t(uint64_t, end, lba + 0xFFFFFFFFU);
+
+		ext[cnt].lba = lba;
+		ext[cnt].blocks = end - lba;
+		ext[cnt].status = status;
+		cnt++;
+
+		lba = end;
+	}
+
+	return cnt;
+
+out_err:
+	PRINT_ERROR("Device %s: llseek() for LBA %lld failed: %lld",
+		virt_dev->name, (long long)lba, (long long)pos);
+	return pos;
+#else
+	ext[0].lba = lba;
+	ext[0].blocks = min_t(uint64_t, virt_dev->nblocks - lba, 0xFFFFFFFFU);
+	ext[0].status = VDISK_LBA_MAPPED;
+	return 1;
+#endif
 }
 
-/* SPC-4 REPORT TARGET PORT GROUPS command */
-static enum compl_status_e vdisk_exec_report_tpgs(struct vdisk_cmd_params *p)
+/*
+ * Fills ext, which must have room for VDISK_LBA_STATUS_CACHE_SIZE entries,
+ * with provisioning extents starting from lba. Returns number of filled
+ * extents or negative error code.
+ */
+static int vdisk_get_lba_extents(struct scst_vdisk_dev *virt_dev,
+	uint64_t lba, struct vdisk_lba_extent *ext)
 {
-	struct scst_cmd *cmd = p->cmd;
-	struct scst_device *dev;
-	uint8_t *address;
-	void *buf;
-	int32_t buf_len;
-	uint32_t data_length, length;
-	uint8_t data_format;
-	int res;
+	int res, gen, i;
 
 	TRACE_ENTRY();
 
-	buf_len = scst_get_buf_full_sense(cmd, &address);
-	if (buf_len <= 0)
+	if (!virt_dev->thin_provisioned || virt_dev->blockio ||
+	    virt_dev->nullio || (virt_dev->fd == NULL)) {
+		/*
+		 * There's no generic way to get provisioning of a block
+		 * device, so the whole device is reported as mapped.
+		 */
+		ext[0].lba = lba;
+		ext[0].blocks = min_t(uint64_t, virt_dev->nblocks - lba,
+				      0xFFFFFFFFU);
+		ext[0].status = VDISK_LBA_MAPPED;
+		res = 1;
 		goto out;
+	}
 
-	dev = cmd->dev;
-	data_format = cmd->cdb[1] >> 5;
+	spin_lock(&virt_dev->lba_status_lock);
+	if (virt_dev->lba_status_cache_gen == atomic_read(&virt_dev->lba_status_gen)) {
+		const struct vdisk_lba_extent *c = virt_dev->lba_status_cache;
 
-	res = scst_tg_get_group_info(&buf, &data_length, dev, data_format);
-	if (res == -ENOMEM) {
-		scst_set_busy(cmd);
-		goto out_put;
-	} else if (res < 0) {
-		scst_set_cmd_error(cmd,
-			SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
-		goto out_put;
+		for (i = 0; i < virt_dev->lba_status_cache_cnt; i++) {
+			if ((lba >= c[i].lba) && (lba < c[i].lba + c[i].blocks))
+				break;
+		}
+		if (i < virt_dev->lba_status_cache_cnt) {
+			res = virt_dev->lba_status_cache_cnt - i;
+			memcpy(ext, &c[i], res * sizeof(*ext));
+			ext[0].blocks -= lba - ext[0].lba;
+			ext[0].lba = lba;
+			spin_unlock(&virt_dev->lba_status_lock);
+			TRACE_DBG("dev %s: %d LBA status extents from cache "
+				"(lba %lld)", virt_dev->name, res,
+				(long long)lba);
+			goto out;
+		}
 	}
+	spin_unlock(&virt_dev->lba_status_lock);
 
-	length = min_t(uint32_t, data_length, buf_len);
-	memcpy(address, buf, length);
-	kfree(buf);
-	if (length < cmd->resp_data_len)
-		scst_set_resp_data_len(cmd, length);
+	gen = atomic_read(&virt_dev->lba_status_gen);
+	/* Pairs with atomic_inc() of the write side */
+	smp_rmb();
 
-out_put:
-	scst_put_buf_full(cmd, address);
+	res = fileio_get_lba_extents(virt_dev, lba, ext,
+			VDISK_LBA_STATUS_CACHE_SIZE);
+	if (res <= 0)
+		goto out;
+
+	spin_lock(&virt_dev->lba_status_lock);
+	if (gen == atomic_read(&virt_dev->lba_status_gen)) {
+		memcpy(virt_dev->lba_status_cache, ext, res * sizeof(*ext));
+		virt_dev->lba_status_cache_cnt = res;
+		virt_dev->lba_status_cache_gen = gen;
+	}
+	spin_unlock(&virt_dev->lba_status_lock);
 
 out:
-	TRACE_EXIT();
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* SBC-3 GET LBA STATUS command */
+static enum compl_status_e vdisk_exec_get_lba_status(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct vdisk_lba_extent *ext;
+	int32_t length;
+	uint8_t *address;
+	uint8_t *buf;
+	int i, cnt, buf_len;
+
+	TRACE_ENTRY();
+
+	if (unlikely(cmd->lba >= virt_dev->nblocks)) {
+		TRACE_DBG("GET LBA STATUS: LBA %lld out of range (cmd %p)",
+			(long long)cmd->lba, cmd);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
+		goto out;
+	}
+
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out;
+
+	ext = kmalloc(VDISK_LBA_STATUS_CACHE_SIZE * sizeof(*ext),
+		      cmd->cmd_gfp_mask);
+	buf = kzalloc(8 + VDISK_LBA_STATUS_CACHE_SIZE * 16, cmd->cmd_gfp_mask);
+	if ((ext == NULL) || (buf == NULL)) {
+		scst_set_busy(cmd);
+		goto out_free;
+	}
+
+	cnt = vdisk_get_lba_extents(virt_dev, cmd->lba, ext);
+	if (unlikely(cnt < 0)) {
+		scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_hardw_error));
+		goto out_free;
+	}
+
+	/* Don't return more descriptors, than fit into the allocation length */
+	cnt = min(cnt, max_t(int, (length - 8) / 16, 1));
+
+	for (i = 0; i < cnt; i++) {
+		uint8_t *d = &buf[8 + i * 16];
+
+		put_unaligned_be64(ext[i].lba, &d[0]);
+		put_unaligned_be32(ext[i].blocks, &d[8]);
+		d[12] = ext[i].status;
+	}
+	buf_len = 8 + cnt * 16;
+	put_unaligned_be32(buf_len - 4, &buf[0]);
+
+	length = min_t(int, length, buf_len);
+	memcpy(address, buf, length);
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
+
+out_free:
+	kfree(buf);
+	kfree(ext);
+	scst_put_buf_full(cmd, address);
+
+out:
+	TRACE_EXIT();
+	return CMD_SUCCEEDED;
+}
+
+/* SPC-4 REPORT TARGET PORT GROUPS command */
+static enum compl_status_e vdisk_exec_report_tpgs(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_device *dev;
+	uint8_t *address;
+	void *buf;
+	int32_t buf_len;
+	uint32_t data_length, length;
+	uint8_t data_format;
+	int res;
+
+	TRACE_ENTRY();
+
+	buf_len = scst_get_buf_full_sense(cmd, &address);
+	if (buf_len <= 0)
+		goto out;
+
+	dev = cmd->dev;
+	data_format = cmd->cdb[1] >> 5;
+
+	res = scst_tg_get_group_info(&buf, &data_length, dev, data_format);
+	if (res == -ENOMEM) {
+		scst_set_busy(cmd);
+		goto out_put;
+	} else if (res < 0) {
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_invalid_field_in_cdb));
+		goto out_put;
+	}
+
+	length = min_t(uint32_t, data_length, buf_len);
+	memcpy(address, buf, length);
+	kfree(buf);
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
+
+out_put:
+	scst_put_buf_full(cmd, address);
+
+out:
+	TRACE_EXIT();
 	return CMD_SUCCEEDED;
 }
 
@@ -5699,7 +6292,8 @@ static int __vdisk_fsync_fileio(loff_t loff,
 #if 0	/* For sparse files we might need to sync metadata as well */
 	res = generic_write_sync(file, loff, len);
 #else
-	res = filemap_write_and_wait_range(file->f_mapping, loff, len);
+	res = filemap_write_and_wait_range(file->f_mapping, loff,
+					   loff + len - 1);
 #endif
 #endif
 	if (unlikely(res != 0)) {
@@ -5751,6 +6345,53 @@ out:
 	return res;
 }
 
+/*
+ * Flushes the whole backend file and its DIF tags file. Concurrent callers
+ * are coalesced: callers arriving while a flush is in progress wait for it
+ * and then piggyback on the next single flush, which is started after their
+ * arrival, hence covers all writes they completed before.
+ */
+static int vdisk_fsync_fileio_coalesced(struct scst_device *dev)
+{
+	int res;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	u64 gen;
+
+	TRACE_ENTRY();
+
+	atomic64_inc(&virt_dev->flush_requested);
+
+	/* Order reading the flush number after the writes to be flushed */
+	smp_mb();
+	gen = atomic64_read(&virt_dev->flush_started);
+
+	mutex_lock(&virt_dev->flush_mutex);
+
+	if (virt_dev->flush_done > gen) {
+		TRACE_DBG("Dev %s: flush %lld piggybacked on %lld", dev->virt_name,
+			(long long)gen, (long long)virt_dev->flush_done);
+		res = virt_dev->flush_res;
+		goto out_unlock;
+	}
+
+	gen = atomic64_inc_return(&virt_dev->flush_started);
+	atomic64_inc(&virt_dev->flush_issued);
+
+	res = __vdisk_fsync_fileio(0, LLONG_MAX, dev, NULL, virt_dev->fd);
+	if ((res == 0) && (virt_dev->dif_fd != NULL))
+		res = __vdisk_fsync_fileio(0, LLONG_MAX, dev, NULL,
+			virt_dev->dif_fd);
+
+	virt_dev->flush_done = gen;
+	virt_dev->flush_res = res;
+
+out_unlock:
+	mutex_unlock(&virt_dev->flush_mutex);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static int vdisk_fsync_fileio(loff_t loff,
 	loff_t len, struct scst_device *dev, struct scst_cmd *cmd, bool async)
 {
@@ -5764,6 +6405,19 @@ static int vdisk_fsync_fileio(loff_t loff,
 	 ** anything without checking for NULL at first !!!
 	 **/
 
+	if ((loff == 0) && (len >= virt_dev->file_size)) {
+		/* Typical SYNCHRONIZE CACHE, which can be coalesced */
+		res = vdisk_fsync_fileio_coalesced(dev);
+		if (unlikely(res != 0) && (cmd != NULL)) {
+			if (res == -ENOMEM)
+				scst_set_busy(cmd);
+			else
+				scst_set_cmd_error(cmd,
+					SCST_LOAD_SENSE(scst_sense_write_error));
+		}
+		goto done;
+	}
+
 	res = __vdisk_fsync_fileio(loff, len, dev, cmd, virt_dev->fd);
 	if (unlikely(res != 0))
 		goto done;
@@ -5881,6 +6535,69 @@ static enum compl_status_e nullio_exec_read(struct vdisk_cmd_params *p)
 	return CMD_SUCCEEDED;
 }
 
+static inline bool vdev_dif_tags_wt(const struct scst_vdisk_dev *virt_dev,
+	bool fua)
+{
+	return (virt_dev->wt_flag || fua) && !virt_dev->nv_cache;
+}
+
+/*
+ * Starts asynchronous read ahead of the DIF tags of p, so reading them
+ * goes in parallel with reading the data.
+ */
+static void vdev_dif_tags_readahead(struct vdisk_cmd_params *p)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	int shift = cmd->dev->block_shift;
+
+	vfs_fadvise(virt_dev->dif_fd, (p->loff >> shift) << SCST_DIF_TAG_SHIFT,
+		(cmd->bufflen >> shift) << SCST_DIF_TAG_SHIFT,
+		POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+ * Waits until the DIF tags written by vdev_write_dif_tags() reach the
+ * storage, if the device is write-through or the command is FUA.
+ */
+static int vdev_sync_dif_tags(struct vdisk_cmd_params *p)
+{
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	int shift = cmd->dev->block_shift;
+
+	loff_t start = (p->loff >> shift) << SCST_DIF_TAG_SHIFT;
+	loff_t len = (cmd->bufflen >> shift) << SCST_DIF_TAG_SHIFT;
+	int res;
+
+	if (!vdev_dif_tags_wt(virt_dev, p->fua))
+		return 0;
+
+	/*
+	 * Unlike filemap_write_and_wait_range() it also writes the metadata
+	 * needed to read the tags back and flushes the device write cache,
+	 * as O_DSYNC would.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	res = vfs_fsync_range(virt_dev->dif_fd, start, start + len - 1, 1);
+#else
+	res = vfs_fsync(virt_dev->dif_fd, 1);
+#endif
+	if (unlikely(res != 0)) {
+		PRINT_ERROR("DIF tags sync failed (dev %s): %d",
+			cmd->dev->virt_name, res);
+		if (res == -ENOMEM)
+			scst_set_busy(cmd);
+		else
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+	}
+
+	return res;
+}
+
 static int vdev_read_dif_tags(struct vdisk_cmd_params *p)
 {
 	int res = 0;
@@ -6011,7 +6728,7 @@ static int vdev_write_dif_tags(struct vdisk_cmd_params *p)
 {
 	int res = 0;
 	struct scst_cmd *cmd = p->cmd;
-	loff_t loff;
+	loff_t loff, start;
 	mm_segment_t old_fs;
 	loff_t err = 0;
 	ssize_t length, full_len;
@@ -6065,6 +6782,7 @@ static int vdev_write_dif_tags(struct vdisk_cmd_params *p)
 
 	tags_sg = NULL;
 	loff = (p->loff >> cmd->dev->block_shift) << SCST_DIF_TAG_SHIFT;
+	start = loff;
 	while (1) {
 		iv_count = 0;
 		full_len = 0;
@@ -6151,6 +6869,16 @@ restart:
 
 	set_fs(old_fs);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
+	/*
+	 * Start writeback of the written tags at once, so for BLOCKIO it
+	 * goes in parallel with the data bios and vdev_sync_dif_tags()
+	 * mostly waits for I/O already in flight.
+	 */
+	if (vdev_dif_tags_wt(virt_dev, p->fua))
+		filemap_fdatawrite_range(fd->f_mapping, start, loff - 1);
+#endif
+
 out:
 	TRACE_EXIT_RES(res);
 	return res;
@@ -6182,6 +6910,8 @@ static enum compl_status_e fileio_exec_read(struct vdisk_cmd_params *p)
 	struct iovec *iv;
 	int iv_count, i, max_iv_count;
 	bool finished = false;
+	bool dif_store = (dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) &&
+	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE);
 
 	TRACE_ENTRY();
 
@@ -6190,6 +6920,9 @@ static enum compl_status_e fileio_exec_read(struct vdisk_cmd_params *p)
 	if (p->use_zero_copy)
 		goto out_dif;
 
+	if (dif_store)
+		vdev_dif_tags_readahead(p);
+
 	iv = vdisk_alloc_iv(cmd, p);
 	if (iv == NULL)
 		goto out_nomem;
@@ -6261,8 +6994,7 @@ static enum compl_status_e fileio_exec_read(struct vdisk_cmd_params *p)
 
 	set_fs(old_fs);
 
-	if ((dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) &&
-	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE)) {
+	if (dif_store) {
 		err = vdev_read_dif_tags(p);
 		if (err != 0)
 			goto out;
@@ -6369,6 +7101,18 @@ static enum compl_status_e fileio_exec_write(struct vdisk_cmd_params *p)
 	struct iovec *iv, *eiv;
 	int rc, i, iv_count, eiv_count, max_iv_count;
 	bool finished = false;
+	bool dif_store = (dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) &&
+	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE);
+	/*
+	 * FUA writes are made durable per I/O instead of syncing the written
+	 * range afterwards. O_DSYNC flag is used for WT devices.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+	bool dsync = p->fua && !virt_dev->wt_flag && !virt_dev->nv_cache &&
+		     !p->use_zero_copy;
+#else
+	const bool dsync = false;
+#endif
 
 	TRACE_ENTRY();
 
@@ -6429,7 +7173,10 @@ restart:
 		TRACE_DBG("Writing: eiv_count %d, full_len %zd", eiv_count, full_len);
 
 		/* WRITE */
-		err = scst_writev(fd, eiv, eiv_count, &loff);
+		if (dsync)
+			err = scst_writev_dsync(fd, eiv, eiv_count, &loff);
+		else
+			err = scst_writev(fd, eiv, eiv_count, &loff);
 		if (err < 0) {
 			PRINT_ERROR("write() returned %lld from %zd",
 				    (unsigned long long int)err,
@@ -6484,17 +7231,24 @@ restart:
 
 	set_fs(old_fs);
 
-	if ((dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) &&
-	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE)) {
+	/*
+	 * Unlike for BLOCKIO, the tags aren't written in parallel with the
+	 * data: both are written synchronously by this thread and the tags
+	 * must not reach the storage before their data.
+	 */
+	if (dif_store) {
 		err = vdev_write_dif_tags(p);
 		if (err != 0)
 			goto out;
+		err = vdev_sync_dif_tags(p);
+		if (err != 0)
+			goto out;
 	}
 
 out_sync:
 	/* O_DSYNC flag is used for WT devices */
-	if (p->fua)
-		vdisk_fsync(loff, scst_cmd_get_data_len(cmd), cmd->dev,
+	if (p->fua && !dsync)
+		vdisk_fsync(p->loff, scst_cmd_get_data_len(cmd), cmd->dev,
 			    cmd->cmd_gfp_mask, cmd, false);
 out:
 	TRACE_EXIT();
@@ -6515,12 +7269,61 @@ out_nomem:
 struct scst_blockio_work {
 	atomic_t bios_inflight;
 	struct scst_cmd *cmd;
+	/* Submission time, only if timed, i.e. io_poll was set */
+	ktime_t start;
+	bool timed;
+	bool polled;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)) && (LINUX_VERSION_CODE <= KERNEL_VERSION(3, 6, 0))
 	/* just to avoid extra dereferences */
 	struct bio_set *bioset;
 #endif
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 6, 0)
+	/*
+	 * The first bio of the command. The work is allocated as its front
+	 * pad from vdisk_bioset, so it must be the last member.
+	 */
+	struct bio bio;
+#endif
 };
 
+static inline void blockio_free_work(struct scst_blockio_work *blockio_work)
+{
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 6, 0)
+	/* Drop the reference the work holds on its first bio */
+	bio_put(&blockio_work->bio);
+#else
+	kmem_cache_free(blockio_work_cachep, blockio_work);
+#endif
+}
+
+/*
+ * Returns the number of bio vecs needed for the remaining len bytes of cmd,
+ * so small commands fit in the inline vecs of a bio instead of allocating
+ * a max sized vecs array. Each SG element can start in the middle of a
+ * page, hence +1 vec per element.
+ */
+static inline int blockio_nr_vecs(const struct scst_cmd *cmd, int len,
+	int max_nr_vecs)
+{
+	return min_t(int, max_nr_vecs,
+		     DIV_ROUND_UP(len, PAGE_SIZE) + cmd->sg_cnt);
+}
+
+static void blockio_account_latency(struct scst_blockio_work *blockio_work)
+{
+	struct scst_vdisk_dev *virt_dev = blockio_work->cmd->dev->dh_priv;
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), blockio_work->start));
+
+	if (blockio_work->polled) {
+		atomic64_inc(&virt_dev->io_poll_cmds);
+		atomic64_add(ns, &virt_dev->io_poll_ns);
+	} else {
+		atomic64_inc(&virt_dev->io_irq_cmds);
+		atomic64_add(ns, &virt_dev->io_irq_ns);
+	}
+	return;
+}
+
 static inline void blockio_check_finish(struct scst_blockio_work *blockio_work)
 {
 	/* Decrement the bios in processing, and if zero signal completion */
@@ -6536,11 +7339,14 @@ static inline void blockio_check_finish(struct scst_blockio_work *blockio_work)
 			cmd->deferred_dif_read_check = 1;
 		}
 
+		if (blockio_work->timed)
+			blockio_account_latency(blockio_work);
+
 		blockio_work->cmd->completed = 1;
 		blockio_work->cmd->scst_cmd_done(cmd,
 			SCST_CMD_STATE_DEFAULT, scst_estimate_context());
 
-		kmem_cache_free(blockio_work_cachep, blockio_work);
+		blockio_free_work(blockio_work);
 	}
 	return;
 }
@@ -6798,6 +7604,38 @@ static void vdisk_blk_add_dif(struct bio *bio, gfp_t gfp_mask,
 }
 #endif /* defined(CONFIG_BLK_DEV_INTEGRITY) */
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+/*
+ * Polls for completion of the single bio of blockio_work, so it completes
+ * in this thread without interrupt and softirq processing. The caller holds
+ * the extra bios_inflight reference, so blockio_work can't go away. If
+ * the block layer dropped the polled flag, e.g. because the queue lost
+ * its poll queues, the bio completes by interrupt and this only waits.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+static void blockio_poll(struct scst_blockio_work *blockio_work,
+	struct bio *bio)
+{
+	while (atomic_read(&blockio_work->bios_inflight) > 1) {
+		if (bio_poll(bio, NULL, 0) == 0)
+			cond_resched();
+	}
+	bio_put(bio);
+	return;
+}
+#else
+static void blockio_poll(struct scst_blockio_work *blockio_work,
+	struct request_queue *q, blk_qc_t cookie)
+{
+	while (atomic_read(&blockio_work->bios_inflight) > 1) {
+		if (blk_poll(q, cookie, true) == 0)
+			cond_resched();
+	}
+	return;
+}
+#endif
+#endif
+
 static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 {
 	struct scst_cmd *cmd = p->cmd;
@@ -6812,7 +7650,7 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 	struct request_queue *q = bdev_get_queue(bdev);
 	int length, max_nr_vecs = 0, offset;
 	struct page *page;
-	struct bio *bio = NULL, *hbio = NULL, *tbio = NULL;
+	struct bio *bio = NULL, *hbio = NULL, *tbio = NULL, *first_bio = NULL;
 	int need_new_bio;
 	struct scst_blockio_work *blockio_work;
 	int bios = 0;
@@ -6824,6 +7662,13 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 	int dsg_offs, dsg_len;
 	bool dif = virt_dev->blk_integrity &&
 		   (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE);
+	bool timed = virt_dev->io_poll;
+	bool poll = timed && virt_dev->bdev_can_poll;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	struct bio *poll_bio = NULL;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	blk_qc_t cookie = BLK_QC_T_NONE;
+#endif
 
 	TRACE_ENTRY();
 
@@ -6835,12 +7680,37 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 		dsg_len = dsg->length;
 	}
 
+	if (q)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+		max_nr_vecs = BIO_MAX_PAGES;
+#else
+		max_nr_vecs = min(bio_get_nr_vecs(bdev), BIO_MAX_PAGES);
+#endif
+	else
+		max_nr_vecs = 1;
+
 	/* Allocate and initialize blockio_work struct */
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 6, 0)
+	/*
+	 * Together with the first bio, so a command fitting in a single bio
+	 * needs only one allocation.
+	 */
+	first_bio = bio_alloc_bioset(gfp_mask,
+			blockio_nr_vecs(cmd, cmd->bufflen, max_nr_vecs), bs);
+	if (first_bio == NULL) {
+		scst_set_busy(cmd);
+		goto finish_cmd;
+	}
+	blockio_work = container_of(first_bio, struct scst_blockio_work, bio);
+	/* Dropped by blockio_free_work() */
+	bio_get(first_bio);
+#else
 	blockio_work = kmem_cache_alloc(blockio_work_cachep, gfp_mask);
 	if (blockio_work == NULL) {
 		scst_set_busy(cmd);
 		goto finish_cmd;
 	}
+#endif
 
 #if 0
 	{
@@ -6859,15 +7729,6 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 	blockio_work->bioset = bs;
 #endif
 
-	if (q)
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
-		max_nr_vecs = BIO_MAX_PAGES;
-#else
-		max_nr_vecs = min(bio_get_nr_vecs(bdev), BIO_MAX_PAGES);
-#endif
-	else
-		max_nr_vecs = 1;
-
 	need_new_bio = 1;
 
 	length = scst_get_sg_page_first(cmd, &page, &offset);
@@ -6898,10 +7759,18 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 			int rc;
 
 			if (need_new_bio) {
+				int nr_vecs = blockio_nr_vecs(cmd, cmd->bufflen -
+					((lba_start0 - scst_cmd_get_lba(cmd)) << block_shift),
+					max_nr_vecs);
+
+				if (first_bio != NULL) {
+					bio = first_bio;
+					first_bio = NULL;
+				} else
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
-				bio = bio_alloc_bioset(gfp_mask, max_nr_vecs, bs);
+					bio = bio_alloc_bioset(gfp_mask, nr_vecs, bs);
 #else
-				bio = bio_alloc(gfp_mask, max_nr_vecs);
+					bio = bio_alloc(gfp_mask, nr_vecs);
 #endif
 
 				if (!bio) {
@@ -6995,6 +7864,18 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 	/* +1 to prevent erroneous too early command completion */
 	atomic_set(&blockio_work->bios_inflight, bios+1);
 
+	/*
+	 * Only a single bio is polled, the polling of one bio doesn't reap
+	 * the completions of the others, which can be on other hw queues.
+	 */
+	if (bios > 1)
+		poll = false;
+	blockio_work->polled = poll;
+
+	blockio_work->timed = timed;
+	if (timed)
+		blockio_work->start = ktime_get();
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
 	blk_start_plug(&plug);
 #endif
@@ -7008,6 +7889,18 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 	LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)) || \
 	LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
 		submit_bio(bio->bi_rw, bio);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+		if (poll) {
+			bio->bi_opf |= REQ_POLLED;
+			/* Keep the bio for polling */
+			poll_bio = bio;
+			bio_get(poll_bio);
+		}
+		submit_bio(bio);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+		if (poll)
+			bio->bi_opf |= REQ_HIPRI;
+		cookie = submit_bio(bio);
 #else
 		submit_bio(bio);
 #endif
@@ -7023,12 +7916,21 @@ static void blockio_exec_rw(struct vdisk_cmd_params *p, bool write, bool fua)
 	if ((dev->dev_dif_mode & SCST_DIF_MODE_DEV_STORE) &&
 	    (virt_dev->dif_fd != NULL) &&
 	    (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions)) != SCST_DIF_ACTION_NONE)) {
-		if (write)
-			vdev_write_dif_tags(p);
-		else
+		if (write) {
+			if (vdev_write_dif_tags(p) == 0)
+				vdev_sync_dif_tags(p);
+		} else
 			vdev_read_dif_tags(p);
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	if (poll_bio != NULL)
+		blockio_poll(blockio_work, poll_bio);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	if (poll)
+		blockio_poll(blockio_work, q, cookie);
+#endif
+
 	blockio_check_finish(blockio_work);
 
 out:
@@ -7041,7 +7943,9 @@ free_bio:
 		hbio = hbio->bi_next;
 		bio_put(bio);
 	}
-	kmem_cache_free(blockio_work_cachep, blockio_work);
+	if (first_bio != NULL)
+		bio_put(first_bio);
+	blockio_free_work(blockio_work);
 
 finish_cmd:
 	cmd->completed = 1;
@@ -7643,37 +8547,220 @@ static void vdev_ext_copy_remap(struct scst_cmd *cmd,
 	TRACE_DBG("cmd %p, seg %p, data_len %d, shift %d, s %d", cmd, seg,
 		seg->data_descr.data_len, shift, s);
 
-	spin_unlock(&lock);
+	spin_unlock(&lock);
+
+	if (s == 0)
+		goto out_free_done;
+
+	d[0].data_len = s;
+	d[0].src_lba = seg->data_descr.src_lba;
+	d[0].dst_lba = seg->data_descr.dst_lba;
+
+	d[1].data_len = seg->data_descr.data_len - s;
+	d[1].src_lba = seg->data_descr.src_lba + (s >> seg->src_tgt_dev->dev->block_shift);
+	d[1].dst_lba = seg->data_descr.dst_lba + (s >> seg->dst_tgt_dev->dev->block_shift);
+
+	scst_ext_copy_remap_done(cmd, d, 2);
+
+out:
+	TRACE_EXIT();
+	return;
+
+out_busy:
+	scst_set_busy(cmd);
+
+out_free_done:
+	kfree(d);
+
+out_done:
+#if 1
+	scst_ext_copy_remap_done(cmd, &seg->data_descr, 1);
+#else
+	scst_ext_copy_remap_done(cmd, NULL, 0);
+#endif
+	goto out;
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+
+struct fileio_ext_copy_work {
+	struct work_struct work;
+	struct scst_cmd *ec_cmd;
+	struct scst_ext_copy_seg_descr *seg;
+};
+
+/*
+ * Returns the vdisk_fileio device, which can be used as EXTENDED COPY source
+ * or destination by the filesystem, or NULL otherwise.
+ */
+static struct scst_vdisk_dev *fileio_ext_copy_dev(struct scst_tgt_dev *tgt_dev)
+{
+	struct scst_device *dev = tgt_dev->dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	if (dev->handler != &vdisk_file_devtype)
+		return NULL;
+
+	virt_dev = dev->dh_priv;
+	if ((virt_dev->fd == NULL) || (virt_dev->dif_fd != NULL) ||
+	    (dev->dev_dif_mode != SCST_DIF_MODE_NONE))
+		return NULL;
+
+	return virt_dev;
+}
+
+/*
+ * Copies len bytes from src to dst by reflink, if the filesystem supports
+ * it, otherwise by copy_file_range(). Returns the number of bytes copied.
+ */
+static loff_t fileio_copy_range(struct file *src, loff_t src_pos,
+	struct file *dst, loff_t dst_pos, loff_t len)
+{
+	loff_t res = 0;
+	ssize_t rc;
+
+	TRACE_ENTRY();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	res = vfs_clone_file_range(src, src_pos, dst, dst_pos, len, 0);
+	if (res == len)
+		goto out;
+	TRACE_DBG("vfs_clone_file_range() returned %lld", (long long)res);
+	res = max_t(loff_t, res, 0);
+#else
+	rc = vfs_clone_file_range(src, src_pos, dst, dst_pos, len);
+	if (rc == 0) {
+		res = len;
+		goto out;
+	}
+	TRACE_DBG("vfs_clone_file_range() failed: %zd", rc);
+#endif
+
+	while (res < len) {
+		rc = vfs_copy_file_range(src, src_pos + res, dst, dst_pos + res,
+			min_t(loff_t, len - res, SSIZE_MAX), 0);
+		if (rc <= 0) {
+			TRACE_DBG("vfs_copy_file_range() returned %zd", rc);
+			break;
+		}
+		res += rc;
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static void fileio_ext_copy_work_fn(struct work_struct *work)
+{
+	struct fileio_ext_copy_work *w = container_of(work,
+					struct fileio_ext_copy_work, work);
+	struct scst_cmd *ec_cmd = w->ec_cmd;
+	struct scst_ext_copy_seg_descr *seg = w->seg;
+	struct scst_ext_copy_data_descr *dd = &seg->data_descr, *left;
+	struct scst_vdisk_dev *virt_dev = ec_cmd->dev->dh_priv;
+	struct scst_vdisk_dev *src = fileio_ext_copy_dev(seg->src_tgt_dev);
+	struct scst_vdisk_dev *dst = fileio_ext_copy_dev(seg->dst_tgt_dev);
+	int src_shift = seg->src_tgt_dev->dev->block_shift;
+	int dst_shift = seg->dst_tgt_dev->dev->block_shift;
+	loff_t src_pos = dd->src_lba << src_shift;
+	loff_t dst_pos = dd->dst_lba << dst_shift;
+	loff_t done;
+
+	TRACE_ENTRY();
+
+	kfree(w);
+
+	if (unlikely((src == NULL) || (dst == NULL))) {
+		done = 0;
+		goto out_account;
+	}
+
+	done = fileio_copy_range(src->fd, src_pos, dst->fd, dst_pos,
+			dd->data_len);
+	vdisk_lba_status_invalidate(dst);
+	/* Leftover must start on a block boundary of both devices */
+	done &= ~((1LL << max(src_shift, dst_shift)) - 1);
+
+	if ((done > 0) && dst->wt_flag && !dst->nv_cache &&
+	    (vfs_fsync_range(dst->fd, dst_pos, dst_pos + done - 1, 1) != 0)) {
+		PRINT_WARNING("Flushing of remapped range failed (dev %s), "
+			"copying it again", dst->name);
+		done = 0;
+	}
+
+	TRACE_DBG("ec_cmd %p: offloaded %lld of %d bytes", ec_cmd,
+		(long long)done, dd->data_len);
+
+out_account:
+	atomic64_add(done, &virt_dev->ext_copy_offloaded_bytes);
+	atomic64_add(dd->data_len - done, &virt_dev->ext_copy_copied_bytes);
+
+	if (done == dd->data_len) {
+		scst_ext_copy_remap_done(ec_cmd, NULL, 0);
+		goto out;
+	}
+
+	if (done == 0)
+		goto out_copy_all;
+
+	left = kzalloc(sizeof(*left), GFP_KERNEL);
+	if (left == NULL)
+		goto out_copy_all;
+
+	left->src_lba = dd->src_lba + (done >> src_shift);
+	left->dst_lba = dd->dst_lba + (done >> dst_shift);
+	left->data_len = dd->data_len - done;
+
+	scst_ext_copy_remap_done(ec_cmd, left, 1);
+
+out:
+	TRACE_EXIT();
+	return;
+
+out_copy_all:
+	scst_ext_copy_remap_done(ec_cmd, dd, 1);
+	goto out;
+}
+
+/*
+ * Offloads EXTENDED COPY segments between vdisk_fileio devices to the
+ * filesystem. Whatever can't be offloaded is left to the copy manager.
+ */
+static void fileio_ext_copy_remap(struct scst_cmd *cmd,
+	struct scst_ext_copy_seg_descr *seg)
+{
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	struct scst_vdisk_dev *src, *dst;
+	struct fileio_ext_copy_work *w;
+
+	TRACE_ENTRY();
 
-	if (s == 0)
-		goto out_free_done;
+	src = fileio_ext_copy_dev(seg->src_tgt_dev);
+	dst = fileio_ext_copy_dev(seg->dst_tgt_dev);
+	if ((src == NULL) || (dst == NULL) || dst->rd_only) {
+		TRACE_DBG("Not possible to offload seg %p (ec_cmd %p)", seg,
+			cmd);
+		goto out_copy;
+	}
 
-	d[0].data_len = s;
-	d[0].src_lba = seg->data_descr.src_lba;
-	d[0].dst_lba = seg->data_descr.dst_lba;
+	w = kmalloc(sizeof(*w), GFP_KERNEL);
+	if (w == NULL)
+		goto out_copy;
 
-	d[1].data_len = seg->data_descr.data_len - s;
-	d[1].src_lba = seg->data_descr.src_lba + (s >> seg->src_tgt_dev->dev->block_shift);
-	d[1].dst_lba = seg->data_descr.dst_lba + (s >> seg->dst_tgt_dev->dev->block_shift);
+	INIT_WORK(&w->work, fileio_ext_copy_work_fn);
+	w->ec_cmd = cmd;
+	w->seg = seg;
 
-	scst_ext_copy_remap_done(cmd, d, 2);
+	/* Avoid recursion in the segments processing, see scst.h */
+	queue_work(system_unbound_wq, &w->work);
 
 out:
 	TRACE_EXIT();
 	return;
 
-out_busy:
-	scst_set_busy(cmd);
-
-out_free_done:
-	kfree(d);
-
-out_done:
-#if 1
+out_copy:
+	atomic64_add(seg->data_descr.data_len, &virt_dev->ext_copy_copied_bytes);
 	scst_ext_copy_remap_done(cmd, &seg->data_descr, 1);
-#else
-	scst_ext_copy_remap_done(cmd, NULL, 0);
-#endif
 	goto out;
 }
 #endif
@@ -7819,7 +8906,13 @@ static int vdisk_create_bioset(struct scst_vdisk_dev *virt_dev)
 	EXTRACHECKS_BUG_ON(virt_dev->vdisk_bioset || !virt_dev->blockio);
 
 	/* Pool size doesn't really matter */
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 6, 0)
+	/* blockio_work is allocated in the front pad of the first bio */
+	virt_dev->vdisk_bioset = bioset_create(2,
+		offsetof(struct scst_blockio_work, bio), BIOSET_NEED_BVECS);
+#else
 	virt_dev->vdisk_bioset = bioset_create(2, 0, BIOSET_NEED_BVECS);
+#endif
 	if (virt_dev->vdisk_bioset == NULL) {
 		PRINT_ERROR("Failed to create bioset (dev %s)", virt_dev->name);
 		res = -ENOMEM;
@@ -7897,6 +8990,8 @@ static int vdev_create_node(struct scst_dev_type *devt,
 	}
 
 	spin_lock_init(&virt_dev->flags_lock);
+	spin_lock_init(&virt_dev->lba_status_lock);
+	mutex_init(&virt_dev->flush_mutex);
 
 	virt_dev->vdev_devt = devt;
 
@@ -8276,8 +9371,12 @@ out:
 	return res;
 }
 
-/* scst_vdisk_mutex supposed to be held */
-static int vdev_fileio_add_device(const char *device_name, char *params)
+/*
+ * Creates a new virt_dev and adds it in vdev_list, but doesn't register it
+ * in SCST. scst_vdisk_mutex supposed to be held.
+ */
+static int vdev_fileio_create_device(const char *device_name, char *params,
+	struct scst_vdisk_dev **out_virt_dev)
 {
 	int res = 0;
 	struct scst_vdisk_dev *virt_dev;
@@ -8317,30 +9416,23 @@ static int vdev_fileio_add_device(const char *device_name, char *params)
 
 	vdisk_report_registering(virt_dev);
 
-	virt_dev->virt_id = scst_register_virtual_device_node(virt_dev->vdev_devt,
-					virt_dev->name, virt_dev->numa_node_id);
-	if (virt_dev->virt_id < 0) {
-		res = virt_dev->virt_id;
-		goto out_del;
-	}
-
-	TRACE_DBG("Registered virt_dev %s with id %d", virt_dev->name,
-		virt_dev->virt_id);
+	*out_virt_dev = virt_dev;
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
 
-out_del:
-	list_del(&virt_dev->vdev_list_entry);
-
 out_destroy:
 	vdev_destroy(virt_dev);
 	goto out;
 }
 
-/* scst_vdisk_mutex supposed to be held */
-static int vdev_blockio_add_device(const char *device_name, char *params)
+/*
+ * Creates a new virt_dev and adds it in vdev_list, but doesn't register it
+ * in SCST. scst_vdisk_mutex supposed to be held.
+ */
+static int vdev_blockio_create_device(const char *device_name, char *params,
+	struct scst_vdisk_dev **out_virt_dev)
 {
 	int res = 0;
 	const char *const allowed_params[] = { "filename", "read_only", "write_through",
@@ -8388,30 +9480,23 @@ static int vdev_blockio_add_device(const char *device_name, char *params)
 
 	vdisk_report_registering(virt_dev);
 
-	virt_dev->virt_id = scst_register_virtual_device_node(virt_dev->vdev_devt,
-					virt_dev->name, virt_dev->numa_node_id);
-	if (virt_dev->virt_id < 0) {
-		res = virt_dev->virt_id;
-		goto out_del;
-	}
-
-	TRACE_DBG("Registered virt_dev %s with id %d", virt_dev->name,
-		virt_dev->virt_id);
+	*out_virt_dev = virt_dev;
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
 
-out_del:
-	list_del(&virt_dev->vdev_list_entry);
-
 out_destroy:
 	vdev_destroy(virt_dev);
 	goto out;
 }
 
-/* scst_vdisk_mutex supposed to be held */
-static int vdev_nullio_add_device(const char *device_name, char *params)
+/*
+ * Creates a new virt_dev and adds it in vdev_list, but doesn't register it
+ * in SCST. scst_vdisk_mutex supposed to be held.
+ */
+static int vdev_nullio_create_device(const char *device_name, char *params,
+	struct scst_vdisk_dev **out_virt_dev)
 {
 	int res = 0;
 	static const char *const allowed_params[] = {
@@ -8442,6 +9527,24 @@ static int vdev_nullio_add_device(const char *device_name, char *params)
 
 	vdisk_report_registering(virt_dev);
 
+	*out_virt_dev = virt_dev;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_destroy:
+	vdev_destroy(virt_dev);
+	goto out;
+}
+
+/* scst_vdisk_mutex supposed to be held */
+static int vdev_register_device(struct scst_vdisk_dev *virt_dev)
+{
+	int res = 0;
+
+	TRACE_ENTRY();
+
 	virt_dev->virt_id = scst_register_virtual_device_node(virt_dev->vdev_devt,
 					virt_dev->name, virt_dev->numa_node_id);
 	if (virt_dev->virt_id < 0) {
@@ -8458,15 +9561,193 @@ out:
 
 out_del:
 	list_del(&virt_dev->vdev_list_entry);
-
-out_destroy:
 	vdev_destroy(virt_dev);
 	goto out;
 }
 
+/*
+ * Does the slow parts of vdisk_attach(), which don't need the SCST device,
+ * in advance without scst_mutex: opens the backend and gets its size and
+ * reads the saved mode pages. The backend is kept open until
+ * vdisk_unprobe(), so the backend reopens by vdisk_attach() don't have to
+ * do the first open again.
+ */
+static int vdisk_probe(struct scst_vdisk_dev *virt_dev)
+{
+	int res = 0;
+	struct file *fd;
+
+	TRACE_ENTRY();
+
+	if (!virt_dev->nullio && !virt_dev->cdrom_empty &&
+	    virt_dev->dev_active) {
+		fd = filp_open(virt_dev->filename, O_LARGEFILE | O_RDONLY, 0600);
+		/* Leave the open errors, like DRBD passive, to attach() */
+		if (IS_ERR(fd))
+			goto load_mode_pages;
+		virt_dev->probe_fd = fd;
+
+		res = vdisk_get_file_size(virt_dev, &virt_dev->file_size);
+		if (res != 0) {
+			if ((res == -EMEDIUMTYPE) && virt_dev->blockio)
+				res = 0;
+			goto out;
+		}
+		virt_dev->file_size_probed = 1;
+	}
+
+load_mode_pages:
+	if (vdev_saved_mode_pages_enabled) {
+		virt_dev->probed_mode_pages_size = vdev_read_mode_pages(virt_dev,
+						&virt_dev->probed_mode_pages);
+		virt_dev->mode_pages_probed = 1;
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static void vdisk_unprobe(struct scst_vdisk_dev *virt_dev)
+{
+	if (virt_dev->probe_fd != NULL) {
+		filp_close(virt_dev->probe_fd, NULL);
+		virt_dev->probe_fd = NULL;
+	}
+	vfree(virt_dev->probed_mode_pages);
+	virt_dev->probed_mode_pages = NULL;
+	virt_dev->file_size_probed = 0;
+	virt_dev->mode_pages_probed = 0;
+}
+
+struct vdev_register_work {
+	struct work_struct work;
+	struct scst_vdisk_dev *virt_dev;
+};
+
+static void vdev_register_work_fn(struct work_struct *work)
+{
+	struct vdev_register_work *w = container_of(work,
+					struct vdev_register_work, work);
+	struct scst_vdisk_dev *virt_dev = w->virt_dev;
+	int res;
+
+	TRACE_ENTRY();
+
+	res = vdisk_probe(virt_dev);
+	if (res != 0) {
+		virt_dev->virt_id = res;
+		goto out_unprobe;
+	}
+
+	/*
+	 * vdev_list is protected by scst_vdisk_mutex held by
+	 * vdisk_add_devices(), so vdisk_attach() can safely look it up.
+	 */
+	virt_dev->virt_id = scst_register_virtual_device_node(virt_dev->vdev_devt,
+					virt_dev->name, virt_dev->numa_node_id);
+
+out_unprobe:
+	vdisk_unprobe(virt_dev);
+
+	TRACE_EXIT();
+	return;
+}
+
+/*
+ * Adds several devices at once. The devices are created one by one, then
+ * probed and registered in SCST in parallel, so the backends opening, the
+ * saved mode pages and PR files loading and the sysfs setup for all of them
+ * overlap. Only attach() and the final publish are serialized by
+ * scst_mutex. Returns 0 if all the devices were added, or the first error
+ * otherwise. The devices, which were successfully added, stay added.
+ */
+static ssize_t vdisk_add_devices(int (*create_fn)(const char *device_name,
+	char *params, struct scst_vdisk_dev **out_virt_dev),
+	int cnt, const char **device_names, char **params)
+{
+	int res, rc, i, added = 0;
+	struct vdev_register_work *works;
+	ktime_t start, created, registered;
+
+	TRACE_ENTRY();
+
+	start = ktime_get();
+
+	works = kcalloc(cnt, sizeof(*works), GFP_KERNEL);
+	if (works == NULL) {
+		PRINT_ERROR("Unable to allocate %d register works", cnt);
+		res = -ENOMEM;
+		goto out;
+	}
+
+	res = mutex_lock_interruptible(&scst_vdisk_mutex);
+	if (res != 0)
+		goto out_free;
+
+	for (i = 0; i < cnt; i++) {
+		rc = create_fn(device_names[i], params[i], &works[i].virt_dev);
+		if (rc != 0) {
+			if (res == 0)
+				res = rc;
+			continue;
+		}
+		INIT_WORK(&works[i].work, vdev_register_work_fn);
+	}
+
+	created = ktime_get();
+
+	for (i = 0; i < cnt; i++) {
+		if (works[i].virt_dev == NULL)
+			continue;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+		queue_work(system_unbound_wq, &works[i].work);
+#else
+		schedule_work(&works[i].work);
+#endif
+	}
+
+	for (i = 0; i < cnt; i++) {
+		struct scst_vdisk_dev *virt_dev = works[i].virt_dev;
+
+		if (virt_dev == NULL)
+			continue;
+
+		flush_work(&works[i].work);
+
+		if (virt_dev->virt_id < 0) {
+			if (res == 0)
+				res = virt_dev->virt_id;
+			list_del(&virt_dev->vdev_list_entry);
+			vdev_destroy(virt_dev);
+			continue;
+		}
+
+		TRACE_DBG("Registered virt_dev %s with id %d", virt_dev->name,
+			virt_dev->virt_id);
+		added++;
+	}
+
+	mutex_unlock(&scst_vdisk_mutex);
+
+	registered = ktime_get();
+
+	PRINT_INFO("Added %d of %d devices (create %lld us, register %lld us)",
+		added, cnt, (long long)ktime_us_delta(created, start),
+		(long long)ktime_us_delta(registered, created));
+
+out_free:
+	kfree(works);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static ssize_t vdisk_add_fileio_device(const char *device_name, char *params)
 {
 	int res;
+	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
 
@@ -8474,7 +9755,9 @@ static ssize_t vdisk_add_fileio_device(const char *device_name, char *params)
 	if (res != 0)
 		goto out;
 
-	res = vdev_fileio_add_device(device_name, params);
+	res = vdev_fileio_create_device(device_name, params, &virt_dev);
+	if (res == 0)
+		res = vdev_register_device(virt_dev);
 
 	mutex_unlock(&scst_vdisk_mutex);
 
@@ -8486,6 +9769,7 @@ out:
 static ssize_t vdisk_add_blockio_device(const char *device_name, char *params)
 {
 	int res;
+	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
 
@@ -8493,7 +9777,9 @@ static ssize_t vdisk_add_blockio_device(const char *device_name, char *params)
 	if (res != 0)
 		goto out;
 
-	res = vdev_blockio_add_device(device_name, params);
+	res = vdev_blockio_create_device(device_name, params, &virt_dev);
+	if (res == 0)
+		res = vdev_register_device(virt_dev);
 
 	mutex_unlock(&scst_vdisk_mutex);
 
@@ -8506,6 +9792,7 @@ out:
 static ssize_t vdisk_add_nullio_device(const char *device_name, char *params)
 {
 	int res;
+	struct scst_vdisk_dev *virt_dev;
 
 	TRACE_ENTRY();
 
@@ -8513,7 +9800,9 @@ static ssize_t vdisk_add_nullio_device(const char *device_name, char *params)
 	if (res)
 		goto out;
 
-	res = vdev_nullio_add_device(device_name, params);
+	res = vdev_nullio_create_device(device_name, params, &virt_dev);
+	if (res == 0)
+		res = vdev_register_device(virt_dev);
 
 	mutex_unlock(&scst_vdisk_mutex);
 
@@ -8523,6 +9812,27 @@ out:
 
 }
 
+static ssize_t vdisk_add_fileio_devices(int cnt, const char **device_names,
+	char **params)
+{
+	return vdisk_add_devices(vdev_fileio_create_device, cnt, device_names,
+		params);
+}
+
+static ssize_t vdisk_add_blockio_devices(int cnt, const char **device_names,
+	char **params)
+{
+	return vdisk_add_devices(vdev_blockio_create_device, cnt, device_names,
+		params);
+}
+
+static ssize_t vdisk_add_nullio_devices(int cnt, const char **device_names,
+	char **params)
+{
+	return vdisk_add_devices(vdev_nullio_create_device, cnt, device_names,
+		params);
+}
+
 #endif /* CONFIG_SCST_PROC */
 
 static void vdev_on_free(struct scst_device *dev, void *arg)
@@ -10471,6 +11781,107 @@ static ssize_t vdev_zero_copy_show(struct kobject *kobj,
 	return pos;
 }
 
+static ssize_t vdev_ext_copy_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos;
+	struct scst_device *dev;
+	struct scst_vdisk_dev *virt_dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+	virt_dev = dev->dh_priv;
+
+	pos = sprintf(buf, "offloaded_bytes %lld\ncopied_bytes %lld\n",
+		(long long)atomic64_read(&virt_dev->ext_copy_offloaded_bytes),
+		(long long)atomic64_read(&virt_dev->ext_copy_copied_bytes));
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t vdisk_flush_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev = container_of(kobj, struct scst_device,
+					       dev_kobj);
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+
+	return sprintf(buf, "requested %lld\nissued %lld\n",
+		(long long)atomic64_read(&virt_dev->flush_requested),
+		(long long)atomic64_read(&virt_dev->flush_issued));
+}
+
+static ssize_t vdisk_sysfs_io_poll_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev = container_of(kobj, struct scst_device,
+					       dev_kobj);
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	bool io_poll = virt_dev->io_poll;
+
+	return sprintf(buf, "%d\n%s", io_poll,
+		       io_poll ? SCST_SYSFS_KEY_MARK "\n" : "");
+}
+
+static ssize_t vdisk_sysfs_io_poll_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_device *dev = container_of(kobj, struct scst_device,
+					       dev_kobj);
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	long io_poll;
+	int res;
+	char ch[16];
+
+	sprintf(ch, "%.*s", min_t(int, sizeof(ch) - 1, count), buf);
+	res = kstrtol(ch, 0, &io_poll);
+	if (res)
+		goto out;
+	res = -EINVAL;
+	if (io_poll != 0 && io_poll != 1)
+		goto out;
+
+	/*
+	 * The backend is opened only when the first LUN is added, so whether
+	 * it supports polling is checked by vdisk_open_fd(). Until then, or
+	 * if it doesn't, the flag is stored, but bios are not polled.
+	 */
+	spin_lock(&virt_dev->flags_lock);
+	virt_dev->io_poll = io_poll;
+	spin_unlock(&virt_dev->flags_lock);
+
+	PRINT_INFO("Polled I/O %s for device %s",
+		io_poll ? "enabled" : "disabled", dev->virt_name);
+
+	if (io_poll && (virt_dev->fd != NULL) && !virt_dev->bdev_can_poll)
+		PRINT_WARNING("Device %s does not support polled I/O (no poll "
+			"queues?), io_poll ignored", dev->virt_name);
+
+	res = count;
+
+out:
+	return res;
+}
+
+static ssize_t vdisk_io_poll_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev = container_of(kobj, struct scst_device,
+					       dev_kobj);
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	s64 irq_cmds = atomic64_read(&virt_dev->io_irq_cmds);
+	s64 poll_cmds = atomic64_read(&virt_dev->io_poll_cmds);
+
+	return sprintf(buf, "irq_cmds %lld\nirq_avg_latency_ns %lld\n"
+		"poll_cmds %lld\npoll_avg_latency_ns %lld\n",
+		(long long)irq_cmds, irq_cmds ? (long long)div64_s64(
+			atomic64_read(&virt_dev->io_irq_ns), irq_cmds) : 0LL,
+		(long long)poll_cmds, poll_cmds ? (long long)div64_s64(
+			atomic64_read(&virt_dev->io_poll_ns), poll_cmds) : 0LL);
+}
+
 static ssize_t vdev_dif_filename_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
@@ -34,8 +34,6 @@
 #define SCST_CM_MAX_RETRIES_TIME (30*HZ)
 #define SCST_CM_ID_KEEP_TIME	(5*HZ)
 
-#define SCST_CM_MAX_EACH_IO_SIZE (512*1024)
-
 /* Too big value is not too good for the blocking machinery */
 #define SCST_CM_MAX_TGT_DESCR_CNT 5
 
@@ -103,6 +101,9 @@ struct scst_cm_internal_cmd_priv {
 	/* E.g. rcmd for WRITEs, ec_cmd for READs, etc. */
 	struct scst_cmd *cm_orig_cmd;
 
+	/* For READs, LBA where the read data should be written to */
+	int64_t cm_write_lba;
+
 	struct list_head cm_internal_cmd_list_entry;
 };
 
@@ -137,8 +138,18 @@ struct scst_cm_ec_cmd_priv {
 
 	struct mutex cm_mutex;
 
+	/*
+	 * Number of READ->WRITE chains in flight. Each chain owns one data
+	 * buffer, which READ fills and following WRITE sends out.
+	 */
 	int cm_cur_in_flight; /* commands */
 
+	/*
+	 * Max number of READs and, separately, WRITEs in flight, so at most
+	 * 2*cm_max_in_flight chains can exist at the same time.
+	 */
+	int cm_max_in_flight;
+
 	/**
 	 ** READ commands stuff
 	 **/
@@ -147,6 +158,7 @@ struct scst_cm_ec_cmd_priv {
 	int64_t cm_cur_read_lba; /* in blocks */
 	int cm_left_to_read; /* in blocks */
 	int cm_max_each_read;/* in blocks */
+	int cm_reads_in_flight; /* commands */
 
 	/**
 	 ** WRITE commands stuff
@@ -341,6 +353,29 @@ static bool scst_cm_is_ec_cmd_done(struct scst_cmd *ec_cmd)
 	return res;
 }
 
+/*
+ * Returns size in bytes of each internal READ and WRITE for sd: the biggest
+ * one both devices and their transports can take in a single command.
+ */
+static int scst_cm_get_each_io_size(const struct scst_ext_copy_seg_descr *sd)
+{
+	const struct scst_tgt_dev *src = sd->src_tgt_dev;
+	const struct scst_tgt_dev *dst = sd->dst_tgt_dev;
+	int res, max_block_size;
+
+	res = min(src->dev->ext_copy_max_io_size, dst->dev->ext_copy_max_io_size);
+	res = min_t(long, res, (long)src->max_sg_cnt << PAGE_SHIFT);
+	res = min_t(long, res, (long)dst->max_sg_cnt << PAGE_SHIFT);
+
+	/* Block sizes are powers of 2, so the biggest one is multiple of both */
+	max_block_size = max(src->dev->block_size, dst->dev->block_size);
+	res &= ~(max_block_size - 1);
+	if (res == 0)
+		res = max_block_size;
+
+	return res;
+}
+
 /*
  * cm_mutex suppose to be locked or no activities on this ec_cmd's priv.
  *
@@ -377,13 +412,17 @@ static int scst_cm_setup_this_data_descr(struct scst_cmd *ec_cmd)
 	priv->cm_start_read_lba = dd->src_lba;
 	priv->cm_cur_read_lba = dd->src_lba;
 	priv->cm_left_to_read = dd->data_len >> sd->src_tgt_dev->dev->block_shift;
-	priv->cm_max_each_read = SCST_CM_MAX_EACH_IO_SIZE >> sd->src_tgt_dev->dev->block_shift;
+	priv->cm_max_each_read = scst_cm_get_each_io_size(sd) >> sd->src_tgt_dev->dev->block_shift;
+	priv->cm_max_in_flight = min(sd->src_tgt_dev->dev->ext_copy_max_in_flight,
+				     sd->dst_tgt_dev->dev->ext_copy_max_in_flight);
 
 	priv->cm_write_tgt_dev = sd->dst_tgt_dev;
 	priv->cm_start_write_lba = dd->dst_lba;
 
-	TRACE_DBG("len %d, src_lba %lld, dst_lba %lld", dd->data_len,
-		(long long)dd->src_lba, (long long)dd->dst_lba);
+	TRACE_DBG("len %d, src_lba %lld, dst_lba %lld, max_each_read %d, "
+		"max_in_flight %d", dd->data_len, (long long)dd->src_lba,
+		(long long)dd->dst_lba, priv->cm_max_each_read,
+		priv->cm_max_in_flight);
 
 	if (unlikely((dd->data_len & (sd->src_tgt_dev->dev->block_size-1)) != 0) ||
 	    unlikely((dd->data_len & (sd->dst_tgt_dev->dev->block_size-1)) != 0)) {
@@ -569,6 +608,7 @@ static void scst_cm_advance_seg_descr(struct scst_cmd *ec_cmd)
 	TRACE_DBG("ec_cmd %p", ec_cmd);
 
 	EXTRACHECKS_BUG_ON(priv->cm_cur_in_flight != 0);
+	EXTRACHECKS_BUG_ON(priv->cm_reads_in_flight != 0);
 
 	scst_cm_destroy_data_descrs(ec_cmd);
 
@@ -898,7 +938,7 @@ static void scst_cm_read_cmd_finished(struct scst_cmd *rcmd);
 
 /* cm_mutex suppose to be locked */
 static int __scst_cm_push_single_read(struct scst_cmd *ec_cmd,
-	int64_t lba, int blocks)
+	int64_t lba, int blocks, int64_t write_lba)
 {
 	int res;
 	struct scst_cm_ec_cmd_priv *priv = ec_cmd->cmd_data_descriptors;
@@ -961,9 +1001,11 @@ static int __scst_cm_push_single_read(struct scst_cmd *ec_cmd,
 	if (res != 0)
 		goto out_free_rcmd;
 
+	((struct scst_cm_internal_cmd_priv *)rcmd->tgt_i_priv)->cm_write_lba = write_lba;
+
 	TRACE_DBG("Adding ec_cmd's (%p) READ rcmd %p (lba %lld, blocks %d, "
-		"check_dif %d) to active cmd list", ec_cmd, rcmd,
-		(long long)rcmd->lba, blocks, check_dif);
+		"check_dif %d, write_lba %lld) to active cmd list", ec_cmd, rcmd,
+		(long long)rcmd->lba, blocks, check_dif, (long long)write_lba);
 	spin_lock_irq(&rcmd->cmd_threads->cmd_list_lock);
 	list_add_tail(&rcmd->cmd_list_entry, &rcmd->cmd_threads->active_cmd_list);
 	spin_unlock_irq(&rcmd->cmd_threads->cmd_list_lock);
@@ -995,7 +1037,10 @@ static void scst_cm_read_retry_fn(struct scst_cmd *rcmd)
 	mutex_lock(&priv->cm_mutex);
 
 	rc = __scst_cm_push_single_read(ec_cmd, rcmd->lba,
-		rcmd->data_len >> priv->cm_read_tgt_dev->dev->block_shift);
+		rcmd->data_len >> priv->cm_read_tgt_dev->dev->block_shift,
+		p->cm_write_lba);
+	if (rc != 0)
+		priv->cm_reads_in_flight--;
 
 	/* ec_cmd can get dead after we will drop cm_mutex! */
 	scst_cm_del_free_from_internal_cmd_list(rcmd, false);
@@ -1104,6 +1149,12 @@ cont:
 
 	mutex_lock(&priv->cm_mutex);
 
+	if (priv->cm_reads_in_flight >= priv->cm_max_in_flight) {
+		TRACE_DBG("ec_cmd %p: READs window full, finishing chain",
+			ec_cmd);
+		goto out_unlock_finished;
+	}
+
 	if (priv->cm_left_to_read == 0) {
 		if (priv->cm_cur_data_descr >= priv->cm_data_descrs_cnt)
 			goto out_unlock_finished;
@@ -1216,13 +1267,15 @@ out_free_wcmd:
 	goto out;
 }
 
+static int scst_cm_gen_more_reads(struct scst_cmd *ec_cmd, int *cnt);
+
 static void scst_cm_read_cmd_finished(struct scst_cmd *rcmd)
 {
 	struct scst_cm_internal_cmd_priv *p = rcmd->tgt_i_priv;
 	struct scst_cmd *ec_cmd = p->cm_orig_cmd;
 	struct scst_cm_ec_cmd_priv *priv = ec_cmd->cmd_data_descriptors;
 	int64_t lba;
-	int rc, len, blocks;
+	int rc, len, blocks, cnt = 0;
 
 	TRACE_ENTRY();
 
@@ -1259,30 +1312,41 @@ static void scst_cm_read_cmd_finished(struct scst_cmd *rcmd)
 	}
 
 cont:
-	lba = rcmd->lba - priv->cm_start_read_lba;
-	lba <<= priv->cm_read_tgt_dev->dev->block_shift;
-	lba >>= priv->cm_write_tgt_dev->dev->block_shift;
-	lba += priv->cm_start_write_lba;
+	/*
+	 * This chain continues with WRITE, so there is room for one more
+	 * READ. Start it before the WRITE, because after the WRITE is
+	 * submitted this chain can finish and take ec_cmd with it.
+	 */
+	mutex_lock(&priv->cm_mutex);
+	priv->cm_reads_in_flight--;
+	scst_cm_gen_more_reads(ec_cmd, &cnt);
+	mutex_unlock(&priv->cm_mutex);
+
+	if (cnt != 0)
+		wake_up(&priv->cm_read_tgt_dev->active_cmd_threads->cmd_list_waitQ);
 
+	lba = p->cm_write_lba;
 	len = rcmd->data_len;
 	blocks = len >> priv->cm_write_tgt_dev->dev->block_shift;
 
-	TRACE_DBG("rcmd->lba %lld, start_read_lba %lld, read shift %d, write "
-		"shift %d, start_write_lba %lld, lba %lld, len %d, blocks %d",
-		(long long)rcmd->lba, (long long)priv->cm_start_read_lba,
-		priv->cm_read_tgt_dev->dev->block_shift,
-		priv->cm_write_tgt_dev->dev->block_shift,
-		(long long)priv->cm_start_write_lba, lba, len, blocks);
+	TRACE_DBG("rcmd->lba %lld, lba %lld, len %d, blocks %d, new reads %d",
+		(long long)rcmd->lba, (long long)lba, len, blocks, cnt);
 
+	/* The WRITE sends out rcmd's buffer as is, no copying */
 	rc = scst_cm_push_single_write(ec_cmd, lba, blocks, rcmd);
 	if (rc != 0)
-		goto out_finished;
+		goto out_free;
 
 out:
 	TRACE_EXIT();
 	return;
 
 out_finished:
+	mutex_lock(&priv->cm_mutex);
+	priv->cm_reads_in_flight--;
+	mutex_unlock(&priv->cm_mutex);
+
+out_free:
 	scst_cm_del_free_from_internal_cmd_list(rcmd, false);
 
 	scst_cm_in_flight_cmd_finished(ec_cmd);
@@ -1295,6 +1359,7 @@ static int scst_cm_push_single_read(struct scst_cmd *ec_cmd, int blocks,
 {
 	int res;
 	struct scst_cm_ec_cmd_priv *priv = ec_cmd->cmd_data_descriptors;
+	int64_t write_lba;
 
 	TRACE_ENTRY();
 
@@ -1302,12 +1367,23 @@ static int scst_cm_push_single_read(struct scst_cmd *ec_cmd, int blocks,
 		"blocks %d", ec_cmd, (long long)priv->cm_cur_read_lba,
 		priv->cm_left_to_read, blocks);
 
-	res = __scst_cm_push_single_read(ec_cmd, priv->cm_cur_read_lba, blocks);
+	/*
+	 * Computed now, because data descriptor can change before this READ
+	 * finishes.
+	 */
+	write_lba = priv->cm_cur_read_lba - priv->cm_start_read_lba;
+	write_lba <<= priv->cm_read_tgt_dev->dev->block_shift;
+	write_lba >>= priv->cm_write_tgt_dev->dev->block_shift;
+	write_lba += priv->cm_start_write_lba;
+
+	res = __scst_cm_push_single_read(ec_cmd, priv->cm_cur_read_lba, blocks,
+		write_lba);
 	if (res != 0)
 		goto out;
 
 	priv->cm_cur_read_lba += blocks;
 	priv->cm_left_to_read -= blocks;
+	priv->cm_reads_in_flight++;
 
 	if (inc_cur_in_flight) {
 		priv->cm_cur_in_flight++;
@@ -1321,62 +1397,80 @@ out:
 }
 
 /*
- * Generates original bunch of internal READ commands. In case of error
- * directly finishes ec_cmd, so it might be dead upon return!
+ * cm_mutex suppose to be locked.
+ *
+ * Starts new READ->WRITE chains while there is data to read and neither
+ * READs window, nor the total chains limit is reached. Number of started
+ * READs is added to *cnt. Returns 0 on success, -ENOENT, if there is
+ * nothing more to read, or other negative error code.
  */
-static void scst_cm_gen_reads(struct scst_cmd *ec_cmd)
+static int scst_cm_gen_more_reads(struct scst_cmd *ec_cmd, int *cnt)
 {
+	int res = 0;
 	struct scst_cm_ec_cmd_priv *priv = ec_cmd->cmd_data_descriptors;
-	int cnt = 0;
 
 	TRACE_ENTRY();
 
-	mutex_lock(&priv->cm_mutex);
+	while ((priv->cm_reads_in_flight < priv->cm_max_in_flight) &&
+	       (priv->cm_cur_in_flight < 2 * priv->cm_max_in_flight)) {
+		int blocks;
 
-	while (1) {
-		int rc;
+		if (priv->cm_left_to_read == 0) {
+			if (priv->cm_cur_data_descr >= priv->cm_data_descrs_cnt) {
+				res = -ENOENT;
+				break;
+			}
+			res = scst_cm_setup_next_data_descr(ec_cmd);
+			if (res != 0)
+				break;
+		}
 
-		while ((priv->cm_left_to_read > 0) &&
-		       (priv->cm_cur_in_flight < SCST_MAX_IN_FLIGHT_INTERNAL_COMMANDS)) {
-			int blocks;
+		blocks = min_t(int, priv->cm_left_to_read, priv->cm_max_each_read);
 
-			blocks = min_t(int, priv->cm_left_to_read, priv->cm_max_each_read);
+		res = scst_cm_push_single_read(ec_cmd, blocks, true);
+		if (res != 0)
+			break;
 
-			rc = scst_cm_push_single_read(ec_cmd, blocks, true);
-			if (rc != 0)
-				goto out_err;
+		(*cnt)++;
+	}
 
-			cnt++;
-		}
+	TRACE_DBG("ec_cmd %p, reads in flight %d, chains in flight %d (res %d)",
+		ec_cmd, priv->cm_reads_in_flight, priv->cm_cur_in_flight, res);
 
-		if (priv->cm_cur_in_flight == SCST_MAX_IN_FLIGHT_INTERNAL_COMMANDS)
-			break;
+	TRACE_EXIT_RES(res);
+	return res;
+}
 
-		rc = scst_cm_setup_next_data_descr(ec_cmd);
-		if (rc != 0)
-			goto out_err;
+/*
+ * Generates original bunch of internal READ commands. In case of error
+ * directly finishes ec_cmd, so it might be dead upon return!
+ */
+static void scst_cm_gen_reads(struct scst_cmd *ec_cmd)
+{
+	struct scst_cm_ec_cmd_priv *priv = ec_cmd->cmd_data_descriptors;
+	int cnt = 0;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&priv->cm_mutex);
+
+	scst_cm_gen_more_reads(ec_cmd, &cnt);
+
+	if (priv->cm_cur_in_flight == 0) {
+		mutex_unlock(&priv->cm_mutex);
+		scst_cm_ec_cmd_done(ec_cmd);
+		goto out;
 	}
 
 	EXTRACHECKS_BUG_ON(cnt == 0);
 
-out_wake:
-	if (cnt != 0)
-		wake_up(&priv->cm_read_tgt_dev->active_cmd_threads->cmd_list_waitQ);
+	wake_up(&priv->cm_read_tgt_dev->active_cmd_threads->cmd_list_waitQ);
 
 	mutex_unlock(&priv->cm_mutex);
 
 out:
 	TRACE_EXIT();
 	return;
-
-out_err:
-	if (priv->cm_cur_in_flight != 0)
-		goto out_wake;
-	else {
-		mutex_unlock(&priv->cm_mutex);
-		scst_cm_ec_cmd_done(ec_cmd);
-	}
-	goto out;
 }
 
 /* cm_mutex suppose to be locked or no activities on this ec_cmd's priv */
@@ -2809,6 +2903,12 @@ out:
 	return res;
 }
 
+/* scst_mutex supposed to be held */
+bool scst_cm_is_cm_acg(const struct scst_acg *acg)
+{
+	return acg == scst_cm_tgt->default_acg;
+}
+
 /* scst_mutex supposed to be held and activities suspended */
 bool scst_cm_on_del_lun(struct scst_acg_dev *acg_dev, bool gen_report_luns_changed)
 {
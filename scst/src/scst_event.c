@@ -10,6 +10,8 @@
 #include <linux/poll.h>
 #include <linux/stddef.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
 #include <linux/module.h>
 #ifndef INSIDE_KERNEL_TREE
 #include <linux/version.h>
@@ -32,9 +34,13 @@ static struct class *scst_event_sysfs_class;
 
 static int scst_event_major;
 
-#define SCST_MAX_EVENTS			2048
+/* Max number of allowed events per subscriber */
+#define SCST_MAX_ALLOWED_EVENTS		2048
 #define SCST_MAX_PAYLOAD		(3*1024)
 #define SCST_DEFAULT_EVENT_TIMEOUT	(60*HZ)
+/* Size of the per subscriber queue of events, must be a power of 2 */
+#define SCST_EVENT_RING_SIZE		(2*1024*1024)
+#define SCST_EVENT_HASH_SIZE		256
 
 struct scst_event_priv {
 	struct list_head privs_list_entry;
@@ -42,6 +48,13 @@ struct scst_event_priv {
 	int queued_events_cnt;
 	unsigned int going_to_exit:1;
 	unsigned int blocking:1;
+	unsigned int dropping:1;
+	/*
+	 * Set once the subscriber used SCST_EVENT_GET_NEXT_EVENTS, which
+	 * reports coalesced_cnt. Only then identical events are coalesced,
+	 * so SCST_EVENT_GET_NEXT_EVENT keeps getting each event.
+	 */
+	unsigned int batched:1;
 	pid_t owner_pid;
 	/*
 	 * WARNING: payloads in events in the allowed list queued AS IS from the
@@ -49,14 +62,37 @@ struct scst_event_priv {
 	 * way, except as BLOBs for comparison!
 	 */
 	struct list_head allowed_events_list;
-	struct list_head queued_events_list;
+
+	/*
+	 * Queued events, stored as struct scst_event_batch_entry one after
+	 * another. Positions only grow, the offset in the ring is position
+	 * modulo SCST_EVENT_RING_SIZE. An entry with zero entry_len marks the
+	 * unused end of the ring.
+	 */
+	uint8_t *ring;
+	uint64_t ring_head;
+	uint64_t ring_tail;
+	/* Position of the last queued event with the same hash */
+	uint64_t coalesce_hash[SCST_EVENT_HASH_SIZE];
+
 	wait_queue_head_t queued_events_waitQ;
+	/* Events with notify_fn waiting for SCST_EVENT_NOTIFY_DONE */
 	struct list_head processing_events_list;
+
+	uint64_t coalesced_cnt;
+	uint64_t dropped_cnt;
+	/* Not yet reported by SCST_EVENT_GET_NEXT_EVENTS */
+	uint32_t unreported_dropped_cnt;
 };
 
 static DEFINE_MUTEX(scst_event_mutex);
 static LIST_HEAD(scst_event_privs_list);
 
+/* Protected by scst_event_mutex */
+static uint64_t scst_event_queued_cnt;
+static uint64_t scst_event_coalesced_cnt;
+static uint64_t scst_event_dropped_cnt;
+
 /*
  * Compares events e1_wild and e2, where e1_wild can have wildcard matching,
  * i.e.:
@@ -120,8 +156,6 @@ static void scst_event_timeout_fn(struct work_struct *work)
 	}
 	list_del_init(&event_entry->events_list_entry);
 
-	(*event_entry->pqueued_events_cnt)--;
-
 	mutex_unlock(&scst_event_mutex);
 
 	TRACE_DBG("Calling notify_fn of event_entry %p", event_entry);
@@ -136,32 +170,192 @@ out:
 	return;
 }
 
-static int scst_clone_event(const struct scst_event_entry *orig_entry,
-	struct scst_event_entry **new_event_entry)
+static inline struct scst_event_batch_entry *scst_event_ring_entry(
+	struct scst_event_priv *priv, uint64_t pos)
+{
+	return (struct scst_event_batch_entry *)(priv->ring +
+		(pos & (SCST_EVENT_RING_SIZE - 1)));
+}
+
+static inline bool scst_event_ring_empty(const struct scst_event_priv *priv)
+{
+	return priv->ring_head == priv->ring_tail;
+}
+
+/* scst_event_mutex supposed to be held */
+static void scst_event_ring_pop(struct scst_event_priv *priv,
+	const struct scst_event_batch_entry *e)
+{
+	priv->ring_head += e->entry_len;
+	priv->queued_events_cnt--;
+	/* Report the next lost event again, once the queue is drained */
+	if (scst_event_ring_empty(priv))
+		priv->dropping = 0;
+	return;
+}
+
+/*
+ * scst_event_mutex supposed to be held. Returns true, if e is a copy of an
+ * event with notification, which has already timed out, i.e. its notify_fn
+ * was called and it isn't on processing_events_list anymore.
+ */
+static bool scst_event_timed_out(struct scst_event_priv *priv,
+	const struct scst_event_batch_entry *e)
 {
-	int res = 0;
-	const struct scst_event *event = &orig_entry->event;
 	struct scst_event_entry *event_entry;
-	int event_entry_len = sizeof(*event_entry) + event->payload_len;
 
-	TRACE_ENTRY();
+	/* Events with notification have non-zero event_id */
+	if (e->event.event_id == 0)
+		return false;
 
-	event_entry = kzalloc(event_entry_len, GFP_KERNEL);
-	if (event_entry == NULL) {
-		PRINT_ERROR("Unable to clone event entry (size %d, event %d, "
-			"issuer %s", event_entry_len, event->event_code,
-			event->issuer_name);
-		res = -ENOMEM;
+	list_for_each_entry(event_entry, &priv->processing_events_list,
+			events_list_entry) {
+		if (event_entry->event.event_id == e->event.event_id)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * scst_event_mutex supposed to be held. Returns the oldest queued event or
+ * NULL, if there are none. Timed out events are dropped on the way.
+ */
+static struct scst_event_batch_entry *scst_event_ring_head(
+	struct scst_event_priv *priv)
+{
+	struct scst_event_batch_entry *e;
+
+again:
+	e = NULL;
+	if (scst_event_ring_empty(priv))
 		goto out;
+
+	e = scst_event_ring_entry(priv, priv->ring_head);
+	if (e->entry_len == 0) {
+		/* The rest of the ring is unused, wrap around */
+		priv->ring_head = ALIGN(priv->ring_head + 1,
+			(uint64_t)SCST_EVENT_RING_SIZE);
+		EXTRACHECKS_BUG_ON(scst_event_ring_empty(priv));
+		e = scst_event_ring_entry(priv, priv->ring_head);
 	}
 
-	TRACE_MEM("event_entry %p (len %d) allocated", event_entry, event_entry_len);
+	if (scst_event_timed_out(priv, e)) {
+		TRACE_MGMT_DBG("Dropping timed out event %d (issuer %s, id %u, "
+			"priv %p)", e->event.event_code, e->event.issuer_name,
+			e->event.event_id, priv);
+		scst_event_ring_pop(priv, e);
+		goto again;
+	}
+
+out:
+	return e;
+}
+
+/*
+ * scst_event_mutex supposed to be held. Copies event to the tail of the
+ * ring. Returns the position of the copy or -ENOSPC, if the ring is full.
+ */
+static int64_t scst_event_ring_push(struct scst_event_priv *priv,
+	const struct scst_event *event)
+{
+	struct scst_event_batch_entry *e;
+	int event_len = sizeof(*event) + event->payload_len;
+	uint32_t len = ALIGN(offsetof(struct scst_event_batch_entry, event) +
+				event_len, 8);
+	uint32_t off = priv->ring_tail & (SCST_EVENT_RING_SIZE - 1);
+	uint32_t gap = 0;
+	uint64_t pos;
+
+	if (off + len > SCST_EVENT_RING_SIZE)
+		gap = SCST_EVENT_RING_SIZE - off;
+
+	if (priv->ring_tail - priv->ring_head + gap + len >
+	    SCST_EVENT_RING_SIZE)
+		return -ENOSPC;
+
+	pos = priv->ring_tail;
+	if (gap != 0) {
+		scst_event_ring_entry(priv, pos)->entry_len = 0;
+		pos += gap;
+	}
+
+	e = scst_event_ring_entry(priv, pos);
+	e->entry_len = len;
+	e->coalesced_cnt = 0;
+	memcpy(&e->event, event, event_len);
+	/* Don't leak previous events via the alignment padding */
+	memset((uint8_t *)&e->event + event_len, 0, len - event_len -
+		offsetof(struct scst_event_batch_entry, event));
+
+	priv->ring_tail = pos + len;
+	priv->queued_events_cnt++;
+
+	return pos;
+}
+
+static uint32_t scst_event_hash(const struct scst_event *event)
+{
+	uint32_t hash;
+
+	hash = jhash(event->issuer_name, strlen(event->issuer_name),
+		event->event_code);
+	return jhash(event->payload, event->payload_len, hash);
+}
 
-	memcpy(&event_entry->event, event, sizeof(*event) + event->payload_len);
+/*
+ * scst_event_mutex supposed to be held. Queues event to priv, unless an
+ * identical event is still waiting there and coalesce is true, in which
+ * case merges event into it.
+ */
+static int scst_event_ring_queue(struct scst_event_priv *priv,
+	const struct scst_event *event, uint32_t hash, bool coalesce)
+{
+	int res = 0;
+	uint64_t *last = &priv->coalesce_hash[hash % SCST_EVENT_HASH_SIZE];
+	struct scst_event_batch_entry *e;
+	int64_t pos;
 
-	WARN_ON(orig_entry->event_notify_fn != NULL);
+	TRACE_ENTRY();
+
+	if (coalesce && (*last >= priv->ring_head) &&
+	    (*last < priv->ring_tail)) {
+		e = scst_event_ring_entry(priv, *last);
+		/* Events with notification have non-zero event_id */
+		if ((e->event.event_id == 0) &&
+		    (e->event.event_code == event->event_code) &&
+		    (e->event.payload_len == event->payload_len) &&
+		    (strcmp(e->event.issuer_name, event->issuer_name) == 0) &&
+		    (memcmp(e->event.payload, event->payload,
+				event->payload_len) == 0)) {
+			TRACE_DBG("event %d (issuer %s) coalesced (priv %p, "
+				"cnt %u)", event->event_code,
+				event->issuer_name, priv, e->coalesced_cnt + 1);
+			e->coalesced_cnt++;
+			priv->coalesced_cnt++;
+			scst_event_coalesced_cnt++;
+			goto out;
+		}
+	}
+
+	pos = scst_event_ring_push(priv, event);
+	if (pos < 0) {
+		if (!priv->dropping)
+			PRINT_ERROR("Too many queued events %d for pid %d, "
+				"event %d, issuer %s is lost. Further lost "
+				"events are only counted in event_stats.",
+				priv->queued_events_cnt, priv->owner_pid,
+				event->event_code, event->issuer_name);
+		priv->dropping = 1;
+		priv->dropped_cnt++;
+		priv->unreported_dropped_cnt++;
+		scst_event_dropped_cnt++;
+		res = -EMFILE;
+		goto out;
+	}
 
-	*new_event_entry = event_entry;
+	scst_event_queued_cnt++;
+	if (coalesce)
+		*last = pos;
 
 out:
 	TRACE_EXIT_RES(res);
@@ -170,83 +364,74 @@ out:
 
 static void __scst_event_queue(struct scst_event_entry *event_entry)
 {
-	const struct scst_event *event = &event_entry->event;
+	struct scst_event *event = &event_entry->event;
 	struct scst_event_priv *priv;
 	struct scst_event_entry *allowed_entry;
+	bool notify = (event_entry->event_notify_fn != NULL);
 	bool queued = false;
+	uint32_t hash;
 	int rc = 0;
 	static atomic_t base_event_id = ATOMIC_INIT(0);
 
 	TRACE_ENTRY();
 
+	if (notify) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+		INIT_WORK(&event_entry->event_timeout_work,
+			  scst_event_timeout_fn, event_entry);
+#else
+		INIT_DELAYED_WORK(&event_entry->event_timeout_work,
+				  scst_event_timeout_fn);
+#endif
+		event->event_id = atomic_inc_return(&base_event_id);
+		if (event_entry->event_timeout == 0)
+			event_entry->event_timeout = SCST_DEFAULT_EVENT_TIMEOUT;
+	}
+
+	hash = scst_event_hash(event);
+
 	mutex_lock(&scst_event_mutex);
 
 	list_for_each_entry(priv, &scst_event_privs_list, privs_list_entry) {
 		list_for_each_entry(allowed_entry, &priv->allowed_events_list,
 				events_list_entry) {
-			if (scst_event_cmp(&allowed_entry->event, event)) {
-				struct scst_event_entry *new_event_entry;
-
-				if (priv->queued_events_cnt >= SCST_MAX_EVENTS) {
-					PRINT_ERROR("Too many queued events %d, "
-						"event %d, issuer %s is lost.",
-						priv->queued_events_cnt,
-						event->event_code,
-						event->issuer_name);
-					rc = -EMFILE;
-					break;
-				}
-
-				if (!queued)
-					new_event_entry = event_entry;
-				else if (event_entry->event_notify_fn == NULL) {
-					rc = scst_clone_event(event_entry, &new_event_entry);
-					if (rc != 0)
-						goto done;
-				} else {
-					PRINT_WARNING("Event %d can be queued only once, "
-						"dublicated receiver pid %d will miss it!",
-						event->event_code, priv->owner_pid);
-					break;
-				}
+			if (!scst_event_cmp(&allowed_entry->event, event))
+				continue;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
-				INIT_WORK(&new_event_entry->event_timeout_work,
-					  scst_event_timeout_fn,
-					  new_event_entry);
-#else
-				INIT_DELAYED_WORK(&new_event_entry->event_timeout_work,
-						  scst_event_timeout_fn);
-#endif
-				if (new_event_entry->event_notify_fn != NULL) {
-					new_event_entry->event.event_id = atomic_inc_return(&base_event_id);
-					if (new_event_entry->event_timeout == 0)
-						new_event_entry->event_timeout = SCST_DEFAULT_EVENT_TIMEOUT;
-					schedule_delayed_work(&new_event_entry->event_timeout_work,
-						new_event_entry->event_timeout);
-				}
-
-				list_add_tail(&new_event_entry->events_list_entry,
-					&priv->queued_events_list);
-				priv->queued_events_cnt++;
-				new_event_entry->pqueued_events_cnt = &priv->queued_events_cnt;
-				queued = true;
-
-				TRACE_DBG("event %d queued (issuer %s, id %u, "
-					"entry %p)", new_event_entry->event.event_code,
-					new_event_entry->event.issuer_name,
-					new_event_entry->event.event_id, new_event_entry);
-
-				wake_up_all(&priv->queued_events_waitQ);
+			if (notify && queued) {
+				PRINT_WARNING("Event %d can be queued only once, "
+					"dublicated receiver pid %d will miss it!",
+					event->event_code, priv->owner_pid);
 				break;
 			}
+
+			rc = scst_event_ring_queue(priv, event, hash,
+				!notify && priv->batched);
+			if (rc != 0)
+				break;
+
+			if (notify) {
+				/* Waits for notify done until it times out */
+				list_add_tail(&event_entry->events_list_entry,
+					&priv->processing_events_list);
+				schedule_delayed_work(&event_entry->event_timeout_work,
+					event_entry->event_timeout);
+			}
+			queued = true;
+
+			TRACE_DBG("event %d queued (issuer %s, id %u, "
+				"priv %p)", event->event_code,
+				event->issuer_name, event->event_id, priv);
+
+			wake_up_all(&priv->queued_events_waitQ);
+			break;
 		}
 	}
-done:
+
 	mutex_unlock(&scst_event_mutex);
 
 	if (!queued) {
-		if (event_entry->event_notify_fn != NULL) {
+		if (notify) {
 			if (rc == 0)
 				rc = -ENOENT;
 			TRACE_DBG("Calling notify_fn of event_entry %p (rc %d)",
@@ -257,6 +442,10 @@ done:
 
 		TRACE_MEM("Freeing orphan event entry %p", event_entry);
 		kfree(event_entry);
+	} else if (!notify) {
+		/* Copied to the subscribers' rings */
+		TRACE_MEM("Freeing queued event entry %p", event_entry);
+		kfree(event_entry);
 	}
 
 	TRACE_EXIT();
@@ -542,11 +731,6 @@ static int scst_event_release(struct inode *inode, struct file *file)
 	}
 
 	mutex_lock(&scst_event_mutex); /* to sync with timeout_work */
-	while (!list_empty(&priv->queued_events_list)) {
-		e = list_entry(priv->queued_events_list.next,
-				typeof(*e), events_list_entry);
-		scst_release_event_entry(e);
-	}
 	while (!list_empty(&priv->processing_events_list)) {
 		e = list_entry(priv->processing_events_list.next,
 				typeof(*e), events_list_entry);
@@ -554,7 +738,8 @@ static int scst_event_release(struct inode *inode, struct file *file)
 	}
 	mutex_unlock(&scst_event_mutex);
 
-	TRACE_MEM("Deleting priv %p", priv);
+	TRACE_MEM("Deleting priv %p (ring %p)", priv, priv->ring);
+	vfree(priv->ring);
 	kfree(priv);
 
 	module_put(THIS_MODULE);
@@ -652,7 +837,7 @@ static int scst_event_allow_event(struct scst_event_priv *priv, void __user *arg
 		}
 	}
 
-	if (priv->allowed_events_cnt >= SCST_MAX_EVENTS) {
+	if (priv->allowed_events_cnt >= SCST_MAX_ALLOWED_EVENTS) {
 		PRINT_ERROR("Too many allowed events %d",
 			priv->allowed_events_cnt);
 		res = -EMFILE;
@@ -718,28 +903,20 @@ out:
 	return res;
 }
 
-/* scst_event_mutex supposed to be held. Might drop it, then get back. */
-static int scst_event_user_next_event(struct scst_event_priv *priv,
-	void __user *arg)
+/*
+ * scst_event_mutex supposed to be held. Might drop it, then get back.
+ * Waits for at least one queued event, if blocking.
+ */
+static int scst_event_wait_events(struct scst_event_priv *priv)
 {
-	int res, rc;
-	int32_t max_event_size, needed_size;
-	struct scst_event_entry *event_entry;
-	struct scst_event_user __user *event_user = arg;
+	int res = 0;
 
 	TRACE_ENTRY();
 
-	res = get_user(max_event_size, (int32_t __user *)arg);
-	if (res != 0) {
-		PRINT_ERROR("Failed to get max event size: %d", res);
-		goto out;
-	};
-
-	/* Waiting for at least one event, if blocking */
-	while (list_empty(&priv->queued_events_list)) {
+	while (scst_event_ring_head(priv) == NULL) {
 		mutex_unlock(&scst_event_mutex);
 		wait_event_interruptible(priv->queued_events_waitQ,
-			(!list_empty(&priv->queued_events_list) || priv->going_to_exit ||
+			(!scst_event_ring_empty(priv) || priv->going_to_exit ||
 			 !priv->blocking || signal_pending(current)));
 		mutex_lock(&scst_event_mutex);
 		if (priv->going_to_exit || signal_pending(current)) {
@@ -747,19 +924,43 @@ static int scst_event_user_next_event(struct scst_event_priv *priv,
 			TRACE_DBG("Signal pending or going_to_exit (%d), returning",
 				priv->going_to_exit);
 			goto out;
-		} else if (list_empty(&priv->queued_events_list) && !priv->blocking) {
+		} else if ((scst_event_ring_head(priv) == NULL) &&
+			   !priv->blocking) {
 			res = -EAGAIN;
 			TRACE_DBG("Nothing pending, returning %d", res);
 			goto out;
 		}
 	}
 
-	EXTRACHECKS_BUG_ON(list_empty(&priv->queued_events_list));
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* scst_event_mutex supposed to be held. Might drop it, then get back. */
+static int scst_event_user_next_event(struct scst_event_priv *priv,
+	void __user *arg)
+{
+	int res, rc;
+	int32_t max_event_size, needed_size;
+	struct scst_event_batch_entry *e;
+	struct scst_event_user __user *event_user = arg;
+
+	TRACE_ENTRY();
 
-	event_entry = list_entry(priv->queued_events_list.next,
-			struct scst_event_entry, events_list_entry);
+	res = get_user(max_event_size, (int32_t __user *)arg);
+	if (res != 0) {
+		PRINT_ERROR("Failed to get max event size: %d", res);
+		goto out;
+	};
 
-	needed_size = sizeof(event_entry->event) + event_entry->event.payload_len;
+	res = scst_event_wait_events(priv);
+	if (res != 0)
+		goto out;
+
+	e = scst_event_ring_head(priv);
+
+	needed_size = sizeof(e->event) + e->event.payload_len;
 
 	if (needed_size > max_event_size) {
 		TRACE_DBG("Too big event (size %d, max size %d)", needed_size,
@@ -770,27 +971,97 @@ static int scst_event_user_next_event(struct scst_event_priv *priv,
 		goto out;
 	}
 
-	rc = copy_to_user(&event_user->out_event, &event_entry->event, needed_size);
+	rc = copy_to_user(&event_user->out_event, &e->event, needed_size);
 	if (rc != 0) {
 		PRINT_ERROR("Copy to user failed (%d)", rc);
 		res = -EFAULT;
 		goto out;
 	}
 
-	if (event_entry->event_notify_fn) {
-		TRACE_DBG("Moving event entry %p to processing events list",
-			event_entry);
-		list_move_tail(&event_entry->events_list_entry,
-			&priv->processing_events_list);
-	} else {
-		TRACE_MEM("Deleting event entry %p", event_entry);
-		list_del(&event_entry->events_list_entry);
-		kfree(event_entry);
+	scst_event_ring_pop(priv, e);
+
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* scst_event_mutex supposed to be held. Might drop it, then get back. */
+static int scst_event_user_next_events(struct scst_event_priv *priv,
+	void __user *arg)
+{
+	int res, rc;
+	struct scst_event_user_batch batch;
+	struct scst_event_batch_entry *e;
+	uint8_t __user *buf;
+	int32_t filled = 0;
+
+	TRACE_ENTRY();
+
+	rc = copy_from_user(&batch, arg, sizeof(batch));
+	if (rc != 0) {
+		PRINT_ERROR("Failed to copy %d user's bytes of events batch",
+			rc);
+		res = -EFAULT;
+		goto out;
 	}
 
-	priv->queued_events_cnt--;
+	if (batch.events_buf_len <= 0) {
+		PRINT_ERROR("Invalid events buffer size %d",
+			batch.events_buf_len);
+		res = -EINVAL;
+		goto out;
+	}
 
-	res = 0;
+	priv->batched = 1;
+
+	res = scst_event_wait_events(priv);
+	if (res != 0)
+		goto out;
+
+	buf = (uint8_t __user *)(unsigned long)batch.events_buf;
+	batch.events_cnt = 0;
+	batch.needed_len = 0;
+
+	while ((e = scst_event_ring_head(priv)) != NULL) {
+		if (e->entry_len > batch.events_buf_len - filled) {
+			if (batch.events_cnt == 0) {
+				TRACE_DBG("Too big event (size %d, buffer size "
+					"%d)", e->entry_len,
+					batch.events_buf_len);
+				batch.needed_len = e->entry_len;
+				res = -ENOSPC;
+			}
+			break;
+		}
+
+		rc = copy_to_user(buf + filled, e, e->entry_len);
+		if (rc != 0) {
+			PRINT_ERROR("Copy to user failed (%d)", rc);
+			res = -EFAULT;
+			goto out;
+		}
+
+		filled += e->entry_len;
+		batch.events_cnt++;
+		scst_event_ring_pop(priv, e);
+	}
+
+	batch.dropped_cnt = priv->unreported_dropped_cnt;
+
+	TRACE_DBG("%d events (%d bytes) returned, %d dropped (res %d)",
+		batch.events_cnt, filled, batch.dropped_cnt, res);
+
+	rc = copy_to_user(arg, &batch, sizeof(batch));
+	if (rc != 0) {
+		PRINT_ERROR("Copy to user failed (%d)", rc);
+		res = -EFAULT;
+		goto out;
+	}
+
+	if (res == 0)
+		priv->unreported_dropped_cnt = 0;
 
 out:
 	TRACE_EXIT_RES(res);
@@ -875,13 +1146,22 @@ static int scst_event_create_priv(struct file *file)
 		goto out_put;
 	}
 
-	TRACE_MEM("priv %p allocated", priv);
+	priv->ring = vmalloc(SCST_EVENT_RING_SIZE);
+	if (priv->ring == NULL) {
+		PRINT_ERROR("Unable to allocate events ring (size %d)",
+			SCST_EVENT_RING_SIZE);
+		res = -ENOMEM;
+		goto out_free;
+	}
+
+	TRACE_MEM("priv %p (ring %p) allocated", priv, priv->ring);
 
 	priv->owner_pid = current->pid;
 	INIT_LIST_HEAD(&priv->allowed_events_list);
 	init_waitqueue_head(&priv->queued_events_waitQ);
-	INIT_LIST_HEAD(&priv->queued_events_list);
 	INIT_LIST_HEAD(&priv->processing_events_list);
+	/* Never in [ring_head, ring_tail) */
+	memset(priv->coalesce_hash, 0xff, sizeof(priv->coalesce_hash));
 	if (file->f_flags & O_NONBLOCK) {
 		TRACE_DBG("%s", "Non-blocking operations");
 		priv->blocking = 0;
@@ -898,6 +1178,9 @@ out:
 	TRACE_EXIT_RES(res);
 	return res;
 
+out_free:
+	kfree(priv);
+
 out_put:
 	module_put(THIS_MODULE);
 	goto out;
@@ -947,6 +1230,11 @@ static long scst_event_ioctl(struct file *file, unsigned int cmd,
 		res = scst_event_user_next_event(priv, (void __user *)arg);
 		break;
 
+	case SCST_EVENT_GET_NEXT_EVENTS:
+		TRACE_DBG("%s", "GET_NEXT_EVENTS");
+		res = scst_event_user_next_events(priv, (void __user *)arg);
+		break;
+
 	case SCST_EVENT_NOTIFY_DONE:
 		TRACE_DBG("%s", "NOTIFY_DONE");
 		res = scst_event_user_notify_done(priv, (void __user *)arg);
@@ -981,7 +1269,7 @@ static unsigned int scst_event_poll(struct file *file, poll_table *wait)
 		goto out_unlock;
 	}
 
-	if (!list_empty(&priv->queued_events_list)) {
+	if (scst_event_ring_head(priv) != NULL) {
 		res |= POLLIN | POLLRDNORM;
 		goto out_unlock;
 	}
@@ -994,7 +1282,7 @@ static unsigned int scst_event_poll(struct file *file, poll_table *wait)
 
 	mutex_lock(&scst_event_mutex);
 
-	if (!list_empty(&priv->queued_events_list)) {
+	if (scst_event_ring_head(priv) != NULL) {
 		res |= POLLIN | POLLRDNORM;
 		goto out_unlock;
 	}
@@ -1006,6 +1294,44 @@ out_unlock:
 	return res;
 }
 
+void scst_event_stats_show(scst_show_fn show, void *arg)
+{
+	struct scst_event_priv *priv;
+
+	mutex_lock(&scst_event_mutex);
+
+	show(arg, "queued %llu\ncoalesced %llu\ndropped %llu\n",
+	     (unsigned long long int)scst_event_queued_cnt,
+	     (unsigned long long int)scst_event_coalesced_cnt,
+	     (unsigned long long int)scst_event_dropped_cnt);
+	list_for_each_entry(priv, &scst_event_privs_list, privs_list_entry)
+		show(arg, "pid %d pending %d coalesced %llu dropped %llu\n",
+		     priv->owner_pid, priv->queued_events_cnt,
+		     (unsigned long long int)priv->coalesced_cnt,
+		     (unsigned long long int)priv->dropped_cnt);
+
+	mutex_unlock(&scst_event_mutex);
+	return;
+}
+
+void scst_event_stats_reset(void)
+{
+	struct scst_event_priv *priv;
+
+	mutex_lock(&scst_event_mutex);
+
+	scst_event_queued_cnt = 0;
+	scst_event_coalesced_cnt = 0;
+	scst_event_dropped_cnt = 0;
+	list_for_each_entry(priv, &scst_event_privs_list, privs_list_entry) {
+		priv->coalesced_cnt = 0;
+		priv->dropped_cnt = 0;
+	}
+
+	mutex_unlock(&scst_event_mutex);
+	return;
+}
+
 #if 0
 #define CONFIG_EVENTS_WAIT_TEST
 #endif
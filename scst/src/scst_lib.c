@@ -30,6 +30,7 @@
 #include <linux/ctype.h>
 #include <linux/delay.h>
 #include <linux/vmalloc.h>
+#include <linux/random.h>
 #include <asm/kmap_types.h>
 #include <asm/unaligned.h>
 #include <asm/checksum.h>
@@ -2498,7 +2499,7 @@ struct scst_aen *scst_alloc_aen(struct scst_session *sess,
 	aen->sess = sess;
 	scst_sess_get(sess);
 
-	aen->lun = scst_pack_lun(unpacked_lun, sess->acg->addr_method);
+	aen->lun = scst_pack_lun(unpacked_lun, scst_sess_addr_method(sess));
 
 out:
 	TRACE_EXIT_HRES((unsigned long)aen);
@@ -2898,8 +2899,30 @@ void scst_dev_inquiry_data_changed(struct scst_device *dev)
 }
 EXPORT_SYMBOL(scst_dev_inquiry_data_changed);
 
-/* The activity supposed to be suspended and scst_mutex held */
-static void scst_check_reassign_sess(struct scst_session *sess)
+static int scst_tgt_devs_cmds(struct list_head *tgt_dev_list)
+{
+	struct scst_tgt_dev *tgt_dev;
+	int res = 0;
+
+	list_for_each_entry(tgt_dev, tgt_dev_list, extra_tgt_dev_list_entry)
+		res += atomic_read(&tgt_dev->tgt_dev_cmd_count);
+
+	return res;
+}
+
+static void scst_wait_for_tgt_devs(struct list_head *tgt_dev_list)
+{
+	while (scst_tgt_devs_cmds(tgt_dev_list) > 0)
+		mdelay(100);
+}
+
+/*
+ * scst_mutex supposed to be held. The tgt_devs removed from sess are added
+ * to tgt_dev_list and must be freed by the caller after all their commands
+ * finished.
+ */
+static void scst_check_reassign_sess(struct scst_session *sess,
+	struct list_head *tgt_dev_list)
 {
 	struct scst_acg *acg, *old_acg;
 	struct scst_acg_dev *acg_dev;
@@ -2927,8 +2950,13 @@ static void scst_check_reassign_sess(struct scst_session *sess)
 		"acg %s", sess, sess->initiator_name, sess->acg->acg_name,
 		acg->acg_name);
 
+	/*
+	 * sess->acg stays pointing to the old acg until all the new tgt_devs
+	 * are in place, because there can be commands being processed in
+	 * this session in parallel. They access sess->acg under RCU, see
+	 * scst_sess_addr_method().
+	 */
 	old_acg = sess->acg;
-	sess->acg = NULL; /* to catch implicit dependencies earlier */
 
 retry_add:
 	add_failed = false;
@@ -2956,7 +2984,8 @@ retry_add:
 					TRACE_MGMT_DBG("Replacing LUN %lld",
 						(long long)tgt_dev->lun);
 					scst_del_tgt_dev(tgt_dev);
-					scst_free_tgt_dev(tgt_dev);
+					list_add_tail(&tgt_dev->extra_tgt_dev_list_entry,
+						      tgt_dev_list);
 					inq_changed_ua_needed = 1;
 					break;
 				}
@@ -3000,7 +3029,8 @@ next:
 				luns_changed = true;
 				something_freed = true;
 				scst_del_tgt_dev(tgt_dev);
-				scst_free_tgt_dev(tgt_dev);
+				list_add_tail(&tgt_dev->extra_tgt_dev_list_entry,
+					      tgt_dev_list);
 			}
 		}
 	}
@@ -3011,7 +3041,7 @@ next:
 		goto retry_add;
 	}
 
-	sess->acg = acg;
+	rcu_assign_pointer(sess->acg, acg);
 
 	TRACE_DBG("Moving sess %p from acg %s to acg %s", sess,
 		old_acg->acg_name, acg->acg_name);
@@ -3053,13 +3083,24 @@ out:
 	return;
 }
 
-/* The activity supposed to be suspended and scst_mutex held */
+/*
+ * scst_mutex supposed to be held. The activity doesn't need to be suspended:
+ * only sessions, which ACG changes, are affected. If the tgt_devs removed from
+ * them still have commands in flight, scst_mutex is temporarily released
+ * while waiting for those commands to finish, like scst_acg_del_lun() does,
+ * so this function must be the last step of the caller's configuration
+ * change.
+ */
 void scst_check_reassign_sessions(void)
 {
 	struct scst_tgt_template *tgtt;
+	struct scst_tgt_dev *tgt_dev, *tt;
+	LIST_HEAD(tgt_dev_list);
 
 	TRACE_ENTRY();
 
+	lockdep_assert_held(&scst_mutex);
+
 	list_for_each_entry(tgtt, &scst_template_list, scst_template_list_entry) {
 		struct scst_tgt *tgt;
 
@@ -3068,11 +3109,22 @@ void scst_check_reassign_sessions(void)
 
 			list_for_each_entry(sess, &tgt->sess_list,
 						sess_list_entry) {
-				scst_check_reassign_sess(sess);
+				scst_check_reassign_sess(sess, &tgt_dev_list);
 			}
 		}
 	}
 
+	if (scst_tgt_devs_cmds(&tgt_dev_list) > 0) {
+		mutex_unlock(&scst_mutex);
+		scst_wait_for_tgt_devs(&tgt_dev_list);
+		mutex_lock(&scst_mutex);
+	}
+
+	list_for_each_entry_safe(tgt_dev, tt, &tgt_dev_list,
+				 extra_tgt_dev_list_entry) {
+		scst_free_tgt_dev(tgt_dev);
+	}
+
 	TRACE_EXIT();
 	return;
 }
@@ -4213,6 +4265,7 @@ int scst_alloc_device(gfp_t gfp_mask, int nodeid,
 #endif
 	scst_init_mem_lim(&dev->dev_mem_lim);
 	spin_lock_init(&dev->dev_lock);
+	INIT_LIST_HEAD(&dev->dev_list_entry);
 	INIT_LIST_HEAD(&dev->dev_exec_cmd_list);
 	INIT_LIST_HEAD(&dev->blocked_cmd_list);
 	INIT_LIST_HEAD(&dev->dev_tgt_dev_list);
@@ -4226,6 +4279,8 @@ int scst_alloc_device(gfp_t gfp_mask, int nodeid,
 	dev->dev_double_ua_possible = 1;
 	dev->queue_alg = SCST_QUEUE_ALG_1_UNRESTRICTED_REORDER;
 	dev->dev_numa_node_id = nodeid;
+	dev->ext_copy_max_io_size = SCST_EXT_COPY_DEF_IO_SIZE;
+	dev->ext_copy_max_in_flight = SCST_EXT_COPY_DEF_IN_FLIGHT;
 
 	scst_pr_init(dev);
 
@@ -4568,23 +4623,6 @@ out:
 	return acg_dev;
 }
 
-static int scst_tgt_devs_cmds(struct list_head *tgt_dev_list)
-{
-	struct scst_tgt_dev *tgt_dev;
-	int res = 0;
-
-	list_for_each_entry(tgt_dev, tgt_dev_list, extra_tgt_dev_list_entry)
-		res += atomic_read(&tgt_dev->tgt_dev_cmd_count);
-
-	return res;
-}
-
-static void scst_wait_for_tgt_devs(struct list_head *tgt_dev_list)
-{
-	while (scst_tgt_devs_cmds(tgt_dev_list) > 0)
-		mdelay(100);
-}
-
 int scst_acg_del_lun(struct scst_acg *acg, uint64_t lun,
 		     bool gen_report_luns_changed)
 {
@@ -4795,7 +4833,8 @@ static void scst_del_acg(struct scst_acg *acg)
 /*
  * scst_free_acg - free an ACG
  *
- * The caller must hold scst_mutex and activity must have been suspended.
+ * Called without any locks from the scst_release_acg_wq work, when the last
+ * reference to acg, including the ones of its sessions, is dropped.
  */
 static void scst_free_acg(struct scst_acg *acg)
 {
@@ -4827,10 +4866,16 @@ static void scst_free_acg(struct scst_acg *acg)
 		scst_free_acg_dev(acg_dev);
 	}
 
-	list_for_each_entry_safe(acn, acnt, &acg->acn_list, acn_list_entry) {
-		scst_free_acn(acn,
-			list_is_last(&acn->acn_list_entry, &acg->acn_list));
-	}
+	/*
+	 * acg is already deleted from its target and has no sessions, so no
+	 * session can be reassigned and scst_check_reassign_sessions(), which
+	 * needs scst_mutex, must not be called.
+	 */
+	list_for_each_entry_safe(acn, acnt, &acg->acn_list, acn_list_entry)
+		scst_free_acn(acn, false);
+
+	/* Wait for RCU readers of sess->acg of sessions moved out of acg */
+	synchronize_rcu();
 
 	kfree(acg->acg_name);
 	kfree(acg);
@@ -5302,9 +5347,11 @@ static __be16 scst_dif_crc_fn(const void *data, unsigned int len);
 static __be16 scst_dif_ip_fn(const void *data, unsigned int len);
 
 /*
- * scst_mutex supposed to be held, there must not be parallel activity in this
- * session. May be invoked from inside scst_check_reassign_sessions() which
- * means that sess->acg can be NULL.
+ * scst_mutex supposed to be held. Commands of sess can be processed in
+ * parallel, e.g. if invoked from scst_check_reassign_sess(), so the new
+ * tgt_dev is published in sess_tgt_dev_list by list_add_tail_rcu() only
+ * after it is fully initialized. sess->acg can then still point to the old
+ * ACG, so acg_dev->acg must be used instead.
  */
 static int scst_alloc_add_tgt_dev(struct scst_session *sess,
 	struct scst_acg_dev *acg_dev, struct scst_tgt_dev **out_tgt_dev)
@@ -5617,7 +5664,7 @@ void scst_sess_free_tgt_devs(struct scst_session *sess)
 }
 
 /* The activity supposed to be suspended and scst_mutex held */
-int scst_acg_add_acn(struct scst_acg *acg, const char *name)
+int scst_acg_add_acn(struct scst_acg *acg, const char *name, bool reassign)
 {
 	int res = 0;
 	struct scst_acn *acn;
@@ -5661,7 +5708,8 @@ out:
 	if (res == 0) {
 		PRINT_INFO("Added name %s to group %s (target %s)", name,
 			acg->acg_name, acg->tgt ? acg->tgt->tgt_name : "?");
-		scst_check_reassign_sessions();
+		if (reassign)
+			scst_check_reassign_sessions();
 	}
 
 	TRACE_EXIT_RES(res);
@@ -5675,7 +5723,7 @@ out_free:
 	goto out;
 }
 
-/* The activity supposed to be suspended and scst_mutex held */
+/* scst_mutex supposed to be held */
 static void scst_free_acn(struct scst_acn *acn, bool reassign)
 {
 	kfree(acn->name);
@@ -5685,7 +5733,7 @@ static void scst_free_acn(struct scst_acn *acn, bool reassign)
 		scst_check_reassign_sessions();
 }
 
-/* The activity supposed to be suspended and scst_mutex held */
+/* scst_mutex supposed to be held */
 void scst_del_free_acn(struct scst_acn *acn, bool reassign)
 {
 	TRACE_ENTRY();
@@ -5696,7 +5744,7 @@ void scst_del_free_acn(struct scst_acn *acn, bool reassign)
 	return;
 }
 
-/* The activity supposed to be suspended and scst_mutex held */
+/* scst_mutex supposed to be held */
 struct scst_acn *scst_find_acn(struct scst_acg *acg, const char *name)
 {
 	struct scst_acn *acn;
@@ -6001,18 +6049,12 @@ ssize_t scst_readv(struct file *file, const struct iovec *vec,
 }
 EXPORT_SYMBOL(scst_readv);
 
-/**
- * scst_writev - write a buffer to a file
- * @file: File to write to.
- * @vec:  Pointer to first element of struct iovec array.
- * @vlen: Number of elements of the iovec array.
- * @pos:  Position in @file where to start writing.
- *
- * Note: although @vec->iov_base has type void __user*, it points at kernel
- * data and not at data in user space.
+/*
+ * Writes a buffer to a file with RWF_* flags @flags. Before kernel 4.6
+ * vfs_writev() has no flags, so @flags must be 0 there.
  */
-ssize_t scst_writev(struct file *file, const struct iovec *vec,
-		    unsigned long vlen, loff_t *pos)
+static ssize_t __scst_writev(struct file *file, const struct iovec *vec,
+			     unsigned long vlen, loff_t *pos, int flags)
 {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
 	struct iovec iovstack[UIO_FASTIOV];
@@ -6025,20 +6067,70 @@ ssize_t scst_writev(struct file *file, const struct iovec *vec,
 	if (ret < 0)
 		return ret;
 	file_start_write(file);
-	ret = vfs_iter_write(file, &iter, pos, 0);
+	ret = vfs_iter_write(file, &iter, pos, (__force rwf_t)flags);
 	file_end_write(file);
 	kfree(iov);
 	return ret;
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0) ||	\
 	(defined(CONFIG_SUSE_KERNEL) &&			\
 	LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0))
-	return vfs_writev(file, (const struct iovec __user *)vec, vlen, pos, 0);
+	return vfs_writev(file, (const struct iovec __user *)vec, vlen, pos,
+			  flags);
 #else
+	WARN_ON_ONCE(flags != 0);
 	return vfs_writev(file, (const struct iovec __user *)vec, vlen, pos);
 #endif
 }
+
+/**
+ * scst_writev - write a buffer to a file
+ * @file: File to write to.
+ * @vec:  Pointer to first element of struct iovec array.
+ * @vlen: Number of elements of the iovec array.
+ * @pos:  Position in @file where to start writing.
+ *
+ * Note: although @vec->iov_base has type void __user*, it points at kernel
+ * data and not at data in user space.
+ */
+ssize_t scst_writev(struct file *file, const struct iovec *vec,
+		    unsigned long vlen, loff_t *pos)
+{
+	return __scst_writev(file, vec, vlen, pos, 0);
+}
 EXPORT_SYMBOL(scst_writev);
 
+/**
+ * scst_writev_dsync - write a buffer to a file and make it durable
+ * @file: File to write to.
+ * @vec:  Pointer to first element of struct iovec array.
+ * @vlen: Number of elements of the iovec array.
+ * @pos:  Position in @file where to start writing.
+ *
+ * The same as scst_writev(), but the written data is on stable storage
+ * when it returns, as if @file was opened with O_DSYNC. Since kernel 4.7
+ * it's done per I/O by RWF_DSYNC, so the filesystem can use FUA writes
+ * instead of flushing the underlying device. Older kernels sync the file.
+ */
+ssize_t scst_writev_dsync(struct file *file, const struct iovec *vec,
+			  unsigned long vlen, loff_t *pos)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+	return __scst_writev(file, vec, vlen, pos, (__force int)RWF_DSYNC);
+#else
+	ssize_t ret;
+	int rc;
+
+	ret = __scst_writev(file, vec, vlen, pos, 0);
+	if (ret > 0) {
+		rc = vfs_fsync(file, 1);
+		if (rc != 0)
+			ret = rc;
+	}
+	return ret;
+#endif
+}
+EXPORT_SYMBOL(scst_writev_dsync);
+
 struct scst_ws_sg_tail {
 	struct scatterlist *sg;
 	int sg_cnt;
@@ -7076,6 +7168,10 @@ struct scst_session *scst_alloc_session(struct scst_tgt *tgt, gfp_t gfp_mask,
 	}
 	spin_lock_init(&sess->sess_list_lock);
 	INIT_LIST_HEAD(&sess->sess_cmd_list);
+	for (i = 0; i < SESS_CMD_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&sess->sess_cmd_hash[i]);
+	spin_lock_init(&sess->sess_cmd_cache_lock);
+	INIT_LIST_HEAD(&sess->sess_cmd_cache_list);
 	sess->tgt = tgt;
 	INIT_LIST_HEAD(&sess->init_deferred_cmd_list);
 	INIT_LIST_HEAD(&sess->init_deferred_mcmd_list);
@@ -7112,6 +7208,8 @@ out_free:
 
 void scst_free_session(struct scst_session *sess)
 {
+	struct scst_cmd *cmd, *t;
+
 	TRACE_ENTRY();
 
 	mutex_lock(&scst_mutex);
@@ -7149,6 +7247,10 @@ void scst_free_session(struct scst_session *sess)
 	 */
 	mutex_unlock(&scst_mutex);
 
+	list_for_each_entry_safe(cmd, t, &sess->sess_cmd_cache_list,
+				 cmd_list_entry)
+		kmem_cache_free(scst_cmd_cachep, cmd);
+
 	kfree(sess->transport_id);
 	kfree(sess->initiator_name);
 	if (sess->sess_name != sess->initiator_name)
@@ -7379,16 +7481,157 @@ out_free:
 	goto out;
 }
 
+/*
+ * Allocates a new command for sess from the session's commands cache, if
+ * possible, or from the slab otherwise.
+ */
+struct scst_cmd *scst_sess_alloc_cmd(struct scst_session *sess,
+	const uint8_t *cdb, unsigned int cdb_len, gfp_t gfp_mask)
+{
+	struct scst_cmd *cmd = NULL;
+	unsigned long flags;
+	int rc;
+
+	TRACE_ENTRY();
+
+	if (sess->sess_cmd_cache_size == 0)
+		goto out_slab;
+
+	spin_lock_irqsave(&sess->sess_cmd_cache_lock, flags);
+	if (likely(!list_empty(&sess->sess_cmd_cache_list))) {
+		cmd = list_first_entry(&sess->sess_cmd_cache_list,
+				typeof(*cmd), cmd_list_entry);
+		list_del(&cmd->cmd_list_entry);
+		sess->sess_cmd_cache_cnt--;
+		sess->sess_cmd_cache_hits++;
+	} else
+		sess->sess_cmd_cache_misses++;
+	spin_unlock_irqrestore(&sess->sess_cmd_cache_lock, flags);
+
+	if (unlikely(cmd == NULL))
+		goto out_slab;
+
+	memset(cmd, 0, sizeof(*cmd));
+
+	rc = scst_pre_init_cmd(cmd, cdb, cdb_len, gfp_mask);
+	if (unlikely(rc != 0)) {
+		kmem_cache_free(scst_cmd_cachep, cmd);
+		cmd = NULL;
+	}
+
+out:
+	TRACE_EXIT();
+	return cmd;
+
+out_slab:
+	cmd = scst_alloc_cmd(cdb, cdb_len, gfp_mask);
+	goto out;
+}
+
+/*
+ * Returns true, if cmd was put in the commands cache of sess, false if the
+ * cache is full and cmd must be freed to the slab. No locks.
+ */
+static bool scst_sess_cache_cmd(struct scst_session *sess,
+	struct scst_cmd *cmd)
+{
+	bool res = false;
+	unsigned long flags;
+
+	if (sess->sess_cmd_cache_size == 0)
+		goto out;
+
+	spin_lock_irqsave(&sess->sess_cmd_cache_lock, flags);
+	if (sess->sess_cmd_cache_cnt < sess->sess_cmd_cache_size) {
+		list_add(&cmd->cmd_list_entry, &sess->sess_cmd_cache_list);
+		sess->sess_cmd_cache_cnt++;
+		res = true;
+	}
+	spin_unlock_irqrestore(&sess->sess_cmd_cache_lock, flags);
+
+out:
+	return res;
+}
+
+/**
+ * scst_sess_set_cmd_cache_size() - set size of the session's commands cache
+ * @sess:	SCST session
+ * @size:	new size of the cache, usually the session's queue depth.
+ *		0 disables the cache.
+ *
+ * Description:
+ *    Sets the maximum number of free commands the session keeps cached
+ *    for reuse by scst_rx_cmd() instead of allocating them from the slab
+ *    and preallocates them. The commands, which are above the new size,
+ *    are freed. Returns 0 on success or negative error code otherwise.
+ *    Not needed for target drivers, which preallocate their commands and
+ *    use scst_rx_cmd_prealloced().
+ *
+ *    Must be called from a process context.
+ */
+int scst_sess_set_cmd_cache_size(struct scst_session *sess, int size)
+{
+	int res = 0, cnt;
+	struct scst_cmd *cmd, *t;
+	LIST_HEAD(free_cmds);
+
+	TRACE_ENTRY();
+
+	if (size < 0) {
+		PRINT_ERROR("Invalid commands cache size %d (sess %p)", size,
+			sess);
+		res = -EINVAL;
+		goto out;
+	}
+
+	spin_lock_irq(&sess->sess_cmd_cache_lock);
+	sess->sess_cmd_cache_size = size;
+	while (sess->sess_cmd_cache_cnt > size) {
+		cmd = list_first_entry(&sess->sess_cmd_cache_list,
+				typeof(*cmd), cmd_list_entry);
+		list_move(&cmd->cmd_list_entry, &free_cmds);
+		sess->sess_cmd_cache_cnt--;
+	}
+	cnt = sess->sess_cmd_cache_cnt;
+	spin_unlock_irq(&sess->sess_cmd_cache_lock);
+
+	list_for_each_entry_safe(cmd, t, &free_cmds, cmd_list_entry)
+		kmem_cache_free(scst_cmd_cachep, cmd);
+
+	for (; cnt < size; cnt++) {
+		/* It will be zeroed when taken from the cache */
+		cmd = kmem_cache_alloc(scst_cmd_cachep, GFP_KERNEL);
+		if (cmd == NULL) {
+			PRINT_ERROR("Unable to preallocate %d commands "
+				"(sess %p)", size - cnt, sess);
+			res = -ENOMEM;
+			break;
+		}
+		if (!scst_sess_cache_cmd(sess, cmd)) {
+			/* Concurrently filled by freed commands */
+			kmem_cache_free(scst_cmd_cachep, cmd);
+			break;
+		}
+	}
+
+	TRACE_MGMT_DBG("Sess %p commands cache size %d", sess, size);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+EXPORT_SYMBOL(scst_sess_set_cmd_cache_size);
+
 static void scst_destroy_cmd(struct scst_cmd *cmd)
 {
+	struct scst_session *sess = cmd->sess;
 	bool pre_alloced = cmd->pre_alloced;
+	bool cacheable = !cmd->pre_alloced && !cmd->internal;
 
 	TRACE_ENTRY();
 
 	TRACE_DBG("Destroying cmd %p", cmd);
 
-	scst_sess_put(cmd->sess);
-
 	/*
 	 * At this point tgt_dev can be dead, but the pointer remains non-NULL
 	 */
@@ -7405,9 +7648,12 @@ static void scst_destroy_cmd(struct scst_cmd *cmd)
 
 	/* At this point cmd can be already freed! */
 
-	if (!pre_alloced)
+	if (!pre_alloced && !(cacheable && scst_sess_cache_cmd(sess, cmd)))
 		kmem_cache_free(scst_cmd_cachep, cmd);
 
+	/* Put sess last, because cmd could be put in its cache above */
+	scst_sess_put(sess);
+
 	TRACE_EXIT();
 	return;
 }
@@ -7615,6 +7861,7 @@ struct scst_mgmt_cmd *scst_alloc_mgmt_cmd(gfp_t gfp_mask)
 	memset(mcmd, 0, sizeof(*mcmd));
 
 	mcmd->status = SCST_MGMT_STATUS_SUCCESS;
+	mcmd->start_time = ktime_get();
 
 out:
 	TRACE_EXIT();
@@ -9146,12 +9393,105 @@ static __be16 scst_dif_ip_fn(const void *data, unsigned int len)
 	return (__force __be16)ip_compute_csum(data, len);
 }
 
+/*
+ * Returns guard tag of a block. Both guard functions are called directly,
+ * so the per-block loops below don't pay for an indirect (retpoline)
+ * call per block.
+ */
+static inline __be16 scst_dif_guard(__be16 (*crc_fn)(const void *buffer,
+	unsigned int len), const void *buf, unsigned int block_size)
+{
+	if (likely(crc_fn == scst_dif_crc_fn))
+		return scst_dif_crc_fn(buf, block_size);
+	else
+		return scst_dif_ip_fn(buf, block_size);
+}
+
+/*
+ * Generates PI tuples t for cnt consecutive blocks of buf. The reference
+ * tag starts from ref_tag and, if ref_inc set, is incremented per block.
+ */
+static void scst_dif_gen_tuples(__be16 (*crc_fn)(const void *buffer,
+	unsigned int len), const uint8_t *buf, int block_size,
+	struct t10_pi_tuple *t, int cnt, __be16 app_tag, uint32_t ref_tag,
+	bool ref_inc)
+{
+	int i;
+
+	if (ref_inc) {
+		for (i = 0; i < cnt; i++) {
+			t[i].app_tag = app_tag;
+			t[i].ref_tag = cpu_to_be32(ref_tag + i);
+		}
+	} else {
+		__be32 ref = cpu_to_be32(ref_tag);
+
+		for (i = 0; i < cnt; i++) {
+			t[i].app_tag = app_tag;
+			t[i].ref_tag = ref;
+		}
+	}
+
+	if (likely(crc_fn == scst_dif_crc_fn)) {
+		for (i = 0; i < cnt; i++, buf += block_size)
+			t[i].guard_tag = scst_dif_crc_fn(buf, block_size);
+	} else {
+		for (i = 0; i < cnt; i++, buf += block_size)
+			t[i].guard_tag = scst_dif_ip_fn(buf, block_size);
+	}
+	return;
+}
+
+/*
+ * Checks PI tuples t of cnt consecutive blocks of buf. Blocks with APP TAG
+ * 0xFFFF and, if type3 set, also REF TAG 0xFFFFFFFF are skipped. APP TAG
+ * is checked under app_tag_mask. The expected reference tag starts from
+ * ref_tag and, if ref_inc set, is incremented per block.
+ *
+ * Returns index of the first block that failed a check with the failed
+ * check in *failed or cnt, if all blocks passed.
+ */
+static int scst_dif_check_tuples(__be16 (*crc_fn)(const void *buffer,
+	unsigned int len), const uint8_t *buf, int block_size,
+	const struct t10_pi_tuple *t, int cnt, enum scst_dif_actions checks,
+	__be16 app_tag, __be16 app_tag_mask, uint32_t ref_tag, bool ref_inc,
+	bool type3, enum scst_dif_actions *failed)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++, buf += block_size) {
+		if ((t[i].app_tag == SCST_DIF_NO_CHECK_ALL_APP_TAG) &&
+		    (!type3 || (t[i].ref_tag == SCST_DIF_NO_CHECK_ALL_REF_TAG)))
+			continue;
+
+		if ((checks & SCST_DIF_CHECK_APP_TAG) &&
+		    ((t[i].app_tag & app_tag_mask) != app_tag)) {
+			*failed = SCST_DIF_CHECK_APP_TAG;
+			break;
+		}
+
+		if ((checks & SCST_DIF_CHECK_REF_TAG) &&
+		    (t[i].ref_tag != cpu_to_be32(ref_inc ? ref_tag + i : ref_tag))) {
+			*failed = SCST_DIF_CHECK_REF_TAG;
+			break;
+		}
+
+		if ((checks & SCST_DIF_CHECK_GUARD_TAG) &&
+		    (t[i].guard_tag != scst_dif_guard(crc_fn, buf, block_size))) {
+			*failed = SCST_DIF_CHECK_GUARD_TAG;
+			break;
+		}
+	}
+
+	return i;
+}
+
 static int scst_verify_dif_type1(struct scst_cmd *cmd)
 {
 	int res = 0;
 	struct scst_device *dev = cmd->dev;
 	enum scst_dif_actions checks = scst_get_dif_checks(cmd->cmd_dif_actions);
-	int len, tags_len = 0, tag_size = 1 << SCST_DIF_TAG_SHIFT;
+	int len, tags_len = 0;
 	struct scatterlist *tags_sg = NULL;
 	uint8_t *buf, *tags_buf = NULL;
 	const struct t10_pi_tuple *t = NULL; /* to silence compiler warning */
@@ -9177,12 +9517,19 @@ static int scst_verify_dif_type1(struct scst_cmd *cmd)
 
 	crc_fn = cmd->tgt_dev->tgt_dev_dif_crc_fn;
 
+	/* Skip CRC check for internal commands */
+	if (cmd->internal)
+		checks &= ~SCST_DIF_CHECK_GUARD_TAG;
+
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
 		uint8_t *cur_buf = buf;
+		int blocks = len >> block_shift;
+
+		while (blocks > 0) {
+			enum scst_dif_actions failed = SCST_DIF_ACTION_NONE;
+			int cnt, i;
 
-		for (i = 0; i < (len >> block_shift); i++) {
 			if (tags_buf == NULL) {
 				tags_buf = scst_get_dif_buf(cmd, &tags_sg, &tags_len);
 				EXTRACHECKS_BUG_ON(tags_len <= 0);
@@ -9192,14 +9539,18 @@ static int scst_verify_dif_type1(struct scst_cmd *cmd)
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
-			if (t->app_tag == SCST_DIF_NO_CHECK_ALL_APP_TAG) {
-				TRACE_DBG("Skipping tag %lld (cmd %p)",
-					(long long)lba, cmd);
-				goto next;
-			}
-
-			if (checks & SCST_DIF_CHECK_APP_TAG) {
-				if (t->app_tag != dev->dev_dif_static_app_tag) {
+			/* Check all blocks mapped by both buffers in one go */
+			cnt = min(blocks, tags_len >> SCST_DIF_TAG_SHIFT);
+			i = scst_dif_check_tuples(crc_fn, cur_buf, block_size, t,
+				cnt, checks, dev->dev_dif_static_app_tag,
+				cpu_to_be16(0xFFFF), lba & 0xFFFFFFFF, true, false,
+				&failed);
+			if (unlikely(i < cnt)) {
+				cur_buf += i << block_shift;
+				t += i;
+				lba += i;
+				switch (failed) {
+				case SCST_DIF_CHECK_APP_TAG:
 					PRINT_WARNING("APP TAG check failed, "
 						"expected 0x%x, seeing "
 						"0x%x (cmd %p (op %s), lba %lld, "
@@ -9209,13 +9560,8 @@ static int scst_verify_dif_type1(struct scst_cmd *cmd)
 					scst_dif_acc_app_check_failed_scst(cmd);
 					scst_set_cmd_error(cmd,
 						SCST_LOAD_SENSE(scst_logical_block_app_tag_check_failed));
-					res = -EIO;
-					goto out_put;
-				}
-			}
-
-			if (checks & SCST_DIF_CHECK_REF_TAG) {
-				if (t->ref_tag != cpu_to_be32(lba & 0xFFFFFFFF)) {
+					break;
+				case SCST_DIF_CHECK_REF_TAG:
 					PRINT_WARNING("REF TAG check failed, "
 						"expected 0x%x, seeing "
 						"0x%x (cmd %p (op %s), lba %lld, "
@@ -9225,37 +9571,30 @@ static int scst_verify_dif_type1(struct scst_cmd *cmd)
 					scst_dif_acc_ref_check_failed_scst(cmd);
 					scst_set_cmd_error(cmd,
 						SCST_LOAD_SENSE(scst_logical_block_ref_tag_check_failed));
-					res = -EIO;
-					goto out_put;
-				}
-			}
-
-			/* Skip CRC check for internal commands */
-			if ((checks & SCST_DIF_CHECK_GUARD_TAG) &&
-			    !cmd->internal) {
-				__be16 crc = crc_fn(cur_buf, block_size);
-
-				if (t->guard_tag != crc) {
+					break;
+				default:
 					PRINT_WARNING("GUARD TAG check failed, "
 						"expected 0x%x, seeing 0x%x "
 						"(cmd %p (op %s), lba %lld, "
-						"dev %s)", crc, t->guard_tag, cmd,
+						"dev %s)", scst_dif_guard(crc_fn, cur_buf,
+						block_size), t->guard_tag, cmd,
 						scst_get_opcode_name(cmd), (long long)lba,
 						dev->virt_name);
 					scst_dif_acc_guard_check_failed_scst(cmd);
 					scst_set_cmd_error(cmd,
 						SCST_LOAD_SENSE(scst_logical_block_guard_check_failed));
-					res = -EIO;
-					goto out_put;
+					break;
 				}
+				res = -EIO;
+				goto out_put;
 			}
 
-next:
-			cur_buf += dev->block_size;
-			lba++;
+			lba += cnt;
+			cur_buf += cnt << block_shift;
+			blocks -= cnt;
 
-			t++;
-			tags_len -= tag_size;
+			t += cnt;
+			tags_len -= cnt << SCST_DIF_TAG_SHIFT;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -9308,13 +9647,172 @@ static void scst_check_fail_guard_tag(struct scst_cmd *cmd)
 	}
 	return;
 }
+
+static void scst_dif_corrupt_tag(struct scst_cmd *cmd,
+	struct t10_pi_tuple *t, uint64_t lba)
+{
+	struct scst_device *dev = cmd->dev;
+
+	switch (cmd->cmd_corrupt_dif_tag) {
+	case 0:
+		break;
+	case 1:
+		if (lba == cmd->lba) {
+			if (cmd->cdb[1] & 0x80) {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting ref tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->ref_tag = cpu_to_be32(0xebfeedad);
+				scst_check_fail_ref_tag(cmd);
+			} else {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting guard tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->guard_tag = cpu_to_be16(0xebed);
+				scst_check_fail_guard_tag(cmd);
+			}
+		}
+		break;
+	case 2:
+		if (lba == (cmd->lba + 1)) {
+			if (cmd->cdb[1] & 0x80) {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting ref tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->ref_tag = cpu_to_be32(0xebfeedad);
+				scst_check_fail_ref_tag(cmd);
+			} else {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting guard tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->guard_tag = cpu_to_be16(0xebed);
+				scst_check_fail_guard_tag(cmd);
+			}
+		}
+		break;
+	case 3:
+		if (lba == (cmd->lba + 2)) {
+			if (cmd->cdb[1] & 0x80) {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting ref tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->ref_tag = cpu_to_be32(0xebfeedad);
+				scst_check_fail_ref_tag(cmd);
+			} else {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting guard tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->guard_tag = cpu_to_be16(0xebed);
+				scst_check_fail_guard_tag(cmd);
+			}
+		}
+		break;
+	case 4:
+		if (lba == (cmd->lba + ((cmd->data_len >> dev->block_shift) >> 1))) {
+			if (cmd->cdb[1] & 0x80) {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting ref tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->ref_tag = cpu_to_be32(0xebfeedad);
+				scst_check_fail_ref_tag(cmd);
+			} else {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting guard tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->guard_tag = cpu_to_be16(0xebed);
+				scst_check_fail_guard_tag(cmd);
+			}
+		}
+		break;
+	case 5:
+		if (lba == (cmd->lba + ((cmd->data_len >> dev->block_shift) - 3))) {
+			if (cmd->cdb[1] & 0x80) {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting ref tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->ref_tag = cpu_to_be32(0xebfeedad);
+				scst_check_fail_ref_tag(cmd);
+			} else {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting guard tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->guard_tag = cpu_to_be16(0xebed);
+				scst_check_fail_guard_tag(cmd);
+			}
+		}
+		break;
+	case 6:
+		if (lba == (cmd->lba + ((cmd->data_len >> dev->block_shift) - 2))) {
+			if (cmd->cdb[1] & 0x80) {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting ref tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->ref_tag = cpu_to_be32(0xebfeedad);
+				scst_check_fail_ref_tag(cmd);
+			} else {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting guard tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->guard_tag = cpu_to_be16(0xebed);
+				scst_check_fail_guard_tag(cmd);
+			}
+		}
+		break;
+	case 7:
+		if (lba == (cmd->lba + ((cmd->data_len >> dev->block_shift) - 1))) {
+			if (cmd->cdb[1] & 0x80) {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting ref tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->ref_tag = cpu_to_be32(0xebfeedad);
+				scst_check_fail_ref_tag(cmd);
+			} else {
+				TRACE(TRACE_SCSI|TRACE_MINOR,
+					"Corrupting guard tag at lba "
+					"%lld (case %d, cmd %p)",
+					(long long)lba,
+					cmd->cmd_corrupt_dif_tag, cmd);
+				t->guard_tag = cpu_to_be16(0xebed);
+				scst_check_fail_guard_tag(cmd);
+			}
+		}
+		break;
+	}
+	return;
+}
 #endif
 
 static int scst_generate_dif_type1(struct scst_cmd *cmd)
 {
 	int res = 0;
 	struct scst_device *dev = cmd->dev;
-	int len, tags_len = 0, tag_size = 1 << SCST_DIF_TAG_SHIFT;
+	int len, tags_len = 0;
 	struct scatterlist *tags_sg = NULL;
 	uint8_t *buf, *tags_buf = NULL;
 	struct t10_pi_tuple *t = NULL; /* to silence compiler warning */
@@ -9340,13 +9838,13 @@ static int scst_generate_dif_type1(struct scst_cmd *cmd)
 
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
 		uint8_t *cur_buf = buf;
+		int blocks = len >> block_shift;
 
 		TRACE_DBG("len %d", len);
 
-		for (i = 0; i < (len >> block_shift); i++) {
-			TRACE_DBG("lba %lld, tags_len %d", (long long)lba, tags_len);
+		while (blocks > 0) {
+			int cnt;
 
 			if (tags_buf == NULL) {
 				tags_buf = scst_get_dif_buf(cmd, &tags_sg, &tags_len);
@@ -9356,168 +9854,27 @@ static int scst_generate_dif_type1(struct scst_cmd *cmd)
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
-			t->app_tag = dev->dev_dif_static_app_tag;
-			t->ref_tag = cpu_to_be32(lba & 0xFFFFFFFF);
-			t->guard_tag = crc_fn(cur_buf, block_size);
+			/* Generate tags for all blocks mapped by both buffers */
+			cnt = min(blocks, tags_len >> SCST_DIF_TAG_SHIFT);
+			TRACE_DBG("cnt %d, tags_len %d", cnt, tags_len);
+			scst_dif_gen_tuples(crc_fn, cur_buf, block_size, t, cnt,
+				dev->dev_dif_static_app_tag, lba & 0xFFFFFFFF, true);
 
 #ifdef CONFIG_SCST_DIF_INJECT_CORRUPTED_TAGS
-			switch (cmd->cmd_corrupt_dif_tag) {
-			case 0:
-				break;
-			case 1:
-				if (lba == cmd->lba) {
-					if (cmd->cdb[1] & 0x80) {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting ref tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->ref_tag = cpu_to_be32(0xebfeedad);
-						scst_check_fail_ref_tag(cmd);
-					} else {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting guard tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->guard_tag = cpu_to_be16(0xebed);
-						scst_check_fail_guard_tag(cmd);
-					}
-				}
-				break;
-			case 2:
-				if (lba == (cmd->lba + 1)) {
-					if (cmd->cdb[1] & 0x80) {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting ref tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->ref_tag = cpu_to_be32(0xebfeedad);
-						scst_check_fail_ref_tag(cmd);
-					} else {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting guard tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->guard_tag = cpu_to_be16(0xebed);
-						scst_check_fail_guard_tag(cmd);
-					}
-				}
-				break;
-			case 3:
-				if (lba == (cmd->lba + 2)) {
-					if (cmd->cdb[1] & 0x80) {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting ref tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->ref_tag = cpu_to_be32(0xebfeedad);
-						scst_check_fail_ref_tag(cmd);
-					} else {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting guard tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->guard_tag = cpu_to_be16(0xebed);
-						scst_check_fail_guard_tag(cmd);
-					}
-				}
-				break;
-			case 4:
-				if (lba == (cmd->lba + ((cmd->data_len >> dev->block_shift) >> 1))) {
-					if (cmd->cdb[1] & 0x80) {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting ref tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->ref_tag = cpu_to_be32(0xebfeedad);
-						scst_check_fail_ref_tag(cmd);
-					} else {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting guard tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->guard_tag = cpu_to_be16(0xebed);
-						scst_check_fail_guard_tag(cmd);
-					}
-				}
-				break;
-			case 5:
-				if (lba == (cmd->lba + ((cmd->data_len >> dev->block_shift) - 3))) {
-					if (cmd->cdb[1] & 0x80) {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting ref tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->ref_tag = cpu_to_be32(0xebfeedad);
-						scst_check_fail_ref_tag(cmd);
-					} else {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting guard tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->guard_tag = cpu_to_be16(0xebed);
-						scst_check_fail_guard_tag(cmd);
-					}
-				}
-				break;
-			case 6:
-				if (lba == (cmd->lba + ((cmd->data_len >> dev->block_shift) - 2))) {
-					if (cmd->cdb[1] & 0x80) {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting ref tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->ref_tag = cpu_to_be32(0xebfeedad);
-						scst_check_fail_ref_tag(cmd);
-					} else {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting guard tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->guard_tag = cpu_to_be16(0xebed);
-						scst_check_fail_guard_tag(cmd);
-					}
-				}
-				break;
-			case 7:
-				if (lba == (cmd->lba + ((cmd->data_len >> dev->block_shift) - 1))) {
-					if (cmd->cdb[1] & 0x80) {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting ref tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->ref_tag = cpu_to_be32(0xebfeedad);
-						scst_check_fail_ref_tag(cmd);
-					} else {
-						TRACE(TRACE_SCSI|TRACE_MINOR,
-							"Corrupting guard tag at lba "
-							"%lld (case %d, cmd %p)",
-							(long long)lba,
-							cmd->cmd_corrupt_dif_tag, cmd);
-						t->guard_tag = cpu_to_be16(0xebed);
-						scst_check_fail_guard_tag(cmd);
-					}
-				}
-				break;
+			if (cmd->cmd_corrupt_dif_tag != 0) {
+				int i;
+
+				for (i = 0; i < cnt; i++)
+					scst_dif_corrupt_tag(cmd, &t[i], lba + i);
 			}
 #endif
-			cur_buf += dev->block_size;
-			lba++;
 
-			t++;
-			tags_len -= tag_size;
+			lba += cnt;
+			cur_buf += cnt << block_shift;
+			blocks -= cnt;
+
+			t += cnt;
+			tags_len -= cnt << SCST_DIF_TAG_SHIFT;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -9605,7 +9962,7 @@ static int scst_verify_dif_type2(struct scst_cmd *cmd)
 	int res = 0;
 	struct scst_device *dev = cmd->dev;
 	enum scst_dif_actions checks = scst_get_dif_checks(cmd->cmd_dif_actions);
-	int len, tags_len = 0, tag_size = 1 << SCST_DIF_TAG_SHIFT;
+	int len, tags_len = 0;
 	struct scatterlist *tags_sg = NULL;
 	uint8_t *buf, *tags_buf = NULL;
 	const struct t10_pi_tuple *t = NULL; /* to silence compiler warning */
@@ -9635,25 +9992,37 @@ static int scst_verify_dif_type2(struct scst_cmd *cmd)
 
 	crc_fn = cmd->tgt_dev->tgt_dev_dif_crc_fn;
 
+	/* Skip CRC check for internal commands */
+	if (cmd->internal)
+		checks &= ~SCST_DIF_CHECK_GUARD_TAG;
+
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
 		uint8_t *cur_buf = buf;
+		int blocks = len >> block_shift;
+
+		while (blocks > 0) {
+			enum scst_dif_actions failed = SCST_DIF_ACTION_NONE;
+			int cnt, i;
 
-		for (i = 0; i < (len >> block_shift); i++) {
 			if (tags_buf == NULL) {
 				tags_buf = scst_get_dif_buf(cmd, &tags_sg, &tags_len);
 				EXTRACHECKS_BUG_ON(tags_len <= 0);
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
-			if (t->app_tag == SCST_DIF_NO_CHECK_ALL_APP_TAG) {
-				TRACE_DBG("Skipping tag (cmd %p)", cmd);
-				goto next;
-			}
-
-			if (checks & SCST_DIF_CHECK_APP_TAG) {
-				if ((t->app_tag & app_tag_mask) != app_tag_masked) {
+			/* Check all blocks mapped by both buffers in one go */
+			cnt = min(blocks, tags_len >> SCST_DIF_TAG_SHIFT);
+			i = scst_dif_check_tuples(crc_fn, cur_buf, block_size, t,
+				cnt, checks, app_tag_masked, app_tag_mask, ref_tag,
+				true, false, &failed);
+			if (unlikely(i < cnt)) {
+				cur_buf += i << block_shift;
+				t += i;
+				lba += i;
+				ref_tag += i;
+				switch (failed) {
+				case SCST_DIF_CHECK_APP_TAG:
 					PRINT_WARNING("APP TAG check failed, "
 						"expected 0x%x, seeing "
 						"0x%x (cmd %p (op %s), dev %s)",
@@ -9662,13 +10031,8 @@ static int scst_verify_dif_type2(struct scst_cmd *cmd)
 					scst_dif_acc_app_check_failed_scst(cmd);
 					scst_set_cmd_error(cmd,
 						SCST_LOAD_SENSE(scst_logical_block_app_tag_check_failed));
-					res = -EIO;
-					goto out_put;
-				}
-			}
-
-			if (checks & SCST_DIF_CHECK_REF_TAG) {
-				if (t->ref_tag != cpu_to_be32(ref_tag)) {
+					break;
+				case SCST_DIF_CHECK_REF_TAG:
 					PRINT_WARNING("REF TAG check failed, "
 						"expected 0x%x, seeing "
 						"0x%x (cmd %p (op %s), dev %s)",
@@ -9678,38 +10042,31 @@ static int scst_verify_dif_type2(struct scst_cmd *cmd)
 					scst_dif_acc_ref_check_failed_scst(cmd);
 					scst_set_cmd_error(cmd,
 						SCST_LOAD_SENSE(scst_logical_block_ref_tag_check_failed));
-					res = -EIO;
-					goto out_put;
-				}
-			}
-
-			/* Skip CRC check for internal commands */
-			if ((checks & SCST_DIF_CHECK_GUARD_TAG) &&
-			    !cmd->internal) {
-				__be16 crc = crc_fn(cur_buf, block_size);
-
-				if (t->guard_tag != crc) {
+					break;
+				default:
 					PRINT_WARNING("GUARD TAG check failed, "
 						"expected 0x%x, seeing 0x%x "
 						"(cmd %p (op %s), lba %lld, "
-						"dev %s)", crc, t->guard_tag, cmd,
+						"dev %s)", scst_dif_guard(crc_fn, cur_buf,
+						block_size), t->guard_tag, cmd,
 						scst_get_opcode_name(cmd), (long long)lba,
 						dev->virt_name);
 					scst_dif_acc_guard_check_failed_scst(cmd);
 					scst_set_cmd_error(cmd,
 						SCST_LOAD_SENSE(scst_logical_block_guard_check_failed));
-					res = -EIO;
-					goto out_put;
+					break;
 				}
+				res = -EIO;
+				goto out_put;
 			}
 
-next:
-			cur_buf += dev->block_size;
-			lba++;
-			ref_tag++;
+			lba += cnt;
+			ref_tag += cnt;
+			cur_buf += cnt << block_shift;
+			blocks -= cnt;
 
-			t++;
-			tags_len -= tag_size;
+			t += cnt;
+			tags_len -= cnt << SCST_DIF_TAG_SHIFT;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -9736,7 +10093,7 @@ static int scst_generate_dif_type2(struct scst_cmd *cmd)
 {
 	int res = 0;
 	struct scst_device *dev = cmd->dev;
-	int len, tags_len = 0, tag_size = 1 << SCST_DIF_TAG_SHIFT;
+	int len, tags_len = 0;
 	struct scatterlist *tags_sg = NULL;
 	uint8_t *buf, *tags_buf = NULL;
 	struct t10_pi_tuple *t = NULL; /* to silence compiler warning */
@@ -9765,13 +10122,13 @@ static int scst_generate_dif_type2(struct scst_cmd *cmd)
 
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
 		uint8_t *cur_buf = buf;
+		int blocks = len >> block_shift;
 
 		TRACE_DBG("len %d", len);
 
-		for (i = 0; i < (len >> block_shift); i++) {
-			TRACE_DBG("tags_len %d", tags_len);
+		while (blocks > 0) {
+			int cnt;
 
 			if (tags_buf == NULL) {
 				tags_buf = scst_get_dif_buf(cmd, &tags_sg, &tags_len);
@@ -9781,15 +10138,18 @@ static int scst_generate_dif_type2(struct scst_cmd *cmd)
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
-			t->app_tag = app_tag_masked;
-			t->ref_tag = cpu_to_be32(ref_tag);
-			t->guard_tag = crc_fn(cur_buf, block_size);
+			/* Generate tags for all blocks mapped by both buffers */
+			cnt = min(blocks, tags_len >> SCST_DIF_TAG_SHIFT);
+			TRACE_DBG("cnt %d, tags_len %d", cnt, tags_len);
+			scst_dif_gen_tuples(crc_fn, cur_buf, block_size, t, cnt,
+				app_tag_masked, ref_tag, true);
 
-			cur_buf += dev->block_size;
-			ref_tag++;
+			ref_tag += cnt;
+			cur_buf += cnt << block_shift;
+			blocks -= cnt;
 
-			t++;
-			tags_len -= tag_size;
+			t += cnt;
+			tags_len -= cnt << SCST_DIF_TAG_SHIFT;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -9825,7 +10185,7 @@ static int scst_verify_dif_type3(struct scst_cmd *cmd)
 	int res = 0;
 	struct scst_device *dev = cmd->dev;
 	enum scst_dif_actions checks = scst_get_dif_checks(cmd->cmd_dif_actions);
-	int len, tags_len = 0, tag_size = 1 << SCST_DIF_TAG_SHIFT;
+	int len, tags_len = 0;
 	struct scatterlist *tags_sg = NULL;
 	uint8_t *buf, *tags_buf = NULL;
 	const struct t10_pi_tuple *t = NULL; /* to silence compiler warning */
@@ -9851,26 +10211,38 @@ static int scst_verify_dif_type3(struct scst_cmd *cmd)
 
 	crc_fn = cmd->tgt_dev->tgt_dev_dif_crc_fn;
 
+	/* Skip CRC check for internal commands */
+	if (cmd->internal)
+		checks &= ~SCST_DIF_CHECK_GUARD_TAG;
+
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
 		uint8_t *cur_buf = buf;
+		int blocks = len >> block_shift;
+
+		while (blocks > 0) {
+			enum scst_dif_actions failed = SCST_DIF_ACTION_NONE;
+			int cnt, i;
 
-		for (i = 0; i < (len >> block_shift); i++) {
 			if (tags_buf == NULL) {
 				tags_buf = scst_get_dif_buf(cmd, &tags_sg, &tags_len);
 				EXTRACHECKS_BUG_ON(tags_len <= 0);
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
-			if ((t->app_tag == SCST_DIF_NO_CHECK_ALL_APP_TAG) &&
-			    (t->ref_tag == SCST_DIF_NO_CHECK_ALL_REF_TAG)) {
-				TRACE_DBG("Skipping tag (cmd %p)", cmd);
-				goto next;
-			}
-
-			if (checks & SCST_DIF_CHECK_APP_TAG) {
-				if (t->app_tag != dev->dev_dif_static_app_tag) {
+			/* Check all blocks mapped by both buffers in one go */
+			cnt = min(blocks, tags_len >> SCST_DIF_TAG_SHIFT);
+			i = scst_dif_check_tuples(crc_fn, cur_buf, block_size, t,
+				cnt, checks, dev->dev_dif_static_app_tag,
+				cpu_to_be16(0xFFFF),
+				be32_to_cpu(dev->dev_dif_static_app_ref_tag), false,
+				true, &failed);
+			if (unlikely(i < cnt)) {
+				cur_buf += i << block_shift;
+				t += i;
+				lba += i;
+				switch (failed) {
+				case SCST_DIF_CHECK_APP_TAG:
 					PRINT_WARNING("APP TAG check failed, "
 						"expected 0x%x, seeing "
 						"0x%x (cmd %p (op %s), dev %s)",
@@ -9880,13 +10252,8 @@ static int scst_verify_dif_type3(struct scst_cmd *cmd)
 					scst_dif_acc_app_check_failed_scst(cmd);
 					scst_set_cmd_error(cmd,
 						SCST_LOAD_SENSE(scst_logical_block_app_tag_check_failed));
-					res = -EIO;
-					goto out_put;
-				}
-			}
-
-			if (checks & SCST_DIF_CHECK_REF_TAG) {
-				if (t->ref_tag != dev->dev_dif_static_app_ref_tag) {
+					break;
+				case SCST_DIF_CHECK_REF_TAG:
 					PRINT_WARNING("REF TAG check failed, "
 						"expected 0x%x, seeing "
 						"0x%x (cmd %p (op %s), dev %s)",
@@ -9896,37 +10263,30 @@ static int scst_verify_dif_type3(struct scst_cmd *cmd)
 					scst_dif_acc_ref_check_failed_scst(cmd);
 					scst_set_cmd_error(cmd,
 						SCST_LOAD_SENSE(scst_logical_block_ref_tag_check_failed));
-					res = -EIO;
-					goto out_put;
-				}
-			}
-
-			/* Skip CRC check for internal commands */
-			if ((checks & SCST_DIF_CHECK_GUARD_TAG) &&
-			    !cmd->internal) {
-				__be16 crc = crc_fn(cur_buf, block_size);
-
-				if (t->guard_tag != crc) {
+					break;
+				default:
 					PRINT_WARNING("GUARD TAG check failed, "
 						"expected 0x%x, seeing 0x%x "
 						"(cmd %p (op %s), lba %lld, "
-						"dev %s)", crc, t->guard_tag, cmd,
+						"dev %s)", scst_dif_guard(crc_fn, cur_buf,
+						block_size), t->guard_tag, cmd,
 						scst_get_opcode_name(cmd), (long long)lba,
 						dev->virt_name);
 					scst_dif_acc_guard_check_failed_scst(cmd);
 					scst_set_cmd_error(cmd,
 						SCST_LOAD_SENSE(scst_logical_block_guard_check_failed));
-					res = -EIO;
-					goto out_put;
+					break;
 				}
+				res = -EIO;
+				goto out_put;
 			}
 
-next:
-			cur_buf += dev->block_size;
-			lba++;
+			lba += cnt;
+			cur_buf += cnt << block_shift;
+			blocks -= cnt;
 
-			t++;
-			tags_len -= tag_size;
+			t += cnt;
+			tags_len -= cnt << SCST_DIF_TAG_SHIFT;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -9953,7 +10313,7 @@ static int scst_generate_dif_type3(struct scst_cmd *cmd)
 {
 	int res = 0;
 	struct scst_device *dev = cmd->dev;
-	int len, tags_len = 0, tag_size = 1 << SCST_DIF_TAG_SHIFT;
+	int len, tags_len = 0;
 	struct scatterlist *tags_sg = NULL;
 	uint8_t *buf, *tags_buf = NULL;
 	struct t10_pi_tuple *t = NULL; /* to silence compiler warning */
@@ -9978,13 +10338,13 @@ static int scst_generate_dif_type3(struct scst_cmd *cmd)
 
 	len = scst_get_buf_first(cmd, &buf);
 	while (len > 0) {
-		int i;
 		uint8_t *cur_buf = buf;
+		int blocks = len >> block_shift;
 
 		TRACE_DBG("len %d", len);
 
-		for (i = 0; i < (len >> block_shift); i++) {
-			TRACE_DBG("tags_len %d", tags_len);
+		while (blocks > 0) {
+			int cnt;
 
 			if (tags_buf == NULL) {
 				tags_buf = scst_get_dif_buf(cmd, &tags_sg, &tags_len);
@@ -9994,14 +10354,18 @@ static int scst_generate_dif_type3(struct scst_cmd *cmd)
 				t = (struct t10_pi_tuple *)tags_buf;
 			}
 
-			t->app_tag = dev->dev_dif_static_app_tag;
-			t->ref_tag = dev->dev_dif_static_app_ref_tag;
-			t->guard_tag = crc_fn(cur_buf, block_size);
+			/* Generate tags for all blocks mapped by both buffers */
+			cnt = min(blocks, tags_len >> SCST_DIF_TAG_SHIFT);
+			TRACE_DBG("cnt %d, tags_len %d", cnt, tags_len);
+			scst_dif_gen_tuples(crc_fn, cur_buf, block_size, t, cnt,
+				dev->dev_dif_static_app_tag,
+				be32_to_cpu(dev->dev_dif_static_app_ref_tag), false);
 
-			cur_buf += dev->block_size;
+			cur_buf += cnt << block_shift;
+			blocks -= cnt;
 
-			t++;
-			tags_len -= tag_size;
+			t += cnt;
+			tags_len -= cnt << SCST_DIF_TAG_SHIFT;
 			if (tags_len == 0) {
 				scst_put_dif_buf(cmd, tags_buf);
 				tags_buf = NULL;
@@ -15395,10 +15759,169 @@ static void __init scst_scsi_op_list_init(void)
 	return;
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 31) || \
+	defined(RHEL_MAJOR) && RHEL_MAJOR -0 <= 5
+static int dif_selftest;
+#else
+static bool dif_selftest;
+#endif
+module_param(dif_selftest, bool, 0444);
+MODULE_PARM_DESC(dif_selftest,
+		 "Runs a DIF tags generation and verification self-test and "
+		 "benchmark on load.");
+
+#define SCST_DIF_SELFTEST_BUF_SIZE	(1024 * 1024)
+#define SCST_DIF_SELFTEST_ITERS		64
+
+/* Returns throughput in MB/s of iters passes over size bytes in ns */
+static unsigned long __init scst_dif_selftest_mbs(int iters, int size, s64 ns)
+{
+	return ns > 0 ? div64_u64((u64)iters * size * 1000, ns) : 0;
+}
+
+static int __init scst_dif_selftest_one(uint8_t *buf,
+	struct t10_pi_tuple *t, int type, bool ip_guard, int block_size)
+{
+	__be16 (*crc_fn)(const void *buffer, unsigned int len) =
+		ip_guard ? scst_dif_ip_fn : scst_dif_crc_fn;
+	int cnt = SCST_DIF_SELFTEST_BUF_SIZE / block_size;
+	enum scst_dif_actions checks = SCST_DIF_CHECK_GUARD_TAG |
+		SCST_DIF_CHECK_APP_TAG | SCST_DIF_CHECK_REF_TAG;
+	enum scst_dif_actions failed = SCST_DIF_ACTION_NONE;
+	__be16 app_tag = cpu_to_be16(0x1234);
+	uint32_t ref_tag = 0x10000 - cnt / 2; /* cross 16-bit boundary */
+	bool ref_inc = (type != 3);
+	unsigned long gen_mbs, check_mbs;
+	ktime_t start;
+	s64 gen_ns, check_ns;
+	int i, res = 0;
+
+	scst_dif_gen_tuples(crc_fn, buf, block_size, t, cnt, app_tag,
+		ref_tag, ref_inc);
+	i = scst_dif_check_tuples(crc_fn, buf, block_size, t, cnt, checks,
+		app_tag, cpu_to_be16(0xFFFF), ref_tag, ref_inc, type == 3,
+		&failed);
+	if (i != cnt) {
+		PRINT_ERROR("DIF self-test: type %d, %s guard, block size %d: "
+			"check %d of good block %d failed", type,
+			ip_guard ? "IP" : "CRC", block_size, failed, i);
+		res = -EINVAL;
+		goto out;
+	}
+
+	/* A single flipped bit must be detected by both guards */
+	buf[(cnt - 1) * block_size + 7] ^= 0x10;
+	i = scst_dif_check_tuples(crc_fn, buf, block_size, t, cnt, checks,
+		app_tag, cpu_to_be16(0xFFFF), ref_tag, ref_inc, type == 3,
+		&failed);
+	buf[(cnt - 1) * block_size + 7] ^= 0x10;
+	if ((i != cnt - 1) || (failed != SCST_DIF_CHECK_GUARD_TAG)) {
+		PRINT_ERROR("DIF self-test: type %d, %s guard, block size %d: "
+			"corrupted block %d not detected (%d, %d)", type,
+			ip_guard ? "IP" : "CRC", block_size, cnt - 1, i, failed);
+		res = -EINVAL;
+		goto out;
+	}
+
+	start = ktime_get();
+	for (i = 0; i < SCST_DIF_SELFTEST_ITERS; i++) {
+		scst_dif_gen_tuples(crc_fn, buf, block_size, t, cnt, app_tag,
+			ref_tag, ref_inc);
+		cond_resched();
+	}
+	gen_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < SCST_DIF_SELFTEST_ITERS; i++) {
+		scst_dif_check_tuples(crc_fn, buf, block_size, t, cnt, checks,
+			app_tag, cpu_to_be16(0xFFFF), ref_tag, ref_inc,
+			type == 3, &failed);
+		cond_resched();
+	}
+	check_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	gen_mbs = scst_dif_selftest_mbs(SCST_DIF_SELFTEST_ITERS,
+			SCST_DIF_SELFTEST_BUF_SIZE, gen_ns);
+	check_mbs = scst_dif_selftest_mbs(SCST_DIF_SELFTEST_ITERS,
+			SCST_DIF_SELFTEST_BUF_SIZE, check_ns);
+
+	PRINT_INFO("DIF type %d, %s guard, block size %d: generate %lu MB/s, "
+		"verify %lu MB/s (single core)", type, ip_guard ? "IP" : "CRC",
+		block_size, gen_mbs, check_mbs);
+
+out:
+	return res;
+}
+
+/*
+ * Verifies that DIF tags generated for a buffer pass verification and
+ * that corrupted data is detected, then measures single core throughput
+ * of DIF tags generation and verification for each DIF type and guard.
+ */
+static int __init scst_dif_run_selftest(void)
+{
+	static const int block_sizes[] = { 512, 4096 };
+	struct t10_pi_tuple *t;
+	uint8_t *buf;
+	int res, type, g, b;
+
+	TRACE_ENTRY();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
+	/* Check value of CRC-16/T10-DIF */
+	if (scst_dif_crc_fn("123456789", 9) != cpu_to_be16(0xD0DB)) {
+		PRINT_ERROR("DIF self-test: wrong CRC 0x%x",
+			be16_to_cpu(scst_dif_crc_fn("123456789", 9)));
+		res = -EINVAL;
+		goto out;
+	}
+#endif
+
+	buf = vmalloc(SCST_DIF_SELFTEST_BUF_SIZE);
+	t = vmalloc((SCST_DIF_SELFTEST_BUF_SIZE / 512) * sizeof(*t));
+	if ((buf == NULL) || (t == NULL)) {
+		res = -ENOMEM;
+		goto out_free;
+	}
+
+	get_random_bytes(buf, SCST_DIF_SELFTEST_BUF_SIZE);
+
+	for (type = 1; type <= 3; type++) {
+		for (g = 0; g < 2; g++) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 27)
+			if (g == 0)
+				continue;
+#endif
+			for (b = 0; b < ARRAY_SIZE(block_sizes); b++) {
+				res = scst_dif_selftest_one(buf, t, type, g != 0,
+					block_sizes[b]);
+				if (res != 0)
+					goto out_free;
+			}
+		}
+	}
+
+	PRINT_INFO("%s", "DIF self-test passed");
+
+out_free:
+	vfree(t);
+	vfree(buf);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 int __init scst_lib_init(void)
 {
 	int res = 0;
 
+	if (dif_selftest) {
+		res = scst_dif_run_selftest();
+		if (res != 0)
+			goto out;
+	}
+
 	scst_scsi_op_list_init();
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30)
@@ -15411,9 +15934,9 @@ int __init scst_lib_init(void)
 		res = -ENOMEM;
 		goto out;
 	}
+#endif
 
 out:
-#endif
 	TRACE_EXIT_RES(res);
 	return res;
 }
@@ -858,6 +858,74 @@ void scst_trace_mcmds(scst_show_fn show, void *arg)
 	return;
 }
 
+/*
+ * TM functions processing latency histogram. Bucket i counts mcmds finished
+ * in less than scst_tm_lat_limits_us[i], the last one counts the rest.
+ * Protected by scst_mcmd_lock.
+ */
+static const unsigned int scst_tm_lat_limits_us[] = {
+	100, 1000, 10000, 100000, 1000000, 10000000,
+};
+#define SCST_TM_LAT_BUCKETS	(ARRAY_SIZE(scst_tm_lat_limits_us) + 1)
+static unsigned long scst_tm_lat_hist[ARRAY_SIZE(scst_tm_fn_name)]
+				      [SCST_TM_LAT_BUCKETS];
+static uint64_t scst_tm_lat_max_us[ARRAY_SIZE(scst_tm_fn_name)];
+
+void scst_tm_lat_account(const struct scst_mgmt_cmd *mcmd)
+{
+	uint64_t lat_us;
+	int i;
+
+	if (mcmd->fn >= ARRAY_SIZE(scst_tm_fn_name))
+		return;
+
+	lat_us = ktime_to_ns(ktime_sub(ktime_get(), mcmd->start_time));
+	do_div(lat_us, 1000);
+
+	for (i = 0; i < ARRAY_SIZE(scst_tm_lat_limits_us); i++)
+		if (lat_us < scst_tm_lat_limits_us[i])
+			break;
+
+	spin_lock_irq(&scst_mcmd_lock);
+	scst_tm_lat_hist[mcmd->fn][i]++;
+	if (lat_us > scst_tm_lat_max_us[mcmd->fn])
+		scst_tm_lat_max_us[mcmd->fn] = lat_us;
+	spin_unlock_irq(&scst_mcmd_lock);
+	return;
+}
+
+void scst_tm_lat_show(scst_show_fn show, void *arg)
+{
+	int fn, i;
+
+	show(arg, "%-22s", "fn");
+	for (i = 0; i < ARRAY_SIZE(scst_tm_lat_limits_us); i++)
+		show(arg, " <%-8u", scst_tm_lat_limits_us[i]);
+	show(arg, " >=%-7u %s\n",
+	     scst_tm_lat_limits_us[ARRAY_SIZE(scst_tm_lat_limits_us) - 1],
+	     "max (us)");
+
+	spin_lock_irq(&scst_mcmd_lock);
+	for (fn = 0; fn < ARRAY_SIZE(scst_tm_fn_name); fn++) {
+		show(arg, "%-22s", scst_tm_fn_name[fn]);
+		for (i = 0; i < SCST_TM_LAT_BUCKETS; i++)
+			show(arg, " %-9lu", scst_tm_lat_hist[fn][i]);
+		show(arg, " %llu\n",
+		     (unsigned long long int)scst_tm_lat_max_us[fn]);
+	}
+	spin_unlock_irq(&scst_mcmd_lock);
+	return;
+}
+
+void scst_tm_lat_reset(void)
+{
+	spin_lock_irq(&scst_mcmd_lock);
+	memset(scst_tm_lat_hist, 0, sizeof(scst_tm_lat_hist));
+	memset(scst_tm_lat_max_us, 0, sizeof(scst_tm_lat_max_us));
+	spin_unlock_irq(&scst_mcmd_lock);
+	return;
+}
+
 static void __printf(2, 3) scst_to_syslog(void *arg, const char *fmt, ...)
 {
 	bool *header_printed = arg;
@@ -1416,10 +1484,12 @@ int scst_register_virtual_device_node(struct scst_dev_type *dev_handler,
 {
 	int res;
 	struct scst_device *dev, *d;
-	bool sysfs_del = false;
+	ktime_t start, prepared, published;
 
 	TRACE_ENTRY();
 
+	start = ktime_get();
+
 	if (dev_handler == NULL) {
 		PRINT_ERROR("%s: valid device handler must be supplied",
 			    __func__);
@@ -1441,17 +1511,9 @@ int scst_register_virtual_device_node(struct scst_dev_type *dev_handler,
 	if (res != 0)
 		goto out;
 
-	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
-	if (res != 0)
-		goto out;
-
-	res = mutex_lock_interruptible(&scst_mutex);
-	if (res != 0)
-		goto out_resume;
-
 	res = scst_alloc_device(GFP_KERNEL, nodeid, &dev);
 	if (res != 0)
-		goto out_unlock;
+		goto out;
 
 	dev->type = dev_handler->type;
 	dev->scsi_dev = NULL;
@@ -1463,6 +1525,10 @@ int scst_register_virtual_device_node(struct scst_dev_type *dev_handler,
 		goto out_free_dev;
 	}
 
+	res = mutex_lock_interruptible(&scst_mutex);
+	if (res != 0)
+		goto out_free_dev;
+
 	while (1) {
 		dev->virt_id = scst_virt_dev_last_id++;
 		if (dev->virt_id > 0)
@@ -1470,6 +1536,18 @@ int scst_register_virtual_device_node(struct scst_dev_type *dev_handler,
 		scst_virt_dev_last_id = 1;
 	}
 
+	mutex_unlock(&scst_mutex);
+
+	/*
+	 * Until the dev is added in scst_dev_list it "doesn't exist" for
+	 * the rest of SCST, so the PR file load and the sysfs setup below
+	 * need neither scst_mutex, nor suspended activities. This allows
+	 * them to run for several devices in parallel. The dev handler's
+	 * attach() and the publish are still serialized, because attach()
+	 * and detach() are called under scst_mutex with suspended
+	 * activities.
+	 */
+
 	res = scst_pr_set_file_name(dev, NULL, "%s/%s", SCST_PR_DIR,
 				    dev->virt_name);
 	if (res != 0)
@@ -1480,33 +1558,32 @@ int scst_register_virtual_device_node(struct scst_dev_type *dev_handler,
 		goto out_free_dev;
 
 #ifndef CONFIG_SCST_PROC
-	/*
-	 * We can drop scst_mutex, because we have not yet added the dev in
-	 * scst_dev_list, so it "doesn't exist" yet.
-	 */
-	mutex_unlock(&scst_mutex);
-
 	res = scst_dev_sysfs_create(dev);
 	if (res != 0)
-		goto out_lock_pr_clear_dev;
-
-	mutex_lock(&scst_mutex);
+		goto out_pr_clear_dev;
 #endif
 
+	prepared = ktime_get();
+
+	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+	if (res != 0)
+		goto out_sysfs_del;
+
+	res = mutex_lock_interruptible(&scst_mutex);
+	if (res != 0)
+		goto out_resume;
+
 	list_for_each_entry(d, &scst_dev_list, dev_list_entry) {
 		if (strcmp(d->virt_name, dev_name) == 0) {
 			PRINT_ERROR("Device %s already exists", dev_name);
 			res = -EEXIST;
-			sysfs_del = true;
-			goto out_pr_clear_dev;
+			goto out_unlock;
 		}
 	}
 
 	res = scst_assign_dev_handler(dev, dev_handler);
-	if (res != 0) {
-		sysfs_del = true;
-		goto out_pr_clear_dev;
-	}
+	if (res != 0)
+		goto out_unlock;
 
 	list_add_tail(&dev->dev_list_entry, &scst_dev_list);
 
@@ -1517,39 +1594,42 @@ int scst_register_virtual_device_node(struct scst_dev_type *dev_handler,
 	mutex_unlock(&scst_mutex);
 	scst_resume_activity();
 
+	published = ktime_get();
+
 	res = dev->virt_id;
 
-	PRINT_INFO("Attached to virtual device %s (id %d)", dev_name, res);
+	PRINT_INFO("Attached to virtual device %s (id %d, prepare %lld us, "
+		"publish %lld us)", dev_name, res,
+		(long long)ktime_us_delta(prepared, start),
+		(long long)ktime_us_delta(published, prepared));
 
 out:
 	TRACE_EXIT_RES(res);
 	return res;
 
 out_unreg:
-	list_del(&dev->dev_list_entry);
+	list_del_init(&dev->dev_list_entry);
+
 	scst_assign_dev_handler(dev, &scst_null_devtype);
-	goto out_pr_clear_dev;
 
+out_unlock:
+	mutex_unlock(&scst_mutex);
+
+out_resume:
+	scst_resume_activity();
+
+out_sysfs_del:
 #ifndef CONFIG_SCST_PROC
-out_lock_pr_clear_dev:
-	mutex_lock(&scst_mutex);
+	scst_dev_sysfs_del(dev);
 #endif
 
 out_pr_clear_dev:
+	mutex_lock(&scst_mutex);
 	scst_pr_clear_dev(dev);
+	mutex_unlock(&scst_mutex);
 
 out_free_dev:
-	mutex_unlock(&scst_mutex);
-	if (sysfs_del)
-		scst_dev_sysfs_del(dev);
 	scst_free_device(dev);
-	goto out_resume;
-
-out_unlock:
-	mutex_unlock(&scst_mutex);
-
-out_resume:
-	scst_resume_activity();
 	goto out;
 }
 EXPORT_SYMBOL_GPL(scst_register_virtual_device_node);
@@ -1967,8 +2047,8 @@ int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 		if (tgt_dev != NULL) {
 			int rc;
 			/*
-			 * sess->acg can be NULL here, if called from
-			 * scst_check_reassign_sess()!
+			 * sess->acg can still point to the old ACG here, if
+			 * called from scst_check_reassign_sess()!
 			 */
 			rc = set_cpus_allowed_ptr(thr->cmd_thread,
 				&tgt_dev->acg_dev->acg->acg_cpu_mask);
@@ -616,7 +616,8 @@ static void scst_pr_abort_reg(struct scst_device *dev,
 		reg->rel_tgt_id, reg, be64_to_cpu(reg->key), reg->tgt_dev,
 		sess);
 
-	packed_lun = scst_pack_lun(reg->tgt_dev->lun, sess->acg->addr_method);
+	packed_lun = scst_pack_lun(reg->tgt_dev->lun,
+				   scst_sess_addr_method(sess));
 
 	rc = scst_rx_mgmt_fn_lun(sess, SCST_PR_ABORT_ALL,
 		&packed_lun, sizeof(packed_lun), SCST_NON_ATOMIC,
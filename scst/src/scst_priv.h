@@ -123,6 +123,10 @@ extern unsigned long scst_trace_flag;
 #define SCST_MAX_EACH_INTERNAL_IO_SIZE	     (128*1024)
 #define SCST_MAX_IN_FLIGHT_INTERNAL_COMMANDS 32
 
+/* Per EXTENDED COPY, so the READs and WRITEs together fit the limit above */
+#define SCST_EXT_COPY_DEF_IN_FLIGHT	(SCST_MAX_IN_FLIGHT_INTERNAL_COMMANDS / 2)
+#define SCST_EXT_COPY_MAX_IN_FLIGHT	256
+
 /*
  * Compatibility with real-time (CONFIG_PREEMPT_RT_FULL) kernels.
  * In such kernels:
@@ -229,6 +233,32 @@ struct scst_cmd_thread_t {
 	bool being_stopped;
 };
 
+/*
+ * sess->acg is changed by scst_check_reassign_sess() under scst_mutex while
+ * commands of sess are being processed, so outside of scst_mutex it must be
+ * accessed only under RCU. The old ACG is freed after a grace period.
+ */
+static inline enum scst_lun_addr_method scst_sess_addr_method(
+	struct scst_session *sess)
+{
+	enum scst_lun_addr_method res;
+
+	rcu_read_lock();
+	res = rcu_dereference(sess->acg)->addr_method;
+	rcu_read_unlock();
+	return res;
+}
+
+static inline int scst_sess_black_hole_type(struct scst_session *sess)
+{
+	int res;
+
+	rcu_read_lock();
+	res = rcu_dereference(sess->acg)->acg_black_hole_type;
+	rcu_read_unlock();
+	return res;
+}
+
 static inline bool scst_set_io_context(struct scst_cmd *cmd,
 	struct io_context **old)
 {
@@ -389,7 +419,7 @@ int scst_acg_repl_lun(struct scst_acg *acg, struct kobject *parent,
 		      struct scst_device *dev, uint64_t lun,
 		      unsigned int flags);
 
-int scst_acg_add_acn(struct scst_acg *acg, const char *name);
+int scst_acg_add_acn(struct scst_acg *acg, const char *name, bool reassign);
 #ifdef CONFIG_SCST_PROC
 int scst_acg_remove_name(struct scst_acg *acg, const char *name, bool reassign);
 #endif
@@ -821,6 +851,8 @@ static inline void scst_sess_put(struct scst_session *sess)
 
 struct scst_cmd *scst_alloc_cmd(const uint8_t *cdb,
 	unsigned int cdb_len, gfp_t gfp_mask);
+struct scst_cmd *scst_sess_alloc_cmd(struct scst_session *sess,
+	const uint8_t *cdb, unsigned int cdb_len, gfp_t gfp_mask);
 int scst_pre_init_cmd(struct scst_cmd *cmd, const uint8_t *cdb,
 	unsigned int cdb_len, gfp_t gfp_mask);
 void scst_free_cmd(struct scst_cmd *cmd);
@@ -893,6 +925,7 @@ int scst_cm_on_add_lun(struct scst_acg_dev *acg_dev, uint64_t lun,
 	unsigned int *flags);
 bool scst_cm_on_del_lun(struct scst_acg_dev *acg_dev,
 	bool gen_report_luns_changed);
+bool scst_cm_is_cm_acg(const struct scst_acg *acg);
 
 int scst_cm_parse_descriptors(struct scst_cmd *cmd);
 void scst_cm_free_descriptors(struct scst_cmd *cmd);
@@ -1028,6 +1061,11 @@ int scst_event_queue_tm_fn_received(struct scst_mgmt_cmd *mcmd);
 typedef void __printf(2, 3) (*scst_show_fn)(void *arg, const char *fmt, ...);
 void scst_trace_cmds(scst_show_fn show, void *arg);
 void scst_trace_mcmds(scst_show_fn show, void *arg);
+void scst_tm_lat_account(const struct scst_mgmt_cmd *mcmd);
+void scst_tm_lat_show(scst_show_fn show, void *arg);
+void scst_tm_lat_reset(void);
+void scst_event_stats_show(scst_show_fn show, void *arg);
+void scst_event_stats_reset(void);
 
 #ifdef CONFIG_SCST_MEASURE_LATENCY
 
@@ -2245,7 +2245,7 @@ static ssize_t scst_proc_groups_names_write(struct file *file,
 
 	switch (action) {
 	case SCST_PROC_ACTION_ADD:
-		rc = scst_acg_add_acn(acg, p);
+		rc = scst_acg_add_acn(acg, p, true);
 		break;
 	case SCST_PROC_ACTION_DEL:
 		rc = scst_acg_remove_name(acg, p, true);
@@ -2285,9 +2285,9 @@ static ssize_t scst_proc_groups_names_write(struct file *file,
 		rc = scst_acg_remove_name(acg, name, false);
 		if (rc != 0)
 			goto out_free_unlock;
-		rc = scst_acg_add_acn(new_acg, name);
+		rc = scst_acg_add_acn(new_acg, name, true);
 		if (rc != 0)
-			scst_acg_add_acn(acg, name);
+			scst_acg_add_acn(acg, name, true);
 		break;
 	}
 	case SCST_PROC_ACTION_CLEAR:
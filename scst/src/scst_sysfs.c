@@ -1339,8 +1339,13 @@ out:
 	return res;
 }
 
-static int __scst_process_luns_mgmt_store(char *buffer,
-	struct scst_tgt *tgt, struct scst_acg *acg, bool tgt_kobj)
+/*
+ * Processes a single LUN management command. scst_mutex supposed to be held.
+ * Sets *luns_changed, if REPORTED LUNS DATA HAS CHANGED should be reported
+ * for acg after all commands of the batch processed.
+ */
+static int scst_process_luns_mgmt_cmd(char *buffer, struct scst_tgt *tgt,
+	struct scst_acg *acg, bool tgt_kobj, bool *luns_changed)
 {
 	int res, action;
 	bool read_only;
@@ -1380,14 +1385,6 @@ static int __scst_process_luns_mgmt_store(char *buffer,
 		goto out;
 	}
 
-	res = mutex_lock_interruptible(&scst_mutex);
-	if (res != 0)
-		goto out;
-
-	/* Check if tgt and acg not already freed while we were coming here */
-	if (scst_check_tgt_acg_ptrs(tgt, acg) != 0)
-		goto out_unlock;
-
 	if ((action != SCST_LUN_ACTION_CLEAR) &&
 	    (action != SCST_LUN_ACTION_DEL)) {
 		p = scst_get_next_lexem(&pp);
@@ -1401,19 +1398,19 @@ static int __scst_process_luns_mgmt_store(char *buffer,
 		if (dev == NULL) {
 			PRINT_ERROR("Device '%s' not found", p);
 			res = -EINVAL;
-			goto out_unlock;
+			goto out;
 		}
 	}
 
 	switch (action) {
 	case SCST_LUN_ACTION_ADD:
 	{
-		unsigned int flags = SCST_ADD_LUN_GEN_UA;
+		unsigned int flags = 0;
 
 		res = scst_parse_add_repl_param(acg, dev, pp, &virt_lun,
 						&read_only);
 		if (res != 0)
-			goto out_unlock;
+			goto out;
 
 		acg_dev = NULL;
 		list_for_each_entry(acg_dev_tmp, &acg->acg_dev_list,
@@ -1428,7 +1425,7 @@ static int __scst_process_luns_mgmt_store(char *buffer,
 			PRINT_ERROR("virt lun %ld already exists in group %s",
 				    virt_lun, acg->acg_name);
 			res = -EEXIST;
-			goto out_unlock;
+			goto out;
 		}
 
 		if (read_only)
@@ -1437,7 +1434,8 @@ static int __scst_process_luns_mgmt_store(char *buffer,
 			tgt_kobj ? tgt->tgt_luns_kobj : acg->luns_kobj,
 			dev, virt_lun, flags, NULL);
 		if (res != 0)
-			goto out_unlock;
+			goto out;
+		*luns_changed = true;
 		break;
 	}
 	case SCST_LUN_ACTION_REPLACE:
@@ -1447,55 +1445,112 @@ static int __scst_process_luns_mgmt_store(char *buffer,
 		res = scst_parse_add_repl_param(acg, dev, pp, &virt_lun,
 						&read_only);
 		if (res != 0)
-			goto out_unlock;
+			goto out;
 
 		flags |= read_only ? SCST_ADD_LUN_READ_ONLY : 0;
 		res = scst_acg_repl_lun(acg, tgt_kobj ? tgt->tgt_luns_kobj :
 					acg->luns_kobj, dev, virt_lun,
 					flags);
 		if (res != 0)
-			goto out_unlock;
+			goto out;
 		break;
 	}
 	case SCST_LUN_ACTION_DEL:
 		p = scst_get_next_lexem(&pp);
 		res = kstrtoul(p, 0, &virt_lun);
 		if (res != 0)
-			goto out_unlock;
+			goto out;
 
 		if (scst_get_next_lexem(&pp)[0] != '\0') {
 			PRINT_ERROR("Too many parameters for del LUN %ld: %s",
 				    virt_lun, p);
 			res = -EINVAL;
-			goto out_unlock;
+			goto out;
 		}
 
-		res = scst_acg_del_lun(acg, virt_lun, true);
+		res = scst_acg_del_lun(acg, virt_lun, false);
 		if (res != 0)
-			goto out_unlock;
+			goto out;
+		*luns_changed = true;
 		break;
 	case SCST_LUN_ACTION_CLEAR:
 		if (scst_get_next_lexem(&pp)[0] != '\0') {
 			PRINT_ERROR("Too many parameters for clear: %s", p);
 			res = -EINVAL;
-			goto out_unlock;
+			goto out;
 		}
 		PRINT_INFO("Removed all devices from group %s",
 			acg->acg_name);
 		list_for_each_entry_safe(acg_dev, acg_dev_tmp,
 					 &acg->acg_dev_list,
 					 acg_dev_list_entry) {
-			res = scst_acg_del_lun(acg, acg_dev->lun,
-				list_is_last(&acg_dev->acg_dev_list_entry,
-					     &acg->acg_dev_list));
+			res = scst_acg_del_lun(acg, acg_dev->lun, false);
 			if (res != 0)
-				goto out_unlock;
+				goto out;
+			*luns_changed = true;
 		}
 		break;
 	}
 
 	res = 0;
 
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Processes one or more LUN management commands, one per line. The "del"
+ * and "replace" commands drop scst_mutex while waiting for the commands of
+ * the removed LUN, so tgt and acg are rechecked before each command.
+ * REPORTED LUNS DATA HAS CHANGED is reported only once for the whole batch.
+ * Processing stops on the first failed command, the already processed
+ * commands are not rolled back.
+ */
+static int __scst_process_luns_mgmt_store(char *buffer,
+	struct scst_tgt *tgt, struct scst_acg *acg, bool tgt_kobj)
+{
+	int res, cmds = 0;
+	char *line, *next = buffer;
+	bool luns_changed = false;
+
+	TRACE_ENTRY();
+
+	res = mutex_lock_interruptible(&scst_mutex);
+	if (res != 0)
+		goto out;
+
+	while ((line = strsep(&next, "\n")) != NULL) {
+		if (line[strspn(line, " \t\r")] == '\0')
+			continue;
+
+		/*
+		 * Check if tgt and acg not already freed while we were coming
+		 * here or while scst_mutex was released by the previous command
+		 */
+		res = scst_check_tgt_acg_ptrs(tgt, acg);
+		if (res != 0)
+			goto out_unlock;
+
+		cmds++;
+		res = scst_process_luns_mgmt_cmd(line, tgt, acg, tgt_kobj,
+						 &luns_changed);
+		if (res != 0) {
+			PRINT_ERROR("LUN management command %d failed: %d",
+				cmds, res);
+			break;
+		}
+	}
+
+	if (cmds == 0) {
+		PRINT_ERROR("%s", "No LUN management command");
+		res = -EINVAL;
+	}
+
+	if (luns_changed && !scst_cm_is_cm_acg(acg) &&
+	    (scst_check_tgt_acg_ptrs(tgt, acg) == 0))
+		scst_report_luns_changed(acg);
+
 out_unlock:
 	mutex_unlock(&scst_mutex);
 
@@ -1571,7 +1626,8 @@ static ssize_t scst_luns_mgmt_show(struct kobject *kobj,
 		"\n"
 		"where parameters are one or more "
 		"param_name=value pairs separated by ';'\n"
-		"\nThe following parameters available: read_only.\n";
+		"\nThe following parameters available: read_only.\n"
+		"\nSeveral commands, one per line, can be written at once.\n";
 
 	return sprintf(buf, "%s", help);
 }
@@ -2168,9 +2224,16 @@ static int scst_process_ini_group_mgmt_store(char *buffer,
 		goto out;
 	}
 
-	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
-	if (res != 0)
-		goto out;
+	/*
+	 * Only deleting a group needs all activities suspended, because
+	 * it can close sessions. Creating a new empty group doesn't
+	 * affect any session.
+	 */
+	if (action == SCST_INI_GROUP_ACTION_DEL) {
+		res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+		if (res != 0)
+			goto out;
+	}
 
 	res = mutex_lock_interruptible(&scst_mutex);
 	if (res != 0)
@@ -2227,7 +2290,8 @@ out_unlock:
 	mutex_unlock(&scst_mutex);
 
 out_resume:
-	scst_resume_activity();
+	if (action == SCST_INI_GROUP_ACTION_DEL)
+		scst_resume_activity();
 
 out:
 	TRACE_EXIT_RES(res);
@@ -3537,6 +3601,138 @@ static struct kobj_attribute dev_max_tgt_dev_commands_attr =
 		scst_dev_sysfs_max_tgt_dev_commands_show,
 		scst_dev_sysfs_max_tgt_dev_commands_store);
 
+static ssize_t scst_dev_sysfs_ext_copy_max_in_flight_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	pos = sprintf(buf, "%d\n%s", dev->ext_copy_max_in_flight,
+		(dev->ext_copy_max_in_flight != SCST_EXT_COPY_DEF_IN_FLIGHT) ?
+			SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t scst_dev_sysfs_ext_copy_max_in_flight_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_device *dev;
+	long newval;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtol(buf, 0, &newval);
+#else
+	res = strict_strtol(buf, 0, &newval);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strtol() for %s failed: %d ", buf, res);
+		goto out;
+	}
+	if ((newval < 1) || (newval > SCST_EXT_COPY_MAX_IN_FLIGHT)) {
+		PRINT_ERROR("Illegal EXTENDED COPY in flight value %ld (allowed "
+			"1-%d)", newval, SCST_EXT_COPY_MAX_IN_FLIGHT);
+		res = -EINVAL;
+		goto out;
+	}
+
+	if (dev->ext_copy_max_in_flight != newval) {
+		PRINT_INFO("Setting new EXTENDED COPY in flight %ld for device "
+			"%s (old %d)", newval, dev->virt_name,
+			dev->ext_copy_max_in_flight);
+		dev->ext_copy_max_in_flight = newval;
+	}
+
+out:
+	if (res == 0)
+		res = count;
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute dev_ext_copy_max_in_flight_attr =
+	__ATTR(ext_copy_max_in_flight, S_IRUGO | S_IWUSR,
+		scst_dev_sysfs_ext_copy_max_in_flight_show,
+		scst_dev_sysfs_ext_copy_max_in_flight_store);
+
+static ssize_t scst_dev_sysfs_ext_copy_max_io_size_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int pos = 0;
+	struct scst_device *dev;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	pos = sprintf(buf, "%d\n%s", dev->ext_copy_max_io_size,
+		dev->ext_copy_max_io_size_set ? SCST_SYSFS_KEY_MARK "\n" : "");
+
+	TRACE_EXIT_RES(pos);
+	return pos;
+}
+
+static ssize_t scst_dev_sysfs_ext_copy_max_io_size_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	struct scst_device *dev;
+	long newval;
+
+	TRACE_ENTRY();
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 39)
+	res = kstrtol(buf, 0, &newval);
+#else
+	res = strict_strtol(buf, 0, &newval);
+#endif
+	if (res != 0) {
+		PRINT_ERROR("strtol() for %s failed: %d ", buf, res);
+		goto out;
+	}
+	if ((newval < (long)PAGE_SIZE) || (newval > SCST_EXT_COPY_MAX_IO_SIZE) ||
+	    ((newval & (PAGE_SIZE - 1)) != 0)) {
+		PRINT_ERROR("Illegal EXTENDED COPY I/O size %ld (must be "
+			"multiple of %lu and not bigger than %d)", newval,
+			PAGE_SIZE, SCST_EXT_COPY_MAX_IO_SIZE);
+		res = -EINVAL;
+		goto out;
+	}
+
+	if (dev->ext_copy_max_io_size != newval) {
+		PRINT_INFO("Setting new EXTENDED COPY I/O size %ld for device "
+			"%s (old %d)", newval, dev->virt_name,
+			dev->ext_copy_max_io_size);
+		dev->ext_copy_max_io_size = newval;
+	}
+	dev->ext_copy_max_io_size_set = 1;
+
+out:
+	if (res == 0)
+		res = count;
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute dev_ext_copy_max_io_size_attr =
+	__ATTR(ext_copy_max_io_size, S_IRUGO | S_IWUSR,
+		scst_dev_sysfs_ext_copy_max_io_size_show,
+		scst_dev_sysfs_ext_copy_max_io_size_store);
+
 static ssize_t scst_dev_numa_node_id_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
@@ -3731,6 +3927,8 @@ static struct kobj_attribute dev_block_attr =
 static struct attribute *scst_dev_attrs[] = {
 	&dev_type_attr.attr,
 	&dev_max_tgt_dev_commands_attr.attr,
+	&dev_ext_copy_max_in_flight_attr.attr,
+	&dev_ext_copy_max_io_size_attr.attr,
 	&dev_numa_node_id_attr.attr,
 	&dev_block_attr.attr,
 	NULL,
@@ -4670,6 +4868,29 @@ static ssize_t scst_sess_sysfs_commands_show(struct kobject *kobj,
 static struct kobj_attribute session_commands_attr =
 	__ATTR(commands, S_IRUGO, scst_sess_sysfs_commands_show, NULL);
 
+static ssize_t scst_sess_sysfs_cmd_cache_show(struct kobject *kobj,
+			    struct kobj_attribute *attr, char *buf)
+{
+	struct scst_session *sess;
+	int size, cnt;
+	unsigned long hits, misses;
+
+	sess = container_of(kobj, struct scst_session, sess_kobj);
+
+	spin_lock_irq(&sess->sess_cmd_cache_lock);
+	size = sess->sess_cmd_cache_size;
+	cnt = sess->sess_cmd_cache_cnt;
+	hits = sess->sess_cmd_cache_hits;
+	misses = sess->sess_cmd_cache_misses;
+	spin_unlock_irq(&sess->sess_cmd_cache_lock);
+
+	return sprintf(buf, "size %d\nfree %d\ncache_allocs %lu\n"
+		"slab_allocs %lu\n", size, cnt, hits, misses);
+}
+
+static struct kobj_attribute session_cmd_cache_attr =
+	__ATTR(cmd_cache, S_IRUGO, scst_sess_sysfs_cmd_cache_show, NULL);
+
 static int scst_sysfs_sess_get_active_commands(struct scst_session *sess)
 {
 	int res;
@@ -4975,6 +5196,7 @@ static struct kobj_attribute session_force_close_attr =
 static struct attribute *scst_session_attrs[] = {
 	&session_commands_attr.attr,
 	&session_active_commands_attr.attr,
+	&session_cmd_cache_attr.attr,
 	&session_initiator_name_attr.attr,
 	&session_unknown_cmd_count_attr.attr,
 	&session_write_cmd_count_attr.attr,
@@ -5287,12 +5509,17 @@ static ssize_t scst_acg_ini_mgmt_show(struct kobject *kobj,
 		"Usage: echo \"add INITIATOR_NAME\" >mgmt\n"
 		"       echo \"del INITIATOR_NAME\" >mgmt\n"
 		"       echo \"move INITIATOR_NAME DEST_GROUP_NAME\" >mgmt\n"
-		"       echo \"clear\" >mgmt\n";
+		"       echo \"clear\" >mgmt\n"
+		"\nSeveral commands, one per line, can be written at once.\n";
 
 	return sprintf(buf, "%s", help);
 }
 
-static int scst_process_acg_ini_mgmt_store(char *buffer,
+/*
+ * Processes a single initiator management command. scst_mutex supposed to be
+ * held. Sessions reassignment is left to the caller.
+ */
+static int scst_process_acg_ini_mgmt_cmd(char *buffer,
 	struct scst_tgt *tgt, struct scst_acg *acg)
 {
 	int res, action;
@@ -5326,37 +5553,25 @@ static int scst_process_acg_ini_mgmt_store(char *buffer,
 		goto out;
 	}
 
-	res = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
-	if (res != 0)
-		goto out;
-
-	res = mutex_lock_interruptible(&scst_mutex);
-	if (res != 0)
-		goto out_resume;
-
-	/* Check if tgt and acg not already freed while we were coming here */
-	if (scst_check_tgt_acg_ptrs(tgt, acg) != 0)
-		goto out_unlock;
-
 	switch (action) {
 	case SCST_ACG_ACTION_INI_ADD:
 		name = scst_get_next_lexem(&pp);
 		if (name[0] == '\0') {
 			PRINT_ERROR("%s", "Invalid initiator name");
 			res = -EINVAL;
-			goto out_unlock;
+			goto out;
 		}
 
-		res = scst_acg_add_acn(acg, name);
+		res = scst_acg_add_acn(acg, name, false);
 		if (res != 0)
-			goto out_unlock;
+			goto out;
 		break;
 	case SCST_ACG_ACTION_INI_DEL:
 		name = scst_get_next_lexem(&pp);
 		if (name[0] == '\0') {
 			PRINT_ERROR("%s", "Invalid initiator name");
 			res = -EINVAL;
-			goto out_unlock;
+			goto out;
 		}
 
 		acn = scst_find_acn(acg, name);
@@ -5365,30 +5580,29 @@ static int scst_process_acg_ini_mgmt_store(char *buffer,
 				"initiator '%s' in group '%s'",
 				name, acg->acg_name);
 			res = -EINVAL;
-			goto out_unlock;
+			goto out;
 		}
-		scst_del_free_acn(acn, true);
+		scst_del_free_acn(acn, false);
 		break;
 	case SCST_ACG_ACTION_INI_CLEAR:
 		list_for_each_entry_safe(acn, acn_tmp, &acg->acn_list,
 				acn_list_entry) {
 			scst_del_free_acn(acn, false);
 		}
-		scst_check_reassign_sessions();
 		break;
 	case SCST_ACG_ACTION_INI_MOVE:
 		name = scst_get_next_lexem(&pp);
 		if (name[0] == '\0') {
 			PRINT_ERROR("%s", "Invalid initiator name");
 			res = -EINVAL;
-			goto out_unlock;
+			goto out;
 		}
 
 		group = scst_get_next_lexem(&pp);
 		if (group[0] == '\0') {
 			PRINT_ERROR("%s", "Invalid group name");
 			res = -EINVAL;
-			goto out_unlock;
+			goto out;
 		}
 
 		TRACE_DBG("Move initiator '%s' to group '%s'",
@@ -5400,37 +5614,87 @@ static int scst_process_acg_ini_mgmt_store(char *buffer,
 				"initiator '%s' in group '%s'",
 				name, acg->acg_name);
 			res = -EINVAL;
-			goto out_unlock;
+			goto out;
 		}
 		acg_dest = scst_tgt_find_acg(tgt, group);
 		if (acg_dest == NULL) {
 			PRINT_ERROR("Unable to find group '%s' in target '%s'",
 				group, tgt->tgt_name);
 			res = -EINVAL;
-			goto out_unlock;
+			goto out;
 		}
 		if (scst_find_acn(acg_dest, name) != NULL) {
 			PRINT_ERROR("Initiator '%s' already exists in group '%s'",
 				name, acg_dest->acg_name);
 			res = -EEXIST;
-			goto out_unlock;
+			goto out;
 		}
 		scst_del_free_acn(acn, false);
 
-		res = scst_acg_add_acn(acg_dest, name);
+		res = scst_acg_add_acn(acg_dest, name, false);
 		if (res != 0)
-			goto out_unlock;
+			goto out;
 		break;
 	}
 
 	res = 0;
 
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Processes one or more initiator management commands, one per line, then
+ * reassigns the affected sessions once. Processing stops on the first
+ * failed command, the already processed commands are not rolled back.
+ */
+static int scst_process_acg_ini_mgmt_store(char *buffer,
+	struct scst_tgt *tgt, struct scst_acg *acg)
+{
+	int res, cmds = 0;
+	char *line, *next = buffer;
+
+	TRACE_ENTRY();
+
+	/*
+	 * No need to suspend activities: sessions, which ACG changes, are
+	 * reassigned by scst_check_reassign_sessions() waiting only for
+	 * their own commands to finish.
+	 */
+	res = mutex_lock_interruptible(&scst_mutex);
+	if (res != 0)
+		goto out;
+
+	/* Check if tgt and acg not already freed while we were coming here */
+	res = scst_check_tgt_acg_ptrs(tgt, acg);
+	if (res != 0)
+		goto out_unlock;
+
+	while ((line = strsep(&next, "\n")) != NULL) {
+		if (line[strspn(line, " \t\r")] == '\0')
+			continue;
+
+		cmds++;
+		res = scst_process_acg_ini_mgmt_cmd(line, tgt, acg);
+		if (res != 0) {
+			PRINT_ERROR("Initiator management command %d failed: "
+				"%d", cmds, res);
+			break;
+		}
+	}
+
+	if (cmds == 0) {
+		PRINT_ERROR("%s", "No initiator management command");
+		res = -EINVAL;
+		goto out_unlock;
+	}
+
+	scst_check_reassign_sessions();
+
 out_unlock:
 	mutex_unlock(&scst_mutex);
 
-out_resume:
-	scst_resume_activity();
-
 out:
 	TRACE_EXIT_RES(res);
 	return res;
@@ -5919,7 +6183,8 @@ static ssize_t scst_devt_mgmt_show(struct kobject *kobj,
 		"\n"
 		"where parameters are one or more "
 		"param_name=value pairs separated by ';'\n\n"
-		"%s%s%s%s%s%s%s%s%s%s\n";
+		"%s%s%s%s%s%s%s%s%s%s\n"
+		"Several commands, one per line, can be written at once.\n";
 	struct scst_dev_type *devt;
 
 	devt = container_of(kobj, struct scst_dev_type, devt_kobj);
@@ -5950,7 +6215,7 @@ static ssize_t scst_devt_mgmt_show(struct kobject *kobj,
 		(devt->dev_optional_attributes != NULL) ? "\n" : "");
 }
 
-static int scst_process_devt_mgmt_store(char *buffer,
+static int scst_process_devt_mgmt_cmd(char *buffer,
 	struct scst_dev_type *devt)
 {
 	int res = 0;
@@ -5958,10 +6223,6 @@ static int scst_process_devt_mgmt_store(char *buffer,
 
 	TRACE_ENTRY();
 
-	/* Check if our pointer is still alive and, if yes, grab it */
-	if (scst_check_grab_devt_ptr(devt, &scst_virtual_dev_type_list) != 0)
-		goto out;
-
 	TRACE_DBG("devt %p, buffer %s", devt, buffer);
 
 	pp = buffer;
@@ -5972,7 +6233,7 @@ static int scst_process_devt_mgmt_store(char *buffer,
 		if (*dev_name == '\0') {
 			PRINT_ERROR("%s", "Device name required");
 			res = -EINVAL;
-			goto out_ungrab;
+			goto out;
 		}
 		res = devt->add_device(dev_name, pp);
 	} else if (strcasecmp("del_device", p) == 0) {
@@ -5980,7 +6241,7 @@ static int scst_process_devt_mgmt_store(char *buffer,
 		if (*dev_name == '\0') {
 			PRINT_ERROR("%s", "Device name required");
 			res = -EINVAL;
-			goto out_ungrab;
+			goto out;
 		}
 
 		p = scst_get_next_lexem(&pp);
@@ -5994,12 +6255,9 @@ static int scst_process_devt_mgmt_store(char *buffer,
 	} else {
 		PRINT_ERROR("Unknown action \"%s\"", p);
 		res = -EINVAL;
-		goto out_ungrab;
+		goto out;
 	}
 
-out_ungrab:
-	scst_ungrab_devt_ptr(devt);
-
 out:
 	TRACE_EXIT_RES(res);
 	return res;
@@ -6007,7 +6265,127 @@ out:
 out_syntax_err:
 	PRINT_ERROR("Syntax error on \"%s\"", p);
 	res = -EINVAL;
-	goto out_ungrab;
+	goto out;
+}
+
+static bool scst_is_add_device_cmd(const char *line)
+{
+	static const char cmd[] = "add_device";
+
+	line += strspn(line, " \t");
+
+	return (strncasecmp(line, cmd, sizeof(cmd) - 1) == 0) &&
+	       isspace(line[sizeof(cmd) - 1]);
+}
+
+/*
+ * Passes several "add_device" commands to the dev handler's add_devices()
+ * callback at once, so it can add the new devices in parallel.
+ */
+static int scst_process_devt_add_devices(char **lines, int cnt,
+	struct scst_dev_type *devt)
+{
+	int res, i;
+	const char **dev_names;
+	char **params;
+
+	TRACE_ENTRY();
+
+	dev_names = kcalloc(cnt, sizeof(*dev_names), GFP_KERNEL);
+	params = kcalloc(cnt, sizeof(*params), GFP_KERNEL);
+	if ((dev_names == NULL) || (params == NULL)) {
+		PRINT_ERROR("Unable to allocate add_device arrays (cnt %d)",
+			cnt);
+		res = -ENOMEM;
+		goto out_free;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		char *pp = lines[i];
+
+		scst_get_next_lexem(&pp); /* add_device */
+		dev_names[i] = scst_get_next_lexem(&pp);
+		if (*dev_names[i] == '\0') {
+			PRINT_ERROR("Device name required (command %d)", i + 1);
+			res = -EINVAL;
+			goto out_free;
+		}
+		params[i] = pp;
+	}
+
+	res = devt->add_devices(cnt, dev_names, params);
+
+out_free:
+	kfree(params);
+	kfree(dev_names);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Processes one or more commands, one per line. If all of them are
+ * "add_device" commands and the dev handler supports it, the devices are
+ * added in one add_devices() call. Otherwise the commands are processed one
+ * by one until the first failure.
+ */
+static int scst_process_devt_mgmt_store(char *buffer,
+	struct scst_dev_type *devt)
+{
+	int res = 0, cnt = 0, i;
+	char *line, *next = buffer, **lines;
+	bool all_add = true;
+
+	TRACE_ENTRY();
+
+	lines = kcalloc(strlen(buffer) / 2 + 1, sizeof(*lines), GFP_KERNEL);
+	if (lines == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	while ((line = strsep(&next, "\n")) != NULL) {
+		if (line[strspn(line, " \t\r")] == '\0')
+			continue;
+		if (!scst_is_add_device_cmd(line))
+			all_add = false;
+		lines[cnt++] = line;
+	}
+
+	if (cnt == 0) {
+		PRINT_ERROR("%s", "No device management command");
+		res = -EINVAL;
+		goto out_free;
+	}
+
+	/* Check if our pointer is still alive and, if yes, grab it */
+	if (scst_check_grab_devt_ptr(devt, &scst_virtual_dev_type_list) != 0)
+		goto out_free;
+
+	if ((cnt > 1) && all_add && (devt->add_devices != NULL)) {
+		res = scst_process_devt_add_devices(lines, cnt, devt);
+		goto out_ungrab;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		res = scst_process_devt_mgmt_cmd(lines[i], devt);
+		if (res != 0) {
+			if (cnt > 1)
+				PRINT_ERROR("Device management command %d "
+					"failed: %d", i + 1, res);
+			break;
+		}
+	}
+
+out_ungrab:
+	scst_ungrab_devt_ptr(devt);
+
+out_free:
+	kfree(lines);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
 }
 
 static int scst_devt_mgmt_store_work_fn(struct scst_sysfs_work_item *work)
@@ -7489,6 +7867,45 @@ out:
 static struct kobj_attribute scst_trace_mcmds_attr =
 	__ATTR(trace_mcmds, S_IRUGO, scst_show_trace_mcmds, NULL);
 
+static ssize_t scst_tm_latency_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	buf[0] = '\0';
+	scst_tm_lat_show(scst_append, buf);
+	return strlen(buf);
+}
+
+static ssize_t scst_tm_latency_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	scst_tm_lat_reset();
+	return count;
+}
+
+static struct kobj_attribute scst_tm_latency_attr =
+	__ATTR(tm_latency, S_IRUGO | S_IWUSR, scst_tm_latency_show,
+	       scst_tm_latency_store);
+
+static ssize_t scst_event_stats_show_attr(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  char *buf)
+{
+	buf[0] = '\0';
+	scst_event_stats_show(scst_append, buf);
+	return strlen(buf);
+}
+
+static ssize_t scst_event_stats_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	scst_event_stats_reset();
+	return count;
+}
+
+static struct kobj_attribute scst_event_stats_attr =
+	__ATTR(event_stats, S_IRUGO | S_IWUSR, scst_event_stats_show_attr,
+	       scst_event_stats_store);
+
 static ssize_t scst_version_show(struct kobject *kobj,
 				 struct kobj_attribute *attr,
 				 char *buf)
@@ -7585,6 +8002,8 @@ static struct attribute *scst_sysfs_root_default_attrs[] = {
 	&scst_force_global_sgv_pool_attr.attr,
 	&scst_trace_cmds_attr.attr,
 	&scst_trace_mcmds_attr.attr,
+	&scst_tm_latency_attr.attr,
+	&scst_event_stats_attr.attr,
 	&scst_version_attr.attr,
 	&scst_last_sysfs_mgmt_res_attr.attr,
 	NULL,
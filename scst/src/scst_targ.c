@@ -683,7 +683,7 @@ struct scst_cmd *scst_rx_cmd(struct scst_session *sess,
 	}
 #endif
 
-	cmd = scst_alloc_cmd(cdb, cdb_len, gfp_mask);
+	cmd = scst_sess_alloc_cmd(sess, cdb, cdb_len, gfp_mask);
 	if (cmd == NULL) {
 		TRACE(TRACE_OUT_OF_MEM, "%s", "Allocation of scst_cmd failed");
 		goto out;
@@ -784,6 +784,15 @@ out_redirect:
 	goto out;
 }
 
+/* sess_list_lock supposed to be held */
+static inline void scst_sess_add_cmd(struct scst_session *sess,
+	struct scst_cmd *cmd)
+{
+	list_add_tail(&cmd->sess_cmd_list_entry, &sess->sess_cmd_list);
+	list_add_tail(&cmd->sess_cmd_hash_entry,
+		&sess->sess_cmd_hash[SESS_CMD_HASH_FN(cmd->tag)]);
+}
+
 /**
  * scst_cmd_init_done() - the command's initialization done
  * @cmd:	SCST command
@@ -852,8 +861,7 @@ void scst_cmd_init_done(struct scst_cmd *cmd,
 		 * old, i.e. deferred, commands and new, i.e. just coming, ones.
 		 */
 		if (cmd->sess_cmd_list_entry.next == NULL)
-			list_add_tail(&cmd->sess_cmd_list_entry,
-				&sess->sess_cmd_list);
+			scst_sess_add_cmd(sess, cmd);
 		switch (sess->init_phase) {
 		case SCST_SESS_IPH_SUCCESS:
 			break;
@@ -872,8 +880,7 @@ void scst_cmd_init_done(struct scst_cmd *cmd,
 			sBUG();
 		}
 	} else
-		list_add_tail(&cmd->sess_cmd_list_entry,
-			      &sess->sess_cmd_list);
+		scst_sess_add_cmd(sess, cmd);
 
 	spin_unlock_irqrestore(&sess->sess_list_lock, flags);
 
@@ -1401,7 +1408,7 @@ out_check_compl:
 		struct scst_session *sess = cmd->sess;
 		bool abort = false;
 
-		switch (sess->acg->acg_black_hole_type) {
+		switch (scst_sess_black_hole_type(sess)) {
 		case SCST_ACG_BLACK_HOLE_CMD:
 		case SCST_ACG_BLACK_HOLE_ALL:
 			abort = true;
@@ -2348,7 +2355,7 @@ static int scst_report_luns_local(struct scst_cmd *cmd)
 				}
 				*(__force __be64 *)&buffer[offs]
 					= scst_pack_lun(tgt_dev->lun,
-						cmd->sess->acg->addr_method);
+						scst_sess_addr_method(cmd->sess));
 				offs += 8;
 			}
 inc_dev_cnt:
@@ -4789,6 +4796,7 @@ static int scst_finish_cmd(struct scst_cmd *cmd)
 		stat->unaligned_cmd_count++;
 
 	list_del(&cmd->sess_cmd_list_entry);
+	list_del(&cmd->sess_cmd_hash_entry);
 
 	/*
 	 * Done under sess_list_lock to sync with scst_abort_cmd() without
@@ -6562,6 +6570,44 @@ static void __scst_abort_task_set(struct scst_mgmt_cmd *mcmd,
 	return;
 }
 
+/*
+ * Aborts all commands of sess addressed to any of its tgt_devs. Does the
+ * same as __scst_abort_task_set() called for each tgt_dev of sess, but walks
+ * sess_cmd_list only once instead of once per LUN.
+ *
+ * rcu_read_lock() supposed to be held.
+ */
+static void __scst_abort_sess_cmds(struct scst_mgmt_cmd *mcmd,
+	struct scst_session *sess)
+{
+	struct scst_cmd *cmd;
+
+	TRACE_ENTRY();
+
+	sBUG_ON(mcmd->fn == SCST_PR_ABORT_ALL);
+
+	spin_lock_irq(&sess->sess_list_lock);
+
+	TRACE_DBG("Searching in sess cmd list (sess=%p)", sess);
+	list_for_each_entry(cmd, &sess->sess_cmd_list,
+			    sess_cmd_list_entry) {
+		if ((cmd->tgt_dev == NULL) &&
+		    (scst_lookup_tgt_dev(sess, cmd->lun) == NULL))
+			continue;
+		if (mcmd->cmd_sn_set) {
+			sBUG_ON(!cmd->tgt_sn_set);
+			if (scst_sn_before(mcmd->cmd_sn, cmd->tgt_sn) ||
+			    (mcmd->cmd_sn == cmd->tgt_sn))
+				continue;
+		}
+		scst_abort_cmd(cmd, mcmd, 0, 0);
+	}
+	spin_unlock_irq(&sess->sess_list_lock);
+
+	TRACE_EXIT();
+	return;
+}
+
 /* Returns 0 if the command processing should be continued, <0 otherwise */
 static int scst_abort_task_set(struct scst_mgmt_cmd *mcmd)
 {
@@ -6737,7 +6783,7 @@ static int scst_mgmt_cmd_init(struct scst_mgmt_cmd *mcmd)
 
 	TRACE_ENTRY();
 
-	t = mcmd->sess->acg->acg_black_hole_type;
+	t = scst_sess_black_hole_type(mcmd->sess);
 	if (unlikely((t == SCST_ACG_BLACK_HOLE_ALL) ||
 		     (t == SCST_ACG_BLACK_HOLE_DATA_MCMD))) {
 		TRACE_MGMT_DBG("Dropping mcmd %p (fn %d, initiator %s)", mcmd,
@@ -6834,7 +6880,7 @@ static int scst_target_reset(struct scst_mgmt_cmd *mcmd)
 {
 	int res, rc;
 	struct scst_device *dev;
-	struct scst_acg *acg = mcmd->sess->acg;
+	struct scst_acg *acg;
 	struct scst_acg_dev *acg_dev;
 	LIST_HEAD(host_devs);
 
@@ -6843,10 +6889,14 @@ static int scst_target_reset(struct scst_mgmt_cmd *mcmd)
 	TRACE(TRACE_MGMT, "Target reset (mcmd %p, cmd count %d)",
 		mcmd, atomic_read(&mcmd->sess->sess_cmd_count));
 
-	mcmd->needs_unblocking = 1;
-
 	mutex_lock(&scst_mutex);
 
+	/* sess->acg can change only under scst_mutex */
+	acg = mcmd->sess->acg;
+	scst_get_acg(acg);
+	mcmd->mcmd_reset_acg = acg;
+	mcmd->needs_unblocking = 1;
+
 	list_for_each_entry(acg_dev, &acg->acg_dev_list, acg_dev_list_entry) {
 		struct scst_device *d;
 		struct scst_tgt_dev *tgt_dev;
@@ -7044,13 +7094,12 @@ static int scst_abort_all_nexus_loss_sess(struct scst_mgmt_cmd *mcmd,
 	}
 
 	rcu_read_lock();
+	__scst_abort_sess_cmds(mcmd, sess);
 	for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
 		struct list_head *head = &sess->sess_tgt_dev_list[i];
 
 		list_for_each_entry_rcu(tgt_dev, head,
 					sess_tgt_dev_list_entry) {
-			__scst_abort_task_set(mcmd, tgt_dev);
-
 			scst_call_dev_task_mgmt_fn_received(mcmd, tgt_dev);
 
 			tm_dbg_task_mgmt(tgt_dev->dev, "NEXUS LOSS SESS or "
@@ -7126,14 +7175,13 @@ static int scst_abort_all_nexus_loss_tgt(struct scst_mgmt_cmd *mcmd,
 
 	rcu_read_lock();
 	list_for_each_entry(sess, &tgt->sess_list, sess_list_entry) {
+		__scst_abort_sess_cmds(mcmd, sess);
 		for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
 			struct list_head *head = &sess->sess_tgt_dev_list[i];
 			struct scst_tgt_dev *tgt_dev;
 
 			list_for_each_entry_rcu(tgt_dev, head,
 					sess_tgt_dev_list_entry) {
-				__scst_abort_task_set(mcmd, tgt_dev);
-
 				if (mcmd->sess == tgt_dev->sess)
 					scst_call_dev_task_mgmt_fn_received(
 						mcmd, tgt_dev);
@@ -7439,10 +7487,11 @@ static int scst_mgmt_affected_cmds_done(struct scst_mgmt_cmd *mcmd)
 
 	case SCST_TARGET_RESET:
 	{
-		struct scst_acg *acg = sess->acg;
+		struct scst_acg *acg;
 		struct scst_acg_dev *acg_dev;
 
 		mutex_lock(&scst_mutex);
+		acg = sess->acg;
 		rcu_read_lock();
 		list_for_each_entry(acg_dev, &acg->acg_dev_list, acg_dev_list_entry) {
 			dev = acg_dev->dev;
@@ -7534,6 +7583,8 @@ static void scst_mgmt_cmd_send_done(struct scst_mgmt_cmd *mcmd)
 	if (scst_is_strict_mgmt_fn(mcmd->fn) && (mcmd->completed_cmd_count > 0))
 		scst_mgmt_cmd_set_status(mcmd, SCST_MGMT_STATUS_TASK_NOT_EXIST);
 
+	scst_tm_lat_account(mcmd);
+
 	if (mcmd->fn < SCST_UNREG_SESS_TM)
 		TRACE(TRACE_MGMT, "TM fn %d (mcmd %p) finished, "
 			"status %d", mcmd->fn, mcmd, mcmd->status);
@@ -7566,7 +7617,7 @@ static void scst_mgmt_cmd_send_done(struct scst_mgmt_cmd *mcmd)
 
 		case SCST_TARGET_RESET:
 		{
-			struct scst_acg *acg = mcmd->sess->acg;
+			struct scst_acg *acg = mcmd->mcmd_reset_acg;
 			struct scst_acg_dev *acg_dev;
 
 			mutex_lock(&scst_mutex);
@@ -7578,6 +7629,8 @@ static void scst_mgmt_cmd_send_done(struct scst_mgmt_cmd *mcmd)
 				spin_unlock_bh(&dev->dev_lock);
 			}
 			mutex_unlock(&scst_mutex);
+			mcmd->mcmd_reset_acg = NULL;
+			scst_put_acg(acg);
 			break;
 		}
 
@@ -8619,17 +8672,15 @@ static struct scst_cmd *__scst_find_cmd_by_tag(struct scst_session *sess,
 	uint64_t tag, bool to_abort)
 {
 	struct scst_cmd *cmd, *res = NULL;
+	struct list_head *head = &sess->sess_cmd_hash[SESS_CMD_HASH_FN(tag)];
 
 	TRACE_ENTRY();
 
-	/* ToDo: hash list */
-
-	TRACE_DBG("%s (sess=%p, tag=%llu)", "Searching in sess cmd list",
+	TRACE_DBG("%s (sess=%p, tag=%llu)", "Searching in sess cmd hash",
 		  sess, (unsigned long long int)tag);
 
-	list_for_each_entry(cmd, &sess->sess_cmd_list,
-			sess_cmd_list_entry) {
-		if ((cmd->tag == tag) && likely(!cmd->internal)) {
+	list_for_each_entry(cmd, head, sess_cmd_hash_entry) {
+		if (cmd->tag == tag) {
 			/*
 			 * We must not count done commands, because
 			 * they were submitted for transmission.
@@ -24,6 +24,10 @@
 #include <linux/slab.h>
 #include <linux/completion.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+#include <linux/blk-mq.h>
+#endif
 
 #include <scsi/scsi.h>
 #include <scsi/scsi_cmnd.h>
@@ -106,6 +110,25 @@ module_param_named(add_default_tgt, scst_local_add_default_tgt, bool, S_IRUGO);
 MODULE_PARM_DESC(add_default_tgt, "add (default) or not on start default "
 	"target scst_local_tgt with default session scst_local_host");
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 31) \
+    || defined(RHEL_MAJOR) && RHEL_MAJOR -0 <= 5
+static int scst_local_inline_processing;
+#else
+static bool scst_local_inline_processing;
+#endif
+module_param_named(inline_processing, scst_local_inline_processing, bool,
+	S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(inline_processing, "process commands in the submitter's "
+	"context, when it can sleep, instead of passing them to SCST threads. "
+	"Under scsi-mq works only for sessions created while it is set, on "
+	"kernel 6.0 or later (default no)");
+
+static unsigned int scst_local_nr_hw_queues = 1;
+module_param_named(nr_hw_queues, scst_local_nr_hw_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_hw_queues, "number of blk-mq hardware queues of each "
+	"session's SCSI host, each served by its own SCST session, 0 means one "
+	"per CPU (default 1)");
+
 static struct workqueue_struct *aen_workqueue;
 
 struct scst_aen_work_item {
@@ -145,11 +168,74 @@ struct scst_local_sess {
 	struct work_struct remove_work;
 
 	struct list_head sessions_list_entry;
+
+	/* Number of not yet freed SCST sessions in hwq_sess */
+	atomic_t sess_refs;
+
+	/*
+	 * SCST sessions of the SCSI host hardware queues, one per queue.
+	 * The first one is scst_sess, which is also used for task
+	 * management and AENs.
+	 */
+	int nr_hwq_sess;
+	struct scst_session *hwq_sess[];
 };
 
 #define to_scst_lcl_sess(d) \
 	container_of(d, struct scst_local_sess, dev)
 
+/* Returns the SCST session serving the hardware queue of SCpnt */
+static struct scst_session *scst_local_cmd_sess(struct scst_local_sess *sess,
+	struct scsi_cmnd *SCpnt)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	if ((sess->nr_hwq_sess > 1) && shost_use_blk_mq(SCpnt->device->host)) {
+		u16 hwq = blk_mq_unique_tag_to_hwq(
+				blk_mq_unique_tag(SCpnt->request));
+
+		if (likely(hwq < sess->nr_hwq_sess))
+			return sess->hwq_sess[hwq];
+	}
+#endif
+	return sess->scst_sess;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+/*
+ * Returns true if the current context of queuecommand() of shost is known
+ * to be allowed to sleep. Hosts created with inline_processing set have
+ * BLK_MQ_F_BLOCKING tag sets, so blk-mq calls them in a sleepable context.
+ * Otherwise queuecommand() can be called from softirqs and, with blk-mq,
+ * inside RCU read side critical sections, which without
+ * CONFIG_PREEMPT_COUNT can't be detected, so then it conservatively
+ * returns false.
+ */
+static bool scst_local_may_sleep(const struct Scsi_Host *shost)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	if (shost->queuecommand_may_block)
+		return true;
+#endif
+#ifdef CONFIG_PREEMPT_COUNT
+	return (preempt_count() == 0) && !irqs_disabled() &&
+		(rcu_preempt_depth() == 0);
+#else
+	return false;
+#endif
+}
+#endif
+
+static int scst_local_get_nr_hw_queues(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	if (scst_local_nr_hw_queues == 0)
+		return num_online_cpus();
+	return scst_local_nr_hw_queues;
+#else
+	return 1;
+#endif
+}
+
 static int __scst_local_add_adapter(struct scst_local_tgt *tgt,
 	const char *initiator_name, bool locked);
 static int scst_local_add_adapter(struct scst_local_tgt *tgt,
@@ -809,8 +895,9 @@ static int scst_local_abort(struct scsi_cmnd *SCpnt)
 
 	sess = to_scst_lcl_sess(scsi_get_device(SCpnt->device->host));
 
-	ret = scst_rx_mgmt_fn_tag(sess->scst_sess, SCST_ABORT_TASK, SCpnt->tag,
-				 false, &dev_reset_completion);
+	ret = scst_rx_mgmt_fn_tag(scst_local_cmd_sess(sess, SCpnt),
+				 SCST_ABORT_TASK, SCpnt->tag, false,
+				 &dev_reset_completion);
 
 	/* Now wait for the completion ... */
 	wait_for_completion_interruptible(&dev_reset_completion);
@@ -1001,8 +1088,8 @@ static int scst_local_queuecommand_lck(struct scsi_cmnd *SCpnt,
 	 * our devices.
 	 */
 	int_to_scsilun(SCpnt->device->lun, &lun);
-	scst_cmd = scst_rx_cmd(sess->scst_sess, lun.scsi_lun, sizeof(lun),
-			       SCpnt->cmnd, SCpnt->cmd_len, true);
+	scst_cmd = scst_rx_cmd(scst_local_cmd_sess(sess, SCpnt), lun.scsi_lun,
+			       sizeof(lun), SCpnt->cmnd, SCpnt->cmd_len, true);
 	if (!scst_cmd) {
 		PRINT_ERROR("%s", "scst_rx_cmd() failed");
 		return SCSI_MLQUEUE_HOST_BUSY;
@@ -1101,6 +1188,23 @@ static int scst_local_queuecommand_lck(struct scsi_cmnd *SCpnt,
 #endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+	if (scst_local_inline_processing) {
+		if (scst_local_may_sleep(SCpnt->device->host)) {
+			/*
+			 * Process the whole command right here. For backends
+			 * not blocking in exec(), like vdisk_nullio, it's
+			 * completed by scsi_done() before we return, without
+			 * any handoff.
+			 */
+			scst_cmd_init_done(scst_cmd, SCST_CONTEXT_DIRECT);
+			goto out;
+		}
+		PRINT_WARNING_ONCE("inline_processing has no effect for SCSI "
+			"host %d, because its queuecommand() is called in "
+			"atomic context. Create the session with "
+			"inline_processing set (kernel 6.0+) to use it.",
+			SCpnt->device->host->host_no);
+	}
 #ifdef CONFIG_SCST_LOCAL_DIRECT_PROCESSING
 	/*
 	 * NOTE! At the moment in scst_estimate_context*() returning
@@ -1124,6 +1228,9 @@ static int scst_local_queuecommand_lck(struct scsi_cmnd *SCpnt,
 	scst_cmd_init_done(scst_cmd, SCST_CONTEXT_THREAD);
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 37)
+out:
+#endif
 	TRACE_EXIT();
 	return 0;
 }
@@ -1232,6 +1339,15 @@ static int scst_local_slave_alloc(struct scsi_device *sdev)
 {
 #if !defined(RHEL_MAJOR) || RHEL_MAJOR -0 >= 6
 	queue_flag_set_unlocked(QUEUE_FLAG_BIDI, sdev->request_queue);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	/* Complete each request on the CPU it was submitted from */
+	if (sdev->host->nr_hw_queues > 1) {
+		queue_flag_set_unlocked(QUEUE_FLAG_SAME_COMP,
+			sdev->request_queue);
+		queue_flag_set_unlocked(QUEUE_FLAG_SAME_FORCE,
+			sdev->request_queue);
+	}
 #endif
 	return 0;
 }
@@ -1682,6 +1798,24 @@ static int scst_local_driver_probe(struct device *dev)
 	hpnt->max_id = 1;        /* Don't want more than one id */
 	hpnt->max_lun = SCST_MAX_LUN + 1;
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	/*
+	 * Let blk-mq call queuecommand() in a context, which can sleep, so
+	 * inline_processing works for this host. Must be set before
+	 * scsi_add_host(), which creates the tag set.
+	 */
+	if (scst_local_inline_processing)
+		hpnt->queuecommand_may_block = 1;
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	hpnt->nr_hw_queues = sess->nr_hwq_sess;
+	if ((sess->nr_hwq_sess > 1) && !shost_use_blk_mq(hpnt))
+		PRINT_WARNING("scsi-mq is disabled, only the first of %d "
+			"sessions of %s will be used", sess->nr_hwq_sess,
+			dev_name(dev));
+#endif
+
 	/*
 	 * Because of a change in the size of this field at 2.6.26
 	 * we use this check ... it allows us to work on earlier
@@ -1777,13 +1911,15 @@ static void scst_local_free_sess(struct scst_session *scst_sess)
 {
 	struct scst_local_sess *sess = scst_sess_get_tgt_priv(scst_sess);
 
-	kfree(sess);
+	if (atomic_dec_and_test(&sess->sess_refs))
+		kfree(sess);
 	return;
 }
 
 static void scst_local_release_adapter(struct device *dev)
 {
 	struct scst_local_sess *sess;
+	int i;
 
 	TRACE_ENTRY();
 
@@ -1818,7 +1954,9 @@ static void scst_local_release_adapter(struct device *dev)
 	scst_process_aens(sess, true);
 	spin_unlock(&sess->aen_lock);
 
-	scst_unregister_session(sess->scst_sess, false, scst_local_free_sess);
+	for (i = sess->nr_hwq_sess - 1; i >= 0; i--)
+		scst_unregister_session(sess->hwq_sess[i], false,
+					scst_local_free_sess);
 
 	TRACE_EXIT();
 	return;
@@ -1827,16 +1965,16 @@ static void scst_local_release_adapter(struct device *dev)
 static int __scst_local_add_adapter(struct scst_local_tgt *tgt,
 	const char *initiator_name, bool locked)
 {
-	int res;
+	int res, i, nr_hwq = scst_local_get_nr_hw_queues();
 	struct scst_local_sess *sess;
+	size_t size = sizeof(*sess) + nr_hwq * sizeof(sess->hwq_sess[0]);
 
 	TRACE_ENTRY();
 
 	/* It's read-mostly, so cache alignment isn't needed */
-	sess = kzalloc(sizeof(*sess), GFP_KERNEL);
+	sess = kzalloc(size, GFP_KERNEL);
 	if (sess == NULL) {
-		PRINT_ERROR("Unable to alloc scst_lcl_host (size %zu)",
-			sizeof(*sess));
+		PRINT_ERROR("Unable to alloc scst_lcl_host (size %zu)", size);
 		res = -ENOMEM;
 		goto out;
 	}
@@ -1858,13 +1996,28 @@ static int __scst_local_add_adapter(struct scst_local_tgt *tgt,
 	spin_lock_init(&sess->aen_lock);
 	INIT_LIST_HEAD(&sess->aen_work_list);
 
-	sess->scst_sess = scst_register_session(tgt->scst_tgt, 0,
-				initiator_name, sess, NULL, NULL);
-	if (sess->scst_sess == NULL) {
-		PRINT_ERROR("%s", "scst_register_session failed");
-		res = -EFAULT;
-		goto out_free;
+	/*
+	 * With several hardware queues each of them gets its own MQ session,
+	 * so commands submitted on different CPUs don't share a session.
+	 */
+	for (i = 0; i < nr_hwq; i++) {
+		if (nr_hwq > 1)
+			sess->hwq_sess[i] = scst_register_session_mq(
+				tgt->scst_tgt, 0, initiator_name, sess,
+				NULL, NULL);
+		else
+			sess->hwq_sess[i] = scst_register_session(
+				tgt->scst_tgt, 0, initiator_name, sess,
+				NULL, NULL);
+		if (sess->hwq_sess[i] == NULL) {
+			PRINT_ERROR("%s", "scst_register_session failed");
+			res = -EFAULT;
+			goto unregister_session;
+		}
+		sess->nr_hwq_sess++;
 	}
+	sess->scst_sess = sess->hwq_sess[0];
+	atomic_set(&sess->sess_refs, nr_hwq);
 
 	sess->dev.bus     = &scst_local_lld_bus;
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 29))
@@ -1918,9 +2071,9 @@ unregister_dev:
 #endif
 
 unregister_session:
-	scst_unregister_session(sess->scst_sess, true, NULL);
+	for (i = sess->nr_hwq_sess - 1; i >= 0; i--)
+		scst_unregister_session(sess->hwq_sess[i], true, NULL);
 
-out_free:
 	kfree(sess);
 	goto out;
 }
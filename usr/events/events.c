@@ -85,22 +85,53 @@ static void usage(void)
 #endif
 }
 
-static void handle_tm_received(struct scst_event_user *event_user)
+static void handle_tm_received(const struct scst_event *event)
 {
-	struct scst_event_tm_fn_received_payload *p = (struct scst_event_tm_fn_received_payload *)event_user->out_event.payload;
+	const struct scst_event_tm_fn_received_payload *p = (const struct scst_event_tm_fn_received_payload *)event->payload;
 
 	printf("fn %d, device %s\n", p->fn, p->device_name);
 
 	return;
 }
 
+static void handle_event(int event_fd, const struct scst_event_batch_entry *e)
+{
+	const struct scst_event *event = &e->event;
+	int res;
+
+	PRINT_INFO("\nevent_code %d, issuer_name %s, coalesced %u",
+		event->event_code, event->issuer_name, e->coalesced_cnt);
+	if (event->payload_len != 0)
+		PRINT_BUFFER("payoad", event->payload, event->payload_len);
+	PRINT_INFO("%s", "");
+
+	if (event->event_code == 0x12345) {
+		struct scst_event_notify_done d;
+
+		PRINT_INFO("%s", "Press any key to send reply to event "
+			"0x12345");
+		getchar();
+
+		memset(&d, 0, sizeof(d));
+		d.event_id = event->event_id;
+		d.status = -19;
+		res = ioctl(event_fd, SCST_EVENT_NOTIFY_DONE, &d);
+		if (res != 0)
+			PRINT_ERROR("SCST_EVENT_NOTIFY_DONE failed: %s "
+				"(res %d)", strerror(errno), res);
+	} else if (event->event_code == SCST_EVENT_TM_FN_RECEIVED)
+		handle_tm_received(event);
+	return;
+}
+
 int main(int argc, char **argv)
 {
 	int res = 0, i;
 	int ch, longindex;
 	int event_fd;
-	uint8_t event_user_buf[10240];
-	struct scst_event_user *event_user = (struct scst_event_user *)event_user_buf;
+	static uint8_t events_buf[256*1024] __attribute__((aligned(8)));
+	struct scst_event_user_batch batch;
+	const struct scst_event_batch_entry *e;
 	struct pollfd pl;
 
 	setlinebuf(stdout);
@@ -203,28 +234,29 @@ int main(int argc, char **argv)
 	}
 
 	while (1) {
-		memset(event_user_buf, 0, sizeof(event_user_buf));
-		event_user->max_event_size = sizeof(event_user_buf);
-		res = ioctl(event_fd, SCST_EVENT_GET_NEXT_EVENT, event_user);
+		memset(&batch, 0, sizeof(batch));
+		batch.events_buf = (unsigned long)events_buf;
+		batch.events_buf_len = sizeof(events_buf);
+		res = ioctl(event_fd, SCST_EVENT_GET_NEXT_EVENTS, &batch);
 		if (res != 0) {
 			res = errno;
 			switch (res) {
 			case ESRCH:
 			case EBUSY:
-				TRACE_MGMT_DBG("SCST_EVENT_GET_NEXT_EVENT returned "
+				TRACE_MGMT_DBG("SCST_EVENT_GET_NEXT_EVENTS returned "
 					"%d (%s)", res, strerror(res));
 				/* fall through */
 			case EINTR:
 				continue;
 			case EAGAIN:
-				TRACE_DBG("SCST_EVENT_GET_NEXT_EVENT, returned "
+				TRACE_DBG("SCST_EVENT_GET_NEXT_EVENTS, returned "
 					"EAGAIN (%d)", res);
 				if (non_blocking)
 					break;
 				else
 					continue;
 			default:
-				PRINT_ERROR("SCST_EVENT_GET_NEXT_EVENT failed: %s (res %d)",
+				PRINT_ERROR("SCST_EVENT_GET_NEXT_EVENTS failed: %s (res %d)",
 					strerror(errno), res);
 				goto out_done;
 			}
@@ -256,40 +288,13 @@ again_poll:
 
 		}
 
-		PRINT_INFO("\nevent_code %d, issuer_name %s",
-			event_user->out_event.event_code,
-			event_user->out_event.issuer_name);
-		if (event_user->out_event.payload_len != 0)
-			PRINT_BUFFER("payoad", event_user->out_event.payload,
-				event_user->out_event.payload_len);
-		PRINT_INFO("%s", "");
-
-		if (event_user->out_event.event_code == 0x12345) {
-			struct scst_event_notify_done d;
-
-			PRINT_INFO("%s", "Press any key to send reply to event "
-				"0x12345");
-			getchar();
-
-			memset(&d, 0, sizeof(d));
-			d.event_id = event_user->out_event.event_id;
-			d.status = -19;
-			res = ioctl(event_fd, SCST_EVENT_NOTIFY_DONE, &d);
-			if (res != 0)
-				PRINT_ERROR("SCST_EVENT_NOTIFY_DONE failed: %s "
-					"(res %d)", strerror(errno), res);
-		} else if (event_user->out_event.event_code == SCST_EVENT_TM_FN_RECEIVED)
-			handle_tm_received(event_user);
-		else if (event_user->out_event.event_code == SCST_EVENT_TM_FN_RECEIVED) {
-			struct scst_event_notify_done d;
-
-			memset(&d, 0, sizeof(d));
-			d.event_id = event_user->out_event.event_id;
-			d.status = -20;
-			res = ioctl(event_fd, SCST_EVENT_NOTIFY_DONE, &d);
-			if (res != 0)
-				PRINT_ERROR("SCST_EVENT_NOTIFY_DONE failed: %s "
-					"(res %d)", strerror(errno), res);
+		if (batch.dropped_cnt != 0)
+			PRINT_WARNING("%u events lost", batch.dropped_cnt);
+
+		e = (const struct scst_event_batch_entry *)events_buf;
+		for (i = 0; i < batch.events_cnt; i++) {
+			handle_event(event_fd, e);
+			e = SCST_EVENT_BATCH_NEXT(e);
 		}
 
 #if 0
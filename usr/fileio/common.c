@@ -28,6 +28,8 @@
 
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include <arpa/inet.h>
 
@@ -44,10 +46,34 @@ static void exec_read_capacity16(struct vdisk_cmd *vcmd);
 static void exec_read_toc(struct vdisk_cmd *vcmd);
 static void exec_prevent_allow_medium_removal(struct vdisk_cmd *vcmd);
 static int exec_fsync(struct vdisk_cmd *vcmd);
+static int exec_fsync_range(struct vdisk_cmd *vcmd, loff_t loff, int length);
 static void exec_read(struct vdisk_cmd *vcmd, loff_t loff);
 static void exec_write(struct vdisk_cmd *vcmd, loff_t loff);
 static void exec_verify(struct vdisk_cmd *vcmd, loff_t loff);
 static void exec_write_same(struct vdisk_cmd *vcmd);
+static void flush_io_batch(struct vdisk_io_batch *batch);
+
+/*
+ * Limits of the number of commands main_loop() requests by a single
+ * SCST_USER_REPLY_AND_GET_MULTI. The batch grows while the kernel fills it
+ * up and shrinks when it returns much less, so under a low queue depth the
+ * commands are spread over all threads instead of being grabbed by one.
+ */
+#define MIN_MULTI_CMDS_CNT	2
+#define MAX_MULTI_CMDS_CNT	64
+
+/* READ or WRITE deferred to be submitted together with its neighbours */
+struct vdisk_io {
+	struct vdisk_cmd *vcmd;
+	loff_t loff;
+	int length;
+	bool write;
+};
+
+struct vdisk_io_batch {
+	int io_cnt;
+	struct vdisk_io ios[MAX_MULTI_CMDS_CNT];
+};
 
 static int open_dev_fd(struct vdisk_dev *dev)
 {
@@ -203,6 +229,14 @@ static struct vdisk_tgt_dev *find_tgt_dev(struct vdisk_dev *dev, uint64_t sess_h
 	return res;
 }
 
+static bool is_mmap_buf(const struct vdisk_dev *dev, uint64_t pbuf)
+{
+	uintptr_t addr = (uintptr_t)dev->mmap_addr;
+
+	return (dev->mmap_addr != NULL) && (pbuf >= addr) &&
+		(pbuf < addr + dev->file_size);
+}
+
 static struct vdisk_tgt_dev *find_empty_tgt_dev(struct vdisk_dev *dev)
 {
 	unsigned int i;
@@ -217,6 +251,22 @@ static struct vdisk_tgt_dev *find_empty_tgt_dev(struct vdisk_dev *dev)
 	return res;
 }
 
+static void defer_io(struct vdisk_cmd *vcmd, loff_t loff, bool write)
+{
+	struct vdisk_io_batch *batch = vcmd->batch;
+	struct vdisk_io *io = &batch->ios[batch->io_cnt++];
+
+	TRACE_DBG("Deferring %s of cmd %d (off %"PRId64", len %d)",
+		write ? "write" : "read", vcmd->cmd->cmd_h, (uint64_t)loff,
+		vcmd->cmd->exec_cmd.bufflen);
+
+	io->vcmd = vcmd;
+	io->loff = loff;
+	io->length = vcmd->cmd->exec_cmd.bufflen;
+	io->write = write;
+	return;
+}
+
 static int do_exec(struct vdisk_cmd *vcmd)
 {
 	int res = 0;
@@ -229,6 +279,8 @@ static int do_exec(struct vdisk_cmd *vcmd)
 	int opcode = cdb[0];
 	loff_t loff;
 	int fua = 0;
+	bool defer = false;
+	bool mmap_read = false;
 
 	TRACE_ENTRY();
 
@@ -267,7 +319,17 @@ static int do_exec(struct vdisk_cmd *vcmd)
 	}
 #endif
 
-	if ((cmd->pbuf == 0) && (cmd->alloc_len != 0)) {
+	switch (opcode) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		/* Replied with a buffer in the mapping, see exec_read() */
+		mmap_read = (dev->mmap_addr != NULL);
+		break;
+	}
+
+	if ((cmd->pbuf == 0) && (cmd->alloc_len != 0) && !mmap_read) {
 #ifdef DEBUG_NOMEM
 		if ((random() % 100) == 75)
 			cmd->pbuf = 0;
@@ -317,12 +379,38 @@ static int do_exec(struct vdisk_cmd *vcmd)
 		break;
 	}
 
+	if (vcmd->batch != NULL) {
+		/*
+		 * Plain READs and WRITEs are deferred to be merged with their
+		 * neighbours. Everything else, including ORDERED commands,
+		 * must be executed after the already deferred ones.
+		 */
+		switch (opcode) {
+		case READ_6:
+		case READ_10:
+		case READ_12:
+		case READ_16:
+		case WRITE_6:
+		case WRITE_10:
+		case WRITE_12:
+		case WRITE_16:
+			defer = !fua && !dev->nullio && (dev->mmap_addr == NULL) &&
+				(cmd->queue_type != SCST_CMD_QUEUE_ORDERED);
+			break;
+		}
+		if (!defer)
+			flush_io_batch(vcmd->batch);
+	}
+
 	switch (opcode) {
 	case READ_6:
 	case READ_10:
 	case READ_12:
 	case READ_16:
-		exec_read(vcmd, loff);
+		if (defer)
+			defer_io(vcmd, loff, false);
+		else
+			exec_read(vcmd, loff);
 		break;
 	case WRITE_6:
 	case WRITE_10:
@@ -340,10 +428,14 @@ static int do_exec(struct vdisk_cmd *vcmd)
 				goto out;
 			}
 
+			if (defer) {
+				defer_io(vcmd, loff, true);
+				break;
+			}
 			exec_write(vcmd, loff);
 			/* O_DSYNC flag is used for WT devices */
-			if (fua)
-				exec_fsync(vcmd);
+			if (fua && (reply->status == 0))
+				exec_fsync_range(vcmd, loff, cmd->bufflen);
 		} else {
 			PRINT_WARNING("Attempt to write to read-only "
 				"device %s", dev->name);
@@ -535,7 +627,8 @@ static int do_on_free_cmd(struct vdisk_cmd *vcmd)
 		cmd->cmd_h, cmd->on_free_cmd.pbuf,
 		cmd->on_free_cmd.buffer_cached);
 
-	if (!cmd->on_free_cmd.buffer_cached && (cmd->on_free_cmd.pbuf != 0)) {
+	if (!cmd->on_free_cmd.buffer_cached && (cmd->on_free_cmd.pbuf != 0) &&
+	    !is_mmap_buf(vcmd->dev, cmd->on_free_cmd.pbuf)) {
 		TRACE_MEM("Freeing buf %"PRIx64, cmd->on_free_cmd.pbuf);
 		free((void *)(unsigned long)cmd->on_free_cmd.pbuf);
 	}
@@ -783,16 +876,20 @@ void *main_loop(void *arg)
 		.dev = dev,
 		.may_need_to_free_pbuf = 0,
 		.reply = &reply,
+		.batch = NULL,
 		.sense = {0}
 	};
 	int scst_usr_fd = dev->scst_usr_fd;
 	struct pollfd pl;
-#define MULTI_CMDS_CNT 2
+	int cmds_cnt = MIN_MULTI_CMDS_CNT;
 	struct {
-		struct scst_user_reply_cmd replies[MULTI_CMDS_CNT];
+		struct scst_user_reply_cmd replies[MAX_MULTI_CMDS_CNT];
 		struct scst_user_get_multi multi_cmd;
-		struct scst_user_get_cmd cmds[MULTI_CMDS_CNT];
+		struct scst_user_get_cmd cmds[MAX_MULTI_CMDS_CNT];
 	} multi;
+	/* Each command of a batch needs its own sense buffer */
+	struct vdisk_cmd vcmds[MAX_MULTI_CMDS_CNT];
+	struct vdisk_io_batch batch;
 
 	TRACE_ENTRY();
 
@@ -808,10 +905,18 @@ void *main_loop(void *arg)
 	pl.fd = scst_usr_fd;
 	pl.events = POLLIN;
 
+	for (i = 0; i < (int)ARRAY_SIZE(vcmds); i++) {
+		vcmds[i] = vcmd;
+		vcmds[i].cmd = &multi.cmds[i];
+		vcmds[i].batch = &batch;
+	}
+	batch.io_cnt = 0;
+
 	cmd.preply = 0;
+	memset(&multi.multi_cmd, 0, sizeof(multi.multi_cmd));
 	multi.multi_cmd.preplies = (uintptr_t)&multi.replies[0];
 	multi.multi_cmd.replies_cnt = 0;
-	multi.multi_cmd.cmds_cnt = MULTI_CMDS_CNT;
+	multi.multi_cmd.cmds_cnt = cmds_cnt;
 
 	while(1) {
 #ifdef DEBUG_TM_IGNORE_ALL
@@ -844,7 +949,7 @@ void *main_loop(void *arg)
 				cmd.preply = 0;
 				multi.multi_cmd.preplies = (uintptr_t)&multi.replies[0];
 				multi.multi_cmd.replies_cnt = 0;
-				multi.multi_cmd.cmds_cnt = MULTI_CMDS_CNT;
+				multi.multi_cmd.cmds_cnt = cmds_cnt;
 			case EINTR:
 				continue;
 			case EAGAIN:
@@ -852,7 +957,7 @@ void *main_loop(void *arg)
 				cmd.preply = 0;
 				multi.multi_cmd.preplies = (uintptr_t)&multi.replies[0];
 				multi.multi_cmd.replies_cnt = 0;
-				multi.multi_cmd.cmds_cnt = MULTI_CMDS_CNT;
+				multi.multi_cmd.cmds_cnt = cmds_cnt;
 				if (dev->non_blocking)
 					break;
 				else
@@ -863,7 +968,7 @@ void *main_loop(void *arg)
 				cmd.preply = 0;
 				multi.multi_cmd.preplies = (uintptr_t)&multi.replies[0];
 				multi.multi_cmd.replies_cnt = 0;
-				multi.multi_cmd.cmds_cnt = MULTI_CMDS_CNT;
+				multi.multi_cmd.cmds_cnt = cmds_cnt;
 				continue;
 #else
 				goto out_close;
@@ -902,15 +1007,14 @@ again_poll:
 					multi.multi_cmd.replies_done, multi.multi_cmd.replies_cnt, dev->name);
 				multi.multi_cmd.preplies = (uintptr_t)&multi.replies[multi.multi_cmd.replies_done];
 				multi.multi_cmd.replies_cnt = multi.multi_cmd.replies_cnt - multi.multi_cmd.replies_done;
-				multi.multi_cmd.cmds_cnt = MULTI_CMDS_CNT;
+				multi.multi_cmd.cmds_cnt = cmds_cnt;
 				continue;
 			}
 			TRACE_DBG("cmds_cnt %d", multi.multi_cmd.cmds_cnt);
 			multi.multi_cmd.preplies = (uintptr_t)&multi.replies[0];
 			for (i = 0, j = 0; i < multi.multi_cmd.cmds_cnt; i++, j++) {
-				vcmd.cmd = &multi.cmds[i];
-				vcmd.reply = &multi.replies[j];
-				res = process_cmd(&vcmd);
+				vcmds[i].reply = &multi.replies[j];
+				res = process_cmd(&vcmds[i]);
 #ifdef DEBUG_TM_IGNORE
 				if (res == 150) {
 					j--;
@@ -919,10 +1023,19 @@ again_poll:
 #endif
 				if (res != 0)
 					goto out_close;
-				TRACE_BUFFER("Sending reply", vcmd.reply, sizeof(reply));
 			}
+			flush_io_batch(&batch);
+			for (i = 0; i < j; i++)
+				TRACE_BUFFER("Sending reply", &multi.replies[i],
+					sizeof(reply));
+
+			if (multi.multi_cmd.cmds_cnt == cmds_cnt)
+				cmds_cnt = min(cmds_cnt * 2, MAX_MULTI_CMDS_CNT);
+			else if (multi.multi_cmd.cmds_cnt < cmds_cnt / 4)
+				cmds_cnt = max(cmds_cnt / 2, MIN_MULTI_CMDS_CNT);
+
 			multi.multi_cmd.replies_cnt = j;
-			multi.multi_cmd.cmds_cnt = MULTI_CMDS_CNT;
+			multi.multi_cmd.cmds_cnt = cmds_cnt;
 		} else {
 			res = process_cmd(&vcmd);
 #ifdef DEBUG_TM_IGNORE
@@ -1697,8 +1810,46 @@ static int exec_fsync(struct vdisk_cmd *vcmd)
 	    dev->o_direct_flag || dev->nullio)
 		goto out;
 
-	/* ToDo: use sync_file_range() instead */
-	fsync(vcmd->fd);
+	if (dev->mmap_addr != NULL)
+		msync(dev->mmap_addr, dev->file_size, MS_SYNC);
+	else {
+		/* ToDo: use sync_file_range() instead */
+		fsync(vcmd->fd);
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int msync_range(struct vdisk_dev *dev, loff_t loff, int length)
+{
+	loff_t start = loff & ~((loff_t)sysconf(_SC_PAGESIZE) - 1);
+
+	return msync(dev->mmap_addr + start, loff + length - start, MS_SYNC);
+}
+
+/* Like exec_fsync(), but in mmap mode syncs only the written range */
+static int exec_fsync_range(struct vdisk_cmd *vcmd, loff_t loff, int length)
+{
+	int res = 0;
+	struct vdisk_dev *dev = vcmd->dev;
+
+	if (dev->mmap_addr == NULL) {
+		res = exec_fsync(vcmd);
+		goto out;
+	}
+
+	if (dev->nv_cache || dev->wt_flag || dev->rd_only_flag ||
+	    dev->o_direct_flag || dev->nullio)
+		goto out;
+
+	res = msync_range(dev, loff, length);
+	if (res != 0) {
+		PRINT_ERROR("msync() failed (errno %d, cmd_h %x)", errno,
+			vcmd->cmd->cmd_h);
+		set_cmd_error(vcmd, SCST_LOAD_SENSE(scst_sense_write_error));
+	}
 
 out:
 	TRACE_EXIT_RES(res);
@@ -1719,7 +1870,15 @@ static void exec_read(struct vdisk_cmd *vcmd, loff_t loff)
 	TRACE_DBG("reading off %"PRId64", len %d", loff, length);
 	if (dev->nullio)
 		err = length;
-	else {
+	else if (dev->mmap_addr != NULL) {
+		if (address == NULL) {
+			/* Zero copy: the kernel maps the file pages directly */
+			vcmd->reply->exec_reply.pbuf =
+				(unsigned long)(dev->mmap_addr + loff);
+		} else
+			memcpy(address, dev->mmap_addr + loff, length);
+		err = length;
+	} else {
 		/* SEEK */
 		err = lseek64(fd, loff, 0/*SEEK_SET*/);
 		if (err != loff) {
@@ -1768,7 +1927,19 @@ restart:
 
 	if (dev->nullio)
 		err = length;
-	else {
+	else if (dev->mmap_addr != NULL) {
+		memcpy(dev->mmap_addr + loff, address, length);
+		/* O_DSYNC doesn't apply to stores into the mapping */
+		if (dev->wt_flag && !dev->nv_cache &&
+		    (msync_range(dev, loff, length) != 0)) {
+			PRINT_ERROR("msync() failed (errno %d, cmd_h %x)",
+				errno, vcmd->cmd->cmd_h);
+			set_cmd_error(vcmd,
+			    SCST_LOAD_SENSE(scst_sense_write_error));
+			goto out;
+		}
+		err = length;
+	} else {
 		/* SEEK */
 		err = lseek64(fd, loff, 0/*SEEK_SET*/);
 		if (err != loff) {
@@ -1813,6 +1984,129 @@ out:
 	return;
 }
 
+static int vdisk_io_cmp(const void *a, const void *b)
+{
+	const struct vdisk_io *io1 = a, *io2 = b;
+
+	if (io1->write != io2->write)
+		return io1->write - io2->write;
+	if (io1->loff != io2->loff)
+		return (io1->loff < io2->loff) ? -1 : 1;
+	return 0;
+}
+
+/* Returns true, if all the iov_cnt buffers of iov are read or written */
+static bool do_rw_iov(int fd, struct iovec *iov, int iov_cnt, loff_t loff,
+	bool write)
+{
+	ssize_t err;
+
+	while (iov_cnt > 0) {
+		if (write)
+			err = pwritev(fd, iov, iov_cnt, loff);
+		else
+			err = preadv(fd, iov, iov_cnt, loff);
+		if (err <= 0) {
+			TRACE_MGMT_DBG("%s() returned %zd (errno %d)",
+				write ? "pwritev" : "preadv", err, errno);
+			return false;
+		}
+		loff += err;
+		while ((iov_cnt > 0) && ((size_t)err >= iov->iov_len)) {
+			err -= iov->iov_len;
+			iov++;
+			iov_cnt--;
+		}
+		if (iov_cnt > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + err;
+			iov->iov_len -= err;
+		}
+	}
+	return true;
+}
+
+/*
+ * Executes io_cnt deferred commands covering a contiguous range by a single
+ * preadv() or pwritev(). If it fails, the commands are executed one by
+ * one to get the status of each of them.
+ */
+static void exec_merged_io(struct vdisk_io *ios, int io_cnt)
+{
+	struct iovec iov[MAX_MULTI_CMDS_CNT];
+	bool write = ios[0].write;
+	int i;
+
+	TRACE_ENTRY();
+
+	if (io_cnt == 1)
+		goto out_single;
+
+	TRACE_DBG("%s %d cmds (off %"PRId64")", write ? "Writing" : "Reading",
+		io_cnt, (uint64_t)ios[0].loff);
+
+	for (i = 0; i < io_cnt; i++) {
+		iov[i].iov_base = (void *)(unsigned long)
+					ios[i].vcmd->cmd->exec_cmd.pbuf;
+		iov[i].iov_len = ios[i].length;
+	}
+
+	if (!do_rw_iov(ios[0].vcmd->fd, iov, io_cnt, ios[0].loff, write))
+		goto out_single;
+
+	if (!write) {
+		for (i = 0; i < io_cnt; i++)
+			set_resp_data_len(ios[i].vcmd, ios[i].length);
+	}
+
+out:
+	TRACE_EXIT();
+	return;
+
+out_single:
+	for (i = 0; i < io_cnt; i++) {
+		if (write)
+			exec_write(ios[i].vcmd, ios[i].loff);
+		else
+			exec_read(ios[i].vcmd, ios[i].loff);
+	}
+	goto out;
+}
+
+/*
+ * Executes the deferred READs and WRITEs sorted by offset, merging the
+ * adjacent ones of the same direction.
+ */
+static void flush_io_batch(struct vdisk_io_batch *batch)
+{
+	struct vdisk_io *ios = batch->ios;
+	int i, j;
+	loff_t end;
+
+	TRACE_ENTRY();
+
+	if (batch->io_cnt == 0)
+		goto out;
+
+	qsort(ios, batch->io_cnt, sizeof(*ios), vdisk_io_cmp);
+
+	for (i = 0; i < batch->io_cnt; i = j) {
+		end = ios[i].loff + ios[i].length;
+		for (j = i + 1; j < batch->io_cnt; j++) {
+			if ((ios[j].write != ios[i].write) ||
+			    (ios[j].loff != end))
+				break;
+			end += ios[j].length;
+		}
+		exec_merged_io(&ios[i], j - i);
+	}
+
+	batch->io_cnt = 0;
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
 static void exec_verify(struct vdisk_cmd *vcmd, loff_t loff)
 {
 	struct vdisk_dev *dev = vcmd->dev;
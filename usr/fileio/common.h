@@ -63,6 +63,7 @@ struct vdisk_dev {
 	int block_shift;
 	loff_t file_size;	/* in bytes */
 	void *(*alloc_fn)(size_t size);
+	uint8_t *mmap_addr;	/* mapping of the file in mmap mode or NULL */
 
 	pthread_mutex_t dev_mutex;
 
@@ -92,6 +93,8 @@ struct vdisk_dev {
 	int type;
 };
 
+struct vdisk_io_batch;
+
 struct vdisk_cmd
 {
 	int fd;
@@ -99,6 +102,8 @@ struct vdisk_cmd
 	struct vdisk_dev *dev;
 	unsigned int may_need_to_free_pbuf:1;
 	struct scst_user_reply_cmd *reply;
+	/* READs and WRITEs are deferred here, if not NULL */
+	struct vdisk_io_batch *batch;
 	uint8_t sense[SCST_SENSE_BUFFERSIZE];
 };
 
@@ -30,6 +30,7 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/user.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
 #include <sys/ioctl.h>
 
@@ -75,6 +76,9 @@ bool log_daemon = false;
 
 #define MAX_VDEVS		10
 
+/* Alignment of the backing file mapping with --mmap_huge */
+#define MMAP_HUGE_ALIGN		(2 * 1024 * 1024)
+
 static void *align_alloc(size_t size);
 
 static struct vdisk_dev devs[MAX_VDEVS];
@@ -97,6 +101,7 @@ static int debug_tm_ignore;
 #endif
 static int non_blocking, sgv_shared, sgv_single_alloc_pages, sgv_purge_interval;
 static int sgv_disable_clustered_pool, prealloc_buffers_num, prealloc_buffer_size;
+static int use_mmap, mmap_huge;
 bool use_multi = true;
 
 static void *(*alloc_fn)(size_t size) = align_alloc;
@@ -124,6 +129,8 @@ static struct option const long_options[] =
 	{"prealloc_buffers", required_argument, 0, 'R'},
 	{"prealloc_buffer_size", required_argument, 0, 'Z'},
 	{"multi_cmd", required_argument, 0, 'M'},
+	{"mmap", no_argument, 0, 'a'},
+	{"mmap_huge", no_argument, 0, 'H'},
 #if defined(DEBUG) || defined(TRACING)
 	{"debug", required_argument, 0, 'd'},
 #endif
@@ -163,6 +170,8 @@ static void usage(void)
 	printf("  -R, --prealloc_buffers=n Prealloc n buffers\n");
 	printf("  -Z, --prealloc_buffer_size=n Sets the size in KB of each prealloced buffer\n");
 	printf("  -M, --multi_cmd=v  Use or not multi-commands processing (default: 1)\n");
+	printf("  -a, --mmap		Serve I/O from a memory mapping of the file\n");
+	printf("  -H, --mmap_huge	As --mmap, but align the mapping for huge pages\n");
 #if defined(DEBUG) || defined(TRACING)
 	printf("  -d, --debug=level	Debug tracing level\n");
 #endif
@@ -300,6 +309,86 @@ out:
 	return res;
 }
 
+/*
+ * Maps the whole backing file of dev. READs are then replied with buffers
+ * pointing directly into the mapping and WRITEs are copied into it.
+ */
+static int map_dev_file(struct vdisk_dev *dev)
+{
+	int res = 0, fd;
+	size_t len = dev->file_size, reserve_len = 0;
+	int flags = MAP_SHARED, prot = PROT_READ | PROT_WRITE;
+	uint8_t *reserve = NULL, *addr = NULL, *p;
+
+	TRACE_ENTRY();
+
+	fd = open(dev->file_name, O_LARGEFILE |
+			(dev->rd_only_flag ? O_RDONLY : O_RDWR));
+	if (fd < 0) {
+		res = -errno;
+		PRINT_ERROR("Unable to open file %s (%s)", dev->file_name,
+			strerror(-res));
+		goto out;
+	}
+
+	/*
+	 * READ reply buffers are pinned by the kernel read-only, so read-only
+	 * files can be shared mapped without write access.
+	 */
+	if (dev->rd_only_flag)
+		prot = PROT_READ;
+
+	if (mmap_huge) {
+		/* Reserve an aligned range and map the file over it */
+		reserve_len = len + MMAP_HUGE_ALIGN;
+		reserve = mmap(NULL, reserve_len, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (reserve == MAP_FAILED) {
+			res = -errno;
+			PRINT_ERROR("Unable to reserve %zd bytes (%s)",
+				reserve_len, strerror(-res));
+			goto out_close;
+		}
+		addr = (uint8_t *)(((uintptr_t)reserve + MMAP_HUGE_ALIGN - 1) &
+				~(uintptr_t)(MMAP_HUGE_ALIGN - 1));
+		flags |= MAP_FIXED;
+	}
+
+	p = mmap(addr, len, prot, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		res = -errno;
+		PRINT_ERROR("Unable to mmap file %s (%s)", dev->file_name,
+			strerror(-res));
+		if (reserve != NULL)
+			munmap(reserve, reserve_len);
+		goto out_close;
+	}
+
+	if (mmap_huge) {
+		size_t page_size = sysconf(_SC_PAGESIZE);
+		uint8_t *end = p + ((len + page_size - 1) & ~(page_size - 1));
+
+		/* Release the unused head and tail of the reservation */
+		if (p != reserve)
+			munmap(reserve, p - reserve);
+		if (end < reserve + reserve_len)
+			munmap(end, reserve + reserve_len - end);
+		if (madvise(p, len, MADV_HUGEPAGE) != 0)
+			PRINT_INFO("madvise(MADV_HUGEPAGE) failed for %s: %s",
+				dev->file_name, strerror(errno));
+	}
+
+	TRACE_DBG("File %s mapped at %p", dev->file_name, p);
+	dev->mmap_addr = p;
+
+out_close:
+	close(fd);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static int start(int argc, char **argv)
 {
 	int res = 0;
@@ -351,6 +440,12 @@ static int start(int argc, char **argv)
 
 		close(fd);
 
+		if (use_mmap && !devs[i].nullio) {
+			res = map_dev_file(&devs[i]);
+			if (res != 0)
+				goto out_unreg;
+		}
+
 		PRINT_INFO("%s", " ");
 		PRINT_INFO("Virtual device \"%s\", path \"%s\", size %"PRId64"MB, "
 			"block size %d, nblocks %"PRId64", options:", devs[i].name,
@@ -480,6 +575,8 @@ static int start(int argc, char **argv)
 			j++;
 		}
 		pthread_mutex_destroy(&devs[i].dev_mutex);
+		if (devs[i].mmap_addr != NULL)
+			munmap(devs[i].mmap_addr, devs[i].file_size);
 	}
 
 out_unreg:
@@ -517,7 +614,7 @@ int main(int argc, char **argv)
 
 	memset(devs, 0, sizeof(devs));
 
-	while ((ch = getopt_long(argc, argv, "+b:e:trongluF:I:cp:f:m:d:vsS:P:hDR:Z:M:",
+	while ((ch = getopt_long(argc, argv, "+b:e:trongluF:I:cp:f:m:d:vsS:P:hDR:Z:M:aH",
 			long_options, &longindex)) >= 0) {
 		switch (ch) {
 		case 'b':
@@ -592,6 +689,12 @@ int main(int argc, char **argv)
 		case 'M':
 			use_multi = atoi(optarg);
 			break;
+		case 'H':
+			mmap_huge = 1;
+			/* fall through */
+		case 'a':
+			use_mmap = 1;
+			break;
 		case 'm':
 			if (strncmp(optarg, "all", 3) == 0)
 				memory_reuse_type = SCST_USER_MEM_REUSE_ALL;
@@ -637,6 +740,20 @@ int main(int argc, char **argv)
 	if (optind > (argc-2))
 		goto out_usage;
 
+	if (use_mmap) {
+		if (o_direct_flag) {
+			PRINT_ERROR("%s", "O_DIRECT and mmap modes are "
+				"mutually exclusive");
+			res = -EINVAL;
+			goto out_usage;
+		}
+		/* Buffers of zero copy READs must not be cached by SCST */
+		if (memory_reuse_type == SCST_USER_MEM_REUSE_ALL)
+			memory_reuse_type = SCST_USER_MEM_REUSE_WRITE;
+		else if (memory_reuse_type == SCST_USER_MEM_REUSE_READ)
+			memory_reuse_type = SCST_USER_MEM_NO_REUSE;
+	}
+
 	if (!on_free_cmd_type_set &&
 	    (memory_reuse_type != SCST_USER_MEM_REUSE_ALL))
 		on_free_cmd_type = SCST_USER_ON_FREE_CMD_CALL;
@@ -655,6 +772,9 @@ int main(int argc, char **argv)
 		PRINT_INFO("	%s", "NULLIO");
 	if (non_blocking)
 		PRINT_INFO("	%s", "NON-BLOCKING");
+	if (use_mmap)
+		PRINT_INFO("	%s", mmap_huge ? "MMAP (huge page aligned)" :
+			"MMAP");
 
 	switch(parse_type) {
 	case SCST_USER_PARSE_STANDARD:
@@ -0,0 +1 @@
+#include "../include/debug.c"
@@ -0,0 +1,654 @@
+/*
+ *  loadgen.c
+ *
+ *  Block device load generator for the SCST regression benchmarks. Runs a
+ *  fixed number of threads, each keeping a fixed number of O_DIRECT
+ *  asynchronous reads and writes of one block size in flight against a
+ *  block device or file, and prints IOPS, throughput and the completion
+ *  latency distribution as a single "key=value" line, so the results are
+ *  easy to parse and to compare between runs. See
+ *  scripts/regression-perftest for the benchmark suite built on top of it.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, version 2
+ *  of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/aio_abi.h>
+
+#include <pthread.h>
+
+#include "version.h"
+#include "debug.h"
+
+char *app_name;
+
+#if defined(DEBUG) || defined(TRACING)
+
+#ifdef DEBUG
+#define DEFAULT_LOG_FLAGS (TRACE_OUT_OF_MEM | TRACE_MINOR | TRACE_PID | \
+	TRACE_FUNCTION | TRACE_SPECIAL | TRACE_MGMT | TRACE_MGMT_DEBUG | \
+	TRACE_TIME)
+#else /* DEBUG */
+# ifdef TRACING
+#define DEFAULT_LOG_FLAGS (TRACE_OUT_OF_MEM | TRACE_MGMT | \
+	TRACE_TIME | TRACE_SPECIAL)
+# else
+#define DEFAULT_LOG_FLAGS 0
+# endif
+#endif /* DEBUG */
+
+unsigned long trace_flag = DEFAULT_LOG_FLAGS;
+#endif /* defined(DEBUG) || defined(TRACING) */
+
+bool log_daemon = false;
+
+#define DEF_BLOCK_SIZE		4096
+#define DEF_DEPTH		32
+#define MAX_DEPTH		1024
+#define MAX_THREADS		256
+#define DEF_RUNTIME		10
+
+/*
+ * Latency histogram with 16 linear sub-buckets per power of two, i.e. with
+ * at most 1/16 relative error. Values below 16 ns have a bucket each.
+ */
+#define HIST_SUB_BITS		4
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct loadgen_stats {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t errors;
+	uint64_t lat_ns;	/* sum of the completion latencies */
+	uint64_t lat_max_ns;
+	uint64_t hist[HIST_BUCKETS];
+};
+
+struct loadgen_thread {
+	pthread_t thread;
+	int idx;
+	aio_context_t ctx;
+	uint64_t rnd;		/* xorshift64 state */
+	uint64_t next_blk;	/* for sequential I/O */
+	uint64_t first_blk;
+	uint64_t nblks;		/* this thread's part of the device */
+	struct iocb *iocbs;
+	uint64_t *submit_ns;
+	uint8_t *bufs;
+	struct loadgen_stats stats;
+};
+
+static const char *file_name;
+static int fd = -1;
+static int block_size = DEF_BLOCK_SIZE;
+static int depth = DEF_DEPTH;
+static int threads_num = 1;
+static int read_pct = 100;
+static bool sequential;
+static unsigned int runtime = DEF_RUNTIME;
+static unsigned int ramp_time;
+static uint64_t size_mb;
+static uint64_t nblocks;
+
+/* Completions before measure_start_ns are not accounted */
+static uint64_t measure_start_ns;
+static uint64_t measure_end_ns;
+static volatile sig_atomic_t stop;
+
+static struct loadgen_thread threads[MAX_THREADS];
+
+static struct option const long_options[] = {
+	{"block", required_argument, 0, 'b'},
+	{"depth", required_argument, 0, 'q'},
+	{"threads", required_argument, 0, 't'},
+	{"read_pct", required_argument, 0, 'r'},
+	{"seq", no_argument, 0, 'S'},
+	{"runtime", required_argument, 0, 'T'},
+	{"ramp_time", required_argument, 0, 'R'},
+	{"size_mb", required_argument, 0, 's'},
+#if defined(DEBUG) || defined(TRACING)
+	{"debug", required_argument, 0, 'd'},
+#endif
+	{"version", no_argument, 0, 'v'},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0},
+};
+
+static void usage(void)
+{
+	printf("Usage: %s [OPTIONS] device\n", app_name);
+	printf("\nO_DIRECT asynchronous I/O load generator\n");
+	printf("  -b, --block=size	I/O size, default %d\n", DEF_BLOCK_SIZE);
+	printf("  -q, --depth=n		I/Os in flight per thread, default %d, "
+		"max %d\n", DEF_DEPTH, MAX_DEPTH);
+	printf("  -t, --threads=n	Number of threads, default 1, max %d\n",
+		MAX_THREADS);
+	printf("  -r, --read_pct=n	Percentage of reads, default 100\n");
+	printf("  -S, --seq		Sequential instead of random I/O\n");
+	printf("  -T, --runtime=secs	Measured run time, default %d\n",
+		DEF_RUNTIME);
+	printf("  -R, --ramp_time=secs	Run time before the measurements start, "
+		"default 0\n");
+	printf("  -s, --size_mb=n	Use only the first n MB of the device\n");
+#if defined(DEBUG) || defined(TRACING)
+	printf("  -d, --debug=level	Debug tracing level\n");
+#endif
+	printf("  -v, --version		Show version and exit\n");
+	printf("\nWARNING: if read_pct is below 100, the device contents are "
+		"overwritten.\n");
+	return;
+}
+
+static inline int io_setup(unsigned int nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static inline int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static inline int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static inline int io_getevents(aio_context_t ctx, long min_nr, long nr,
+	struct io_event *events, struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static int hist_idx(uint64_t ns)
+{
+	int msb;
+
+	if (ns < HIST_SUB)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Returns the lowest latency, which falls into histogram bucket idx */
+static uint64_t hist_val(int idx)
+{
+	int msb, sub;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	sub = idx % HIST_SUB;
+	return (uint64_t)(HIST_SUB + sub) << (msb - HIST_SUB_BITS);
+}
+
+static void account_io(struct loadgen_stats *st, const struct iocb *iocb,
+	int64_t res, uint64_t lat)
+{
+	if (res != block_size) {
+		st->errors++;
+		return;
+	}
+
+	if (iocb->aio_lio_opcode == IOCB_CMD_PREAD)
+		st->reads++;
+	else
+		st->writes++;
+	st->lat_ns += lat;
+	if (lat > st->lat_max_ns)
+		st->lat_max_ns = lat;
+	st->hist[hist_idx(lat)]++;
+	return;
+}
+
+static void prep_io(struct loadgen_thread *t, int i)
+{
+	struct iocb *iocb = &t->iocbs[i];
+	uint64_t blk;
+	bool rd;
+
+	if (sequential) {
+		blk = t->next_blk;
+		if (++t->next_blk == t->nblks)
+			t->next_blk = 0;
+	} else
+		blk = xorshift64(&t->rnd) % t->nblks;
+
+	if (read_pct == 100)
+		rd = true;
+	else if (read_pct == 0)
+		rd = false;
+	else
+		rd = (xorshift64(&t->rnd) % 100) < (uint64_t)read_pct;
+
+	iocb->aio_lio_opcode = rd ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+	iocb->aio_offset = (t->first_blk + blk) * block_size;
+	return;
+}
+
+static void *io_loop(void *arg)
+{
+	struct loadgen_thread *t = arg;
+	struct io_event *events;
+	struct iocb **submit;
+	struct timespec timeout = { .tv_sec = 0, .tv_nsec = 100000000 };
+	int i, n, in_flight = 0, res;
+	uint64_t now;
+
+	events = calloc(depth, sizeof(*events));
+	submit = calloc(depth, sizeof(*submit));
+	if ((events == NULL) || (submit == NULL)) {
+		PRINT_ERROR("Thread %d: unable to allocate events", t->idx);
+		goto out_free;
+	}
+
+	for (i = 0; i < depth; i++) {
+		prep_io(t, i);
+		submit[i] = &t->iocbs[i];
+	}
+	n = depth;
+
+	while (1) {
+		now = now_ns();
+		for (i = 0; i < n; i++) {
+			int idx = submit[i] - t->iocbs;
+
+			t->submit_ns[idx] = now;
+		}
+		while (n > 0) {
+			res = io_submit(t->ctx, n, submit);
+			if (res < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				PRINT_ERROR("Thread %d: io_submit() failed: %s",
+					t->idx, strerror(errno));
+				stop = 1;
+				break;
+			}
+			in_flight += res;
+			n -= res;
+			memmove(submit, submit + res, n * sizeof(*submit));
+		}
+
+		if (in_flight == 0)
+			break;
+
+		res = io_getevents(t->ctx, 1, depth, events, &timeout);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			PRINT_ERROR("Thread %d: io_getevents() failed: %s",
+				t->idx, strerror(errno));
+			break;
+		}
+
+		now = now_ns();
+		if (now >= measure_end_ns)
+			stop = 1;
+
+		n = 0;
+		for (i = 0; i < res; i++) {
+			struct iocb *iocb = (struct iocb *)(unsigned long)
+				events[i].obj;
+			int idx = iocb - t->iocbs;
+
+			in_flight--;
+			if (t->submit_ns[idx] >= measure_start_ns)
+				account_io(&t->stats, iocb, events[i].res,
+					now - t->submit_ns[idx]);
+			else if (events[i].res != block_size)
+				t->stats.errors++;
+			if (!stop) {
+				prep_io(t, idx);
+				submit[n++] = iocb;
+			}
+		}
+	}
+
+out_free:
+	free(events);
+	free(submit);
+	return NULL;
+}
+
+static int init_thread(struct loadgen_thread *t, int idx)
+{
+	int res, i;
+
+	t->idx = idx;
+	t->rnd = (now_ns() ^ ((uint64_t)(idx + 1) << 32)) | 1;
+	/* Sequential streams of the threads don't overlap */
+	if (sequential) {
+		t->nblks = nblocks / threads_num;
+		t->first_blk = t->nblks * idx;
+	} else {
+		t->nblks = nblocks;
+		t->first_blk = 0;
+	}
+
+	t->iocbs = calloc(depth, sizeof(*t->iocbs));
+	t->submit_ns = calloc(depth, sizeof(*t->submit_ns));
+	if ((t->iocbs == NULL) || (t->submit_ns == NULL)) {
+		res = ENOMEM;
+		goto out;
+	}
+
+	res = posix_memalign((void **)&t->bufs, 4096,
+		(size_t)depth * block_size);
+	if (res != 0)
+		goto out;
+	memset(t->bufs, 0x5a, (size_t)depth * block_size);
+
+	for (i = 0; i < depth; i++) {
+		struct iocb *iocb = &t->iocbs[i];
+
+		iocb->aio_fildes = fd;
+		iocb->aio_buf = (unsigned long)(t->bufs +
+			(size_t)i * block_size);
+		iocb->aio_nbytes = block_size;
+	}
+
+	if (io_setup(depth, &t->ctx) != 0) {
+		res = errno;
+		PRINT_ERROR("io_setup() failed: %s", strerror(res));
+		goto out;
+	}
+
+out:
+	return res;
+}
+
+static void free_thread(struct loadgen_thread *t)
+{
+	if (t->ctx != 0)
+		io_destroy(t->ctx);
+	free(t->iocbs);
+	free(t->submit_ns);
+	free(t->bufs);
+	return;
+}
+
+static uint64_t percentile(const struct loadgen_stats *st, double pct)
+{
+	uint64_t ios = st->reads + st->writes, sum = 0, target;
+	int i;
+
+	if (ios == 0)
+		return 0;
+
+	target = (uint64_t)(ios * pct / 100);
+	if (target == 0)
+		target = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += st->hist[i];
+		if (sum >= target)
+			return hist_val(i);
+	}
+	return st->lat_max_ns;
+}
+
+static void print_stats(double secs)
+{
+	struct loadgen_stats total;
+	uint64_t ios;
+	int i, j;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < threads_num; i++) {
+		struct loadgen_stats *st = &threads[i].stats;
+
+		total.reads += st->reads;
+		total.writes += st->writes;
+		total.errors += st->errors;
+		total.lat_ns += st->lat_ns;
+		if (st->lat_max_ns > total.lat_max_ns)
+			total.lat_max_ns = st->lat_max_ns;
+		for (j = 0; j < HIST_BUCKETS; j++)
+			total.hist[j] += st->hist[j];
+	}
+	ios = total.reads + total.writes;
+
+	printf("bs=%d qd=%d threads=%d read_pct=%d pattern=%s time=%.2f "
+		"ios=%"PRIu64" errors=%"PRIu64" iops=%.0f read_iops=%.0f "
+		"write_iops=%.0f mbps=%.2f lat_avg_us=%.2f lat_p50_us=%.2f "
+		"lat_p99_us=%.2f lat_p999_us=%.2f lat_max_us=%.2f\n",
+		block_size, depth, threads_num, read_pct,
+		sequential ? "seq" : "rand", secs, ios, total.errors,
+		ios / secs, total.reads / secs, total.writes / secs,
+		ios * block_size / secs / (1024 * 1024),
+		ios ? total.lat_ns / 1000.0 / ios : 0,
+		percentile(&total, 50) / 1000.0,
+		percentile(&total, 99) / 1000.0,
+		percentile(&total, 99.9) / 1000.0,
+		total.lat_max_ns / 1000.0);
+	return;
+}
+
+static void sig_stop(int sig)
+{
+	stop = 1;
+	return;
+}
+
+static int get_size(uint64_t *size)
+{
+	struct stat st;
+	int res = 0;
+
+	if (fstat(fd, &st) != 0) {
+		res = errno;
+		goto out;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, size) != 0)
+			res = errno;
+	} else
+		*size = st.st_size;
+
+out:
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	int res = 0, ch, longindex, i, started = 0;
+	uint64_t size, start;
+	struct sigaction act;
+
+	setlinebuf(stdout);
+
+	res = debug_init();
+	if (res != 0)
+		goto out;
+
+	app_name = argv[0];
+
+	while ((ch = getopt_long(argc, argv, "+b:q:t:r:ST:R:s:d:vh",
+			long_options, &longindex)) >= 0) {
+		switch (ch) {
+		case 'b':
+			block_size = atoi(optarg);
+			if ((block_size < 512) || (block_size % 512) != 0)
+				goto out_usage;
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			if ((depth < 1) || (depth > MAX_DEPTH))
+				goto out_usage;
+			break;
+		case 't':
+			threads_num = atoi(optarg);
+			if ((threads_num < 1) || (threads_num > MAX_THREADS))
+				goto out_usage;
+			break;
+		case 'r':
+			read_pct = atoi(optarg);
+			if ((read_pct < 0) || (read_pct > 100))
+				goto out_usage;
+			break;
+		case 'S':
+			sequential = true;
+			break;
+		case 'T':
+			runtime = strtoul(optarg, NULL, 0);
+			if (runtime == 0)
+				goto out_usage;
+			break;
+		case 'R':
+			ramp_time = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size_mb = strtoull(optarg, NULL, 0);
+			break;
+#if defined(DEBUG) || defined(TRACING)
+		case 'd':
+			trace_flag = strtol(optarg, (char **)NULL, 0);
+			break;
+#endif
+		case 'v':
+			printf("%s version %s\n", app_name, VERSION_STR);
+			goto out_done;
+		default:
+			goto out_usage;
+		}
+	}
+
+	if (optind != argc - 1)
+		goto out_usage;
+	file_name = argv[optind];
+
+	fd = open(file_name, (read_pct == 100 ? O_RDONLY : O_RDWR) | O_DIRECT);
+	if (fd < 0) {
+		res = errno;
+		PRINT_ERROR("Unable to open %s (%s)", file_name, strerror(res));
+		goto out_done;
+	}
+
+	res = get_size(&size);
+	if (res != 0) {
+		PRINT_ERROR("Unable to get size of %s (%s)", file_name,
+			strerror(res));
+		goto out_close;
+	}
+	if ((size_mb != 0) && ((size_mb << 20) < size))
+		size = size_mb << 20;
+
+	nblocks = size / block_size;
+	if (nblocks < (uint64_t)threads_num) {
+		PRINT_ERROR("%s is too small (%"PRIu64" bytes)", file_name,
+			size);
+		res = EINVAL;
+		goto out_close;
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = sig_stop;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+
+	for (i = 0; i < threads_num; i++) {
+		res = init_thread(&threads[i], i);
+		if (res != 0) {
+			PRINT_ERROR("Unable to init thread %d: %s", i,
+				strerror(res));
+			goto out_free;
+		}
+	}
+
+	start = now_ns();
+	measure_start_ns = start + ramp_time * 1000000000ULL;
+	measure_end_ns = measure_start_ns + runtime * 1000000000ULL;
+
+	for (i = 0; i < threads_num; i++) {
+		res = pthread_create(&threads[i].thread, NULL, io_loop,
+			&threads[i]);
+		if (res != 0) {
+			PRINT_ERROR("Unable to start thread %d: %s", i,
+				strerror(res));
+			stop = 1;
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	if (res == 0) {
+		uint64_t end = now_ns();
+
+		/* Interrupted by a signal before the end of the run */
+		if (end > measure_end_ns)
+			end = measure_end_ns;
+		if (end > measure_start_ns)
+			print_stats((end - measure_start_ns) / 1e9);
+		else
+			res = EINTR;
+	}
+
+out_free:
+	for (i = 0; i < threads_num; i++)
+		free_thread(&threads[i]);
+
+out_close:
+	close(fd);
+
+out_done:
+	debug_done();
+
+out:
+	return res;
+
+out_usage:
+	usage();
+	res = EINVAL;
+	goto out_done;
+}
@@ -86,7 +86,7 @@ static void usage(int status)
 	}
 }
 
-static void stpg_handle_tm_received(struct scst_event_user *event_user)
+static void stpg_handle_tm_received(const struct scst_event *event)
 {
 	/*
 	 * Put code to abort state transition here, if this STPG cmd,
@@ -204,9 +204,9 @@ static int wait_until_finished(pid_t pid, unsigned long deadline, int *status, i
 	return res;
 }
 
-static int handle_stpg_received(struct scst_event_user *event_user)
+static int handle_stpg_received(const struct scst_event *event)
 {
-	const struct scst_event_stpg_payload *p = (struct scst_event_stpg_payload *)event_user->out_event.payload;
+	const struct scst_event_stpg_payload *p = (const struct scst_event_stpg_payload *)event->payload;
 	int num, k;
 	int res = 0;
 	pid_t pids[p->stpg_descriptors_cnt];
@@ -274,13 +274,14 @@ static int handle_stpg_received(struct scst_event_user *event_user)
 
 static int stpg_event_loop(void)
 {
-	int res = 0, status;
+	int res = 0, status, i;
 	int event_fd;
-	uint8_t event_user_buf[1024*1024];
+	static uint8_t events_buf[1024*1024] __attribute__((aligned(8)));
 	pid_t c_pid = 0;
 	struct pollfd pl;
-	struct scst_event_user *event_user =
-		(struct scst_event_user *)event_user_buf;
+	struct scst_event_user_batch batch;
+	const struct scst_event_batch_entry *be;
+	const struct scst_event *event;
 	struct scst_event e1;
 	bool first_error = true;
 
@@ -334,25 +335,26 @@ static int stpg_event_loop(void)
 	}
 
 	while (1) {
-		memset(event_user_buf, 0, sizeof(event_user_buf));
-		event_user->max_event_size = sizeof(event_user_buf);
-		res = ioctl(event_fd, SCST_EVENT_GET_NEXT_EVENT, event_user);
+		memset(&batch, 0, sizeof(batch));
+		batch.events_buf = (unsigned long)events_buf;
+		batch.events_buf_len = sizeof(events_buf);
+		res = ioctl(event_fd, SCST_EVENT_GET_NEXT_EVENTS, &batch);
 		if (res != 0) {
 			res = -errno;
 			switch (-res) {
 			case ESRCH:
 			case EBUSY:
-				TRACE_MGMT_DBG("SCST_EVENT_GET_NEXT_EVENT "
+				TRACE_MGMT_DBG("SCST_EVENT_GET_NEXT_EVENTS "
 					"returned %d (%s)", res, strerror(res));
 				/* fall through */
 			case EINTR:
 				continue;
 			case EAGAIN:
-				TRACE_DBG("SCST_EVENT_GET_NEXT_EVENT, "
+				TRACE_DBG("SCST_EVENT_GET_NEXT_EVENTS, "
 					"returned EAGAIN (%d)", -res);
 				continue;
 			default:
-				PRINT_ERROR("SCST_EVENT_GET_NEXT_EVENT "
+				PRINT_ERROR("SCST_EVENT_GET_NEXT_EVENTS "
 					"failed: %d (%s)", res, strerror(-res));
 				if (!first_error)
 					goto out;
@@ -384,43 +386,52 @@ again_poll:
 			}
 		}
 		first_error = true;
+
+		if (batch.dropped_cnt != 0)
+			PRINT_WARNING("%u events lost", batch.dropped_cnt);
+
+		be = (const struct scst_event_batch_entry *)events_buf;
+		for (i = 0; i < batch.events_cnt; i++,
+		     be = SCST_EVENT_BATCH_NEXT(be)) {
+			event = &be->event;
 #ifdef DEBUG
-		PRINT_INFO("event_code %d, issuer_name %s",
-			event_user->out_event.event_code,
-			event_user->out_event.issuer_name);
+			PRINT_INFO("event_code %d, issuer_name %s, coalesced %u",
+				event->event_code, event->issuer_name,
+				be->coalesced_cnt);
 #endif
-		if (event_user->out_event.payload_len != 0)
-			TRACE_BUFFER("payload", event_user->out_event.payload,
-				event_user->out_event.payload_len);
-
-		if (event_user->out_event.event_code == SCST_EVENT_STPG_USER_INVOKE) {
-			c_pid = fork();
-			if (c_pid == -1)
-				PRINT_ERROR("Failed to fork: %d", c_pid);
-			else if (c_pid == 0) {
-				struct scst_event_notify_done d;
-
-				signal(SIGCHLD, SIG_DFL);
-
-				status = handle_stpg_received(event_user);
-
-				memset(&d, 0, sizeof(d));
-				d.event_id = event_user->out_event.event_id;
-				d.status = status;
-				res = ioctl(event_fd, SCST_EVENT_NOTIFY_DONE, &d);
-				if (res != 0) {
-					res = -errno;
-					PRINT_ERROR("SCST_EVENT_NOTIFY_DONE "
-						"failed: %s (res %d)",
-						strerror(-res), res);
-				} else
-					PRINT_INFO("STPG event completed with status %d", status);
-				exit(res);
-			}
-		} else if (event_user->out_event.event_code == SCST_EVENT_TM_FN_RECEIVED)
-			stpg_handle_tm_received(event_user);
-		else
-			PRINT_ERROR("Unknown event %d received", event_user->out_event.event_code);
+			if (event->payload_len != 0)
+				TRACE_BUFFER("payload", event->payload,
+					event->payload_len);
+
+			if (event->event_code == SCST_EVENT_STPG_USER_INVOKE) {
+				c_pid = fork();
+				if (c_pid == -1)
+					PRINT_ERROR("Failed to fork: %d", c_pid);
+				else if (c_pid == 0) {
+					struct scst_event_notify_done d;
+
+					signal(SIGCHLD, SIG_DFL);
+
+					status = handle_stpg_received(event);
+
+					memset(&d, 0, sizeof(d));
+					d.event_id = event->event_id;
+					d.status = status;
+					res = ioctl(event_fd, SCST_EVENT_NOTIFY_DONE, &d);
+					if (res != 0) {
+						res = -errno;
+						PRINT_ERROR("SCST_EVENT_NOTIFY_DONE "
+							"failed: %s (res %d)",
+							strerror(-res), res);
+					} else
+						PRINT_INFO("STPG event completed with status %d", status);
+					exit(res);
+				}
+			} else if (event->event_code == SCST_EVENT_TM_FN_RECEIVED)
+				stpg_handle_tm_received(event);
+			else
+				PRINT_ERROR("Unknown event %d received", event->event_code);
+		}
 	}
 out:
 	return res;
@@ -0,0 +1,997 @@
+/*
+ *  ubench.c
+ *
+ *  Benchmark of the scst_user interface itself. Registers an scst_user
+ *  device, which completes all commands immediately without touching any
+ *  data, serves it with the selected interface mode and on exit reports
+ *  how many commands, subcommands and syscalls it served and how long it
+ *  waited for the next commands. See ubench-run for a load generator.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, version 2
+ *  of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include <pthread.h>
+
+#include "version.h"
+#include <scst_user.h>
+#include "debug.h"
+
+char *app_name;
+
+#if defined(DEBUG) || defined(TRACING)
+
+#ifdef DEBUG
+#define DEFAULT_LOG_FLAGS (TRACE_OUT_OF_MEM | TRACE_MINOR | TRACE_PID | \
+	TRACE_FUNCTION | TRACE_SPECIAL | TRACE_MGMT | TRACE_MGMT_DEBUG | \
+	TRACE_TIME)
+#else /* DEBUG */
+# ifdef TRACING
+#define DEFAULT_LOG_FLAGS (TRACE_OUT_OF_MEM | TRACE_MGMT | \
+	TRACE_TIME | TRACE_SPECIAL)
+# else
+#define DEFAULT_LOG_FLAGS 0
+# endif
+#endif /* DEBUG */
+
+unsigned long trace_flag = DEFAULT_LOG_FLAGS;
+#endif /* defined(DEBUG) || defined(TRACING) */
+
+bool log_daemon = false;
+
+#define DEF_NAME		"ubench"
+#define DEF_BLOCK_SIZE		512
+#define DEF_SIZE_MB		1024
+#define DEF_BATCH		8
+#define MAX_BATCH		64
+#define MAX_THREADS		32
+#define DEF_RING_ENTRIES	256
+
+#define SENSE_LEN		18
+#define INQ_BUF_SZ		96
+/* 8 byte ASCII Vendor */
+#define VENDOR			"SCST_USR"
+
+/* Buckets of the wait histogram: [0, 1us), [1us, 2us), [2us, 4us) ... */
+#define HIST_BUCKETS		24
+
+enum ubench_mode {
+	MODE_CMD,	/* SCST_USER_REPLY_AND_GET_CMD */
+	MODE_MULTI,	/* SCST_USER_REPLY_AND_GET_MULTI */
+	MODE_RING,	/* SCST_USER_RING_SETUP */
+};
+
+static const char *const mode_names[] = {
+	[MODE_CMD] = "cmd",
+	[MODE_MULTI] = "multi",
+	[MODE_RING] = "ring",
+};
+
+struct ubench_stats {
+	uint64_t cmds;		/* executed SCSI commands */
+	uint64_t subcmds;	/* all received subcommands */
+	uint64_t syscalls;
+	uint64_t batches;	/* not empty batches of subcommands */
+	uint64_t wait_ns;	/* total time spent waiting for subcommands */
+	uint64_t hist[HIST_BUCKETS];
+};
+
+struct ubench_thread {
+	pthread_t thread;
+	int idx;
+	struct ubench_stats stats;
+};
+
+static struct ubench_ring {
+	void *mem;
+	size_t size;
+	int eventfd;
+	struct scst_user_ring_hdr *cmd_hdr;
+	struct scst_user_get_cmd *cmds;
+	struct scst_user_ring_hdr *reply_hdr;
+	struct scst_user_reply_cmd *replies;
+	uint32_t cmd_mask;
+	uint32_t reply_mask;
+	/* Sense buffers must stay valid until the kernel consumes replies */
+	uint8_t (*sense)[SENSE_LEN];
+} ring;
+
+static int scst_usr_fd = -1;
+static enum ubench_mode mode = MODE_MULTI;
+static int batch = DEF_BATCH;
+static int threads_num = 1;
+static int use_queues;
+static int queue_steering = SCST_USER_QUEUE_STEER_CPU;
+static int ring_entries = DEF_RING_ENTRIES;
+static unsigned int poll_usecs;
+static unsigned int user_poll_usecs;
+static int block_size = DEF_BLOCK_SIZE;
+static int block_shift = 9;
+static uint64_t nblocks;
+static const char *dev_name = DEF_NAME;
+
+static volatile sig_atomic_t stop;
+
+static struct ubench_thread threads[MAX_THREADS];
+
+static struct option const long_options[] = {
+	{"mode", required_argument, 0, 'm'},
+	{"batch", required_argument, 0, 'b'},
+	{"threads", required_argument, 0, 't'},
+	{"queues", no_argument, 0, 'Q'},
+	{"lba_steering", no_argument, 0, 'L'},
+	{"ring_entries", required_argument, 0, 'r'},
+	{"poll_usecs", required_argument, 0, 'p'},
+	{"user_poll_usecs", required_argument, 0, 'u'},
+	{"block", required_argument, 0, 'B'},
+	{"size_mb", required_argument, 0, 's'},
+	{"name", required_argument, 0, 'n'},
+#if defined(DEBUG) || defined(TRACING)
+	{"debug", required_argument, 0, 'd'},
+#endif
+	{"version", no_argument, 0, 'v'},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0},
+};
+
+static void usage(void)
+{
+	printf("Usage: %s [OPTIONS]\n", app_name);
+	printf("\nscst_user interface benchmark with a NULL backend\n");
+	printf("  -m, --mode=cmd|multi|ring Interface mode, default multi\n");
+	printf("  -b, --batch=n		Max subcommands per syscall or per ring pass "
+		"(multi and ring modes), default %d, max %d\n", DEF_BATCH,
+		MAX_BATCH);
+	printf("  -t, --threads=n	Number of threads (cmd and multi modes), "
+		"default 1\n");
+	printf("  -Q, --queues		Register a queue per thread and bind "
+		"threads to them (multi mode)\n");
+	printf("  -L, --lba_steering	Steer commands to queues by LBA instead "
+		"of CPU\n");
+	printf("  -r, --ring_entries=n	Entries in each ring, default %d\n",
+		DEF_RING_ENTRIES);
+	printf("  -p, --poll_usecs=n	Kernel rings thread busy poll time, "
+		"default 0\n");
+	printf("  -u, --user_poll_usecs=n	User space busy poll time of the "
+		"commands ring, default 0\n");
+	printf("  -B, --block=size	Block size, default %d\n", DEF_BLOCK_SIZE);
+	printf("  -s, --size_mb=n	Device size in MB, default %d\n",
+		DEF_SIZE_MB);
+	printf("  -n, --name=name	Device name, default %s\n", DEF_NAME);
+#if defined(DEBUG) || defined(TRACING)
+	printf("  -d, --debug=level	Debug tracing level\n");
+#endif
+	printf("  -v, --version		Show version and exit\n");
+	printf("\nStatistics are printed on SIGINT or SIGTERM.\n");
+	return;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void account_wait(struct ubench_stats *st, uint64_t start, int got)
+{
+	uint64_t ns = now_ns() - start;
+	uint64_t us = ns / 1000;
+	int b = 0;
+
+	if (got == 0)
+		return;
+
+	st->batches++;
+	st->subcmds += got;
+	st->wait_ns += ns;
+	while ((us != 0) && (b < HIST_BUCKETS - 1)) {
+		us >>= 1;
+		b++;
+	}
+	st->hist[b]++;
+	return;
+}
+
+static int set_sense(uint8_t *buffer, int key, int asc, int ascq)
+{
+	memset(buffer, 0, SENSE_LEN);
+	buffer[0] = 0x70;	/* Error Code			*/
+	buffer[2] = key;	/* Sense Key			*/
+	buffer[7] = 0x0a;	/* Additional Sense Length	*/
+	buffer[12] = asc;	/* ASC				*/
+	buffer[13] = ascq;	/* ASCQ				*/
+	return SENSE_LEN;
+}
+
+static void set_cmd_error(struct scst_user_scsi_cmd_reply_exec *reply,
+	uint8_t *sense, int key, int asc, int ascq)
+{
+	reply->status = SAM_STAT_CHECK_CONDITION;
+	reply->resp_data_len = 0;
+	reply->sense_len = set_sense(sense, key, asc, ascq);
+	reply->psense_buffer = (unsigned long)sense;
+	return;
+}
+
+static void *alloc_buf(int len)
+{
+	void *p;
+
+	if (posix_memalign(&p, sysconf(_SC_PAGESIZE), len) != 0)
+		return NULL;
+	memset(p, 0, len);
+	return p;
+}
+
+static int exec_inquiry(const uint8_t *cdb, uint8_t *buf)
+{
+	int len;
+
+	memset(buf, 0, INQ_BUF_SZ);
+	buf[0] = TYPE_DISK;
+
+	if (cdb[1] & 0x01) {
+		/* EVPD */
+		buf[1] = cdb[2];
+		switch (cdb[2]) {
+		case 0x00:
+			buf[3] = 2;
+			buf[4] = 0x00;
+			buf[5] = 0x80;
+			return 6;
+		case 0x80:
+			len = snprintf((char *)&buf[4], INQ_BUF_SZ - 4, "%s",
+				dev_name);
+			buf[3] = len;
+			return len + 4;
+		default:
+			return -1;
+		}
+	}
+
+	if (cdb[2] != 0)
+		return -1;
+
+	buf[2] = 6;	/* SPC-4 */
+	buf[3] = 0x12;	/* HiSup + data in format specified in SPC */
+	buf[4] = 31;	/* n - 4 = 35 - 4 = 31 for full 36 byte data */
+	buf[7] = 0x02;	/* CmdQue */
+	memcpy(&buf[8], VENDOR, 8);
+	memset(&buf[16], ' ', 16);
+	memcpy(&buf[16], dev_name, strnlen(dev_name, 16));
+	memcpy(&buf[32], "340 ", 4);
+	return 36;
+}
+
+static int exec_read_capacity(const uint8_t *cdb, uint8_t *buf)
+{
+	uint64_t last = nblocks - 1;
+
+	if (cdb[0] == READ_CAPACITY) {
+		memset(buf, 0, 8);
+		*(uint32_t *)&buf[0] = htonl(last > 0xfffffffe ? 0xffffffff :
+						(uint32_t)last);
+		*(uint32_t *)&buf[4] = htonl(block_size);
+		return 8;
+	}
+
+	memset(buf, 0, 32);
+	*(uint32_t *)&buf[0] = htonl(last >> 32);
+	*(uint32_t *)&buf[4] = htonl((uint32_t)last);
+	*(uint32_t *)&buf[8] = htonl(block_size);
+	return 32;
+}
+
+static int exec_mode_sense(const uint8_t *cdb, uint8_t *buf)
+{
+	/* Only the header, no block descriptors and no pages */
+	if (cdb[0] == MODE_SENSE) {
+		memset(buf, 0, 4);
+		buf[0] = 3;
+		return 4;
+	}
+	memset(buf, 0, 8);
+	buf[1] = 6;
+	return 8;
+}
+
+static void exec_cmd(struct ubench_stats *st, struct scst_user_get_cmd *cmd,
+	struct scst_user_reply_cmd *reply, uint8_t *sense)
+{
+	struct scst_user_scsi_cmd_exec *ex = &cmd->exec_cmd;
+	struct scst_user_scsi_cmd_reply_exec *r = &reply->exec_reply;
+	const uint8_t *cdb = ex->cdb;
+	uint8_t *buf = (uint8_t *)(unsigned long)ex->pbuf;
+	int len = 0;
+
+	st->cmds++;
+
+	r->reply_type = SCST_EXEC_REPLY_COMPLETED;
+
+	if ((ex->pbuf == 0) && (ex->alloc_len != 0)) {
+		buf = alloc_buf(ex->alloc_len);
+		if (buf == NULL) {
+			r->status = SAM_STAT_TASK_SET_FULL;
+			return;
+		}
+		r->pbuf = (unsigned long)buf;
+	}
+
+	switch (cdb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case VERIFY:
+	case VERIFY_16:
+		if ((ex->lba < 0) || ((uint64_t)ex->lba +
+				((uint64_t)ex->data_len >> block_shift) > nblocks)) {
+			set_cmd_error(r, sense, SCST_LOAD_SENSE(
+				scst_sense_block_out_range_error));
+			return;
+		}
+		if (ex->data_direction & SCST_DATA_READ)
+			len = ex->bufflen;
+		break;
+	case TEST_UNIT_READY:
+	case START_STOP:
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		break;
+	case INQUIRY:
+		len = exec_inquiry(cdb, buf);
+		break;
+	case READ_CAPACITY:
+		len = exec_read_capacity(cdb, buf);
+		break;
+	case SERVICE_ACTION_IN_16:
+		if ((cdb[1] & 0x1f) == SAI_READ_CAPACITY_16)
+			len = exec_read_capacity(cdb, buf);
+		else
+			len = -1;
+		break;
+	case MODE_SENSE:
+	case MODE_SENSE_10:
+		len = exec_mode_sense(cdb, buf);
+		break;
+	case REQUEST_SENSE:
+		len = set_sense(buf, NO_SENSE, 0, 0);
+		break;
+	default:
+		TRACE_DBG("Unsupported opcode %x", cdb[0]);
+		set_cmd_error(r, sense, SCST_LOAD_SENSE(
+			scst_sense_invalid_opcode));
+		return;
+	}
+
+	if (len < 0) {
+		set_cmd_error(r, sense, SCST_LOAD_SENSE(
+			scst_sense_invalid_field_in_cdb));
+		return;
+	}
+
+	r->resp_data_len = (len < ex->bufflen) ? len : ex->bufflen;
+	return;
+}
+
+/* Processes subcommand cmd and fills reply on it */
+static void process_cmd(struct ubench_stats *st, struct scst_user_get_cmd *cmd,
+	struct scst_user_reply_cmd *reply, uint8_t *sense)
+{
+	memset(reply, 0, sizeof(*reply));
+	reply->cmd_h = cmd->cmd_h;
+	reply->subcode = cmd->subcode;
+
+	switch (cmd->subcode) {
+	case SCST_USER_EXEC:
+		exec_cmd(st, cmd, reply, sense);
+		break;
+
+	case SCST_USER_ALLOC_MEM:
+		reply->alloc_reply.pbuf = (unsigned long)alloc_buf(
+						cmd->alloc_cmd.alloc_len);
+		break;
+
+	case SCST_USER_PARSE:
+	{
+		struct scst_user_scsi_cmd_parse *p = &cmd->parse_cmd;
+		struct scst_user_scsi_cmd_reply_parse *pr = &reply->parse_reply;
+
+		pr->queue_type = p->queue_type;
+		pr->data_direction = p->expected_data_direction;
+		pr->lba = p->lba;
+		pr->data_len = p->expected_transfer_len;
+		pr->bufflen = p->expected_transfer_len;
+		pr->out_bufflen = p->expected_out_transfer_len;
+		pr->cdb_len = p->cdb_len;
+		pr->op_flags = p->op_flags | SCST_INFO_VALID;
+		break;
+	}
+
+	case SCST_USER_ON_FREE_CMD:
+		if (!cmd->on_free_cmd.buffer_cached &&
+		    (cmd->on_free_cmd.pbuf != 0))
+			free((void *)(unsigned long)cmd->on_free_cmd.pbuf);
+		break;
+
+	case SCST_USER_ON_CACHED_MEM_FREE:
+		free((void *)(unsigned long)cmd->on_cached_mem_free.pbuf);
+		break;
+
+	case SCST_USER_ATTACH_SESS:
+	case SCST_USER_DETACH_SESS:
+		PRINT_INFO("Session %"PRIx64" %s", cmd->sess.sess_h,
+			(cmd->subcode == SCST_USER_ATTACH_SESS) ?
+				"attached" : "detached");
+		break;
+
+	case SCST_USER_TASK_MGMT_RECEIVED:
+	case SCST_USER_TASK_MGMT_DONE:
+		TRACE_MGMT_DBG("TM fn %d", cmd->tm_cmd.fn);
+		break;
+
+	default:
+		PRINT_ERROR("Unknown or wrong cmd subcode %x", cmd->subcode);
+		break;
+	}
+	return;
+}
+
+static void *cmd_loop(void *arg)
+{
+	struct ubench_thread *t = arg;
+	struct ubench_stats *st = &t->stats;
+	struct scst_user_get_cmd cmd;
+	struct scst_user_reply_cmd reply;
+	uint8_t sense[SENSE_LEN];
+	uint64_t start;
+	int res;
+
+	cmd.preply = 0;
+	while (!stop) {
+		start = now_ns();
+		res = ioctl(scst_usr_fd, SCST_USER_REPLY_AND_GET_CMD, &cmd);
+		st->syscalls++;
+		if (res != 0) {
+			res = errno;
+			cmd.preply = 0;
+			switch (res) {
+			case EINTR:
+			case EAGAIN:
+			case ESRCH:
+			case EBUSY:
+				continue;
+			default:
+				PRINT_ERROR("SCST_USER_REPLY_AND_GET_CMD failed: "
+					"%s (%d)", strerror(res), res);
+				continue;
+			}
+		}
+		account_wait(st, start, 1);
+
+		process_cmd(st, &cmd, &reply, sense);
+		/* preply shares space with the subcommand, which isn't needed anymore */
+		cmd.preply = (unsigned long)&reply;
+	}
+	return NULL;
+}
+
+static void *multi_loop(void *arg)
+{
+	struct ubench_thread *t = arg;
+	struct ubench_stats *st = &t->stats;
+	struct {
+		struct scst_user_reply_cmd replies[MAX_BATCH];
+		uint8_t sense[MAX_BATCH][SENSE_LEN];
+		struct scst_user_get_multi multi_cmd;
+		struct scst_user_get_cmd cmds[MAX_BATCH];
+	} *m;
+	uint64_t start;
+	int res, i;
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL) {
+		PRINT_ERROR("%s", "Unable to allocate multi buffer");
+		return NULL;
+	}
+
+	m->multi_cmd.preplies = (unsigned long)&m->replies[0];
+	m->multi_cmd.queue = use_queues ? t->idx + 1 : 0;
+
+	while (!stop) {
+		m->multi_cmd.cmds_cnt = batch;
+		start = now_ns();
+		res = ioctl(scst_usr_fd, SCST_USER_REPLY_AND_GET_MULTI,
+			&m->multi_cmd);
+		st->syscalls++;
+		if (res != 0) {
+			res = errno;
+			switch (res) {
+			case EINTR:
+			case EAGAIN:
+				/* Replies might be partially done */
+				break;
+			case ESRCH:
+			case EBUSY:
+				m->multi_cmd.replies_cnt = 0;
+				continue;
+			default:
+				PRINT_ERROR("SCST_USER_REPLY_AND_GET_MULTI failed: "
+					"%s (%d)", strerror(res), res);
+				m->multi_cmd.replies_cnt = 0;
+				continue;
+			}
+		}
+
+		if (m->multi_cmd.replies_done < m->multi_cmd.replies_cnt) {
+			/* Retry the unprocessed replies */
+			memmove(&m->replies[0],
+				&m->replies[m->multi_cmd.replies_done],
+				(m->multi_cmd.replies_cnt -
+				 m->multi_cmd.replies_done) *
+					sizeof(m->replies[0]));
+			m->multi_cmd.replies_cnt -= m->multi_cmd.replies_done;
+			continue;
+		}
+
+		if (res != 0) {
+			m->multi_cmd.replies_cnt = 0;
+			continue;
+		}
+
+		account_wait(st, start, m->multi_cmd.cmds_cnt);
+
+		for (i = 0; i < m->multi_cmd.cmds_cnt; i++)
+			process_cmd(st, &m->cmds[i], &m->replies[i],
+				m->sense[i]);
+		m->multi_cmd.replies_cnt = m->multi_cmd.cmds_cnt;
+	}
+
+	free(m);
+	return NULL;
+}
+
+static int ring_setup(void)
+{
+	struct scst_user_ring_setup setup;
+	int res;
+
+	ring.eventfd = eventfd(0, EFD_NONBLOCK);
+	if (ring.eventfd < 0) {
+		res = errno;
+		PRINT_ERROR("eventfd() failed: %s", strerror(res));
+		goto out;
+	}
+
+	memset(&setup, 0, sizeof(setup));
+	setup.cmd_entries = ring_entries;
+	setup.reply_entries = ring_entries;
+	setup.eventfd = ring.eventfd;
+	setup.poll_usecs = poll_usecs;
+	res = ioctl(scst_usr_fd, SCST_USER_RING_SETUP, &setup);
+	if (res != 0) {
+		res = errno;
+		PRINT_ERROR("Unable to set up rings: %s", strerror(res));
+		goto out;
+	}
+
+	ring.size = setup.mmap_size;
+	ring.mem = mmap(NULL, ring.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			scst_usr_fd, 0);
+	if (ring.mem == MAP_FAILED) {
+		res = errno;
+		PRINT_ERROR("Unable to mmap rings: %s", strerror(res));
+		ring.mem = NULL;
+		goto out;
+	}
+
+	ring.cmd_hdr = (void *)((char *)ring.mem + setup.cmd_hdr_offs);
+	ring.cmds = (void *)((char *)ring.mem + setup.cmds_offs);
+	ring.reply_hdr = (void *)((char *)ring.mem + setup.reply_hdr_offs);
+	ring.replies = (void *)((char *)ring.mem + setup.replies_offs);
+	ring.cmd_mask = setup.cmd_entries - 1;
+	ring.reply_mask = setup.reply_entries - 1;
+
+	ring.sense = calloc(setup.reply_entries, SENSE_LEN);
+	if (ring.sense == NULL) {
+		res = ENOMEM;
+		goto out;
+	}
+
+	PRINT_INFO("Rings set up: %d commands, %d replies entries",
+		setup.cmd_entries, setup.reply_entries);
+
+out:
+	return res;
+}
+
+/* Makes replies and consumed commands visible and kicks the kernel thread */
+static void ring_publish(struct ubench_stats *st, uint32_t cmd_head,
+	uint32_t reply_tail)
+{
+	__atomic_store_n(&ring.cmd_hdr->head, cmd_head, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring.reply_hdr->tail, reply_tail, __ATOMIC_RELEASE);
+	/* Pairs with the kernel thread setting NEED_WAKEUP and rechecking */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring.reply_hdr->flags, __ATOMIC_RELAXED) &
+	    SCST_USER_RING_NEED_WAKEUP) {
+		ioctl(scst_usr_fd, SCST_USER_RING_WAKEUP, NULL);
+		st->syscalls++;
+	}
+	return;
+}
+
+/* Waits for new commands in the commands ring */
+static void ring_wait(struct ubench_stats *st, uint32_t cmd_head)
+{
+	struct pollfd pl;
+	uint64_t start = now_ns(), cnt;
+
+	while (__atomic_load_n(&ring.cmd_hdr->tail, __ATOMIC_ACQUIRE) ==
+			cmd_head) {
+		if ((now_ns() - start) / 1000 < user_poll_usecs)
+			continue;
+
+		__atomic_store_n(&ring.cmd_hdr->flags,
+			SCST_USER_RING_NEED_WAKEUP, __ATOMIC_RELAXED);
+		/* Pairs with the kernel producing commands and checking flags */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring.cmd_hdr->tail, __ATOMIC_ACQUIRE) ==
+				cmd_head) {
+			memset(&pl, 0, sizeof(pl));
+			pl.fd = ring.eventfd;
+			pl.events = POLLIN;
+			poll(&pl, 1, -1);
+			st->syscalls++;
+			if (read(ring.eventfd, &cnt, sizeof(cnt)) > 0)
+				st->syscalls++;
+		}
+		__atomic_store_n(&ring.cmd_hdr->flags, 0, __ATOMIC_RELAXED);
+		if (stop)
+			break;
+	}
+	return;
+}
+
+static void *ring_loop(void *arg)
+{
+	struct ubench_thread *t = arg;
+	struct ubench_stats *st = &t->stats;
+	uint32_t cmd_head = ring.cmd_hdr->head;
+	uint32_t reply_tail = ring.reply_hdr->tail;
+	uint32_t tail;
+	uint64_t start;
+	int n;
+
+	while (!stop) {
+		start = now_ns();
+		ring_wait(st, cmd_head);
+		tail = __atomic_load_n(&ring.cmd_hdr->tail, __ATOMIC_ACQUIRE);
+		if (tail == cmd_head)
+			continue;
+
+		account_wait(st, start, (tail - cmd_head) < (uint32_t)batch ?
+					(int)(tail - cmd_head) : batch);
+
+		for (n = 0; (cmd_head != tail) && (n < batch); n++) {
+			struct scst_user_get_cmd cmd;
+
+			/* Wait for the kernel to consume replies, if full */
+			while (reply_tail - __atomic_load_n(&ring.reply_hdr->head,
+					__ATOMIC_ACQUIRE) > ring.reply_mask) {
+				ring_publish(st, cmd_head, reply_tail);
+				if (stop)
+					goto out;
+			}
+
+			/* Copy it, the slot is reused once head is published */
+			memcpy(&cmd, &ring.cmds[cmd_head & ring.cmd_mask],
+				sizeof(cmd));
+			cmd_head++;
+
+			process_cmd(st, &cmd,
+				&ring.replies[reply_tail & ring.reply_mask],
+				ring.sense[reply_tail & ring.reply_mask]);
+			reply_tail++;
+		}
+
+		ring_publish(st, cmd_head, reply_tail);
+	}
+
+out:
+	return NULL;
+}
+
+static void print_stats(double secs)
+{
+	struct ubench_stats total;
+	uint64_t us;
+	int i, j, last = 0;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < threads_num; i++) {
+		struct ubench_stats *st = &threads[i].stats;
+
+		total.cmds += st->cmds;
+		total.subcmds += st->subcmds;
+		total.syscalls += st->syscalls;
+		total.batches += st->batches;
+		total.wait_ns += st->wait_ns;
+		for (j = 0; j < HIST_BUCKETS; j++) {
+			total.hist[j] += st->hist[j];
+			if (total.hist[j] != 0 && j > last)
+				last = j;
+		}
+	}
+
+	printf("mode %s batch %d threads %d queues %d time %.1f\n",
+		mode_names[mode], batch, threads_num,
+		use_queues ? threads_num : 1, secs);
+	printf("cmds %"PRIu64" subcmds %"PRIu64" syscalls %"PRIu64
+		" iops %.0f syscalls/cmd %.3f subcmds/batch %.2f "
+		"avg_wait_us %.2f\n", total.cmds, total.subcmds,
+		total.syscalls, secs > 0 ? total.cmds / secs : 0,
+		total.cmds ? (double)total.syscalls / total.cmds : 0,
+		total.batches ? (double)total.subcmds / total.batches : 0,
+		total.batches ? total.wait_ns / 1000.0 / total.batches : 0);
+	printf("wait_us batches\n");
+	for (i = 0; i <= last; i++) {
+		us = (i == 0) ? 0 : 1ULL << (i - 1);
+		printf("%7"PRIu64"+ %"PRIu64"\n", us, total.hist[i]);
+	}
+	return;
+}
+
+static void sig_nop(int sig)
+{
+	return;
+}
+
+static int start_threads(void)
+{
+	void *(*fn)(void *);
+	int i, res = 0;
+
+	switch (mode) {
+	case MODE_CMD:
+		fn = cmd_loop;
+		break;
+	case MODE_MULTI:
+		fn = multi_loop;
+		break;
+	default:
+		fn = ring_loop;
+		break;
+	}
+
+	for (i = 0; i < threads_num; i++) {
+		threads[i].idx = i;
+		res = pthread_create(&threads[i].thread, NULL, fn, &threads[i]);
+		if (res != 0) {
+			PRINT_ERROR("pthread_create() failed: %s",
+				strerror(res));
+			threads_num = i;
+			break;
+		}
+	}
+	return res;
+}
+
+static void stop_threads(void)
+{
+	int i;
+
+	stop = 1;
+	for (i = 0; i < threads_num; i++) {
+		/* Kick it out of ioctl() or poll() until it notices stop */
+		while (pthread_tryjoin_np(threads[i].thread, NULL) == EBUSY) {
+			pthread_kill(threads[i].thread, SIGUSR1);
+			usleep(10000);
+		}
+	}
+	return;
+}
+
+int main(int argc, char **argv)
+{
+	int res = 0, ch, longindex, sig;
+	uint64_t size_mb = DEF_SIZE_MB, start;
+	struct scst_user_dev_desc desc;
+	struct sigaction act;
+	sigset_t set;
+
+	setlinebuf(stdout);
+
+	res = debug_init();
+	if (res != 0)
+		goto out;
+
+	app_name = argv[0];
+
+	while ((ch = getopt_long(argc, argv, "+m:b:t:QLr:p:u:B:s:n:d:vh",
+			long_options, &longindex)) >= 0) {
+		switch (ch) {
+		case 'm':
+			if (strcmp(optarg, "cmd") == 0)
+				mode = MODE_CMD;
+			else if (strcmp(optarg, "multi") == 0)
+				mode = MODE_MULTI;
+			else if (strcmp(optarg, "ring") == 0)
+				mode = MODE_RING;
+			else
+				goto out_usage;
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			if ((batch < 1) || (batch > MAX_BATCH))
+				goto out_usage;
+			break;
+		case 't':
+			threads_num = atoi(optarg);
+			if ((threads_num < 1) || (threads_num > MAX_THREADS))
+				goto out_usage;
+			break;
+		case 'Q':
+			use_queues = 1;
+			break;
+		case 'L':
+			queue_steering = SCST_USER_QUEUE_STEER_LBA;
+			break;
+		case 'r':
+			ring_entries = atoi(optarg);
+			break;
+		case 'p':
+			poll_usecs = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			user_poll_usecs = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			block_size = atoi(optarg);
+			if ((block_size < 512) ||
+			    (block_size & (block_size - 1)) != 0)
+				goto out_usage;
+			block_shift = ffs(block_size) - 1;
+			break;
+		case 's':
+			size_mb = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			dev_name = optarg;
+			break;
+#if defined(DEBUG) || defined(TRACING)
+		case 'd':
+			trace_flag = strtol(optarg, (char **)NULL, 0);
+			break;
+#endif
+		case 'v':
+			printf("%s version %s\n", app_name, VERSION_STR);
+			goto out_done;
+		default:
+			goto out_usage;
+		}
+	}
+
+	if (mode == MODE_RING)
+		threads_num = 1;
+	else if (mode == MODE_CMD)
+		batch = 1;
+	if (mode != MODE_MULTI)
+		use_queues = 0;
+
+	nblocks = (size_mb << 20) >> block_shift;
+	if (nblocks == 0)
+		goto out_usage;
+
+	scst_usr_fd = open(DEV_USER_PATH DEV_USER_NAME, O_RDWR);
+	if (scst_usr_fd < 0) {
+		res = errno;
+		PRINT_ERROR("Unable to open SCST device %s (%s)",
+			DEV_USER_PATH DEV_USER_NAME, strerror(res));
+		goto out_done;
+	}
+
+	memset(&desc, 0, sizeof(desc));
+	desc.license_str = (unsigned long)"GPL";
+	desc.version_str = (unsigned long)DEV_USER_VERSION;
+	strncpy(desc.name, dev_name, sizeof(desc.name)-1);
+	desc.type = TYPE_DISK;
+	desc.block_size = block_size;
+	desc.opt.parse_type = SCST_USER_PARSE_STANDARD;
+	desc.opt.on_free_cmd_type = SCST_USER_ON_FREE_CMD_IGNORE;
+	desc.opt.memory_reuse_type = SCST_USER_MEM_REUSE_ALL;
+	desc.opt.tst = SCST_TST_1_SEP_TASK_SETS;
+	desc.opt.queue_alg = SCST_QUEUE_ALG_1_UNRESTRICTED_REORDER;
+	desc.opt.qerr = SCST_QERR_0_ALL_RESUME;
+	desc.opt.d_sense = SCST_D_SENSE_0_FIXED_SENSE;
+	if (use_queues) {
+		desc.queues_num = threads_num;
+		desc.queue_steering = queue_steering;
+	}
+
+	res = ioctl(scst_usr_fd, SCST_USER_REGISTER_DEVICE, &desc);
+	if (res != 0) {
+		res = errno;
+		PRINT_ERROR("Unable to register device: %s", strerror(res));
+		goto out_close;
+	}
+
+	if (mode == MODE_RING) {
+		res = ring_setup();
+		if (res != 0)
+			goto out_close;
+	}
+
+	PRINT_INFO("Device %s, %"PRIu64" blocks of %d bytes, mode %s, batch %d, "
+		"threads %d", dev_name, nblocks, block_size, mode_names[mode],
+		batch, threads_num);
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = sig_nop;
+	/* No SA_RESTART, so the blocked syscalls return EINTR */
+	sigaction(SIGUSR1, &act, NULL);
+
+	/* Only the main thread gets SIGINT and SIGTERM */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	start = now_ns();
+	res = start_threads();
+	if (threads_num > 0)
+		sigwait(&set, &sig);
+	stop_threads();
+
+	print_stats((now_ns() - start) / 1e9);
+
+	if (ring.mem != NULL)
+		munmap(ring.mem, ring.size);
+
+out_close:
+	close(scst_usr_fd);
+
+out_done:
+	debug_done();
+
+out:
+	return res;
+
+out_usage:
+	usage();
+	res = EINVAL;
+	goto out_done;
+}